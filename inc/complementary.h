@@ -0,0 +1,34 @@
+#pragma once
+// Cheap quaternion complementary filter, single precision only.
+
+#include <stdint.h>
+
+/**
+ * Filter state. The quaternion uses the same convention as struct madgwick.
+ */
+struct complementary {
+	float q0, q1, q2, q3;
+	float accel_gain;       // 0 to 1, fraction of the tilt error corrected per update
+	float magn_gain;        // 0 to 1, fraction of the heading error corrected per update
+	float sample_period;    // seconds
+};
+
+/**
+ * Resets the filter to the identity orientation.
+ *
+ * @param filter           The filter
+ * @param sample_rate_hz   Rate at which the update function will be called
+ * @param accel_gain       Tilt correction per update, such as 0.01
+ * @param magn_gain        Heading correction per update, such as 0.01
+ */
+void complementary_init(struct complementary *filter, float sample_rate_hz, float accel_gain, float magn_gain);
+
+/**
+ * Updates the orientation. Pass a magnetometer reading of all zeros to skip the heading correction.
+ *
+ * @param filter       The filter
+ * @param gx, gy, gz   Angular rate in radians per second
+ * @param ax, ay, az   Acceleration in any unit, only the direction is used
+ * @param mx, my, mz   Magnetic field in any unit, only the direction is used
+ */
+void complementary_update(struct complementary *filter, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz);
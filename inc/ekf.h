@@ -0,0 +1,59 @@
+#pragma once
+// Extended Kalman filter estimating orientation and gyro bias.
+//
+// Multiplicative formulation: the quaternion and bias are held as the nominal
+// state and the filter tracks a 6 element error state (3 attitude errors in the
+// sensor frame, 3 gyro biases). All sizes are fixed at compile time, the
+// covariance is stored as a packed upper triangle, and measurements are applied
+// one scalar at a time with a symmetric Joseph form update.
+//
+// EKF_REAL selects the arithmetic type. It defaults to float; building with
+// -DEKF_REAL=double -DEKF_SQRT=sqrt gives a double precision reference.
+
+#include <stdint.h>
+
+#ifndef EKF_REAL
+#define EKF_REAL float
+#endif
+#ifndef EKF_SQRT
+#define EKF_SQRT sqrtf
+#endif
+
+typedef EKF_REAL ekf_real;
+
+#define EKF_STATES 6
+#define EKF_PACKED (EKF_STATES * (EKF_STATES + 1) / 2)
+
+/**
+ * Filter state. The quaternion uses the same convention as struct madgwick.
+ */
+struct ekf {
+	ekf_real q0, q1, q2, q3;
+	ekf_real bias[3];           // gyro bias, radians per second
+	ekf_real p[EKF_PACKED];     // error covariance, upper triangle row by row
+	ekf_real gyro_noise;        // gyro noise density squared, (rad/s)^2 / Hz
+	ekf_real bias_noise;        // bias random walk squared, (rad/s)^2 / s
+	ekf_real accel_noise;       // variance of one normalized accelerometer component
+	ekf_real magn_noise;        // variance of one normalized magnetometer component
+	ekf_real sample_period;     // seconds
+	uint32_t accel_rejected;    // updates where the acceleration was too far from 1 g to trust
+};
+
+/**
+ * Resets the filter to the identity orientation and zero bias, with default noise parameters.
+ *
+ * @param filter           The filter
+ * @param sample_rate_hz   Rate at which ekf_update() will be called
+ */
+void ekf_init(struct ekf *filter, float sample_rate_hz);
+
+/**
+ * Propagates the state with the gyro, then corrects it with the accelerometer
+ * and, if the reading is not all zeros, the magnetometer.
+ *
+ * @param filter       The filter
+ * @param gx, gy, gz   Angular rate in radians per second
+ * @param ax, ay, az   Acceleration in g
+ * @param mx, my, mz   Magnetic field in any unit, only the direction is used
+ */
+void ekf_update(struct ekf *filter, ekf_real gx, ekf_real gy, ekf_real gz, ekf_real ax, ekf_real ay, ekf_real az, ekf_real mx, ekf_real my, ekf_real mz);
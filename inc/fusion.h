@@ -0,0 +1,107 @@
+#pragma once
+// Common interface to the orientation filters, selectable at runtime.
+
+#include <stdint.h>
+#include "imu_block.h"
+#include "madgwick.h"
+#include "mahony.h"
+#include "complementary.h"
+#include "ekf.h"
+
+enum FUSION_FILTER {
+	FUSION_MADGWICK,
+	FUSION_MAHONY,
+	FUSION_COMPLEMENTARY,
+	FUSION_EKF,
+	FUSION_FILTERS
+};
+
+/**
+ * A filter of any type. Only the member of the union matching the type is valid.
+ */
+struct fusion {
+	enum FUSION_FILTER type;
+	uint8_t use_magnetometer;
+	union {
+		struct madgwick madgwick;
+		struct mahony mahony;
+		struct complementary complementary;
+		struct ekf ekf;
+	} state;
+};
+
+/**
+ * Worst and latest cost of one filter update in CPU cycles, measured by fusion_update_block().
+ */
+struct fusion_stats {
+	uint32_t updates;
+	uint32_t last_cycles;
+	uint32_t max_cycles;
+};
+
+extern struct fusion_stats fusion_stats;
+
+/**
+ * Result of replaying a recorded trace through one filter.
+ */
+struct fusion_benchmark {
+	uint32_t updates;
+	uint32_t mean_cycles;
+	uint32_t max_cycles;
+	float mean_error_deg;   // angle between the estimate and the reference, 0 if there is no reference
+	float max_error_deg;
+};
+
+/**
+ * Resets a filter of the given type to the identity orientation, with default gains.
+ *
+ * @param fusion            The filter
+ * @param type              FUSION_MADGWICK, FUSION_MAHONY, FUSION_COMPLEMENTARY or FUSION_EKF
+ * @param sample_rate_hz    Initial sample rate, later taken from each block
+ * @param use_magnetometer  Nonzero to correct the heading with the magnetometer
+ */
+void fusion_init(struct fusion *fusion, enum FUSION_FILTER type, float sample_rate_hz, uint8_t use_magnetometer);
+
+/**
+ * Switches to another filter type, carrying the current orientation over so the output does not jump.
+ *
+ * @param fusion   The filter
+ * @param type     FUSION_MADGWICK, FUSION_MAHONY, FUSION_COMPLEMENTARY or FUSION_EKF
+ */
+void fusion_select(struct fusion *fusion, enum FUSION_FILTER type);
+
+/**
+ * Runs one update per sample of a block, timing each update. The sample period
+ * is taken from the block.
+ *
+ * @param fusion   The filter
+ * @param block    The samples
+ */
+void fusion_update_block(struct fusion *fusion, const struct imu_block *block);
+
+/**
+ * Reads the current orientation.
+ *
+ * @param fusion   The filter
+ * @param q        Receives q0 (scalar part), q1, q2, q3
+ */
+void fusion_get_quaternion(const struct fusion *fusion, float q[4]);
+
+/**
+ * @param type   A filter type
+ * @returns      Its name, for logs
+ */
+const char *fusion_name(enum FUSION_FILTER type);
+
+/**
+ * Replays a recorded trace through a freshly initialized filter, measuring the
+ * cycles per update and the orientation error against a reference.
+ *
+ * @param type              Filter to benchmark
+ * @param use_magnetometer  Nonzero for MARG updates
+ * @param trace             Recorded blocks
+ * @param block_count       Number of blocks in the trace
+ * @param reference         One reference quaternion per sample of the trace, or 0 to skip the error
+ * @param result            Receives the result
+ */
+void fusion_benchmark(enum FUSION_FILTER type, uint8_t use_magnetometer, const struct imu_block *trace, uint32_t block_count, const float (*reference)[4], struct fusion_benchmark *result);
@@ -0,0 +1,37 @@
+#pragma once
+// Matches up blocks from several sensors by timestamp, so redundant or array
+// configurations can process one set of simultaneous samples at a time.
+
+#include <stdint.h>
+#include "imu_block.h"
+
+#define IMU_ALIGN_MAX_SENSORS 4
+
+struct imu_align {
+	uint8_t sensors;
+	uint32_t tolerance_us;
+	const struct imu_block *pending[IMU_ALIGN_MAX_SENSORS];
+	void (*handler)(const struct imu_block *const blocks[], uint8_t count);
+	uint32_t sets;          // sets handed to the handler
+	uint32_t dropped;       // blocks that had no partner within the tolerance
+};
+
+/**
+ * Prepares an aligner.
+ *
+ * @param align          The aligner
+ * @param sensors        Number of sensors, block->sensor must be below this
+ * @param tolerance_us   Largest difference between the first timestamps of a set, such as half a sample period
+ * @param handler        Called with one block per sensor, indexed by sensor
+ */
+void imu_align_init(struct imu_align *align, uint8_t sensors, uint32_t tolerance_us, void (*handler)(const struct imu_block *const blocks[], uint8_t count));
+
+/**
+ * Adds a block. Once every sensor has a block and their timestamps agree, the
+ * set is handed to the handler. Otherwise the oldest block is dropped. The
+ * blocks must stay valid until the next block of the same sensor is added.
+ *
+ * @param align   The aligner
+ * @param block   A block from one of the sensors
+ */
+void imu_align_add(struct imu_align *align, const struct imu_block *block);
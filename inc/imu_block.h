@@ -0,0 +1,40 @@
+#pragma once
+// Blocks of IMU samples, stored as one array per axis (structure of arrays) so
+// downstream filters can process each axis as a contiguous vector.
+
+#include <stdint.h>
+
+#define IMU_BLOCK_CAPACITY 32
+
+enum IMU_AXIS {
+	IMU_GYRO_X, IMU_GYRO_Y, IMU_GYRO_Z,
+	IMU_ACCEL_X, IMU_ACCEL_Y, IMU_ACCEL_Z,
+	IMU_MAGN_X, IMU_MAGN_Y, IMU_MAGN_Z,
+	IMU_AXES
+};
+
+/**
+ * A block of consecutive samples. Blocks are handed to consumers by pointer and
+ * stay valid until the producer cycles back to them, so consumers must finish
+ * with a block before the next few blocks have been produced.
+ *
+ * raw[] holds the sensor readings in counts with calibration offsets
+ * subtracted, value[] holds the same readings converted to physical units:
+ * gyro in radians per second, accel in G's, magnetometer in Gauss.
+ *
+ * Every sample the sensor takes has a sequence number, including samples that
+ * were never read, and the samples of a block are always consecutive. With the
+ * data ready interrupt capture_cycles[] is the cycle count on entry to the ISR,
+ * in FIFO mode it is estimated from when the FIFO was read.
+ */
+struct imu_block {
+	uint32_t sequence;           // increments by one per block, gaps mean dropped blocks
+	uint32_t timestamp_us;       // time_now_us() of the first sample
+	uint32_t sample_period_us;   // time between samples
+	uint16_t count;              // number of valid samples
+	uint8_t sensor;              // which sensor produced the block, when there are several
+	uint32_t first_sample;       // sample sequence number of the first sample, gaps between blocks mean dropped samples
+	uint32_t capture_cycles[IMU_BLOCK_CAPACITY];  // DWT->CYCCNT when each sample was taken, 0 for filtered samples
+	int16_t raw[IMU_AXES][IMU_BLOCK_CAPACITY];
+	float value[IMU_AXES][IMU_BLOCK_CAPACITY];
+};
@@ -0,0 +1,106 @@
+#pragma once
+// Gyro bias calibration: stillness detection over windows of raw samples,
+// persistence of accepted offsets in flash, and online refinement.
+//
+// Offsets are kept in 1/16 counts so that small corrections accumulate.
+// Records are appended to flash sector 23, which the linker script keeps
+// out of the ROM region; the sector is only erased once it is full, and the
+// newest record of every sensor is written back after the erase.
+//
+// imu_calibration_add() only marks new offsets for saving. Programming the
+// flash, and the 1 to 2 second erase, are left to imu_calibration_service(),
+// called from a low priority task, which never waits for the erase.
+
+#include <stdint.h>
+
+#define IMU_CALIBRATION_WINDOW  64      // samples per stillness window, a power of two
+#define IMU_CALIBRATION_SECTOR  23
+#define IMU_CALIBRATION_ADDRESS 0x081E0000
+#define IMU_CALIBRATION_SIZE    (128 * 1024)
+#define IMU_CALIBRATION_KEEP    8       // sensors whose records survive an erase
+
+enum IMU_CALIBRATION_SOURCE {CALIBRATION_NONE, CALIBRATION_FLASH, CALIBRATION_MEASURED};
+
+struct imu_calibration {
+
+	uint32_t id;                        // distinguishes sensors sharing the flash sector
+
+	// current window, wide enough for IMU_CALIBRATION_WINDOW full scale samples
+	uint16_t count;
+	int32_t sum[6];                     // gyro xyz, accel xyz
+	uint64_t sum_squares[6];
+
+	// acceptance limits, in counts
+	uint32_t gyro_variance_limit;
+	uint32_t accel_variance_limit;
+	int32_t gyro_offset_limit;          // largest plausible bias
+
+	// result
+	int32_t offset[3];                  // gyro xyz, 1/16 counts
+	int32_t saved_offset[3];
+	enum IMU_CALIBRATION_SOURCE source;
+	uint32_t sequence;                  // of the newest record in flash
+	uint8_t save_pending;               // offsets waiting for imu_calibration_service()
+
+	uint32_t windows;
+	uint32_t still_windows;
+	uint32_t saves;
+	uint32_t save_errors;
+
+};
+
+/**
+ * Resets the calibration state with default acceptance limits for a
+ * +/-2000dps gyro (16.4 counts/dps) and a +/-4g accelerometer.
+ *
+ * @param cal   The calibration
+ * @param id    Sensor identifier used to tag flash records
+ */
+void imu_calibration_init(struct imu_calibration *cal, uint32_t id);
+
+/**
+ * Loads the newest valid offsets for this sensor from flash.
+ *
+ * @param cal   The calibration
+ * @returns     1 if offsets were found
+ */
+uint8_t imu_calibration_load(struct imu_calibration *cal);
+
+/**
+ * Adds one raw sample. Each full window is checked for stillness; a still
+ * window either provides the first offsets or refines the current ones.
+ * Offsets that moved far enough from the saved ones are marked for saving.
+ *
+ * @param cal     The calibration
+ * @param gyro    Raw gyro xyz, without any offset applied
+ * @param accel   Raw accelerometer xyz
+ * @returns       1 if the offsets changed
+ */
+uint8_t imu_calibration_add(struct imu_calibration *cal, const int16_t gyro[3], const int16_t accel[3]);
+
+/**
+ * Appends the current offsets to flash, erasing the sector first if it is full.
+ * Blocks for the whole erase, see imu_calibration_service() for a save that does not.
+ *
+ * @param cal   The calibration
+ * @returns     1 on success
+ */
+uint8_t imu_calibration_save(struct imu_calibration *cal);
+
+/**
+ * Saves offsets marked by imu_calibration_add(), a step at a time: when the
+ * sector is full, the first call starts the erase and returns, and a later
+ * call writes the kept records back and appends the new one. Call it
+ * periodically from a task of lower priority than the one adding samples.
+ *
+ * @param cal   The calibration
+ * @returns     1 if a record was written
+ */
+uint8_t imu_calibration_service(struct imu_calibration *cal);
+
+/**
+ * @param cal    The calibration
+ * @param axis   0, 1 or 2 for gyro x, y or z
+ * @returns      The offset rounded to whole counts
+ */
+int16_t imu_calibration_offset(const struct imu_calibration *cal, uint8_t axis);
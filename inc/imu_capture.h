@@ -0,0 +1,86 @@
+#pragma once
+// Captures the full rate waveform around a shock: raw samples are kept in a
+// ring, and when the accelerometer magnitude crosses a level or changes faster
+// than a slope the samples before and after the trigger are frozen and uploaded
+// in the background while acquisition continues.
+//
+// The ring is meant for the 64K CCM RAM, which the CPU reaches with no bus
+// contention but the DMA can not reach. The upload copies samples into the UART
+// buffer, so that is fine.
+
+#include <stdint.h>
+#include "imu_block.h"
+
+// places a variable in the CCM RAM, it is not cleared or initialized at startup
+#define IMU_CAPTURE_CCMRAM __attribute__((section(".ccmram")))
+
+#define IMU_CAPTURE_FRAME_SAMPLES 40   // samples per upload frame, small enough for the UART buffer
+
+enum IMU_CAPTURE_TRIGGER {
+	IMU_CAPTURE_LEVEL,     // magnitude at or above threshold, in g
+	IMU_CAPTURE_SLOPE      // magnitude rising at or above threshold, in g per second
+};
+
+enum IMU_CAPTURE_STATE {
+	IMU_CAPTURE_ARMED,
+	IMU_CAPTURE_POST_TRIGGER,
+	IMU_CAPTURE_UPLOADING
+};
+
+struct imu_capture_sample {
+	uint32_t timestamp_us;
+	int16_t raw[IMU_AXES];
+};
+
+struct imu_capture {
+	struct imu_capture_sample *ring;
+	uint32_t capacity;
+	uint32_t head;                     // samples written, the ring position is head % capacity
+	uint16_t pre_samples;
+	uint16_t post_samples;
+	enum IMU_CAPTURE_TRIGGER trigger;
+	float threshold;
+	float last_magnitude;
+	float scale[IMU_AXES];             // counts to physical units, learned from the blocks
+	volatile enum IMU_CAPTURE_STATE state;
+	uint16_t id;                       // increments per capture
+	uint32_t trigger_index;            // value of head at the trigger sample
+	uint32_t first_index;              // first sample of the frozen window
+	uint32_t end_index;                // one past the last sample of the frozen window
+	uint32_t upload_index;             // next sample to upload, samples before it may be overwritten
+	uint8_t header_sent;
+	uint32_t captures;
+	uint32_t lost;                     // samples dropped because the upload fell a whole ring behind
+};
+
+/**
+ * Prepares a capture engine.
+ *
+ * @param capture        The engine
+ * @param ring           Storage for the ring, such as an array declared with IMU_CAPTURE_CCMRAM
+ * @param capacity       Number of samples in the ring, more than pre_samples + post_samples
+ * @param pre_samples    Samples kept from before the trigger
+ * @param post_samples   Samples kept from after the trigger
+ * @param trigger        IMU_CAPTURE_LEVEL or IMU_CAPTURE_SLOPE
+ * @param threshold      Level in g, or slope in g per second
+ */
+void imu_capture_init(struct imu_capture *capture, struct imu_capture_sample *ring, uint32_t capacity, uint16_t pre_samples, uint16_t post_samples, enum IMU_CAPTURE_TRIGGER trigger, float threshold);
+
+/**
+ * Adds the samples of a block to the ring and checks them for a trigger.
+ *
+ * @param capture   The engine
+ * @param block     The samples, raw[] is stored and value[] is used for the trigger
+ * @returns         1 if a capture has just been frozen, call imu_capture_upload() until it returns 0
+ */
+uint8_t imu_capture_add_block(struct imu_capture *capture, const struct imu_block *block);
+
+/**
+ * Sends the next frame of a frozen capture over the UART: first a header, then
+ * the samples oldest first. See tools/capture_decode.py. The engine re-arms
+ * once the last frame has been sent.
+ *
+ * @param capture   The engine
+ * @returns         1 if there is more to send
+ */
+uint8_t imu_capture_upload(struct imu_capture *capture);
@@ -0,0 +1,81 @@
+#pragma once
+// Converts big endian sensor register dumps into imu_block samples.
+//
+// One pass over the records does the byte swap, offset subtraction, axis
+// remapping and scaling. On the Cortex-M4 two 16bit values are swapped and
+// offset at once with the REV16 and SSUB16 DSP instructions, and scaling is a
+// multiply by a precomputed reciprocal instead of a division.
+
+#include <stdint.h>
+#include "imu_block.h"
+
+#define IMU_CONVERT_MAX_VALUES 32
+#define IMU_CONVERT_DROP       IMU_AXES
+
+/**
+ * Describes the layout of one record: a sequence of big endian int16 values.
+ */
+struct imu_convert {
+	uint8_t record_size;                        // bytes, a multiple of 4
+	uint8_t axis[IMU_CONVERT_MAX_VALUES];       // destination axis of each value, or IMU_CONVERT_DROP
+	float scale[IMU_CONVERT_MAX_VALUES];        // multiplier from counts to physical units, negative to flip an axis
+	uint32_t offset[IMU_CONVERT_MAX_VALUES / 2]; // offsets in counts, packed two per word
+	uint16_t unmapped;                          // bit mask of axes no value maps to
+};
+
+/**
+ * Prepares a converter. Offsets start at 0.
+ *
+ * @param convert       The converter
+ * @param record_size   Size of one record in bytes, a multiple of 4
+ * @param axis          Destination axis of each value in the record, or IMU_CONVERT_DROP to skip it
+ * @param scale         Multiplier for each value in the record. Negative values flip the axis in value[], raw[] keeps the sensor's sign.
+ */
+void imu_convert_init(struct imu_convert *convert, uint8_t record_size, const uint8_t axis[], const float scale[]);
+
+/**
+ * Sets the offset subtracted from an axis before scaling.
+ *
+ * @param convert   The converter
+ * @param axis      The axis
+ * @param offset    Offset in counts
+ */
+void imu_convert_set_offset(struct imu_convert *convert, enum IMU_AXIS axis, int16_t offset);
+
+/**
+ * Extracts one axis of one record, without the offset. For code that looks at
+ * individual samples, like calibration.
+ *
+ * @param convert   The converter
+ * @param record    The record
+ * @param axis      The axis
+ * @returns         The raw reading
+ */
+int16_t imu_convert_extract(const struct imu_convert *convert, const uint8_t *record, enum IMU_AXIS axis);
+
+/**
+ * Appends records to a block: raw[] gets the readings minus the offsets, value[]
+ * gets them scaled. Axes no value maps to are set to 0.
+ *
+ * @param convert   The converter
+ * @param records   Consecutive records
+ * @param count     Number of records, at most IMU_BLOCK_CAPACITY - block->count
+ * @param block     The block to append to
+ */
+void imu_convert(const struct imu_convert *convert, const uint8_t *records, uint16_t count, struct imu_block *block);
+
+/**
+ * Straightforward version of imu_convert(), for checking and benchmarking it.
+ */
+void imu_convert_reference(const struct imu_convert *convert, const uint8_t *records, uint16_t count, struct imu_block *block);
+
+/**
+ * Times imu_convert() and imu_convert_reference() on a full block of
+ * synthetic records.
+ *
+ * @param convert             The converter
+ * @param reference_cycles    Set to the CPU cycles used by the reference version
+ * @param mismatches          Set to the number of values where both versions disagree
+ * @returns                   CPU cycles used by imu_convert()
+ */
+uint32_t imu_convert_benchmark(const struct imu_convert *convert, uint32_t *reference_cycles, uint32_t *mismatches);
@@ -0,0 +1,105 @@
+#pragma once
+// Multistage decimation of IMU blocks, so oversampled sensors can be reported at
+// a lower rate without aliasing instead of dropping samples.
+//
+// Each stage is a polyphase FIR decimator: only every factor'th output of the
+// low pass filter is computed, directly from a delay line that holds each input
+// twice so the taps are always read as one contiguous vector. Cascading a few
+// short stages (such as 1kHz -> 250Hz -> 125Hz) costs far fewer multiplies
+// than one long filter at the input rate.
+//
+// When samples are missing between input blocks the delay lines start over,
+// filled with the first sample after the gap, so no step from old samples or
+// zeros rings through the filters. The output block in progress is handed over
+// early and the output numbering skips the decimated length of the gap.
+
+#include <stdint.h>
+#include "imu_block.h"
+
+#define IMU_DECIMATE_STAGES 3
+#define IMU_DECIMATE_TAPS   32
+#define IMU_DECIMATE_POOL   2
+
+/**
+ * One stage, and the cost of running it measured with the DWT cycle counter.
+ */
+struct imu_decimate_stage {
+	uint8_t factor;
+	uint8_t tap_count;
+	uint8_t phase;                                  // inputs since the last output
+	uint8_t head;                                   // position of the newest input in the delay line
+	uint8_t empty;                                  // the delay line is filled with the next input
+	float taps[IMU_DECIMATE_TAPS];
+	float history[IMU_AXES][2 * IMU_DECIMATE_TAPS];
+	uint32_t inputs;
+	uint32_t outputs;
+	uint32_t last_cycles;                           // cycles spent on the latest block
+	uint32_t max_cycles;
+	uint64_t total_cycles;
+};
+
+struct imu_decimate {
+	uint8_t stage_count;
+	struct imu_decimate_stage stage[IMU_DECIMATE_STAGES];
+	float work[IMU_AXES][IMU_BLOCK_CAPACITY];       // samples between stages, filtered in place
+	struct imu_block blocks[IMU_DECIMATE_POOL];
+	uint8_t block_index;
+	uint16_t block_length;
+	uint32_t sequence;
+	uint32_t samples;                               // output samples so far, numbers the output samples
+	uint32_t next_sample;                           // first_sample the next input block continues with
+	uint32_t restarts;                              // gaps in the input that restarted the delay lines
+	void (*handler)(const struct imu_block *block);
+};
+
+/**
+ * Prepares an empty pipeline. Add stages with imu_decimate_add_stage().
+ *
+ * @param decimate       The pipeline
+ * @param block_length   Samples per output block, up to IMU_BLOCK_CAPACITY
+ * @param handler        Called with each output block
+ */
+void imu_decimate_init(struct imu_decimate *decimate, uint16_t block_length, void (*handler)(const struct imu_block *block));
+
+/**
+ * Appends a stage.
+ *
+ * @param decimate    The pipeline
+ * @param factor      Keep one output per this many inputs
+ * @param taps        Filter coefficients, or 0 to design a low pass with imu_decimate_design()
+ * @param tap_count   Number of coefficients, up to IMU_DECIMATE_TAPS
+ * @returns           1 on success, 0 if there are too many stages or taps
+ */
+uint8_t imu_decimate_add_stage(struct imu_decimate *decimate, uint8_t factor, const float *taps, uint8_t tap_count);
+
+/**
+ * Designs a Blackman windowed sinc low pass filter for decimating by a factor,
+ * with the cutoff at 80% of the output Nyquist frequency and unity gain at DC.
+ *
+ * @param taps        Receives the coefficients
+ * @param tap_count   Number of coefficients
+ * @param factor      Decimation factor the filter is for
+ */
+void imu_decimate_design(float *taps, uint8_t tap_count, uint8_t factor);
+
+/**
+ * Evaluates the frequency response of a filter, to check a design.
+ *
+ * @param taps        The coefficients
+ * @param tap_count   Number of coefficients
+ * @param frequency   Frequency in cycles per input sample, 0 to 0.5
+ * @returns           Magnitude of the response, 1 means unity gain
+ */
+float imu_decimate_gain(const float *taps, uint8_t tap_count, float frequency);
+
+/**
+ * Filters the value[] samples of a block through every stage. Output blocks
+ * hold value[] only, raw[] is zero because filtered readings have no count
+ * representation. Timestamps are corrected for the group delay of the filters,
+ * output samples are numbered on their own and capture_cycles[] is zero.
+ * A gap before the block restarts the delay lines.
+ *
+ * @param decimate   The pipeline
+ * @param block      Input samples at the full rate
+ */
+void imu_decimate_process(struct imu_decimate *decimate, const struct imu_block *block);
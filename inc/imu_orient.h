@@ -0,0 +1,83 @@
+#pragma once
+// Compact orientation telemetry. A unit quaternion is sent in 32 bits as its
+// "smallest three": the index of the largest component in 2 bits, then the
+// other three components in 10 bits each. The largest component is made
+// positive, which describes the same rotation, and the host recomputes it from
+// the unit length. The other three are then at most 1/sqrt(2) in magnitude, and
+// are sent as 511 + round(511 sqrt(2) v): steps of 0.00138, with 0 exact.
+// Vectors such as the angular rate can be sent along as IEEE 754 half floats.
+//
+// Error bounds, for unit quaternions and round to nearest:
+//   each of the smallest three    +/-0.00070 (half a step)
+//   rotation angle                at most 0.27 degrees
+//   half float                    relative error 2^-11 (0.049%) from 6.1e-5 to 65504,
+//                                 absolute error 2^-25 below that, larger values become infinity
+//
+// An orientation with angular rate takes 11 bytes instead of 28 as floats.
+
+#include <stdint.h>
+#include "imu_block.h"
+
+#define IMU_ORIENT_GYRO          0x01    // value[] of the sample the orientation is for, as half floats
+#define IMU_ORIENT_ACCEL         0x02
+#define IMU_ORIENT_MAGN          0x04
+#define IMU_ORIENT_MAX_ENTRIES   32
+#define IMU_ORIENT_MAX_FRAME     (2 + 15 + IMU_ORIENT_MAX_ENTRIES * (1 + 4 + 3 * 3 * 2) + 2)
+
+/**
+ * Collects orientations into frames.
+ */
+struct imu_orient {
+	uint8_t vectors;                // IMU_ORIENT_GYRO, IMU_ORIENT_ACCEL and IMU_ORIENT_MAGN or'ed together
+	uint8_t per_frame;              // orientations per frame
+	uint8_t count;                  // orientations in the frame so far
+	uint8_t sensor;
+	uint32_t last_sample;           // sequence number of the latest orientation
+	uint32_t sample_period_us;
+	uint32_t length;                // bytes in the frame so far
+	uint8_t frame[IMU_ORIENT_MAX_FRAME];
+	uint32_t frames;
+};
+
+/**
+ * Packs a quaternion into 32 bits: the index of the largest component in bits
+ * 31-30, then the other three components in order, 10 bits each.
+ *
+ * @param q   q0 (scalar part), q1, q2, q3, normalized here
+ * @returns   The packed quaternion
+ */
+uint32_t imu_orient_pack_quaternion(const float q[4]);
+
+/**
+ * Converts a float to an IEEE 754 half float, rounding to nearest even.
+ *
+ * @param value   The float
+ * @returns       The half float bits
+ */
+uint16_t imu_orient_half(float value);
+
+/**
+ * Prepares an empty frame.
+ *
+ * @param orient      The frame collector
+ * @param vectors     IMU_ORIENT_GYRO, IMU_ORIENT_ACCEL and IMU_ORIENT_MAGN or'ed together, or 0 for orientations only
+ * @param per_frame   Orientations per frame, 1 to IMU_ORIENT_MAX_ENTRIES
+ */
+void imu_orient_init(struct imu_orient *orient, uint8_t vectors, uint8_t per_frame);
+
+/**
+ * Adds the orientation after the last sample of a block, and sends the frame
+ * over the UART once it is full. See tools/orient_decode.py.
+ *
+ * @param orient   The frame collector
+ * @param block    The block the filter has just been updated with
+ * @param q        The orientation, q0 (scalar part), q1, q2, q3
+ */
+void imu_orient_add(struct imu_orient *orient, const struct imu_block *block, const float q[4]);
+
+/**
+ * Sends the orientations collected so far, if any.
+ *
+ * @param orient   The frame collector
+ */
+void imu_orient_flush(struct imu_orient *orient);
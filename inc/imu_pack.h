@@ -0,0 +1,66 @@
+#pragma once
+// Compressed telemetry of raw IMU samples. Consecutive readings of an axis
+// rarely differ by much, so each raw count is sent as the difference from the
+// previous sample of the same axis, zigzag mapped so small negative differences
+// are small too, then as a varint: 7 bits per byte, with the top bit set on
+// every byte but the last. A quiet sensor takes about 1 byte per axis instead
+// of a 4 byte float.
+//
+// Every frame numbers itself, and a keyframe sends differences from 0, so the
+// host can start decoding at any keyframe and resynchronizes at the next one
+// after a lost or corrupted frame. Each frame also carries the sum of its raw
+// counts, which the host uses to check the reconstruction is bit exact.
+
+#include <stdint.h>
+#include "imu_block.h"
+
+#define IMU_PACK_MAX_FRAME (2 + 20 + IMU_BLOCK_CAPACITY * IMU_AXES * 3 + 2)   // a difference takes at most 3 bytes
+
+/**
+ * Encoder state for the samples of one sensor.
+ */
+struct imu_pack {
+	uint16_t keyframe_interval;     // frames between keyframes
+	uint16_t since_keyframe;
+	uint8_t frame;                  // frame counter, wraps around
+	int16_t last[IMU_AXES];         // raw counts of the previous sample, differences are taken from these
+
+	// statistics
+	uint32_t samples;
+	uint32_t frames;
+	uint32_t keyframes;
+	uint32_t bytes;                 // everything sent, headers and checksums included
+};
+
+/**
+ * Prepares an encoder. The first frame is always a keyframe.
+ *
+ * @param pack                The encoder
+ * @param keyframe_interval   Frames between keyframes, 1 makes every frame a keyframe
+ */
+void imu_pack_init(struct imu_pack *pack, uint16_t keyframe_interval);
+
+/**
+ * Makes the next frame a keyframe, such as when the host has just connected.
+ *
+ * @param pack   The encoder
+ */
+void imu_pack_keyframe(struct imu_pack *pack);
+
+/**
+ * Encodes the raw[] counts of a block into one frame. See tools/pack_decode.py.
+ *
+ * @param pack    The encoder
+ * @param block   The samples
+ * @param frame   Receives the frame, IMU_PACK_MAX_FRAME bytes
+ * @returns       Length of the frame in bytes
+ */
+uint32_t imu_pack_encode(struct imu_pack *pack, const struct imu_block *block, uint8_t *frame);
+
+/**
+ * Encodes a block and sends the frame over the UART.
+ *
+ * @param pack    The encoder
+ * @param block   The samples
+ */
+void imu_pack_send(struct imu_pack *pack, const struct imu_block *block);
@@ -0,0 +1,131 @@
+#pragma once
+// Vibration spectrum of one IMU axis: Hann windowed, overlapped real FFTs whose
+// power is averaged over several frames, reported with the strongest peaks.
+//
+// A real frame of N points is packed into N/2 complex values, transformed with a
+// radix-2 complex FFT and split into the N/2+1 bins of the real spectrum. The
+// complex FFT can run in float or in Q15 fixed point with block scaling, so both
+// can be compared on the target with imu_spectrum_benchmark().
+
+#include <stdint.h>
+#include "imu_block.h"
+
+#define IMU_SPECTRUM_MIN_POINTS 16
+#define IMU_SPECTRUM_MAX_POINTS 2048
+#define IMU_SPECTRUM_PEAKS      4
+#define IMU_SPECTRUM_SEND_BINS  200
+
+enum IMU_SPECTRUM_PATH {
+	IMU_SPECTRUM_FLOAT,
+	IMU_SPECTRUM_Q15
+};
+
+struct imu_spectrum_peak {
+	float frequency_hz;    // interpolated between bins
+	float amplitude;       // peak amplitude of a sine at that frequency, in the axis units
+};
+
+/**
+ * An averaged spectrum. amplitude[] stays valid until the next result is computed.
+ */
+struct imu_spectrum_result {
+	uint32_t timestamp_us;                 // time of the newest sample of the last frame
+	float bin_hz;                          // frequency step between bins
+	uint16_t bins;                         // points / 2 + 1, from DC to Nyquist
+	uint16_t frames;                       // frames averaged
+	const float *amplitude;
+	struct imu_spectrum_peak peak[IMU_SPECTRUM_PEAKS];   // strongest first, amplitude 0 when unused
+};
+
+struct imu_spectrum {
+	enum IMU_SPECTRUM_PATH path;
+	uint8_t axis;
+	uint16_t points;
+	uint16_t hop;                          // new samples between frames
+	uint16_t average;                      // frames per result
+	uint16_t head;                         // next position in input[]
+	uint16_t filled;                       // samples in input[], up to points
+	uint16_t since_frame;                  // samples since the last frame
+	uint32_t next_sample;                  // first_sample the next block continues with
+	uint16_t frames;                       // frames accumulated into power[]
+	uint8_t frame_ready;                   // buffer[] holds a frame waiting for imu_spectrum_run()
+	uint32_t frame_timestamp_us;
+	uint32_t sample_period_us;
+	float window_sum;
+	float input[IMU_SPECTRUM_MAX_POINTS];                  // ring of the latest samples
+	float buffer[IMU_SPECTRUM_MAX_POINTS];                 // frame, then N/2 complex values
+	int16_t buffer_q15[IMU_SPECTRUM_MAX_POINTS];
+	float window[IMU_SPECTRUM_MAX_POINTS / 2 + 1];         // first half of the symmetric Hann window
+	float twiddle[IMU_SPECTRUM_MAX_POINTS / 2][2];         // e^(-j 2 pi k / N) as cos, -sin
+	int16_t twiddle_q15[IMU_SPECTRUM_MAX_POINTS / 2][2];
+	float power[IMU_SPECTRUM_MAX_POINTS / 2 + 1];          // power summed over the frames so far
+	float amplitude[IMU_SPECTRUM_MAX_POINTS / 2 + 1];      // of the latest result
+	struct imu_spectrum_result result;
+	uint32_t missed_frames;                // frames skipped because the previous one was not run yet
+	uint32_t gaps;                         // frames started over because samples were missing
+	uint32_t last_cycles;                  // cost of the latest imu_spectrum_run()
+	uint32_t max_cycles;
+	void (*handler)(const struct imu_spectrum_result *result);
+};
+
+/**
+ * Result of transforming the same frame with both paths.
+ */
+struct imu_spectrum_benchmark {
+	uint16_t points;
+	uint32_t float_cycles;     // complex FFT only
+	uint32_t q15_cycles;       // to-Q15 conversion + complex FFT
+	float q15_error;           // largest bin error of the Q15 path, relative to the largest bin
+};
+
+/**
+ * Prepares a spectrum analyser.
+ *
+ * @param spectrum   The analyser
+ * @param axis       Which axis of the blocks to analyse, such as IMU_ACCEL_Z
+ * @param points     FFT length, a power of two from IMU_SPECTRUM_MIN_POINTS to IMU_SPECTRUM_MAX_POINTS, rounded down
+ * @param hop        New samples between frames, points / 2 for 50% overlap
+ * @param average    Frames averaged into each result
+ * @param path       IMU_SPECTRUM_FLOAT or IMU_SPECTRUM_Q15
+ * @param handler    Called with each averaged spectrum
+ */
+void imu_spectrum_init(struct imu_spectrum *spectrum, uint8_t axis, uint16_t points, uint16_t hop, uint16_t average, enum IMU_SPECTRUM_PATH path, void (*handler)(const struct imu_spectrum_result *result));
+
+/**
+ * Adds the samples of a block. This only copies samples: when a frame is due it
+ * is captured and imu_spectrum_run() should be called, typically from a lower
+ * priority task. Samples missing before the block start the frame over.
+ *
+ * @param spectrum   The analyser
+ * @param block      Samples, the axis chosen at init is used
+ * @returns          1 if a frame is waiting for imu_spectrum_run()
+ */
+uint8_t imu_spectrum_add_block(struct imu_spectrum *spectrum, const struct imu_block *block);
+
+/**
+ * Transforms the captured frame and adds its power to the average. Every
+ * average frames the handler is called with the result.
+ *
+ * @param spectrum   The analyser
+ */
+void imu_spectrum_run(struct imu_spectrum *spectrum);
+
+/**
+ * Transforms the latest samples with both the float and the Q15 path and
+ * compares them. Needs points samples to have been added, and discards a
+ * frame waiting for imu_spectrum_run().
+ *
+ * @param spectrum   The analyser
+ * @param result     Receives the cycle counts and the error
+ */
+void imu_spectrum_benchmark(struct imu_spectrum *spectrum, struct imu_spectrum_benchmark *result);
+
+/**
+ * Sends part of a result over the UART in binary, small enough for the UART
+ * buffer. Every frame carries the peaks. See tools/spectrum_decode.py.
+ *
+ * @param result      The spectrum
+ * @param first_bin   First bin to send, 0 to start
+ * @returns           First bin of the next part, or 0 once every bin has been sent
+ */
+uint16_t imu_spectrum_send(const struct imu_spectrum_result *result, uint16_t first_bin);
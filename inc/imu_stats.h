@@ -0,0 +1,91 @@
+#pragma once
+// Per-axis summaries of IMU samples over tumbling or sliding windows, so only
+// min, max, mean, variance and RMS have to be sent instead of every sample.
+//
+// Mean and variance are updated with Welford's method in O(1) per sample. A
+// sliding window also keeps its samples in a ring so the oldest one can be
+// replaced, and tracks min and max with monotonic queues, which is O(1) per
+// sample amortized. The mean is kept relative to a sample from the window, so
+// the float updates only ever see the spread of the samples and not their level.
+//
+// Windows only hold consecutive samples: when the first_sample of a block shows
+// that samples were missed, the window in progress is dropped and a new one
+// starts with that block, so a result never spans a gap and its times follow
+// from the sample period.
+
+#include <stdint.h>
+#include "imu_block.h"
+
+#define IMU_STATS_MAX_WINDOW 128   // longest sliding window, tumbling windows can be up to 65535 samples
+#define IMU_STATS_RESYNC     64    // windows between recomputing a sliding mean and variance from the ring
+
+struct imu_stats_axis {
+	float min;
+	float max;
+	float mean;
+	float variance;    // population variance, so rms^2 = mean^2 + variance
+	float rms;
+};
+
+struct imu_stats_result {
+	uint32_t timestamp_us;     // time of the first sample in the window
+	uint32_t duration_us;      // time from the first to the last sample
+	uint16_t count;            // samples in the window
+	uint8_t sensor;
+	struct imu_stats_axis axis[IMU_AXES];
+};
+
+// positions in the ring whose values are monotonic from front to back
+struct imu_stats_queue {
+	uint16_t slot[IMU_STATS_MAX_WINDOW];
+	uint16_t front;
+	uint16_t count;
+};
+
+struct imu_stats {
+	uint16_t window;
+	uint16_t hop;                      // samples between results
+	uint8_t sliding;                   // hop < window, the ring and queues are used
+	uint16_t count;                    // samples in the window so far
+	uint16_t since_result;
+	uint16_t slot;                     // next position in ring[]
+	uint32_t replaced;                 // samples replaced since the last recomputation
+	uint32_t next_sample;              // first_sample the next block continues with
+	uint32_t gaps;                     // windows started over because samples were missing
+	float shift[IMU_AXES];             // subtracted from every sample before the updates
+	float mean[IMU_AXES];              // relative to shift[]
+	float m2[IMU_AXES];                // sum of squared differences from the mean
+	float min[IMU_AXES];
+	float max[IMU_AXES];
+	float ring[IMU_AXES][IMU_STATS_MAX_WINDOW];
+	struct imu_stats_queue min_queue[IMU_AXES];
+	struct imu_stats_queue max_queue[IMU_AXES];
+	struct imu_stats_result result;
+	void (*handler)(const struct imu_stats_result *result);
+};
+
+/**
+ * Prepares a statistics stage.
+ *
+ * @param stats     The stage
+ * @param window    Samples summarized by each result
+ * @param hop       Samples between results: window for tumbling windows, less for sliding windows of up to IMU_STATS_MAX_WINDOW samples
+ * @param handler   Called with each result
+ */
+void imu_stats_init(struct imu_stats *stats, uint16_t window, uint16_t hop, void (*handler)(const struct imu_stats_result *result));
+
+/**
+ * Adds the value[] samples of a block, calling the handler whenever a result is due.
+ * A gap before the block starts the window over.
+ *
+ * @param stats   The stage
+ * @param block   The samples
+ */
+void imu_stats_add_block(struct imu_stats *stats, const struct imu_block *block);
+
+/**
+ * Sends a result over the UART in binary. See tools/stats_decode.py.
+ *
+ * @param result   The result
+ */
+void imu_stats_send(const struct imu_stats_result *result);
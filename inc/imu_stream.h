@@ -0,0 +1,17 @@
+#pragma once
+// Streams IMU samples over the UART in binary, each sample with its sequence
+// number and the cycle count at which it was taken, so a host can find dropped
+// samples and measure sampling jitter. Replaces the CSV output when every
+// sample is needed.
+
+#include <stdint.h>
+#include "imu_block.h"
+
+#define IMU_STREAM_FRAME_SAMPLES 16   // samples per frame, longer blocks are split over several frames
+
+/**
+ * Sends the samples of a block, value[] in physical units. See tools/stream_decode.py.
+ *
+ * @param block   The samples
+ */
+void imu_stream_send(const struct imu_block *block);
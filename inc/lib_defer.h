@@ -0,0 +1,64 @@
+#pragma once
+// Deferred work: interrupt handlers queue work items and pend PendSV, and the
+// PendSV handler, at the lowest interrupt priority, runs them once every other
+// interrupt has finished. Handlers then only take a timestamp and queue the
+// rest, so no interrupt is held up by formatting or blocking I2C transfers.
+//
+// Work items can be queued from any interrupt priority: the list is pushed with
+// LDREX/STREX and taken as a whole by PendSV, so no interrupts are disabled.
+// After the work has run PendSV continues with the kernel's context switch, if
+// lib_kernel is in use.
+
+#include <stdint.h>
+
+/**
+ * A work item, allocated by the caller (usually static). It can only be queued
+ * once at a time: queueing it again before it has run is counted as dropped.
+ */
+struct defer_work {
+	struct defer_work *next;
+	void (*run)(struct defer_work *work);
+	void *context;
+	volatile uint32_t queued;         // nonzero from defer_post() until the work starts running
+	uint32_t posted_cycles;           // DWT cycle count when queued
+
+	// statistics, dropped is counted by defer_post() and the rest by PendSV
+	uint32_t runs;
+	volatile uint32_t dropped;
+	uint32_t last_latency_cycles;     // from defer_post() to the start of run()
+	uint32_t max_latency_cycles;
+};
+
+/**
+ * Totals over every work item.
+ */
+struct defer_stats {
+	uint32_t runs;
+	volatile uint32_t dropped;        // counted from any priority, like defer_work.dropped
+	uint32_t max_latency_cycles;
+	uint64_t total_latency_cycles;
+};
+
+extern struct defer_stats defer_stats;
+
+/**
+ * Gives PendSV the lowest priority. Call before the first defer_post().
+ */
+void defer_init(void);
+
+/**
+ * Prepares a work item.
+ *
+ * @param work      The work item
+ * @param run       Called from PendSV with the work item
+ * @param context   Anything run() needs, stored in work->context
+ */
+void defer_work_init(struct defer_work *work, void (*run)(struct defer_work *work), void *context);
+
+/**
+ * Queues a work item and pends PendSV. Safe from any interrupt or from thread mode.
+ *
+ * @param work   The work item
+ * @returns      1 if queued, 0 if it was still queued from before
+ */
+uint8_t defer_post(struct defer_work *work);
@@ -0,0 +1,77 @@
+#pragma once
+// Cooperative rate-monotonic executive. Replaces a hand written superloop.
+
+#include <stdint.h>
+
+/**
+ * A task. Allocated by the caller (usually static). The statistics fields can
+ * be read at any time, the rest should be treated as private.
+ *
+ * Tasks are prioritized rate-monotonically: the shorter the deadline (the
+ * period, for periodic tasks) the higher the priority. Tasks never preempt
+ * each other, the highest priority ready task runs to completion.
+ */
+struct exec_task {
+	struct exec_task *next;
+	const char *name;
+	void(*run)(void);
+	uint32_t period_us;      // 0 for event triggered tasks
+	uint32_t deadline_us;
+	volatile uint32_t release_us;
+	volatile uint8_t ready;
+
+	// statistics
+	uint32_t runs;
+	uint32_t deadline_misses;
+	uint32_t lost_events;    // events posted while the task was still waiting to run
+	uint32_t last_cycles;
+	uint32_t min_cycles;
+	uint32_t max_cycles;
+	uint64_t total_cycles;
+};
+
+/**
+ * Time the executive spent asleep in WFI because no task was ready. The share
+ * of time the core slept between two readings is the difference of idle_us
+ * over the time passed, which is where the WFI idle saves power.
+ */
+struct exec_idle {
+	uint32_t sleeps;         // WFI entries
+	uint32_t wakeups;        // returns from WFI before the next release, to run an event task
+	uint32_t idle_us;        // runs freely, wraps around with time_now_us()
+};
+
+extern struct exec_idle exec_idle;
+
+/**
+ * Adds a task that runs at a fixed rate. The deadline is the end of the period.
+ *
+ * @param task        The task
+ * @param name        A name for the task, for debugging
+ * @param run         Function to call every period
+ * @param period_us   Microseconds between releases
+ */
+void exec_add_periodic(struct exec_task *task, const char *name, void(*run)(void), uint32_t period_us);
+
+/**
+ * Adds a task that runs after exec_post() is called for it.
+ *
+ * @param task          The task
+ * @param name          A name for the task, for debugging
+ * @param run           Function to call once per posted event
+ * @param deadline_us   Microseconds after the event by which the task must have completed
+ */
+void exec_add_event(struct exec_task *task, const char *name, void(*run)(void), uint32_t deadline_us);
+
+/**
+ * Marks an event triggered task ready to run. Safe to call from ISRs.
+ *
+ * @param task   The task
+ */
+void exec_post(struct exec_task *task);
+
+/**
+ * Runs the tasks forever. The core sleeps with WFI whenever no task is ready.
+ * Requires timebase_setup() and EnableCycles() to have been called.
+ */
+void exec_run(void);
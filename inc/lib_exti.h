@@ -34,4 +34,14 @@ void exti_setup(enum GPIO_PIN pin, enum GPIO_PULL pull, enum EXTI_EDGE edge, voi
  *
  * @param pin		GPIO pin associated with the interrupt.
  */
-void exti_trigger(enum GPIO_PIN pin);
\ No newline at end of file
+void exti_trigger(enum GPIO_PIN pin);
+
+/**
+ * Gets the DWT cycle count taken first thing in the ISR, before the pending bit
+ * is checked or the handler is called. Call it from the handler to timestamp the
+ * edge without the ISR's own overhead.
+ *
+ * @param pin   GPIO pin associated with the interrupt
+ * @returns     DWT->CYCCNT on entry to the ISR that last called the pin's handler
+ */
+uint32_t exti_entry_cycles(enum GPIO_PIN pin);
\ No newline at end of file
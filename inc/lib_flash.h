@@ -0,0 +1,45 @@
+#pragma once
+// Internal flash erase and programming for the STM32F429 (2MB, dual bank).
+// Assumes a supply of 2.7 to 3.6V so words can be programmed 32 bits at a time.
+
+#include <stdint.h>
+
+/**
+ * Erases one sector. Sectors 0-3 and 12-15 are 16KB, 4 and 16 are 64KB, the rest are 128KB.
+ * A 128KB sector takes 1 to 2 seconds, during which code in the same bank stalls.
+ *
+ * @param sector   0 to 23
+ * @returns        1 on success, 0 if the flash reported an error
+ */
+uint8_t flash_erase_sector(uint8_t sector);
+
+/**
+ * Starts erasing a sector and returns at once. Poll flash_busy() until it
+ * returns 0, then call flash_erase_finish(). Reading the sector's bank stalls
+ * until then, and nothing else may program or erase the flash in between.
+ *
+ * @param sector   0 to 23
+ */
+void flash_erase_start(uint8_t sector);
+
+/**
+ * @returns   1 while an erase or programming operation is running
+ */
+uint8_t flash_busy(void);
+
+/**
+ * Ends an erase started by flash_erase_start(), waiting if it is still running.
+ *
+ * @returns   1 on success, 0 if the flash reported an error
+ */
+uint8_t flash_erase_finish(void);
+
+/**
+ * Programs words into erased flash.
+ *
+ * @param address   Destination, must be word aligned
+ * @param data      Source words
+ * @param words     Number of words
+ * @returns         1 on success, 0 if the flash reported an error
+ */
+uint8_t flash_write_words(uint32_t address, const uint32_t *data, uint32_t words);
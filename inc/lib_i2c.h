@@ -53,4 +53,45 @@ void i2c_write_register(I2C_TypeDef *i2c, uint8_t i2c_address, uint8_t reg, uint
  * @param first_reg     First register to read from
  * @param rx_buffer     Pointer to an array of uint8_t's where values will be stored
  */
-void i2c_read_registers(I2C_TypeDef *i2c, uint8_t i2c_address, uint8_t byte_count, uint8_t first_reg, uint8_t *rx_buffer);
\ No newline at end of file
+void i2c_read_registers(I2C_TypeDef *i2c, uint8_t i2c_address, uint8_t byte_count, uint8_t first_reg, uint8_t *rx_buffer);
+
+enum I2C_TRANSFER_STATUS {I2C_TRANSFER_IDLE, I2C_TRANSFER_QUEUED, I2C_TRANSFER_BUSY, I2C_TRANSFER_DONE, I2C_TRANSFER_ERROR};
+
+/**
+ * A non-blocking register read, see i2c_read_registers_async().
+ * Owned by the caller and must stay valid until done() has been called.
+ */
+struct i2c_transfer {
+	struct i2c_transfer *next;                      // used by the bus queue
+	uint8_t i2c_address;
+	uint8_t first_reg;
+	uint8_t byte_count;                             // 2 to 255
+	uint8_t *rx_buffer;
+	void (*done)(struct i2c_transfer *transfer);    // called in interrupt context, may be 0
+	void *context;                                  // for the caller
+	volatile enum I2C_TRANSFER_STATUS status;
+};
+
+/**
+ * Queues a register read that runs in the background: the address and register
+ * phases are driven by the I2C event interrupt and the data is received by DMA
+ * (I2C1: DMA1 stream 0, I2C2: DMA1 stream 2). Reads on I2C1 and I2C2 run at the
+ * same time, reads on the same bus run one after another.
+ * The blocking functions must not be used on a bus while reads are queued on it.
+ *
+ * @param i2c        I2C1 or I2C2
+ * @param transfer   The read, with i2c_address, first_reg, byte_count, rx_buffer and done filled in
+ * @returns          1 if queued, 0 if the transfer is already queued or invalid
+ */
+uint8_t i2c_read_registers_async(I2C_TypeDef *i2c, struct i2c_transfer *transfer);
+
+/**
+ * Pauses or resumes the background reads on a bus, so the blocking functions can
+ * be used in between, or the bus set up again. Pausing waits for the current read
+ * to finish; reads queued while paused start when the bus is resumed. Pauses nest,
+ * the bus resumes once every pause has been matched by a resume.
+ *
+ * @param i2c     I2C1 or I2C2
+ * @param pause   1 to pause, 0 to resume
+ */
+void i2c_async_pause(I2C_TypeDef *i2c, uint8_t pause);
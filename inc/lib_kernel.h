@@ -0,0 +1,145 @@
+#pragma once
+// Minimal preemptive fixed priority kernel using SysTick and PendSV.
+
+#include <stdint.h>
+
+#define KERNEL_TICK_HZ       1000
+#define KERNEL_PRIORITIES    32
+#define KERNEL_WAIT_FOREVER  0xFFFFFFFF
+
+/**
+ * A task. Allocated by the caller (usually static) along with its stack.
+ * Treat the fields as private, except for the statistics.
+ */
+struct kernel_task {
+	uint32_t *sp;                     // must stay first, used by kernel_pendsv
+	struct kernel_task *next;         // ready list or wait list
+	struct kernel_task *delay_next;   // delayed list
+	struct kernel_task **wait_list;   // the wait list the task is blocked on, if any
+	const char *name;
+	uint32_t wake_tick;
+	uint8_t priority;
+	uint8_t state;
+	uint8_t delayed;
+	uint8_t timed_out;
+
+	// statistics
+	uint32_t switches;
+};
+
+/**
+ * A counting semaphore. Can be given from ISRs.
+ */
+struct kernel_sem {
+	volatile uint32_t count;
+	struct kernel_task *waiters;
+};
+
+/**
+ * A fixed size queue of fixed size items, copied in and out. Items can be sent
+ * and received from ISRs as long as the timeout is 0.
+ */
+struct kernel_queue {
+	uint8_t *buffer;
+	uint32_t item_size;
+	uint32_t length;
+	uint32_t head;
+	uint32_t count;
+	struct kernel_task *readers;
+	struct kernel_task *writers;
+};
+
+/**
+ * Context switch cost, in CPU cycles, measured from the moment a switch is
+ * requested until the new task has been selected (exception entry and saving
+ * the old context included).
+ */
+struct kernel_stats {
+	uint32_t switches;
+	uint32_t last_switch_cycles;
+	uint32_t max_switch_cycles;
+};
+
+extern struct kernel_stats kernel_stats;
+
+/**
+ * Prepares a task. Tasks can be created before or after kernel_start().
+ *
+ * @param task          The task
+ * @param name          A name for the task, for debugging
+ * @param entry         Function the task runs
+ * @param arg           Argument passed to entry
+ * @param priority      0 (lowest, shared with the idle task) to KERNEL_PRIORITIES - 1 (highest)
+ * @param stack         Memory for the task's stack
+ * @param stack_words   Size of the stack in 32bit words. Tasks that use the FPU need at least 50 words for a context.
+ */
+void kernel_task_create(struct kernel_task *task, const char *name, void(*entry)(void *arg), void *arg, uint8_t priority, uint32_t *stack, uint32_t stack_words);
+
+/**
+ * Starts SysTick and switches to the highest priority task. Never returns.
+ * The stack in use until then (MSP) is only used by interrupts afterwards.
+ */
+void kernel_start(void);
+
+/**
+ * Blocks the calling task for a number of ticks.
+ *
+ * @param ticks   Ticks to sleep for
+ */
+void kernel_sleep(uint32_t ticks);
+
+/**
+ * Lets other ready tasks of the same priority run.
+ */
+void kernel_yield(void);
+
+/**
+ * @returns   Ticks since kernel_start()
+ */
+uint32_t kernel_ticks(void);
+
+void kernel_sem_init(struct kernel_sem *sem, uint32_t initial_count);
+
+/**
+ * Takes a semaphore, blocking if the count is 0.
+ *
+ * @param sem       The semaphore
+ * @param timeout   Ticks to wait for, 0 to not wait, or KERNEL_WAIT_FOREVER. Must be 0 in ISRs.
+ * @returns         1 if the semaphore was taken, 0 on timeout
+ */
+uint8_t kernel_sem_take(struct kernel_sem *sem, uint32_t timeout);
+
+/**
+ * Gives a semaphore, waking the highest priority waiting task. Safe to call from ISRs.
+ *
+ * @param sem   The semaphore
+ */
+void kernel_sem_give(struct kernel_sem *sem);
+
+/**
+ * @param queue       The queue
+ * @param buffer      Memory for item_size * length bytes
+ * @param item_size   Size of one item in bytes
+ * @param length      Maximum number of items
+ */
+void kernel_queue_init(struct kernel_queue *queue, void *buffer, uint32_t item_size, uint32_t length);
+
+/**
+ * Copies an item into a queue, blocking while it is full.
+ *
+ * @param queue     The queue
+ * @param item      Item to copy in
+ * @param timeout   Ticks to wait for, 0 to not wait, or KERNEL_WAIT_FOREVER. Must be 0 in ISRs.
+ * @returns         1 if the item was queued, 0 on timeout
+ */
+uint8_t kernel_queue_send(struct kernel_queue *queue, const void *item, uint32_t timeout);
+
+/**
+ * Copies an item out of a queue, blocking while it is empty.
+ *
+ * @param queue     The queue
+ * @param item      Where to copy the item to
+ * @param timeout   Ticks to wait for, 0 to not wait, or KERNEL_WAIT_FOREVER. Must be 0 in ISRs.
+ * @returns         1 if an item was received, 0 on timeout
+ */
+uint8_t kernel_queue_receive(struct kernel_queue *queue, void *item, uint32_t timeout);
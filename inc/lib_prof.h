@@ -0,0 +1,67 @@
+#pragma once
+// Scoped cycle profiling with the DWT cycle counter.
+//
+// Build with -DPROFILING to enable. Without it every macro and function below
+// compiles to nothing, so instrumentation can be left in production code.
+//
+// Usage:
+//     PROF_BEGIN(i2c_read);
+//     i2c_read_registers(...);
+//     PROF_END(i2c_read);
+//
+// Regions can be nested, including by ISRs interrupting a region. Each region
+// records its inclusive time and its self time (inclusive minus nested regions).
+
+#include <stdint.h>
+
+#define PROF_NAME_LENGTH  16
+#define PROF_BUCKETS      32
+#define PROF_MAX_DEPTH    16
+
+/**
+ * Statistics for one region. Histogram bucket n counts executions that took
+ * between 2^n and 2^(n+1)-1 cycles.
+ */
+struct prof_region {
+	const char *name;
+	struct prof_region *next;
+	uint8_t registered;
+	uint32_t count;
+	uint32_t min_cycles;
+	uint32_t max_cycles;
+	uint64_t total_cycles;
+	uint64_t self_cycles;
+	uint32_t histogram[PROF_BUCKETS];
+};
+
+#ifdef PROFILING
+
+#define PROF_BEGIN(region) \
+	static struct prof_region prof_region_##region = { .name = #region }; \
+	prof_begin(&prof_region_##region)
+
+#define PROF_END(region) \
+	prof_end(&prof_region_##region)
+
+void prof_begin(struct prof_region *region);
+void prof_end(struct prof_region *region);
+
+/**
+ * Sends every region's statistics over the UART in binary. See tools/prof_decode.py.
+ */
+void prof_dump(void);
+
+/**
+ * Clears the statistics of every region.
+ */
+void prof_reset(void);
+
+#else
+
+#define PROF_BEGIN(region) do {} while (0)
+#define PROF_END(region)   do {} while (0)
+
+static inline void prof_dump(void) {}
+static inline void prof_reset(void) {}
+
+#endif
@@ -0,0 +1,87 @@
+#pragma once
+// Lock-free single producer, single consumer queue of fixed size slots, such as
+// between an interrupt that acquires samples and the task that processes them.
+//
+// The producer only writes head and the consumer only writes tail, so neither
+// side ever disables interrupts or waits for the other. Both indices run freely
+// and are masked into the power of two slot count, so all slots are usable.
+// Slots are filled and drained in place: reserve/commit and peek/release avoid
+// copying, which also lets a DMA transfer fill a reserved slot.
+
+#include <stdint.h>
+
+struct spsc {
+	uint8_t *storage;
+	uint16_t slot_size;          // bytes, a multiple of 4 so every slot is word aligned
+	uint16_t mask;               // slots - 1
+	volatile uint32_t head;      // slots committed, written by the producer only
+	volatile uint32_t tail;      // slots released, written by the consumer only
+	uint32_t overflows;          // reservations refused because the queue was full, producer side
+	uint32_t high_water;         // most slots in use at once, producer side
+};
+
+/**
+ * Prepares an empty queue.
+ *
+ * @param queue       The queue
+ * @param storage     slots * slot_size bytes, word aligned
+ * @param slot_size   Bytes per slot, a multiple of 4
+ * @param slots       Number of slots, a power of two
+ * @returns           1 on success, 0 if the sizes are not allowed
+ */
+uint8_t spsc_init(struct spsc *queue, void *storage, uint16_t slot_size, uint16_t slots);
+
+/**
+ * Producer: gets the next free slot to fill. It is only handed to the consumer
+ * by spsc_commit(), and reserving again before that returns the same slot.
+ *
+ * @param queue   The queue
+ * @returns       The slot, or 0 if the queue is full
+ */
+void *spsc_reserve(struct spsc *queue);
+
+/**
+ * Producer: hands the reserved slot to the consumer.
+ *
+ * @param queue   The queue
+ */
+void spsc_commit(struct spsc *queue);
+
+/**
+ * Producer: copies an item into the queue.
+ *
+ * @param queue   The queue
+ * @param item    slot_size bytes
+ * @returns       1 on success, 0 if the queue was full
+ */
+uint8_t spsc_push(struct spsc *queue, const void *item);
+
+/**
+ * Consumer: gets the oldest committed slot. It stays valid until spsc_release().
+ *
+ * @param queue   The queue
+ * @returns       The slot, or 0 if the queue is empty
+ */
+void *spsc_peek(struct spsc *queue);
+
+/**
+ * Consumer: gives the slot returned by spsc_peek() back to the producer.
+ *
+ * @param queue   The queue
+ */
+void spsc_release(struct spsc *queue);
+
+/**
+ * Consumer: copies the oldest item out of the queue.
+ *
+ * @param queue   The queue
+ * @param item    Receives slot_size bytes
+ * @returns       1 on success, 0 if the queue was empty
+ */
+uint8_t spsc_pop(struct spsc *queue, void *item);
+
+/**
+ * @param queue   The queue
+ * @returns       Slots committed but not released yet
+ */
+uint32_t spsc_count(const struct spsc *queue);
@@ -0,0 +1,83 @@
+#pragma once
+// Software timers on a hierarchical timer wheel driven by the TIM2 timebase.
+
+#include <stdint.h>
+
+enum SWTIMER_CONTEXT {ISR_CONTEXT, THREAD_CONTEXT};
+
+/**
+ * A software timer. Allocated by the caller (usually static), so any number of
+ * timers can be active without dynamic memory. Treat the fields as private.
+ */
+struct swtimer {
+	struct swtimer *next;
+	struct swtimer *prev;
+	uint32_t expires;
+	uint32_t period;
+	void(*callback)(void *arg);
+	void *arg;
+	uint8_t context;
+	uint8_t active;
+	uint16_t overruns;
+};
+
+/**
+ * Cost of the wheel, in CPU cycles, for benchmarking.
+ */
+struct swtimer_stats {
+	uint32_t ticks;
+	uint32_t expired;
+	uint32_t max_tick_cycles;
+	uint32_t max_start_cycles;
+};
+
+extern struct swtimer_stats swtimer_stats;
+
+/**
+ * Starts the timer wheel. Requires timebase_setup() to have been called.
+ *
+ * @param tick_us   Length of one wheel tick in microseconds, such as 1000
+ */
+void swtimer_setup(uint32_t tick_us);
+
+/**
+ * Prepares a timer for use.
+ *
+ * @param timer      The timer
+ * @param callback   Function called when the timer expires
+ * @param arg        Argument passed to the callback
+ * @param context    ISR_CONTEXT to call the callback from the tick ISR, or
+ *                   THREAD_CONTEXT to call it from swtimer_run_pending()
+ */
+void swtimer_init(struct swtimer *timer, void(*callback)(void *arg), void *arg, enum SWTIMER_CONTEXT context);
+
+/**
+ * Arms a timer. Restarting an active timer reschedules it. O(1).
+ *
+ * @param timer          The timer
+ * @param delay_ticks    Ticks until the first expiry
+ * @param period_ticks   Ticks between expiries after the first, or 0 for a one-shot timer
+ */
+void swtimer_start(struct swtimer *timer, uint32_t delay_ticks, uint32_t period_ticks);
+
+/**
+ * Disarms a timer, including one that has expired but not yet run. O(1).
+ *
+ * @param timer   The timer
+ */
+void swtimer_stop(struct swtimer *timer);
+
+/**
+ * @returns   Ticks since swtimer_setup()
+ */
+uint32_t swtimer_now(void);
+
+/**
+ * Runs the callbacks of expired THREAD_CONTEXT timers. Call from the main loop.
+ */
+void swtimer_run_pending(void);
+
+/**
+ * Sleeps with WFI until at least one THREAD_CONTEXT timer is waiting to run.
+ */
+void swtimer_wait(void);
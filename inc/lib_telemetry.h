@@ -0,0 +1,121 @@
+#pragma once
+// Telemetry multiplexer: several logical channels, such as raw samples, the
+// fused attitude, statistics, logs and profiling, share the UART. Each channel
+// queues whole records, keeps only every n-th record offered to it, and has a
+// priority and a share of every frame. telemetry_flush() packs queued records
+// into one frame of a fixed size that fills the UART's DMA buffer:
+//
+//   1. channels in priority order take records up to their share of the frame
+//   2. channels in priority order fill the space left over
+//
+// Records are never split, so a frame only depends on what is queued, and a
+// channel always gets its share when it has data, however busy the others
+// are. Records that find their queue full are counted as dropped, and the
+// counters of every channel go out on channel 0 every few flushes.
+//
+// Modules that send their own frames with uart_send_bytes() can be routed into
+// a channel with telemetry_route(), so tools/telemetry_demux.py can write each
+// channel to a file that the module's own decoder reads.
+//
+// Everything here runs in thread mode, from exec tasks, never from interrupts.
+
+#include <stdint.h>
+
+#define TELEMETRY_MAX_FRAME      1024    // the UART's DMA buffer
+#define TELEMETRY_STATS_CHANNEL  0       // channel id of the counters sent by the multiplexer itself
+#define TELEMETRY_NAME_LENGTH    8
+
+/**
+ * A channel, allocated by the caller (usually static).
+ */
+struct telemetry_channel {
+	uint8_t id;                          // 1 to 255, tags its records in the frames
+	char name[TELEMETRY_NAME_LENGTH];    // for the host, not necessarily null terminated
+	uint8_t priority;                    // 0 is served first
+	uint16_t divider;                    // keeps 1 of every divider records offered
+	uint16_t share;                      // bytes of every frame reserved for this channel, record headers included
+	uint16_t phase;                      // records to skip before the next one is kept
+	uint16_t max_record;                 // largest record that fits in a frame
+	uint8_t *storage;                    // queued records, each a uint16 length followed by the bytes
+	uint16_t size;
+	uint32_t head;                       // bytes written, runs freely
+	uint32_t tail;                       // bytes read, runs freely
+	struct telemetry_channel *next;      // in priority order
+
+	// statistics
+	uint32_t offered;
+	uint32_t decimated;                  // skipped by the divider
+	uint32_t dropped;                    // queue full, or too large for a frame
+	uint32_t sent;
+	uint32_t sent_bytes;
+};
+
+struct telemetry {
+	struct telemetry_channel *channels;  // in priority order
+	uint16_t frame_bytes;
+	uint16_t stats_interval;             // flushes between counters, 0 for never
+	uint16_t since_stats;
+	uint8_t sequence;
+	uint32_t frames;
+	uint8_t frame[TELEMETRY_MAX_FRAME];
+};
+
+/**
+ * Prepares a multiplexer without channels.
+ *
+ * @param mux              The multiplexer
+ * @param frame_bytes      Size of every frame, up to TELEMETRY_MAX_FRAME. Send one frame per frame_bytes * 10 / baud seconds.
+ * @param stats_interval   Flushes between the channel counters, 0 for never
+ */
+void telemetry_init(struct telemetry *mux, uint16_t frame_bytes, uint16_t stats_interval);
+
+/**
+ * Adds a channel.
+ *
+ * @param mux        The multiplexer
+ * @param channel    The channel
+ * @param id         1 to 255, unique
+ * @param name       Up to TELEMETRY_NAME_LENGTH characters, for the host
+ * @param storage    Queue storage, at least the size of the largest record plus 2
+ * @param size       Bytes of storage
+ * @param priority   0 is served first, channels of equal priority in the order they were added
+ * @param divider    Keeps 1 of every divider records, 1 keeps them all
+ * @param share      Bytes of every frame reserved for the channel, at least its largest record plus 3 to be guaranteed
+ */
+void telemetry_add_channel(struct telemetry *mux, struct telemetry_channel *channel, uint8_t id, const char *name, uint8_t *storage, uint16_t size, uint8_t priority, uint16_t divider, uint16_t share);
+
+/**
+ * Offers a record to a channel.
+ *
+ * @param channel   The channel
+ * @param data      The record
+ * @param length    Bytes in the record
+ * @returns         1 if queued, 0 if skipped by the divider or dropped
+ */
+uint8_t telemetry_write(struct telemetry_channel *channel, const void *data, uint16_t length);
+
+/**
+ * Offers a line of text to a channel, without the terminating null.
+ *
+ * @param channel   The channel
+ * @param text      The text
+ * @returns         1 if queued, 0 if skipped by the divider or dropped
+ */
+uint8_t telemetry_log(struct telemetry_channel *channel, const char *text);
+
+/**
+ * Routes uart_send_bytes() into a channel, each call becoming one record, until
+ * telemetry_route(0) sends to the UART again.
+ *
+ * @param channel   The channel, or 0 to stop routing
+ */
+void telemetry_route(struct telemetry_channel *channel);
+
+/**
+ * Packs queued records into a frame and sends it, see tools/telemetry_demux.py.
+ * Waits for the previous frame to finish, so call it about as often as a frame takes.
+ *
+ * @param mux   The multiplexer
+ * @returns     Number of records sent
+ */
+uint16_t telemetry_flush(struct telemetry *mux);
@@ -6,6 +6,61 @@ uint32_t maxUsSleep;
 uint32_t cyclesPerUs;
 extern uint32_t SystemCoreClock;
 
+/**
+ * Statistics collected by sleepMs() while the timebase is running, and by
+ * sleepMsBusy() in a separate set, so both can be compared.
+ *
+ * error_us is how late the sleep returned relative to its deadline.
+ * wake_latency is the number of CPU cycles between the TIM2 compare ISR
+ * firing and sleepMs() noticing the deadline and returning, 0 for busy sleeps.
+ * wakeups counts every return from WFI, including early wake-ups caused by
+ * unrelated interrupts (sensor data ready, UART DMA, etc.), 0 for busy sleeps.
+ */
+struct sleep_stats {
+	uint32_t sleeps;
+	uint32_t wakeups;
+	int32_t  last_error_us;
+	int32_t  max_error_us;
+	uint32_t last_wake_latency;
+	uint32_t max_wake_latency;
+};
+
+extern struct sleep_stats sleep_stats;
+extern struct sleep_stats sleep_busy_stats;
+
 void EnableCycles();
 void sleepUs(uint32_t uS);
 void sleepMs(uint32_t mS);
+
+/**
+ * Busy-wait version of sleepMs(). Burns 100% CPU, but does not need the timebase.
+ * Its error is measured with the cycle counter into sleep_busy_stats.
+ */
+void sleepMsBusy(uint32_t mS);
+
+/**
+ * Starts TIM2 as a free-running 32bit 1MHz timebase.
+ * Once running, sleepMs() puts the core to sleep with WFI until a TIM2 compare
+ * fires at the deadline, or any other interrupt wakes it up.
+ */
+void timebase_setup(void);
+
+/**
+ * @returns   Microseconds since timebase_setup(). Wraps around every ~71 minutes.
+ */
+uint32_t time_now_us(void);
+
+/**
+ * Calls a handler from the TIM2 ISR at a fixed rate, using compare channel 2.
+ *
+ * @param handler     Pointer to the tick handler
+ * @param period_us   Microseconds between calls
+ */
+void timebase_set_tick_handler(void(*handler)(void), uint32_t period_us);
+
+/**
+ * Arms the TIM2 compare that wakes the core from WFI at a deadline.
+ *
+ * @param deadline_us   Value of time_now_us() at which to wake up
+ */
+void timebase_set_wakeup(uint32_t deadline_us);
@@ -22,6 +22,22 @@ void uart_setup(enum GPIO_PIN tx_pin, uint32_t baud);
 void uart_send_csv_floats(uint8_t count, float first_value, ...);
 void uart_send_bin_floats(uint8_t count, float first_value, ...);
 
+/**
+ * Transmit raw bytes via DMA. Waits for the previous transfer to finish before copying them into the TX buffer.
+ *
+ * @param data     Bytes to send
+ * @param length   Number of bytes, at most 1024
+ */
+void uart_send_bytes(const void *data, uint32_t length);
+
+/**
+ * Hands everything given to uart_send_bytes() to a handler instead of sending it,
+ * such as to queue the frames of a module in a telemetry channel (see lib_telemetry.h).
+ *
+ * @param handler   Pointer to the handler, or 0 to send again
+ */
+void uart_redirect(void (*handler)(const void *data, uint32_t length));
+
 /**
  * Effectively empties the TX buffer by placing a null character at position zero and resetting the pointer.
  */
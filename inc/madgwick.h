@@ -0,0 +1,71 @@
+#pragma once
+// Madgwick's gradient descent orientation filter, single precision only.
+
+#include <stdint.h>
+#include "imu_block.h"
+
+/**
+ * Filter state. q0 is the scalar part of the quaternion describing the sensor
+ * frame relative to the earth frame.
+ */
+struct madgwick {
+	float q0, q1, q2, q3;
+	float beta;             // gain of the accelerometer/magnetometer correction
+	float sample_period;    // seconds
+};
+
+/**
+ * Worst and latest cost of one filter update in CPU cycles, measured by madgwick_update_block().
+ */
+struct madgwick_stats {
+	uint32_t updates;
+	uint32_t last_cycles;
+	uint32_t max_cycles;
+};
+
+extern struct madgwick_stats madgwick_stats;
+
+/**
+ * Resets the filter to the identity orientation.
+ *
+ * @param filter           The filter
+ * @param sample_rate_hz   Rate at which the update functions will be called
+ * @param beta             Correction gain. 0.1 is a reasonable start; higher converges faster but is noisier.
+ */
+void madgwick_init(struct madgwick *filter, float sample_rate_hz, float beta);
+
+/**
+ * Updates the orientation from gyro and accelerometer readings.
+ *
+ * @param filter       The filter
+ * @param gx, gy, gz   Angular rate in radians per second
+ * @param ax, ay, az   Acceleration in any unit, only the direction is used
+ */
+void madgwick_update_imu(struct madgwick *filter, float gx, float gy, float gz, float ax, float ay, float az);
+
+/**
+ * Updates the orientation from gyro, accelerometer and magnetometer readings.
+ * Falls back to madgwick_update_imu() if the magnetometer reading is all zeros.
+ *
+ * @param filter       The filter
+ * @param gx, gy, gz   Angular rate in radians per second
+ * @param ax, ay, az   Acceleration in any unit, only the direction is used
+ * @param mx, my, mz   Magnetic field in any unit, only the direction is used
+ */
+void madgwick_update_marg(struct madgwick *filter, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz);
+
+/**
+ * Runs one update per sample of a block, timing each update. The sample period
+ * is taken from the block.
+ *
+ * @param filter            The filter
+ * @param block             The samples
+ * @param use_magnetometer  Nonzero for MARG updates, 0 for IMU updates
+ */
+void madgwick_update_block(struct madgwick *filter, const struct imu_block *block, uint8_t use_magnetometer);
+
+/**
+ * Approximate 1 / sqrt(x), relative error below 0.1%. Much cheaper than
+ * 1.0f / sqrtf(x), which needs both a VSQRT and a VDIV.
+ */
+float inv_sqrt(float x);
@@ -0,0 +1,45 @@
+#pragma once
+// Mahony's nonlinear complementary (PI) orientation filter, single precision only.
+
+#include <stdint.h>
+
+/**
+ * Filter state. The quaternion uses the same convention as struct madgwick.
+ */
+struct mahony {
+	float q0, q1, q2, q3;
+	float kp;                   // proportional gain
+	float ki;                   // integral gain, 0 disables gyro bias estimation
+	float integral_x, integral_y, integral_z;
+	float sample_period;        // seconds
+};
+
+/**
+ * Resets the filter to the identity orientation.
+ *
+ * @param filter           The filter
+ * @param sample_rate_hz   Rate at which the update functions will be called
+ * @param kp               Proportional gain, such as 1.0
+ * @param ki               Integral gain, such as 0.0 or 0.01
+ */
+void mahony_init(struct mahony *filter, float sample_rate_hz, float kp, float ki);
+
+/**
+ * Updates the orientation from gyro and accelerometer readings.
+ *
+ * @param filter       The filter
+ * @param gx, gy, gz   Angular rate in radians per second
+ * @param ax, ay, az   Acceleration in any unit, only the direction is used
+ */
+void mahony_update_imu(struct mahony *filter, float gx, float gy, float gz, float ax, float ay, float az);
+
+/**
+ * Updates the orientation from gyro, accelerometer and magnetometer readings.
+ * Falls back to mahony_update_imu() if the magnetometer reading is all zeros.
+ *
+ * @param filter       The filter
+ * @param gx, gy, gz   Angular rate in radians per second
+ * @param ax, ay, az   Acceleration in any unit, only the direction is used
+ * @param mx, my, mz   Magnetic field in any unit, only the direction is used
+ */
+void mahony_update_marg(struct mahony *filter, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz);
@@ -3,14 +3,242 @@
 #include "lib_gpio.h"
 #include "lib_i2c.h"
 #include "lib_exti.h"
+#include "lib_spsc.h"
+#include "lib_defer.h"
+#include "imu_block.h"
+#include "imu_convert.h"
+#include "imu_calibration.h"
 
+#define MPU6050_MAX_SENSORS     4
+#define MPU6050_ADDRESS_AD0_LOW  0b1101000
+#define MPU6050_ADDRESS_AD0_HIGH 0b1101001
+#define MPU6050_BLOCK_POOL      4
+#define MPU6050_RECORD_SIZE     20      // register dump from 0x3B: accel, temperature, gyro, magnetometer
+#define MPU6050_ASYNC_RECORDS   16      // samples read in the background but not yet serviced, a power of two
+#define MPU6050_JITTER_BINS     32      // histogram bins, the middle one starts at the average period
+
+
+// digital low pass filter bandwidth (accelerometer), the gyro output rate is 8kHz with MPU6050_DLPF_260HZ and 1kHz otherwise
+enum MPU6050_DLPF {MPU6050_DLPF_260HZ, MPU6050_DLPF_184HZ, MPU6050_DLPF_94HZ, MPU6050_DLPF_44HZ, MPU6050_DLPF_21HZ, MPU6050_DLPF_10HZ, MPU6050_DLPF_5HZ};
+enum MPU6050_GYRO_RANGE {MPU6050_GYRO_250DPS, MPU6050_GYRO_500DPS, MPU6050_GYRO_1000DPS, MPU6050_GYRO_2000DPS};
+enum MPU6050_ACCEL_RANGE {MPU6050_ACCEL_2G, MPU6050_ACCEL_4G, MPU6050_ACCEL_8G, MPU6050_ACCEL_16G};
+
+/**
+ * Output data rate, filtering and full scale ranges.
+ */
+struct mpu6050_config {
+	uint16_t rate_hz;                       // rounded to the nearest rate the divider can produce, lowered to what the I2C bus carries
+	enum MPU6050_DLPF dlpf;
+	enum MPU6050_GYRO_RANGE gyro_range;
+	enum MPU6050_ACCEL_RANGE accel_range;
+};
+
+/**
+ * FIFO mode counters.
+ */
+struct mpu6050_fifo_stats {
+	uint8_t  enabled;
+	uint32_t samples;
+	uint32_t bursts;
+	uint32_t overflows;
+	uint32_t realigns;
+	uint32_t discarded;                     // samples thrown away by FIFO resets, numbered all the same
+};
 
 /**
- * Configure an MPU6050 and HMC5883L sensor.
+ * Data ready jitter: each interval between data ready interrupts, measured from
+ * ISR entry to ISR entry, less the average interval. The average follows the
+ * sensor's own clock, which can be a few percent off the nominal rate, so only
+ * the variation is binned. Intervals spanning several periods mean interrupts
+ * were lost altogether, while interrupts were masked for too long.
+ */
+struct mpu6050_jitter {
+	uint32_t bin_cycles;                    // width of a bin
+	uint32_t period_q4;                     // average interval, in 1/16 cycles
+	uint32_t last_cycles;                   // ISR entry of the latest data ready interrupt
+	uint16_t settle;                        // intervals left before binning starts, while the average settles
+	uint32_t intervals;
+	uint32_t lost;                          // data ready interrupts that never ran
+	int32_t  min_cycles;                    // smallest and largest deviation from the average
+	int32_t  max_cycles;
+	uint32_t bins[MPU6050_JITTER_BINS];     // bin i counts deviations from (i - BINS / 2) to (i - BINS / 2 + 1) bin widths, the ends also count everything beyond
+	volatile uint32_t restart_bin_cycles;   // nonzero asks the interrupt to clear the histogram with this bin width
+};
+
+/**
+ * One MPU6050, with an optional HMC5883L on its auxiliary bus. All driver state
+ * lives here, so several sensors can run at once on one or both I2C buses.
+ */
+struct mpu6050 {
+
+	uint8_t id;                                     // setup order, tags blocks and calibration records
+	I2C_TypeDef *i2c;
+	uint8_t address;
+	enum GPIO_PIN sck_pin;
+	enum GPIO_PIN sda_pin;
+	enum GPIO_PIN irq_pin;
+	uint8_t aux_master;                             // USER_CTRL I2C_MST_EN, kept set when the FIFO is reset
+	struct mpu6050_config config;                   // in effect
+	struct mpu6050_config requested;                // applied at the next sample boundary
+	volatile uint8_t config_requested;
+	uint8_t discard;                                // samples to throw away after a configuration change
+	void (*handler)(const struct imu_block *block);
+
+	// conversion and calibration
+	struct imu_convert register_layout;
+	struct imu_convert fifo_layout;
+	struct imu_calibration calibration;             // offsets loaded from flash, refined whenever the sensor is still
+
+	// sample blocks, handed to the event handler in turn
+	struct imu_block blocks[MPU6050_BLOCK_POOL];
+	uint8_t block_index;
+	uint32_t block_sequence;
+	uint16_t block_length;
+	uint32_t sample_period_us;
+	uint32_t sample_period_cycles;
+	uint32_t sample_sequence;                       // sequence number of the next sample
+	struct mpu6050_jitter jitter;
+
+	// blocking reads, deferred from the data ready interrupt to PendSV
+	struct defer_work read_work;
+	volatile uint32_t read_time_us;
+	volatile uint32_t read_cycles;
+	volatile uint32_t read_sequence;
+
+	// background reads, started by the data ready interrupt
+	uint8_t async;
+	void (*ready)(struct mpu6050 *imu);
+	struct i2c_transfer transfer;
+	struct mpu6050_record {
+		uint32_t timestamp_us;
+		uint32_t capture_cycles;
+		uint32_t sequence;
+		uint8_t data[MPU6050_RECORD_SIZE];
+	} records[MPU6050_ASYNC_RECORDS];
+	struct spsc record_queue;                       // filled by the interrupts, drained by mpu6050_service()
+	uint32_t missed;                                // data ready while the previous read was still running, or no room
+
+	// FIFO mode
+	uint16_t fifo_watermark;
+	uint32_t fifo_drained_us;                       // when the FIFO was last emptied
+	struct mpu6050_fifo_stats fifo_stats;
+
+};
+
+/**
+ * Configure an MPU6050 and HMC5883L sensor. The data ready interrupt takes a
+ * timestamp and defers the blocking read to PendSV (see lib_defer.h), which gives
+ * blocks to the handler. See mpu6050_start_async() to read with the DMA instead.
  *
+ * @param imu       The sensor's state, must stay valid for as long as the sensor runs
  * @param sck_pin   I2C clock pin
  * @param sda_pin   I2C data pin
  * @param int_pin   MPU6050 interrupt pin
- * @param handler   Pointer to an event handler that will be called after new sensor readings have been processed
+ * @param address   MPU6050_ADDRESS_AD0_LOW or MPU6050_ADDRESS_AD0_HIGH
+ * @param handler   Pointer to an event handler that will be given each block of new sensor readings
+ * @returns         1 on success, 0 for an unsupported pin combination or too many sensors
+ */
+uint8_t mpu6050_setup(struct mpu6050 *imu, enum GPIO_PIN sck_pin, enum GPIO_PIN sda_pin, enum GPIO_PIN int_pin, uint8_t address, void(*handler)(const struct imu_block *block));
+
+/**
+ * Changes the output data rate, low pass filter and ranges while running. The
+ * change is made right after the next sample has been read: the current block is
+ * handed over first, so no block mixes settings, the scale factors and gyro offsets
+ * are recomputed for the new ranges, and the first sample taken during the switch
+ * is dropped. In FIFO mode the FIFO is reset after the switch.
+ * Offsets are only refined online at +/-2000dps and +/-4g, the ranges they are stored for.
+ * The I2C bus runs at 400kHz while the reads of the sensors on it need more than
+ * 75% of 100kHz, and rates whose reads do not fit in 75% of 400kHz are lowered:
+ * a single sensor alone on the bus reads at most 1428 samples per second.
+ *
+ * @param imu      The sensor
+ * @param config   The new configuration, copied
+ */
+void mpu6050_configure(struct mpu6050 *imu, const struct mpu6050_config *config);
+
+/**
+ * Sets how many samples are collected into a block before it is given to the
+ * event handler. Defaults to 1 in data ready mode. In FIFO mode every drained
+ * burst is handed over as well, even if it is shorter.
+ *
+ * @param imu      The sensor
+ * @param length   Samples per block, 1 to IMU_BLOCK_CAPACITY
+ */
+void mpu6050_set_block_length(struct mpu6050 *imu, uint16_t length);
+
+/**
+ * Reads the sensors and gives them to the event handler once a block is full.
+ * This is what the data ready interrupt does by default.
+ *
+ * @param imu   The sensor
+ */
+void mpu6050_read_sensors(struct mpu6050 *imu);
+
+/**
+ * Replaces what the data ready interrupt does. Use this to keep the I2C read out
+ * of interrupt context: the handler posts an event, and the task handling the
+ * event calls mpu6050_read_sensors().
+ *
+ * @param imu       The sensor
+ * @param handler   Pointer to the new data ready handler
+ */
+void mpu6050_set_irq_handler(struct mpu6050 *imu, void(*handler)(void));
+
+/**
+ * Makes the data ready interrupt timestamp the sample and start a background
+ * read (interrupt and DMA driven), then return. Reads of sensors on different
+ * buses overlap. When a read completes, ready() is called in interrupt context;
+ * it should post an event whose task calls mpu6050_service().
+ * Blocks are timestamped with the data ready interrupt, so blocks of different
+ * sensors can be matched up with imu_align.
+ *
+ * @param imu     The sensor
+ * @param ready   Called in interrupt context after each completed read, or 0 to poll mpu6050_service()
+ */
+void mpu6050_start_async(struct mpu6050 *imu, void (*ready)(struct mpu6050 *imu));
+
+/**
+ * Converts the samples read in the background and gives blocks to the event handler.
+ *
+ * @param imu   The sensor
+ * @returns     Number of samples serviced
+ */
+uint16_t mpu6050_service(struct mpu6050 *imu);
+
+/**
+ * Switches the MPU6050 to FIFO mode. The data ready interrupt is disabled, instead
+ * mpu6050_fifo_poll() must be called periodically to drain the FIFO in bursts.
+ * The I2C bus is switched to 400kHz, which keeps the bursts short.
+ *
+ * @param imu         The sensor
+ * @param rate_hz     Sample rate, 4 to 1000 Hz
+ * @param watermark   Number of samples to let accumulate before mpu6050_fifo_poll() reads them
+ */
+void mpu6050_fifo_setup(struct mpu6050 *imu, uint16_t rate_hz, uint16_t watermark);
+
+/**
+ * Drains the FIFO if at least the watermark number of samples is waiting, and
+ * gives the samples to the event handler in blocks. Handles FIFO overflows by resetting
+ * the FIFO, which realigns the stream on a sample boundary. The background reads of
+ * other sensors on the bus are held back during each blocking access.
+ *
+ * @param imu   The sensor
+ * @returns     Number of samples read
+ */
+uint16_t mpu6050_fifo_poll(struct mpu6050 *imu);
+
+/**
+ * Clears the data ready jitter histogram. The histogram is cleared by the next
+ * data ready interrupt, and also whenever the sample rate changes.
+ *
+ * @param imu          The sensor
+ * @param bin_cycles   Width of a histogram bin in CPU cycles, or 0 for 1us
+ */
+void mpu6050_jitter_reset(struct mpu6050 *imu, uint32_t bin_cycles);
+
+/**
+ * Sends the data ready jitter histogram over the UART, see tools/stream_decode.py.
+ *
+ * @param imu   The sensor
  */
-void mpu6050_hmc5883l_setup(enum GPIO_PIN sck_pin, enum GPIO_PIN sda_pin, enum GPIO_PIN int_pin, void(*handler)(float gyro_x, float gyro_y, float gyro_z, float accel_x, float accel_y, float accel_z, float magn_x, float magn_y, float magn_z));
+void mpu6050_jitter_send(const struct mpu6050 *imu);
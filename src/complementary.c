@@ -0,0 +1,117 @@
+// Cheap quaternion complementary filter, single precision only.
+//
+// The gyro rate is integrated, then the tilt and heading are nudged towards
+// the accelerometer and magnetometer by a fixed fraction of the error, as in
+// R. Valenti et al., "Keeping a Good Attitude", 2015. The corrections are
+// built directly as quaternions, so no trigonometric functions are needed.
+
+#include "complementary.h"
+#include "madgwick.h"
+
+/**
+ * Resets the filter to the identity orientation.
+ *
+ * @param filter           The filter
+ * @param sample_rate_hz   Rate at which the update function will be called
+ * @param accel_gain       Tilt correction per update, such as 0.01
+ * @param magn_gain        Heading correction per update, such as 0.01
+ */
+void complementary_init(struct complementary *filter, float sample_rate_hz, float accel_gain, float magn_gain) {
+
+	filter->q0 = 1.0f;
+	filter->q1 = 0.0f;
+	filter->q2 = 0.0f;
+	filter->q3 = 0.0f;
+	filter->accel_gain = accel_gain;
+	filter->magn_gain = magn_gain;
+	filter->sample_period = 1.0f / sample_rate_hz;
+
+}
+
+// rotates a sensor frame vector into the earth frame: v' = q v q*
+static void to_earth(const struct complementary *f, float *x, float *y, float *z) {
+
+	float q0 = f->q0, q1 = f->q1, q2 = f->q2, q3 = f->q3;
+	float vx = *x, vy = *y, vz = *z;
+
+	*x = (1.0f - 2.0f * (q2 * q2 + q3 * q3)) * vx + 2.0f * (q1 * q2 - q0 * q3) * vy + 2.0f * (q1 * q3 + q0 * q2) * vz;
+	*y = 2.0f * (q1 * q2 + q0 * q3) * vx + (1.0f - 2.0f * (q1 * q1 + q3 * q3)) * vy + 2.0f * (q2 * q3 - q0 * q1) * vz;
+	*z = 2.0f * (q1 * q3 - q0 * q2) * vx + 2.0f * (q2 * q3 + q0 * q1) * vy + (1.0f - 2.0f * (q1 * q1 + q2 * q2)) * vz;
+
+}
+
+// blends an earth frame correction d with the identity by a gain, then applies it: q = d' q
+static void correct(struct complementary *f, float d0, float d1, float d2, float d3, float gain) {
+
+	d0 = 1.0f - gain + gain * d0;
+	d1 *= gain;
+	d2 *= gain;
+	d3 *= gain;
+	float norm = inv_sqrt(d0 * d0 + d1 * d1 + d2 * d2 + d3 * d3);
+	d0 *= norm;
+	d1 *= norm;
+	d2 *= norm;
+	d3 *= norm;
+
+	float q0 = f->q0, q1 = f->q1, q2 = f->q2, q3 = f->q3;
+	f->q0 = d0 * q0 - d1 * q1 - d2 * q2 - d3 * q3;
+	f->q1 = d0 * q1 + d1 * q0 + d2 * q3 - d3 * q2;
+	f->q2 = d0 * q2 - d1 * q3 + d2 * q0 + d3 * q1;
+	f->q3 = d0 * q3 + d1 * q2 - d2 * q1 + d3 * q0;
+
+}
+
+/**
+ * Updates the orientation. Pass a magnetometer reading of all zeros to skip the heading correction.
+ *
+ * @param filter       The filter
+ * @param gx, gy, gz   Angular rate in radians per second
+ * @param ax, ay, az   Acceleration in any unit, only the direction is used
+ * @param mx, my, mz   Magnetic field in any unit, only the direction is used
+ */
+void complementary_update(struct complementary *filter, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz) {
+
+	// predict with the gyro
+	float q0 = filter->q0, q1 = filter->q1, q2 = filter->q2, q3 = filter->q3;
+	float h = 0.5f * filter->sample_period;
+	q0 += h * (-q1 * gx - q2 * gy - q3 * gz);
+	q1 += h * ( filter->q0 * gx + q2 * gz - q3 * gy);
+	q2 += h * ( filter->q0 * gy - filter->q1 * gz + q3 * gx);
+	q3 += h * ( filter->q0 * gz + filter->q1 * gy - filter->q2 * gx);
+	float norm = inv_sqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+	filter->q0 = q0 * norm;
+	filter->q1 = q1 * norm;
+	filter->q2 = q2 * norm;
+	filter->q3 = q3 * norm;
+
+	// tilt: rotate the measured gravity direction onto the earth's z axis
+	if (!(ax == 0.0f && ay == 0.0f && az == 0.0f)) {
+		norm = inv_sqrt(ax * ax + ay * ay + az * az);
+		float x = ax * norm, y = ay * norm, z = az * norm;
+		to_earth(filter, &x, &y, &z);
+		// the shortest rotation from (x, y, z) to (0, 0, 1), undefined only when upside down
+		if (z > -0.99f) {
+			float s = inv_sqrt(2.0f * (1.0f + z));
+			correct(filter, 0.5f / s, y * s, -x * s, 0.0f, filter->accel_gain);
+		}
+	}
+
+	// heading: rotate the horizontal part of the measured field onto the earth's x axis
+	if (!(mx == 0.0f && my == 0.0f && mz == 0.0f)) {
+		float x = mx, y = my, z = mz;
+		to_earth(filter, &x, &y, &z);
+		float gamma = x * x + y * y;
+		if (gamma > 0.0f) {
+			float root = gamma * inv_sqrt(gamma);   // sqrt(gamma)
+			float c = gamma + x * root;
+			if (c > 1e-6f * gamma) {
+				float c_inv = inv_sqrt(c);
+				correct(filter, c * c_inv * inv_sqrt(2.0f * gamma), 0.0f, 0.0f, -y * 0.70710678f * c_inv, filter->magn_gain);
+			} else {
+				// pointing exactly south: any direction of rotation will do
+				correct(filter, 0.0f, 0.0f, 0.0f, 1.0f, filter->magn_gain);
+			}
+		}
+	}
+
+}
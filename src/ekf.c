@@ -0,0 +1,214 @@
+// Extended Kalman filter estimating orientation and gyro bias.
+//
+// Error state x = [attitude error (3), bias error (3)], with the true
+// orientation q ⊗ [1, x0/2, x1/2, x2/2] and the true bias b + x3..x5.
+
+#include "ekf.h"
+#include <math.h>
+
+// index into the packed upper triangle, row <= column
+#define P(row, col) ((row) * EKF_STATES - (row) * ((row) - 1) / 2 + (col) - (row))
+
+/**
+ * Resets the filter to the identity orientation and zero bias, with default noise parameters.
+ *
+ * @param filter           The filter
+ * @param sample_rate_hz   Rate at which ekf_update() will be called
+ */
+void ekf_init(struct ekf *filter, float sample_rate_hz) {
+
+	filter->q0 = 1.0f;
+	filter->q1 = 0.0f;
+	filter->q2 = 0.0f;
+	filter->q3 = 0.0f;
+	for (uint8_t i = 0; i < 3; i++)
+		filter->bias[i] = 0.0f;
+
+	for (uint8_t i = 0; i < EKF_PACKED; i++)
+		filter->p[i] = 0.0f;
+	for (uint8_t i = 0; i < 3; i++) {
+		filter->p[P(i, i)] = 0.1f;              // about 18 degrees
+		filter->p[P(i + 3, i + 3)] = 0.0025f;   // about 3 degrees per second
+	}
+
+	filter->gyro_noise = 1e-4f;
+	filter->bias_noise = 1e-8f;
+	filter->accel_noise = 2.5e-3f;
+	filter->magn_noise = 1e-2f;
+	filter->sample_period = 1.0f / sample_rate_hz;
+	filter->accel_rejected = 0;
+
+}
+
+// P = F P F' + Q with F = [[I - [w x] dt, -I dt], [0, I]], only the upper triangle is computed
+static void ekf_predict_covariance(struct ekf *f, ekf_real wx, ekf_real wy, ekf_real wz) {
+
+	ekf_real dt = f->sample_period;
+	ekf_real r[3][3] = {
+		{ 1.0f,     wz * dt, -wy * dt},
+		{-wz * dt,  1.0f,     wx * dt},
+		{ wy * dt, -wx * dt,  1.0f   }
+	};
+	ekf_real p[EKF_STATES][EKF_STATES];
+	ekf_real m[EKF_STATES][EKF_STATES];
+
+	for (uint8_t i = 0; i < EKF_STATES; i++)
+		for (uint8_t j = i; j < EKF_STATES; j++)
+			p[i][j] = p[j][i] = f->p[P(i, j)];
+
+	// M = F P, the bias rows are unchanged
+	for (uint8_t i = 0; i < 3; i++)
+		for (uint8_t j = 0; j < EKF_STATES; j++)
+			m[i][j] = r[i][0] * p[0][j] + r[i][1] * p[1][j] + r[i][2] * p[2][j] - dt * p[i + 3][j];
+	for (uint8_t i = 3; i < EKF_STATES; i++)
+		for (uint8_t j = 0; j < EKF_STATES; j++)
+			m[i][j] = p[i][j];
+
+	// P = M F'
+	for (uint8_t i = 0; i < EKF_STATES; i++) {
+		for (uint8_t j = i; j < EKF_STATES; j++) {
+			if (j < 3)
+				f->p[P(i, j)] = m[i][0] * r[j][0] + m[i][1] * r[j][1] + m[i][2] * r[j][2] - dt * m[i][j + 3];
+			else
+				f->p[P(i, j)] = m[i][j];
+		}
+	}
+
+	for (uint8_t i = 0; i < 3; i++) {
+		f->p[P(i, i)] += f->gyro_noise * dt;
+		f->p[P(i + 3, i + 3)] += f->bias_noise * dt;
+	}
+
+}
+
+// applies one scalar measurement with an attitude-only row h, accumulating into the error state x
+static void ekf_scalar_update(struct ekf *f, const ekf_real h[3], ekf_real residual, ekf_real noise, ekf_real x[EKF_STATES]) {
+
+	ekf_real u[EKF_STATES];     // P h'
+	ekf_real k[EKF_STATES];     // gain
+
+	for (uint8_t i = 0; i < EKF_STATES; i++) {
+		u[i] = 0.0f;
+		for (uint8_t j = 0; j < 3; j++)
+			u[i] += f->p[i <= j ? P(i, j) : P(j, i)] * h[j];
+	}
+
+	ekf_real s = h[0] * u[0] + h[1] * u[1] + h[2] * u[2] + noise;
+	ekf_real s_inv = 1.0f / s;
+	ekf_real innovation = residual - (h[0] * x[0] + h[1] * x[1] + h[2] * x[2]);
+
+	for (uint8_t i = 0; i < EKF_STATES; i++) {
+		k[i] = u[i] * s_inv;
+		x[i] += k[i] * innovation;
+	}
+
+	// Joseph form (I - k h) P (I - k h)' + k r k', expanded so it stays symmetric
+	for (uint8_t i = 0; i < EKF_STATES; i++)
+		for (uint8_t j = i; j < EKF_STATES; j++)
+			f->p[P(i, j)] += s * k[i] * k[j] - k[i] * u[j] - u[i] * k[j];
+
+}
+
+// applies the three components of a measured direction v against the predicted direction e
+static void ekf_vector_update(struct ekf *f, const ekf_real v[3], const ekf_real e[3], ekf_real noise, ekf_real x[EKF_STATES]) {
+
+	// the measurement Jacobian with respect to the attitude error is [e x]
+	const ekf_real rows[3][3] = {
+		{ 0.0f, -e[2],  e[1]},
+		{ e[2],  0.0f, -e[0]},
+		{-e[1],  e[0],  0.0f}
+	};
+
+	for (uint8_t i = 0; i < 3; i++)
+		ekf_scalar_update(f, rows[i], v[i] - e[i], noise, x);
+
+}
+
+/**
+ * Propagates the state with the gyro, then corrects it with the accelerometer
+ * and, if the reading is not all zeros, the magnetometer.
+ *
+ * @param filter       The filter
+ * @param gx, gy, gz   Angular rate in radians per second
+ * @param ax, ay, az   Acceleration in g
+ * @param mx, my, mz   Magnetic field in any unit, only the direction is used
+ */
+void ekf_update(struct ekf *filter, ekf_real gx, ekf_real gy, ekf_real gz, ekf_real ax, ekf_real ay, ekf_real az, ekf_real mx, ekf_real my, ekf_real mz) {
+
+	ekf_real wx = gx - filter->bias[0];
+	ekf_real wy = gy - filter->bias[1];
+	ekf_real wz = gz - filter->bias[2];
+
+	// propagate the quaternion: q = q ⊗ [1, w dt / 2]
+	ekf_real h = 0.5f * filter->sample_period;
+	ekf_real q0 = filter->q0, q1 = filter->q1, q2 = filter->q2, q3 = filter->q3;
+	ekf_real n0 = q0 + h * (-q1 * wx - q2 * wy - q3 * wz);
+	ekf_real n1 = q1 + h * ( q0 * wx + q2 * wz - q3 * wy);
+	ekf_real n2 = q2 + h * ( q0 * wy - q1 * wz + q3 * wx);
+	ekf_real n3 = q3 + h * ( q0 * wz + q1 * wy - q2 * wx);
+	ekf_real norm = 1.0f / EKF_SQRT(n0 * n0 + n1 * n1 + n2 * n2 + n3 * n3);
+	q0 = n0 * norm;
+	q1 = n1 * norm;
+	q2 = n2 * norm;
+	q3 = n3 * norm;
+
+	ekf_predict_covariance(filter, wx, wy, wz);
+
+	ekf_real x[EKF_STATES] = {0};
+	uint8_t corrected = 0;
+
+	// gravity, only trusted while the sensor is not accelerating much
+	ekf_real a_squared = ax * ax + ay * ay + az * az;
+	if (a_squared > 0.64f && a_squared < 1.44f) {
+		norm = 1.0f / EKF_SQRT(a_squared);
+		ekf_real v[3] = {ax * norm, ay * norm, az * norm};
+		ekf_real e[3] = {
+			2.0f * (q1 * q3 - q0 * q2),
+			2.0f * (q0 * q1 + q2 * q3),
+			q0 * q0 - q1 * q1 - q2 * q2 + q3 * q3
+		};
+		ekf_vector_update(filter, v, e, filter->accel_noise, x);
+		corrected = 1;
+	} else {
+		filter->accel_rejected++;
+	}
+
+	// magnetic field, compared against the horizontal/vertical field implied by the current estimate
+	if (!(mx == 0.0f && my == 0.0f && mz == 0.0f)) {
+		norm = 1.0f / EKF_SQRT(mx * mx + my * my + mz * mz);
+		ekf_real v[3] = {mx * norm, my * norm, mz * norm};
+		ekf_real hx = 2.0f * (v[0] * (0.5f - q2 * q2 - q3 * q3) + v[1] * (q1 * q2 - q0 * q3) + v[2] * (q1 * q3 + q0 * q2));
+		ekf_real hy = 2.0f * (v[0] * (q1 * q2 + q0 * q3) + v[1] * (0.5f - q1 * q1 - q3 * q3) + v[2] * (q2 * q3 - q0 * q1));
+		ekf_real bx = EKF_SQRT(hx * hx + hy * hy);
+		ekf_real bz = 2.0f * (v[0] * (q1 * q3 - q0 * q2) + v[1] * (q2 * q3 + q0 * q1) + v[2] * (0.5f - q1 * q1 - q2 * q2));
+		ekf_real e[3] = {
+			2.0f * (bx * (0.5f - q2 * q2 - q3 * q3) + bz * (q1 * q3 - q0 * q2)),
+			2.0f * (bx * (q1 * q2 - q0 * q3) + bz * (q0 * q1 + q2 * q3)),
+			2.0f * (bx * (q0 * q2 + q1 * q3) + bz * (0.5f - q1 * q1 - q2 * q2))
+		};
+		ekf_vector_update(filter, v, e, filter->magn_noise, x);
+		corrected = 1;
+	}
+
+	// fold the error state into the nominal state
+	if (corrected) {
+		ekf_real d1 = 0.5f * x[0], d2 = 0.5f * x[1], d3 = 0.5f * x[2];
+		n0 = q0 - q1 * d1 - q2 * d2 - q3 * d3;
+		n1 = q1 + q0 * d1 + q2 * d3 - q3 * d2;
+		n2 = q2 + q0 * d2 - q1 * d3 + q3 * d1;
+		n3 = q3 + q0 * d3 + q1 * d2 - q2 * d1;
+		norm = 1.0f / EKF_SQRT(n0 * n0 + n1 * n1 + n2 * n2 + n3 * n3);
+		q0 = n0 * norm;
+		q1 = n1 * norm;
+		q2 = n2 * norm;
+		q3 = n3 * norm;
+		for (uint8_t i = 0; i < 3; i++)
+			filter->bias[i] += x[i + 3];
+	}
+
+	filter->q0 = q0;
+	filter->q1 = q1;
+	filter->q2 = q2;
+	filter->q3 = q3;
+
+}
@@ -0,0 +1,219 @@
+// Common interface to the orientation filters, selectable at runtime.
+
+#include "fusion.h"
+#include "stm32f429xx.h"
+#include <math.h>
+
+struct fusion_stats fusion_stats = {0};
+
+static const char *names[FUSION_FILTERS] = {"madgwick", "mahony", "complementary", "ekf"};
+
+/**
+ * Resets a filter of the given type to the identity orientation, with default gains.
+ *
+ * @param fusion            The filter
+ * @param type              FUSION_MADGWICK, FUSION_MAHONY, FUSION_COMPLEMENTARY or FUSION_EKF
+ * @param sample_rate_hz    Initial sample rate, later taken from each block
+ * @param use_magnetometer  Nonzero to correct the heading with the magnetometer
+ */
+void fusion_init(struct fusion *fusion, enum FUSION_FILTER type, float sample_rate_hz, uint8_t use_magnetometer) {
+
+	fusion->type = type;
+	fusion->use_magnetometer = use_magnetometer;
+
+	switch (type) {
+		case FUSION_MAHONY:
+			mahony_init(&fusion->state.mahony, sample_rate_hz, 1.0f, 0.0f);
+			break;
+		case FUSION_COMPLEMENTARY:
+			complementary_init(&fusion->state.complementary, sample_rate_hz, 0.02f, 0.01f);
+			break;
+		case FUSION_EKF:
+			ekf_init(&fusion->state.ekf, sample_rate_hz);
+			break;
+		default:
+			fusion->type = FUSION_MADGWICK;
+			madgwick_init(&fusion->state.madgwick, sample_rate_hz, 0.1f);
+			break;
+	}
+
+}
+
+/**
+ * Switches to another filter type, carrying the current orientation over so the output does not jump.
+ *
+ * @param fusion   The filter
+ * @param type     FUSION_MADGWICK, FUSION_MAHONY, FUSION_COMPLEMENTARY or FUSION_EKF
+ */
+void fusion_select(struct fusion *fusion, enum FUSION_FILTER type) {
+
+	if (type == fusion->type)
+		return;
+
+	float q[4];
+	fusion_get_quaternion(fusion, q);
+	fusion_init(fusion, type, 1.0f, fusion->use_magnetometer);
+
+	// every state struct starts with q0..q3
+	float *state = (float *) &fusion->state;
+	for (uint8_t i = 0; i < 4; i++)
+		state[i] = q[i];
+
+}
+
+// one update of whichever filter is selected
+static void fusion_update(struct fusion *fusion, const struct imu_block *block, uint16_t n) {
+
+	float gx = block->value[IMU_GYRO_X][n],  gy = block->value[IMU_GYRO_Y][n],  gz = block->value[IMU_GYRO_Z][n];
+	float ax = block->value[IMU_ACCEL_X][n], ay = block->value[IMU_ACCEL_Y][n], az = block->value[IMU_ACCEL_Z][n];
+	float mx = 0.0f, my = 0.0f, mz = 0.0f;
+	if (fusion->use_magnetometer) {
+		mx = block->value[IMU_MAGN_X][n];
+		my = block->value[IMU_MAGN_Y][n];
+		mz = block->value[IMU_MAGN_Z][n];
+	}
+
+	switch (fusion->type) {
+		case FUSION_MAHONY:
+			mahony_update_marg(&fusion->state.mahony, gx, gy, gz, ax, ay, az, mx, my, mz);
+			break;
+		case FUSION_COMPLEMENTARY:
+			complementary_update(&fusion->state.complementary, gx, gy, gz, ax, ay, az, mx, my, mz);
+			break;
+		case FUSION_EKF:
+			ekf_update(&fusion->state.ekf, gx, gy, gz, ax, ay, az, mx, my, mz);
+			break;
+		default:
+			madgwick_update_marg(&fusion->state.madgwick, gx, gy, gz, ax, ay, az, mx, my, mz);
+			break;
+	}
+
+}
+
+// sets the sample period of whichever filter is selected
+static void fusion_set_period(struct fusion *fusion, float sample_period) {
+
+	switch (fusion->type) {
+		case FUSION_MAHONY:        fusion->state.mahony.sample_period = sample_period;        break;
+		case FUSION_COMPLEMENTARY: fusion->state.complementary.sample_period = sample_period; break;
+		case FUSION_EKF:           fusion->state.ekf.sample_period = sample_period;           break;
+		default:                   fusion->state.madgwick.sample_period = sample_period;      break;
+	}
+
+}
+
+/**
+ * Runs one update per sample of a block, timing each update. The sample period
+ * is taken from the block.
+ *
+ * @param fusion   The filter
+ * @param block    The samples
+ */
+void fusion_update_block(struct fusion *fusion, const struct imu_block *block) {
+
+	// the sample rate may have been changed by the producer
+	fusion_set_period(fusion, block->sample_period_us * 1e-6f);
+
+	for (uint16_t n = 0; n < block->count; n++) {
+
+		uint32_t start = DWT->CYCCNT;
+		fusion_update(fusion, block, n);
+		uint32_t cycles = DWT->CYCCNT - start;
+
+		fusion_stats.updates++;
+		fusion_stats.last_cycles = cycles;
+		if (cycles > fusion_stats.max_cycles)
+			fusion_stats.max_cycles = cycles;
+
+	}
+
+}
+
+/**
+ * Reads the current orientation.
+ *
+ * @param fusion   The filter
+ * @param q        Receives q0 (scalar part), q1, q2, q3
+ */
+void fusion_get_quaternion(const struct fusion *fusion, float q[4]) {
+
+	const float *state = (const float *) &fusion->state;
+	for (uint8_t i = 0; i < 4; i++)
+		q[i] = state[i];
+
+}
+
+/**
+ * @param type   A filter type
+ * @returns      Its name, for logs
+ */
+const char *fusion_name(enum FUSION_FILTER type) {
+
+	return type < FUSION_FILTERS ? names[type] : "unknown";
+
+}
+
+/**
+ * Replays a recorded trace through a freshly initialized filter, measuring the
+ * cycles per update and the orientation error against a reference.
+ *
+ * @param type              Filter to benchmark
+ * @param use_magnetometer  Nonzero for MARG updates
+ * @param trace             Recorded blocks
+ * @param block_count       Number of blocks in the trace
+ * @param reference         One reference quaternion per sample of the trace, or 0 to skip the error
+ * @param result            Receives the result
+ */
+void fusion_benchmark(enum FUSION_FILTER type, uint8_t use_magnetometer, const struct imu_block *trace, uint32_t block_count, const float (*reference)[4], struct fusion_benchmark *result) {
+
+	struct fusion fusion;
+	uint64_t total_cycles = 0;
+	float total_error = 0.0f;
+
+	fusion_init(&fusion, type, 1.0f, use_magnetometer);
+	result->updates = 0;
+	result->max_cycles = 0;
+	result->max_error_deg = 0.0f;
+
+	for (uint32_t b = 0; b < block_count; b++) {
+
+		const struct imu_block *block = &trace[b];
+		fusion_set_period(&fusion, block->sample_period_us * 1e-6f);
+
+		for (uint16_t n = 0; n < block->count; n++) {
+
+			uint32_t start = DWT->CYCCNT;
+			fusion_update(&fusion, block, n);
+			uint32_t cycles = DWT->CYCCNT - start;
+
+			total_cycles += cycles;
+			if (cycles > result->max_cycles)
+				result->max_cycles = cycles;
+
+			if (reference) {
+				// angle of the rotation between the two orientations, from the rotation r* q. atan2 instead of
+				// acos of the dot product keeps small angles accurate, and ignores the length of q, which
+				// inv_sqrt() only gets right to 0.1%, enough for acos to read a few degrees as 0
+				float q[4];
+				fusion_get_quaternion(&fusion, q);
+				const float *r = reference[result->updates];
+				float d0 = r[0] * q[0] + r[1] * q[1] + r[2] * q[2] + r[3] * q[3];
+				float d1 = r[0] * q[1] - r[1] * q[0] - r[2] * q[3] + r[3] * q[2];
+				float d2 = r[0] * q[2] + r[1] * q[3] - r[2] * q[0] - r[3] * q[1];
+				float d3 = r[0] * q[3] - r[1] * q[2] + r[2] * q[1] - r[3] * q[0];
+				float error = 2.0f * 57.2957795f * atan2f(sqrtf(d1 * d1 + d2 * d2 + d3 * d3), fabsf(d0));
+				total_error += error;
+				if (error > result->max_error_deg)
+					result->max_error_deg = error;
+			}
+
+			result->updates++;
+
+		}
+
+	}
+
+	result->mean_cycles = result->updates ? total_cycles / result->updates : 0;
+	result->mean_error_deg = result->updates ? total_error / result->updates : 0.0f;
+
+}
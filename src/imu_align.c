@@ -0,0 +1,71 @@
+// Matches up blocks from several sensors by timestamp, so redundant or array
+// configurations can process one set of simultaneous samples at a time.
+
+#include "imu_align.h"
+
+/**
+ * Prepares an aligner.
+ *
+ * @param align          The aligner
+ * @param sensors        Number of sensors, block->sensor must be below this
+ * @param tolerance_us   Largest difference between the first timestamps of a set, such as half a sample period
+ * @param handler        Called with one block per sensor, indexed by sensor
+ */
+void imu_align_init(struct imu_align *align, uint8_t sensors, uint32_t tolerance_us, void (*handler)(const struct imu_block *const blocks[], uint8_t count)) {
+
+	align->sensors = sensors < IMU_ALIGN_MAX_SENSORS ? sensors : IMU_ALIGN_MAX_SENSORS;
+	align->tolerance_us = tolerance_us;
+	align->handler = handler;
+	for (uint8_t i = 0; i < IMU_ALIGN_MAX_SENSORS; i++)
+		align->pending[i] = 0;
+	align->sets = 0;
+	align->dropped = 0;
+
+}
+
+/**
+ * Adds a block. Once every sensor has a block and their timestamps agree, the
+ * set is handed to the handler. Otherwise the oldest block is dropped. The
+ * blocks must stay valid until the next block of the same sensor is added.
+ *
+ * @param align   The aligner
+ * @param block   A block from one of the sensors
+ */
+void imu_align_add(struct imu_align *align, const struct imu_block *block) {
+
+	if (block->sensor >= align->sensors)
+		return;
+
+	if (align->pending[block->sensor])
+		align->dropped++;
+	align->pending[block->sensor] = block;
+
+	// wait for the other sensors, and keep dropping the oldest block until the set agrees
+	while (1) {
+
+		uint8_t oldest = 0;
+		uint32_t newest_us = 0;
+		for (uint8_t i = 0; i < align->sensors; i++) {
+			if (align->pending[i] == 0)
+				return;
+			// timestamps wrap, so compare differences
+			if ((int32_t) (align->pending[i]->timestamp_us - align->pending[oldest]->timestamp_us) < 0)
+				oldest = i;
+			if (i == 0 || (int32_t) (align->pending[i]->timestamp_us - newest_us) > 0)
+				newest_us = align->pending[i]->timestamp_us;
+		}
+
+		if (newest_us - align->pending[oldest]->timestamp_us <= align->tolerance_us)
+			break;
+
+		align->pending[oldest] = 0;
+		align->dropped++;
+
+	}
+
+	align->handler(align->pending, align->sensors);
+	align->sets++;
+	for (uint8_t i = 0; i < align->sensors; i++)
+		align->pending[i] = 0;
+
+}
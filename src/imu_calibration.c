@@ -0,0 +1,340 @@
+// Gyro bias calibration: stillness detection over windows of raw samples,
+// persistence of accepted offsets in flash, and online refinement.
+
+#include "imu_calibration.h"
+#include "lib_flash.h"
+
+#define RECORD_MAGIC     0x4C414347     // "GCAL"
+#define RECORD_WORDS     8
+#define RECORD_SLOTS     (IMU_CALIBRATION_SIZE / (RECORD_WORDS * 4))
+#define WINDOW_SHIFT     6              // log2(IMU_CALIBRATION_WINDOW)
+#define SAVE_THRESHOLD   (4 * 16)       // save once an offset moved 4 counts (0.25dps) from flash
+#define REFINE_SHIFT     3              // refinement moves 1/8 of the way to each still window
+
+// flash record, one per slot
+struct record {
+	uint32_t magic;
+	uint32_t id;
+	uint32_t sequence;
+	int32_t offset[3];
+	uint32_t reserved;
+	uint32_t checksum;
+};
+
+static uint32_t record_checksum(const struct record *r) {
+
+	const uint32_t *words = (const uint32_t *) r;
+	uint32_t sum = 0x5A5A5A5A;
+	for (uint8_t i = 0; i < RECORD_WORDS - 1; i++)
+		sum = (sum << 5 | sum >> 27) ^ words[i];
+	return sum;
+
+}
+
+// newest record of every sensor, written back once the full sector has been erased
+static struct record kept[IMU_CALIBRATION_KEEP];
+static uint8_t kept_count;
+static uint8_t erasing;
+
+static const struct record *record_slot(uint32_t slot) {
+
+	return (const struct record *) (IMU_CALIBRATION_ADDRESS + slot * RECORD_WORDS * 4);
+
+}
+
+static uint8_t record_valid(const struct record *r) {
+
+	return r->magic == RECORD_MAGIC && r->checksum == record_checksum(r);
+
+}
+
+// returns RECORD_SLOTS if the sector is full
+static uint32_t blank_slot(void) {
+
+	uint32_t slot = 0;
+	while (slot < RECORD_SLOTS && record_slot(slot)->magic != 0xFFFFFFFF)
+		slot++;
+	return slot;
+
+}
+
+// copies the newest record of every sensor, up to IMU_CALIBRATION_KEEP sensors, before an erase
+static void keep_newest(void) {
+
+	kept_count = 0;
+
+	for (uint32_t slot = 0; slot < RECORD_SLOTS; slot++) {
+		const struct record *r = record_slot(slot);
+		if (!record_valid(r))
+			continue;
+		uint8_t k = 0;
+		while (k < kept_count && kept[k].id != r->id)
+			k++;
+		if (k == kept_count) {
+			if (kept_count == IMU_CALIBRATION_KEEP)
+				continue;
+			kept_count++;
+		} else if (r->sequence < kept[k].sequence) {
+			continue;
+		}
+		kept[k] = *r;
+	}
+
+}
+
+// writes the kept records to the start of the erased sector
+static uint8_t restore_kept(void) {
+
+	for (uint8_t k = 0; k < kept_count; k++)
+		if (!flash_write_words((uintptr_t) record_slot(k), (const uint32_t *) &kept[k], RECORD_WORDS))
+			return 0;
+	kept_count = 0;
+	return 1;
+
+}
+
+// appends the current offsets, the sector must not be full
+static uint8_t append_record(struct imu_calibration *cal, uint32_t slot) {
+
+	struct record r = {
+		.magic = RECORD_MAGIC,
+		.id = cal->id,
+		.sequence = cal->sequence + 1,
+		.offset = {cal->offset[0], cal->offset[1], cal->offset[2]},
+		.reserved = 0
+	};
+	r.checksum = record_checksum(&r);
+
+	if (!flash_write_words((uintptr_t) record_slot(slot), (const uint32_t *) &r, RECORD_WORDS)) {
+		cal->save_errors++;
+		return 0;
+	}
+
+	// the offsets may have been refined meanwhile, what was saved is what the record holds
+	for (uint8_t i = 0; i < 3; i++)
+		cal->saved_offset[i] = r.offset[i];
+	cal->sequence = r.sequence;
+	cal->saves++;
+	return 1;
+
+}
+
+/**
+ * Resets the calibration state with default acceptance limits for a
+ * +/-2000dps gyro (16.4 counts/dps) and a +/-4g accelerometer.
+ *
+ * @param cal   The calibration
+ * @param id    Sensor identifier used to tag flash records
+ */
+void imu_calibration_init(struct imu_calibration *cal, uint32_t id) {
+
+	cal->id = id;
+	cal->count = 0;
+	for (uint8_t i = 0; i < 6; i++) {
+		cal->sum[i] = 0;
+		cal->sum_squares[i] = 0;
+	}
+
+	cal->gyro_variance_limit = 16;          // 4 counts rms, about 0.25dps
+	cal->accel_variance_limit = 1600;       // 40 counts rms, about 5mg
+	cal->gyro_offset_limit = 328;           // the MPU6050 zero rate output is within +/-20dps
+
+	for (uint8_t i = 0; i < 3; i++) {
+		cal->offset[i] = 0;
+		cal->saved_offset[i] = 0;
+	}
+	cal->source = CALIBRATION_NONE;
+	cal->sequence = 0;
+	cal->save_pending = 0;
+	cal->windows = 0;
+	cal->still_windows = 0;
+	cal->saves = 0;
+	cal->save_errors = 0;
+
+}
+
+/**
+ * Loads the newest valid offsets for this sensor from flash.
+ *
+ * @param cal   The calibration
+ * @returns     1 if offsets were found
+ */
+uint8_t imu_calibration_load(struct imu_calibration *cal) {
+
+	uint8_t found = 0;
+
+	for (uint32_t slot = 0; slot < RECORD_SLOTS; slot++) {
+		const struct record *r = record_slot(slot);
+		if (r->magic == 0xFFFFFFFF)
+			break;
+		if (!record_valid(r) || r->id != cal->id)
+			continue;
+		if (found && r->sequence < cal->sequence)
+			continue;
+		for (uint8_t i = 0; i < 3; i++)
+			cal->offset[i] = cal->saved_offset[i] = r->offset[i];
+		cal->sequence = r->sequence;
+		found = 1;
+	}
+
+	if (found)
+		cal->source = CALIBRATION_FLASH;
+	return found;
+
+}
+
+/**
+ * Appends the current offsets to flash, erasing the sector first if it is full.
+ * Blocks for the whole erase, see imu_calibration_service() for a save that does not.
+ *
+ * @param cal   The calibration
+ * @returns     1 on success
+ */
+uint8_t imu_calibration_save(struct imu_calibration *cal) {
+
+	// an erase started by imu_calibration_service() is finished here
+	if (erasing || blank_slot() == RECORD_SLOTS) {
+		if (!erasing)
+			keep_newest();
+		uint8_t erased = erasing ? flash_erase_finish() : flash_erase_sector(IMU_CALIBRATION_SECTOR);
+		erasing = 0;
+		if (!erased || !restore_kept()) {
+			cal->save_errors++;
+			return 0;
+		}
+	}
+
+	cal->save_pending = 0;
+	return append_record(cal, blank_slot());
+
+}
+
+/**
+ * Saves offsets marked by imu_calibration_add(), a step at a time: when the
+ * sector is full, the first call starts the erase and returns, and a later
+ * call writes the kept records back and appends the new one. Call it
+ * periodically from a task of lower priority than the one adding samples.
+ *
+ * @param cal   The calibration
+ * @returns     1 if a record was written
+ */
+uint8_t imu_calibration_service(struct imu_calibration *cal) {
+
+	// the sector is shared, so the erase may have been started for another sensor
+	if (erasing) {
+		if (flash_busy())
+			return 0;
+		erasing = 0;
+		if (!flash_erase_finish() || !restore_kept()) {
+			cal->save_errors++;
+			return 0;
+		}
+	}
+
+	if (!cal->save_pending)
+		return 0;
+
+	uint32_t slot = blank_slot();
+	if (slot == RECORD_SLOTS) {
+		keep_newest();
+		flash_erase_start(IMU_CALIBRATION_SECTOR);
+		erasing = 1;
+		return 0;
+	}
+
+	cal->save_pending = 0;
+	return append_record(cal, slot);
+
+}
+
+// checks a full window, returns 1 if the offsets changed
+static uint8_t imu_calibration_window(struct imu_calibration *cal) {
+
+	cal->windows++;
+
+	// variance * N^2 = N * sum(x^2) - sum(x)^2, all in 64 bits
+	for (uint8_t i = 0; i < 6; i++) {
+		uint64_t spread = (cal->sum_squares[i] << WINDOW_SHIFT) - (uint64_t) ((int64_t) cal->sum[i] * cal->sum[i]);
+		uint32_t variance = spread >> (2 * WINDOW_SHIFT);
+		if (variance > (i < 3 ? cal->gyro_variance_limit : cal->accel_variance_limit))
+			return 0;
+	}
+
+	int32_t mean[3];
+	for (uint8_t i = 0; i < 3; i++) {
+		mean[i] = cal->sum[i] >> (WINDOW_SHIFT - 4);     // 1/16 counts
+		if (mean[i] > cal->gyro_offset_limit * 16 || mean[i] < -cal->gyro_offset_limit * 16)
+			return 0;
+	}
+
+	cal->still_windows++;
+
+	if (cal->source == CALIBRATION_NONE) {
+		for (uint8_t i = 0; i < 3; i++)
+			cal->offset[i] = mean[i];
+		cal->source = CALIBRATION_MEASURED;
+		cal->save_pending = 1;
+		return 1;
+	}
+
+	uint8_t changed = 0;
+	uint8_t drifted = 0;
+	for (uint8_t i = 0; i < 3; i++) {
+		int32_t before = imu_calibration_offset(cal, i);
+		cal->offset[i] += (mean[i] - cal->offset[i]) >> REFINE_SHIFT;
+		if (imu_calibration_offset(cal, i) != before)
+			changed = 1;
+		int32_t moved = cal->offset[i] - cal->saved_offset[i];
+		if (moved >= SAVE_THRESHOLD || moved <= -SAVE_THRESHOLD)
+			drifted = 1;
+	}
+
+	if (drifted)
+		cal->save_pending = 1;
+	return changed;
+
+}
+
+/**
+ * Adds one raw sample. Each full window is checked for stillness; a still
+ * window either provides the first offsets or refines the current ones.
+ * Offsets that moved far enough from the saved ones are marked for saving.
+ *
+ * @param cal     The calibration
+ * @param gyro    Raw gyro xyz, without any offset applied
+ * @param accel   Raw accelerometer xyz
+ * @returns       1 if the offsets changed
+ */
+uint8_t imu_calibration_add(struct imu_calibration *cal, const int16_t gyro[3], const int16_t accel[3]) {
+
+	for (uint8_t i = 0; i < 3; i++) {
+		cal->sum[i] += gyro[i];
+		cal->sum_squares[i] += (int32_t) gyro[i] * gyro[i];
+		cal->sum[i + 3] += accel[i];
+		cal->sum_squares[i + 3] += (int32_t) accel[i] * accel[i];
+	}
+
+	if (++cal->count < IMU_CALIBRATION_WINDOW)
+		return 0;
+
+	uint8_t changed = imu_calibration_window(cal);
+
+	cal->count = 0;
+	for (uint8_t i = 0; i < 6; i++) {
+		cal->sum[i] = 0;
+		cal->sum_squares[i] = 0;
+	}
+	return changed;
+
+}
+
+/**
+ * @param cal    The calibration
+ * @param axis   0, 1 or 2 for gyro x, y or z
+ * @returns      The offset rounded to whole counts
+ */
+int16_t imu_calibration_offset(const struct imu_calibration *cal, uint8_t axis) {
+
+	return (cal->offset[axis] + 8) >> 4;
+
+}
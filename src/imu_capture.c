@@ -0,0 +1,206 @@
+// Captures the full rate waveform around a shock: raw samples are kept in a
+// ring, and when the accelerometer magnitude crosses a level or changes faster
+// than a slope the samples before and after the trigger are frozen and uploaded
+// in the background while acquisition continues.
+
+#include "imu_capture.h"
+#include "lib_uart.h"
+#include <math.h>
+#include <string.h>
+
+/**
+ * Prepares a capture engine.
+ *
+ * @param capture        The engine
+ * @param ring           Storage for the ring, such as an array declared with IMU_CAPTURE_CCMRAM
+ * @param capacity       Number of samples in the ring, more than pre_samples + post_samples
+ * @param pre_samples    Samples kept from before the trigger
+ * @param post_samples   Samples kept from after the trigger
+ * @param trigger        IMU_CAPTURE_LEVEL or IMU_CAPTURE_SLOPE
+ * @param threshold      Level in g, or slope in g per second
+ */
+void imu_capture_init(struct imu_capture *capture, struct imu_capture_sample *ring, uint32_t capacity, uint16_t pre_samples, uint16_t post_samples, enum IMU_CAPTURE_TRIGGER trigger, float threshold) {
+
+	// the window must leave room in the ring for the samples arriving during the trigger sample
+	if (post_samples >= capacity)
+		post_samples = capacity - 1;
+	if ((uint32_t) pre_samples + post_samples >= capacity)
+		pre_samples = capacity - post_samples - 1;
+
+	capture->ring = ring;
+	capture->capacity = capacity;
+	capture->head = 0;
+	capture->pre_samples = pre_samples;
+	capture->post_samples = post_samples;
+	capture->trigger = trigger;
+	capture->threshold = threshold;
+	capture->last_magnitude = -1.0f;
+	for (uint8_t axis = 0; axis < IMU_AXES; axis++)
+		capture->scale[axis] = 0.0f;
+	capture->state = IMU_CAPTURE_ARMED;
+	capture->id = 0;
+	capture->trigger_index = 0;
+	capture->first_index = 0;
+	capture->end_index = 0;
+	capture->upload_index = 0;
+	capture->header_sent = 0;
+	capture->captures = 0;
+	capture->lost = 0;
+
+}
+
+// value[] is raw[] times a fixed scale, so the scale can be read back from any reading that is not close to 0
+static void imu_capture_learn_scale(struct imu_capture *capture, const struct imu_block *block) {
+
+	for (uint8_t axis = 0; axis < IMU_AXES; axis++) {
+		for (uint16_t n = 0; n < block->count; n++) {
+			int16_t raw = block->raw[axis][n];
+			if (raw >= 64 || raw <= -64) {
+				capture->scale[axis] = block->value[axis][n] / raw;
+				break;
+			}
+		}
+	}
+
+}
+
+// returns 1 if this sample fires the trigger
+static uint8_t imu_capture_check(struct imu_capture *capture, const struct imu_block *block, uint16_t n) {
+
+	float ax = block->value[IMU_ACCEL_X][n];
+	float ay = block->value[IMU_ACCEL_Y][n];
+	float az = block->value[IMU_ACCEL_Z][n];
+	float magnitude = sqrtf(ax * ax + ay * ay + az * az);
+	float last = capture->last_magnitude;
+	capture->last_magnitude = magnitude;
+
+	if (capture->state != IMU_CAPTURE_ARMED)
+		return 0;
+	if (capture->trigger == IMU_CAPTURE_LEVEL)
+		return magnitude >= capture->threshold;
+	if (last < 0.0f || block->sample_period_us == 0)
+		return 0;
+	return (magnitude - last) * 1e6f / block->sample_period_us >= capture->threshold;
+
+}
+
+/**
+ * Adds the samples of a block to the ring and checks them for a trigger.
+ *
+ * @param capture   The engine
+ * @param block     The samples, raw[] is stored and value[] is used for the trigger
+ * @returns         1 if a capture has just been frozen, call imu_capture_upload() until it returns 0
+ */
+uint8_t imu_capture_add_block(struct imu_capture *capture, const struct imu_block *block) {
+
+	enum IMU_CAPTURE_STATE state = capture->state;
+	imu_capture_learn_scale(capture, block);
+
+	for (uint16_t n = 0; n < block->count; n++) {
+
+		// samples not uploaded yet are never overwritten
+		if (capture->state != IMU_CAPTURE_ARMED && capture->head - capture->upload_index >= capture->capacity) {
+			capture->lost++;
+			continue;
+		}
+
+		struct imu_capture_sample *sample = &capture->ring[capture->head % capture->capacity];
+		sample->timestamp_us = block->timestamp_us + n * block->sample_period_us;
+		for (uint8_t axis = 0; axis < IMU_AXES; axis++)
+			sample->raw[axis] = block->raw[axis][n];
+		capture->head++;
+
+		if (imu_capture_check(capture, block, n)) {
+			uint32_t index = capture->head - 1;
+			uint32_t history = index < capture->pre_samples ? index : capture->pre_samples;
+			capture->trigger_index = index;
+			capture->first_index = index - history;
+			capture->end_index = index + capture->post_samples + 1;
+			capture->upload_index = capture->first_index;
+			capture->header_sent = 0;
+			capture->id++;
+			capture->captures++;
+			capture->state = IMU_CAPTURE_POST_TRIGGER;
+		}
+
+		if (capture->state == IMU_CAPTURE_POST_TRIGGER && capture->head >= capture->end_index)
+			capture->state = IMU_CAPTURE_UPLOADING;
+
+	}
+
+	return state != IMU_CAPTURE_UPLOADING && capture->state == IMU_CAPTURE_UPLOADING;
+
+}
+
+/**
+ * Sends the next frame of a frozen capture over the UART: first a header, then
+ * the samples oldest first. See tools/capture_decode.py. The engine re-arms
+ * once the last frame has been sent.
+ *
+ * @param capture   The engine
+ * @returns         1 if there is more to send
+ */
+uint8_t imu_capture_upload(struct imu_capture *capture) {
+
+	static uint8_t frame[2 + 5 + IMU_CAPTURE_FRAME_SAMPLES * sizeof(struct imu_capture_sample) + 2];
+
+	if (capture->state != IMU_CAPTURE_UPLOADING)
+		return 0;
+
+	uint32_t n = 0;
+	frame[n++] = 0xA5;
+
+	if (!capture->header_sent) {
+
+		const struct imu_capture_sample *trigger = &capture->ring[capture->trigger_index % capture->capacity];
+		uint16_t pre = capture->trigger_index - capture->first_index;
+		uint16_t total = capture->end_index - capture->first_index;
+		uint8_t type = capture->trigger;
+
+		frame[n++] = 0x56;
+		memcpy(&frame[n], &capture->id, 2);              n += 2;
+		memcpy(&frame[n], &trigger->timestamp_us, 4);    n += 4;
+		frame[n++] = type;
+		memcpy(&frame[n], &capture->threshold, 4);       n += 4;
+		memcpy(&frame[n], &pre, 2);                      n += 2;
+		memcpy(&frame[n], &total, 2);                    n += 2;
+		memcpy(&frame[n], capture->scale, sizeof(capture->scale));
+		n += sizeof(capture->scale);
+		capture->header_sent = 1;
+
+	} else {
+
+		uint32_t count = capture->end_index - capture->upload_index;
+		if (count > IMU_CAPTURE_FRAME_SAMPLES)
+			count = IMU_CAPTURE_FRAME_SAMPLES;
+		uint16_t index = capture->upload_index - capture->first_index;
+
+		frame[n++] = 0x57;
+		memcpy(&frame[n], &capture->id, 2);              n += 2;
+		memcpy(&frame[n], &index, 2);                    n += 2;
+		frame[n++] = count;
+		for (uint32_t i = 0; i < count; i++) {
+			const struct imu_capture_sample *sample = &capture->ring[(capture->upload_index + i) % capture->capacity];
+			memcpy(&frame[n], &sample->timestamp_us, 4);  n += 4;
+			memcpy(&frame[n], sample->raw, sizeof(sample->raw));
+			n += sizeof(sample->raw);
+		}
+		capture->upload_index += count;
+
+	}
+
+	uint16_t checksum = 0;
+	for (uint32_t j = 2; j < n; j++)
+		checksum += frame[j];
+	frame[n++] = checksum & 0xFF;
+	frame[n++] = checksum >> 8;
+
+	uart_send_bytes(frame, n);
+
+	if (capture->header_sent && capture->upload_index >= capture->end_index) {
+		capture->state = IMU_CAPTURE_ARMED;
+		return 0;
+	}
+	return 1;
+
+}
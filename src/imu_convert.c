@@ -0,0 +1,227 @@
+// Converts big endian sensor register dumps into imu_block samples.
+
+#include "imu_convert.h"
+#include "stm32f429xx.h"
+#include <string.h>
+
+#if defined(__ARM_FEATURE_DSP)
+#define rev16(x)      __REV16(x)
+#define ssub16(a, b)  __SSUB16(a, b)
+#else
+// portable versions, for cores without the DSP extension and for host builds
+static inline uint32_t rev16(uint32_t x) {
+	return ((x & 0x00FF00FF) << 8) | ((x >> 8) & 0x00FF00FF);
+}
+static inline uint32_t ssub16(uint32_t a, uint32_t b) {
+	return ((a - b) & 0xFFFF) | (((a >> 16) - (b >> 16)) << 16);
+}
+#endif
+
+/**
+ * Prepares a converter. Offsets start at 0.
+ *
+ * @param convert       The converter
+ * @param record_size   Size of one record in bytes, a multiple of 4
+ * @param axis          Destination axis of each value in the record, or IMU_CONVERT_DROP to skip it
+ * @param scale         Multiplier for each value in the record. Negative values flip the axis in value[], raw[] keeps the sensor's sign.
+ */
+void imu_convert_init(struct imu_convert *convert, uint8_t record_size, const uint8_t axis[], const float scale[]) {
+
+	if (record_size > IMU_CONVERT_MAX_VALUES * 2)
+		record_size = IMU_CONVERT_MAX_VALUES * 2;
+	convert->record_size = record_size & ~3;
+	convert->unmapped = (1 << IMU_AXES) - 1;
+
+	for (uint8_t n = 0; n < IMU_CONVERT_MAX_VALUES; n++) {
+		if (n < convert->record_size / 2) {
+			convert->axis[n] = axis[n];
+			convert->scale[n] = scale[n];
+			if (axis[n] < IMU_AXES)
+				convert->unmapped &= ~(1 << axis[n]);
+		} else {
+			convert->axis[n] = IMU_CONVERT_DROP;
+			convert->scale[n] = 0.0f;
+		}
+	}
+
+	memset(convert->offset, 0, sizeof(convert->offset));
+
+}
+
+/**
+ * Sets the offset subtracted from an axis before scaling.
+ *
+ * @param convert   The converter
+ * @param axis      The axis
+ * @param offset    Offset in counts
+ */
+void imu_convert_set_offset(struct imu_convert *convert, enum IMU_AXIS axis, int16_t offset) {
+
+	for (uint8_t n = 0; n < convert->record_size / 2; n++) {
+		if (convert->axis[n] != axis)
+			continue;
+		// value 2n is in the low half of word n, value 2n+1 in the high half
+		uint32_t shift = (n & 1) * 16;
+		convert->offset[n / 2] &= ~(0xFFFFUL << shift);
+		convert->offset[n / 2] |= (uint32_t)(uint16_t)offset << shift;
+	}
+
+}
+
+/**
+ * Extracts one axis of one record, without the offset. For code that looks at
+ * individual samples, like calibration.
+ *
+ * @param convert   The converter
+ * @param record    The record
+ * @param axis      The axis
+ * @returns         The raw reading
+ */
+int16_t imu_convert_extract(const struct imu_convert *convert, const uint8_t *record, enum IMU_AXIS axis) {
+
+	for (uint8_t n = 0; n < convert->record_size / 2; n++)
+		if (convert->axis[n] == axis)
+			return record[2 * n] << 8 | record[2 * n + 1];
+	return 0;
+
+}
+
+static void clear_unmapped(const struct imu_convert *convert, uint16_t first, uint16_t count, struct imu_block *block) {
+
+	if (convert->unmapped == 0)
+		return;
+	for (uint8_t axis = 0; axis < IMU_AXES; axis++) {
+		if ((convert->unmapped & (1 << axis)) == 0)
+			continue;
+		memset(&block->raw[axis][first], 0, count * sizeof(int16_t));
+		memset(&block->value[axis][first], 0, count * sizeof(float));
+	}
+
+}
+
+/**
+ * Appends records to a block: raw[] gets the readings minus the offsets, value[]
+ * gets them scaled. Axes no value maps to are set to 0.
+ *
+ * @param convert   The converter
+ * @param records   Consecutive records
+ * @param count     Number of records, at most IMU_BLOCK_CAPACITY - block->count
+ * @param block     The block to append to
+ */
+void imu_convert(const struct imu_convert *convert, const uint8_t *records, uint16_t count, struct imu_block *block) {
+
+	uint16_t first = block->count;
+	uint8_t words = convert->record_size / 4;
+
+	for (uint16_t n = 0; n < count; n++) {
+
+		const uint8_t *record = &records[n * convert->record_size];
+		uint16_t index = first + n;
+
+		for (uint8_t w = 0; w < words; w++) {
+
+			// two big endian values per word: swap and subtract both offsets at once
+			uint32_t word;
+			memcpy(&word, &record[4 * w], 4);
+			word = ssub16(rev16(word), convert->offset[w]);
+
+			int16_t low  = (int16_t)(word & 0xFFFF);
+			int16_t high = (int16_t)(word >> 16);
+			uint8_t low_axis  = convert->axis[2 * w];
+			uint8_t high_axis = convert->axis[2 * w + 1];
+
+			if (low_axis < IMU_AXES) {
+				block->raw[low_axis][index] = low;
+				block->value[low_axis][index] = low * convert->scale[2 * w];
+			}
+			if (high_axis < IMU_AXES) {
+				block->raw[high_axis][index] = high;
+				block->value[high_axis][index] = high * convert->scale[2 * w + 1];
+			}
+
+		}
+
+	}
+
+	clear_unmapped(convert, first, count, block);
+	block->count += count;
+
+}
+
+/**
+ * Straightforward version of imu_convert(), for checking and benchmarking it.
+ */
+void imu_convert_reference(const struct imu_convert *convert, const uint8_t *records, uint16_t count, struct imu_block *block) {
+
+	uint16_t first = block->count;
+
+	for (uint16_t n = 0; n < count; n++) {
+
+		const uint8_t *record = &records[n * convert->record_size];
+
+		for (uint8_t v = 0; v < convert->record_size / 2; v++) {
+
+			uint8_t axis = convert->axis[v];
+			if (axis >= IMU_AXES)
+				continue;
+
+			int16_t reading = record[2 * v] << 8 | record[2 * v + 1];
+			int16_t offset = convert->offset[v / 2] >> ((v & 1) * 16);
+			int16_t corrected = reading - offset;
+			block->raw[axis][first + n] = corrected;
+			block->value[axis][first + n] = corrected / (1.0f / convert->scale[v]);
+
+		}
+
+	}
+
+	clear_unmapped(convert, first, count, block);
+	block->count += count;
+
+}
+
+/**
+ * Times imu_convert() and imu_convert_reference() on a full block of
+ * synthetic records.
+ *
+ * @param convert             The converter
+ * @param reference_cycles    Set to the CPU cycles used by the reference version
+ * @param mismatches          Set to the number of values where both versions disagree
+ * @returns                   CPU cycles used by imu_convert()
+ */
+uint32_t imu_convert_benchmark(const struct imu_convert *convert, uint32_t *reference_cycles, uint32_t *mismatches) {
+
+	static uint8_t records[IMU_BLOCK_CAPACITY * IMU_CONVERT_MAX_VALUES * 2];
+	static struct imu_block fast, reference;
+
+	// pseudo random readings covering the whole int16 range
+	uint32_t seed = 12345;
+	for (uint32_t n = 0; n < IMU_BLOCK_CAPACITY * convert->record_size; n++) {
+		seed = seed * 1664525 + 1013904223;
+		records[n] = seed >> 24;
+	}
+
+	fast.count = 0;
+	uint32_t start = DWT->CYCCNT;
+	imu_convert(convert, records, IMU_BLOCK_CAPACITY, &fast);
+	uint32_t cycles = DWT->CYCCNT - start;
+
+	reference.count = 0;
+	start = DWT->CYCCNT;
+	imu_convert_reference(convert, records, IMU_BLOCK_CAPACITY, &reference);
+	*reference_cycles = DWT->CYCCNT - start;
+
+	// the reciprocal multiply may differ from the division in the last bit
+	*mismatches = 0;
+	for (uint8_t axis = 0; axis < IMU_AXES; axis++) {
+		for (uint16_t n = 0; n < IMU_BLOCK_CAPACITY; n++) {
+			float difference = fast.value[axis][n] - reference.value[axis][n];
+			float tolerance = 1e-6f * (reference.value[axis][n] < 0 ? -reference.value[axis][n] : reference.value[axis][n]);
+			if (fast.raw[axis][n] != reference.raw[axis][n] || difference > tolerance || difference < -tolerance)
+				(*mismatches)++;
+		}
+	}
+
+	return cycles;
+
+}
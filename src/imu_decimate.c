@@ -0,0 +1,278 @@
+// Multistage decimation of IMU blocks, so oversampled sensors can be reported at
+// a lower rate without aliasing instead of dropping samples.
+
+#include "imu_decimate.h"
+#include "stm32f429xx.h"
+#include "lib_prof.h"
+#include <math.h>
+
+#define PI 3.14159265358979f
+
+/**
+ * Prepares an empty pipeline. Add stages with imu_decimate_add_stage().
+ *
+ * @param decimate       The pipeline
+ * @param block_length   Samples per output block, up to IMU_BLOCK_CAPACITY
+ * @param handler        Called with each output block
+ */
+void imu_decimate_init(struct imu_decimate *decimate, uint16_t block_length, void (*handler)(const struct imu_block *block)) {
+
+	if (block_length < 1) block_length = 1;
+	if (block_length > IMU_BLOCK_CAPACITY) block_length = IMU_BLOCK_CAPACITY;
+
+	decimate->stage_count = 0;
+	decimate->block_index = 0;
+	decimate->block_length = block_length;
+	decimate->sequence = 0;
+	decimate->samples = 0;
+	decimate->next_sample = 0;
+	decimate->restarts = 0;
+	decimate->handler = handler;
+	for (uint8_t i = 0; i < IMU_DECIMATE_POOL; i++)
+		decimate->blocks[i] = (struct imu_block) { 0 };
+
+}
+
+/**
+ * Appends a stage.
+ *
+ * @param decimate    The pipeline
+ * @param factor      Keep one output per this many inputs
+ * @param taps        Filter coefficients, or 0 to design a low pass with imu_decimate_design()
+ * @param tap_count   Number of coefficients, up to IMU_DECIMATE_TAPS
+ * @returns           1 on success, 0 if there are too many stages or taps
+ */
+uint8_t imu_decimate_add_stage(struct imu_decimate *decimate, uint8_t factor, const float *taps, uint8_t tap_count) {
+
+	if (decimate->stage_count >= IMU_DECIMATE_STAGES || factor < 1 || tap_count < 1 || tap_count > IMU_DECIMATE_TAPS)
+		return 0;
+
+	struct imu_decimate_stage *stage = &decimate->stage[decimate->stage_count];
+	*stage = (struct imu_decimate_stage) { 0 };
+	stage->factor = factor;
+	stage->tap_count = tap_count;
+	stage->empty = 1;
+
+	if (taps)
+		for (uint8_t k = 0; k < tap_count; k++)
+			stage->taps[k] = taps[k];
+	else
+		imu_decimate_design(stage->taps, tap_count, factor);
+
+	decimate->stage_count++;
+	return 1;
+
+}
+
+/**
+ * Designs a Blackman windowed sinc low pass filter for decimating by a factor,
+ * with the cutoff at 80% of the output Nyquist frequency and unity gain at DC.
+ *
+ * @param taps        Receives the coefficients
+ * @param tap_count   Number of coefficients
+ * @param factor      Decimation factor the filter is for
+ */
+void imu_decimate_design(float *taps, uint8_t tap_count, uint8_t factor) {
+
+	float cutoff = 0.8f * 0.5f / factor;                 // cycles per input sample
+	float middle = (tap_count - 1) * 0.5f;
+	float sum = 0.0f;
+
+	for (uint8_t n = 0; n < tap_count; n++) {
+		float t = n - middle;
+		float sinc = t == 0.0f ? 2.0f * cutoff : sinf(2.0f * PI * cutoff * t) / (PI * t);
+		float window = tap_count == 1 ? 1.0f :
+			0.42f - 0.5f * cosf(2.0f * PI * n / (tap_count - 1)) + 0.08f * cosf(4.0f * PI * n / (tap_count - 1));
+		taps[n] = sinc * window;
+		sum += taps[n];
+	}
+
+	for (uint8_t n = 0; n < tap_count; n++)
+		taps[n] /= sum;
+
+}
+
+/**
+ * Evaluates the frequency response of a filter, to check a design.
+ *
+ * @param taps        The coefficients
+ * @param tap_count   Number of coefficients
+ * @param frequency   Frequency in cycles per input sample, 0 to 0.5
+ * @returns           Magnitude of the response, 1 means unity gain
+ */
+float imu_decimate_gain(const float *taps, uint8_t tap_count, float frequency) {
+
+	float re = 0.0f;
+	float im = 0.0f;
+	for (uint8_t k = 0; k < tap_count; k++) {
+		re += taps[k] * cosf(2.0f * PI * frequency * k);
+		im -= taps[k] * sinf(2.0f * PI * frequency * k);
+	}
+	return sqrtf(re * re + im * im);
+
+}
+
+// filters count samples of every axis in place, returns the number of outputs
+static uint16_t imu_decimate_stage_run(struct imu_decimate_stage *stage, float work[][IMU_BLOCK_CAPACITY], uint32_t time_us[], uint16_t count) {
+
+	uint8_t tap_count = stage->tap_count;
+	uint8_t head = stage->head;
+	uint8_t phase = stage->phase;
+	uint16_t outputs = 0;
+
+	// every axis starts from the same delay line position, the last one leaves it for the next block
+	for (uint8_t axis = 0; axis < IMU_AXES; axis++) {
+
+		float *history = stage->history[axis];
+		float *x = work[axis];
+		head = stage->head;
+		phase = stage->phase;
+		outputs = 0;
+
+		if (stage->empty && count > 0)
+			for (uint8_t k = 0; k < 2 * tap_count; k++)
+				history[k] = x[0];
+
+		for (uint16_t i = 0; i < count; i++) {
+
+			// each input is stored twice, so history[head] .. history[head + tap_count - 1] is always newest to oldest
+			head = head ? head - 1 : tap_count - 1;
+			history[head] = x[i];
+			history[head + tap_count] = x[i];
+
+			if (++phase < stage->factor)
+				continue;
+			phase = 0;
+
+			// two accumulators hide the latency of the FPU multiply-accumulate
+			const float *h = &history[head];
+			float sum0 = 0.0f;
+			float sum1 = 0.0f;
+			uint8_t k = 0;
+			for (; k + 1 < tap_count; k += 2) {
+				sum0 += stage->taps[k] * h[k];
+				sum1 += stage->taps[k + 1] * h[k + 1];
+			}
+			if (k < tap_count)
+				sum0 += stage->taps[k] * h[k];
+
+			// outputs never overtake inputs, so filtering in place is safe
+			x[outputs] = sum0 + sum1;
+			if (axis == 0)
+				time_us[outputs] = time_us[i];
+			outputs++;
+
+		}
+
+	}
+
+	stage->head = head;
+	stage->phase = phase;
+	if (count > 0)
+		stage->empty = 0;
+	stage->inputs += count;
+	stage->outputs += outputs;
+	return outputs;
+
+}
+
+// hands the output block in progress to the handler and starts the next one
+static void imu_decimate_emit(struct imu_decimate *decimate) {
+
+	struct imu_block *out = &decimate->blocks[decimate->block_index];
+	out->sequence = decimate->sequence++;
+	decimate->handler(out);
+	decimate->block_index = (decimate->block_index + 1) % IMU_DECIMATE_POOL;
+	decimate->blocks[decimate->block_index].count = 0;
+
+}
+
+/**
+ * Filters the value[] samples of a block through every stage. Output blocks
+ * hold value[] only, raw[] is zero because filtered readings have no count
+ * representation. Timestamps are corrected for the group delay of the filters,
+ * output samples are numbered on their own and capture_cycles[] is zero.
+ * A gap before the block restarts the delay lines.
+ *
+ * @param decimate   The pipeline
+ * @param block      Input samples at the full rate
+ */
+void imu_decimate_process(struct imu_decimate *decimate, const struct imu_block *block) {
+
+	uint16_t count = block->count;
+	uint32_t time_us[IMU_BLOCK_CAPACITY];
+	uint32_t period_us = block->sample_period_us;
+	uint32_t delay_us = 0;
+
+	// samples are missing: the delay lines would mix samples from both sides of the gap
+	if (block->first_sample != decimate->next_sample && decimate->stage[0].inputs > 0) {
+
+		uint32_t factor = 1;
+		for (uint8_t s = 0; s < decimate->stage_count; s++) {
+			decimate->stage[s].empty = 1;
+			decimate->stage[s].phase = 0;
+			factor *= decimate->stage[s].factor;
+		}
+		decimate->restarts++;
+
+		// hand over the outputs from before the gap, and number the next ones as if the gap had been filtered
+		if (decimate->blocks[decimate->block_index].count > 0)
+			imu_decimate_emit(decimate);
+		uint32_t missing = block->first_sample - decimate->next_sample;
+		if (missing < 0x80000000)
+			decimate->samples += (missing + factor - 1) / factor;
+
+	}
+	decimate->next_sample = block->first_sample + count;
+
+	for (uint16_t n = 0; n < count; n++)
+		time_us[n] = block->timestamp_us + n * period_us;
+	for (uint8_t axis = 0; axis < IMU_AXES; axis++)
+		for (uint16_t n = 0; n < count; n++)
+			decimate->work[axis][n] = block->value[axis][n];
+
+	PROF_BEGIN(imu_decimate);
+	for (uint8_t s = 0; s < decimate->stage_count && count > 0; s++) {
+
+		struct imu_decimate_stage *stage = &decimate->stage[s];
+		uint32_t start = DWT->CYCCNT;
+		count = imu_decimate_stage_run(stage, decimate->work, time_us, count);
+		uint32_t cycles = DWT->CYCCNT - start;
+
+		stage->last_cycles = cycles;
+		stage->total_cycles += cycles;
+		if (cycles > stage->max_cycles)
+			stage->max_cycles = cycles;
+
+		// a linear phase filter delays its input by half its length
+		delay_us += (stage->tap_count - 1) * period_us / 2;
+		period_us *= stage->factor;
+
+	}
+	PROF_END(imu_decimate);
+
+	// the stages have run even if nothing came out, so their delay lines stay current
+	for (uint16_t n = 0; n < count; n++) {
+
+		struct imu_block *out = &decimate->blocks[decimate->block_index];
+		if (out->count == 0) {
+			out->timestamp_us = time_us[n] - delay_us;
+			out->sample_period_us = period_us;
+			out->sensor = block->sensor;
+			out->first_sample = decimate->samples;
+		}
+
+		for (uint8_t axis = 0; axis < IMU_AXES; axis++) {
+			out->value[axis][out->count] = decimate->work[axis][n];
+			out->raw[axis][out->count] = 0;
+		}
+		out->capture_cycles[out->count] = 0;
+		out->count++;
+		decimate->samples++;
+
+		if (out->count >= decimate->block_length)
+			imu_decimate_emit(decimate);
+
+	}
+
+}
@@ -0,0 +1,184 @@
+// Compact orientation telemetry: smallest three quaternions in 32 bits, and
+// vectors as half floats.
+
+#include "imu_orient.h"
+#include "lib_uart.h"
+#include <math.h>
+#include <string.h>
+
+#define SQRT2 1.41421356f
+
+/**
+ * Packs a quaternion into 32 bits: the index of the largest component in bits
+ * 31-30, then the other three components in order, 10 bits each.
+ *
+ * @param q   q0 (scalar part), q1, q2, q3, normalized here
+ * @returns   The packed quaternion
+ */
+uint32_t imu_orient_pack_quaternion(const float q[4]) {
+
+	uint8_t largest = 0;
+	for (uint8_t i = 1; i < 4; i++)
+		if (fabsf(q[i]) > fabsf(q[largest]))
+			largest = i;
+
+	// q and -q are the same rotation, pick the one with the largest component positive
+	float norm = sqrtf(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+	if (norm == 0.0f)
+		return 0;
+	float scale = (q[largest] < 0.0f ? -511.0f : 511.0f) * SQRT2 / norm;
+
+	// steps of 1/(511 sqrt(2)) around 511, so 0 is exact
+	uint32_t packed = largest;
+	for (uint8_t i = 0; i < 4; i++) {
+		if (i == largest)
+			continue;
+		int32_t step = lroundf(q[i] * scale) + 511;
+		if (step < 0) step = 0;
+		if (step > 1022) step = 1022;
+		packed = packed << 10 | step;
+	}
+	return packed;
+
+}
+
+/**
+ * Converts a float to an IEEE 754 half float, rounding to nearest even.
+ *
+ * @param value   The float
+ * @returns       The half float bits
+ */
+uint16_t imu_orient_half(float value) {
+
+	uint32_t bits;
+	memcpy(&bits, &value, 4);
+	uint16_t sign = (bits >> 16) & 0x8000;
+	uint32_t magnitude = bits & 0x7FFFFFFF;
+
+	// infinity and NaN, then everything that rounds to beyond 65504
+	if (magnitude >= 0x7F800000)
+		return sign | 0x7C00 | (magnitude > 0x7F800000 ? 0x0200 : 0);
+	if (magnitude >= 0x477FF000)
+		return sign | 0x7C00;
+
+	// below 2^-14 the half float is subnormal, in steps of 2^-24
+	if (magnitude < 0x38800000) {
+		if (magnitude <= 0x33000000)
+			return sign;
+		uint32_t mantissa = (magnitude & 0x007FFFFF) | 0x00800000;
+		uint32_t shift = 126 - (magnitude >> 23);
+		return sign | ((mantissa + (1 << (shift - 1)) - 1 + ((mantissa >> shift) & 1)) >> shift);
+	}
+
+	// rebias the exponent and drop 13 mantissa bits, a carry moves into the exponent
+	return sign | ((magnitude - 0x38000000 + 0x0FFF + ((magnitude >> 13) & 1)) >> 13);
+
+}
+
+/**
+ * Prepares an empty frame.
+ *
+ * @param orient      The frame collector
+ * @param vectors     IMU_ORIENT_GYRO, IMU_ORIENT_ACCEL and IMU_ORIENT_MAGN or'ed together, or 0 for orientations only
+ * @param per_frame   Orientations per frame, 1 to IMU_ORIENT_MAX_ENTRIES
+ */
+void imu_orient_init(struct imu_orient *orient, uint8_t vectors, uint8_t per_frame) {
+
+	if (per_frame < 1) per_frame = 1;
+	if (per_frame > IMU_ORIENT_MAX_ENTRIES) per_frame = IMU_ORIENT_MAX_ENTRIES;
+
+	orient->vectors = vectors & (IMU_ORIENT_GYRO | IMU_ORIENT_ACCEL | IMU_ORIENT_MAGN);
+	orient->per_frame = per_frame;
+	orient->count = 0;
+	orient->sensor = 0;
+	orient->last_sample = 0;
+	orient->sample_period_us = 0;
+	orient->length = 0;
+	orient->frames = 0;
+
+}
+
+/**
+ * Adds the orientation after the last sample of a block, and sends the frame
+ * over the UART once it is full. See tools/orient_decode.py.
+ *
+ * @param orient   The frame collector
+ * @param block    The block the filter has just been updated with
+ * @param q        The orientation, q0 (scalar part), q1, q2, q3
+ */
+void imu_orient_add(struct imu_orient *orient, const struct imu_block *block, const float q[4]) {
+
+	if (block->count == 0)
+		return;
+
+	uint16_t last = block->count - 1;
+	uint32_t sample = block->first_sample + last;
+	uint32_t timestamp_us = block->timestamp_us + last * block->sample_period_us;
+
+	// each orientation stores how many samples it is after the previous one, in a byte
+	if (orient->count > 0 && (block->sensor != orient->sensor || block->sample_period_us != orient->sample_period_us || sample - orient->last_sample > 255))
+		imu_orient_flush(orient);
+
+	uint8_t *frame = orient->frame;
+	uint32_t n = orient->length;
+	if (orient->count == 0) {
+		orient->sensor = block->sensor;
+		orient->sample_period_us = block->sample_period_us;
+		orient->last_sample = sample;
+		frame[n++] = 0xA5;
+		frame[n++] = 0x5B;
+		frame[n++] = block->sensor;
+		frame[n++] = orient->vectors;
+		memcpy(&frame[n], &sample, 4);                     n += 4;
+		memcpy(&frame[n], &timestamp_us, 4);               n += 4;
+		memcpy(&frame[n], &block->sample_period_us, 4);    n += 4;
+		n++;                                               // count, filled in when sent
+	}
+
+	uint32_t packed = imu_orient_pack_quaternion(q);
+	frame[n++] = sample - orient->last_sample;
+	memcpy(&frame[n], &packed, 4);                         n += 4;
+	for (uint8_t vector = 0; vector < 3; vector++) {
+		if (!(orient->vectors & (1 << vector)))
+			continue;
+		for (uint8_t axis = 3 * vector; axis < 3 * vector + 3; axis++) {
+			uint16_t half = imu_orient_half(block->value[axis][last]);
+			memcpy(&frame[n], &half, 2);                   n += 2;
+		}
+	}
+
+	orient->length = n;
+	orient->last_sample = sample;
+	orient->count++;
+	if (orient->count >= orient->per_frame)
+		imu_orient_flush(orient);
+
+}
+
+/**
+ * Sends the orientations collected so far, if any.
+ *
+ * @param orient   The frame collector
+ */
+void imu_orient_flush(struct imu_orient *orient) {
+
+	if (orient->count == 0)
+		return;
+
+	uint8_t *frame = orient->frame;
+	uint32_t n = orient->length;
+	frame[16] = orient->count;
+
+	uint16_t checksum = 0;
+	for (uint32_t j = 2; j < n; j++)
+		checksum += frame[j];
+	frame[n++] = checksum & 0xFF;
+	frame[n++] = checksum >> 8;
+
+	uart_send_bytes(frame, n);
+
+	orient->frames++;
+	orient->count = 0;
+	orient->length = 0;
+
+}
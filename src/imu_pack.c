@@ -0,0 +1,129 @@
+// Compressed telemetry of raw IMU samples: per axis differences, zigzag mapped
+// and sent as varints, with periodic keyframes for resynchronization.
+
+#include "imu_pack.h"
+#include "lib_uart.h"
+#include <string.h>
+
+/**
+ * Prepares an encoder. The first frame is always a keyframe.
+ *
+ * @param pack                The encoder
+ * @param keyframe_interval   Frames between keyframes, 1 makes every frame a keyframe
+ */
+void imu_pack_init(struct imu_pack *pack, uint16_t keyframe_interval) {
+
+	if (keyframe_interval < 1)
+		keyframe_interval = 1;
+
+	pack->keyframe_interval = keyframe_interval;
+	pack->frame = 0;
+	pack->samples = 0;
+	pack->frames = 0;
+	pack->keyframes = 0;
+	pack->bytes = 0;
+	imu_pack_keyframe(pack);
+
+}
+
+/**
+ * Makes the next frame a keyframe, such as when the host has just connected.
+ *
+ * @param pack   The encoder
+ */
+void imu_pack_keyframe(struct imu_pack *pack) {
+
+	pack->since_keyframe = pack->keyframe_interval;
+
+}
+
+// appends a difference as a zigzag varint, returns the new length
+static uint32_t imu_pack_varint(uint8_t *frame, uint32_t n, int16_t delta) {
+
+	// 0, -1, 1, -2, 2 ... become 0, 1, 2, 3, 4 ...
+	uint16_t zigzag = (uint16_t) ((uint16_t) delta << 1) ^ (uint16_t) (delta >> 15);
+
+	while (zigzag >= 0x80) {
+		frame[n++] = zigzag | 0x80;
+		zigzag >>= 7;
+	}
+	frame[n++] = zigzag;
+	return n;
+
+}
+
+/**
+ * Encodes the raw[] counts of a block into one frame. See tools/pack_decode.py.
+ *
+ * @param pack    The encoder
+ * @param block   The samples
+ * @param frame   Receives the frame, IMU_PACK_MAX_FRAME bytes
+ * @returns       Length of the frame in bytes
+ */
+uint32_t imu_pack_encode(struct imu_pack *pack, const struct imu_block *block, uint8_t *frame) {
+
+	uint8_t keyframe = pack->since_keyframe >= pack->keyframe_interval;
+	if (keyframe) {
+		memset(pack->last, 0, sizeof(pack->last));
+		pack->since_keyframe = 0;
+		pack->keyframes++;
+	}
+	pack->since_keyframe++;
+
+	uint16_t count = block->count;
+	uint16_t raw_sum = 0;
+
+	uint32_t n = 0;
+	frame[n++] = 0xA5;
+	frame[n++] = 0x5A;
+	frame[n++] = block->sensor;
+	frame[n++] = keyframe;
+	frame[n++] = pack->frame++;
+	memcpy(&frame[n], &block->first_sample, 4);        n += 4;
+	memcpy(&frame[n], &block->timestamp_us, 4);        n += 4;
+	memcpy(&frame[n], &block->sample_period_us, 4);    n += 4;
+	frame[n++] = count;
+	uint32_t length_index = n;                         n += 2;
+	uint32_t sum_index = n;                            n += 2;
+
+	uint32_t payload = n;
+	for (uint16_t i = 0; i < count; i++) {
+		for (uint8_t axis = 0; axis < IMU_AXES; axis++) {
+			int16_t raw = block->raw[axis][i];
+			n = imu_pack_varint(frame, n, (int16_t) (raw - pack->last[axis]));
+			pack->last[axis] = raw;
+			raw_sum += (uint16_t) raw;
+		}
+	}
+
+	uint16_t length = n - payload;
+	memcpy(&frame[length_index], &length, 2);
+	memcpy(&frame[sum_index], &raw_sum, 2);
+
+	uint16_t checksum = 0;
+	for (uint32_t j = 2; j < n; j++)
+		checksum += frame[j];
+	frame[n++] = checksum & 0xFF;
+	frame[n++] = checksum >> 8;
+
+	pack->samples += count;
+	pack->frames++;
+	pack->bytes += n;
+	return n;
+
+}
+
+/**
+ * Encodes a block and sends the frame over the UART.
+ *
+ * @param pack    The encoder
+ * @param block   The samples
+ */
+void imu_pack_send(struct imu_pack *pack, const struct imu_block *block) {
+
+	static uint8_t frame[IMU_PACK_MAX_FRAME];
+
+	uint32_t length = imu_pack_encode(pack, block, frame);
+	uart_send_bytes(frame, length);
+
+}
@@ -0,0 +1,459 @@
+// Vibration spectrum of one IMU axis: Hann windowed, overlapped real FFTs whose
+// power is averaged over several frames, reported with the strongest peaks.
+
+#include "imu_spectrum.h"
+#include "stm32f429xx.h"
+#include "lib_uart.h"
+#include "lib_prof.h"
+#include <math.h>
+#include <string.h>
+
+#define PI 3.14159265358979f
+#define Q15_INPUT_LIMIT 16383    // half of full scale, so a complex value can not overflow a butterfly
+
+/**
+ * Prepares a spectrum analyser.
+ *
+ * @param spectrum   The analyser
+ * @param axis       Which axis of the blocks to analyse, such as IMU_ACCEL_Z
+ * @param points     FFT length, a power of two from IMU_SPECTRUM_MIN_POINTS to IMU_SPECTRUM_MAX_POINTS, rounded down
+ * @param hop        New samples between frames, points / 2 for 50% overlap
+ * @param average    Frames averaged into each result
+ * @param path       IMU_SPECTRUM_FLOAT or IMU_SPECTRUM_Q15
+ * @param handler    Called with each averaged spectrum
+ */
+void imu_spectrum_init(struct imu_spectrum *spectrum, uint8_t axis, uint16_t points, uint16_t hop, uint16_t average, enum IMU_SPECTRUM_PATH path, void (*handler)(const struct imu_spectrum_result *result)) {
+
+	uint16_t n = IMU_SPECTRUM_MIN_POINTS;
+	while (n * 2 <= points && n * 2 <= IMU_SPECTRUM_MAX_POINTS)
+		n *= 2;
+
+	spectrum->path = path;
+	spectrum->axis = axis < IMU_AXES ? axis : IMU_ACCEL_Z;
+	spectrum->points = n;
+	spectrum->hop = hop < 1 ? 1 : hop > n ? n : hop;
+	spectrum->average = average < 1 ? 1 : average;
+	spectrum->head = 0;
+	spectrum->filled = 0;
+	spectrum->since_frame = 0;
+	spectrum->next_sample = 0;
+	spectrum->frames = 0;
+	spectrum->frame_ready = 0;
+	spectrum->frame_timestamp_us = 0;
+	spectrum->sample_period_us = 0;
+	spectrum->missed_frames = 0;
+	spectrum->gaps = 0;
+	spectrum->last_cycles = 0;
+	spectrum->max_cycles = 0;
+	spectrum->handler = handler;
+
+	// periodic Hann window, symmetric about n / 2
+	spectrum->window_sum = 0.0f;
+	for (uint16_t i = 0; i <= n / 2; i++)
+		spectrum->window[i] = 0.5f - 0.5f * cosf(2.0f * PI * i / n);
+	for (uint16_t i = 0; i < n; i++)
+		spectrum->window_sum += spectrum->window[i <= n / 2 ? i : n - i];
+
+	for (uint16_t k = 0; k < n / 2; k++) {
+		float c = cosf(2.0f * PI * k / n);
+		float s = -sinf(2.0f * PI * k / n);
+		spectrum->twiddle[k][0] = c;
+		spectrum->twiddle[k][1] = s;
+		spectrum->twiddle_q15[k][0] = (int16_t) lrintf(c * 32767.0f);
+		spectrum->twiddle_q15[k][1] = (int16_t) lrintf(s * 32767.0f);
+	}
+
+	spectrum->result = (struct imu_spectrum_result) { 0 };
+	spectrum->result.bins = n / 2 + 1;
+	spectrum->result.amplitude = spectrum->amplitude;
+
+}
+
+/**
+ * Adds the samples of a block. This only copies samples: when a frame is due it
+ * is captured and imu_spectrum_run() should be called, typically from a lower
+ * priority task. Samples missing before the block start the frame over.
+ *
+ * @param spectrum   The analyser
+ * @param block      Samples, the axis chosen at init is used
+ * @returns          1 if a frame is waiting for imu_spectrum_run()
+ */
+uint8_t imu_spectrum_add_block(struct imu_spectrum *spectrum, const struct imu_block *block) {
+
+	uint16_t mask = spectrum->points - 1;
+	spectrum->sample_period_us = block->sample_period_us;
+
+	// a frame across the gap would have a step in it, and no longer be evenly sampled
+	if (spectrum->filled > 0 && block->first_sample != spectrum->next_sample) {
+		spectrum->filled = 0;
+		spectrum->since_frame = 0;
+		spectrum->gaps++;
+	}
+	spectrum->next_sample = block->first_sample + block->count;
+
+	for (uint16_t n = 0; n < block->count; n++) {
+
+		spectrum->input[spectrum->head] = block->value[spectrum->axis][n];
+		spectrum->head = (spectrum->head + 1) & mask;
+		if (spectrum->filled < spectrum->points)
+			spectrum->filled++;
+		spectrum->since_frame++;
+
+		if (spectrum->filled < spectrum->points || spectrum->since_frame < spectrum->hop)
+			continue;
+		spectrum->since_frame = 0;
+
+		if (spectrum->frame_ready) {
+			spectrum->missed_frames++;
+			continue;
+		}
+
+		// oldest sample first
+		for (uint16_t i = 0; i < spectrum->points; i++)
+			spectrum->buffer[i] = spectrum->input[(spectrum->head + i) & mask];
+		spectrum->frame_timestamp_us = block->timestamp_us + n * block->sample_period_us;
+		spectrum->frame_ready = 1;
+
+	}
+
+	return spectrum->frame_ready;
+
+}
+
+// removes the mean, so gravity does not leak into the low bins, and applies the window
+static void imu_spectrum_window(struct imu_spectrum *spectrum) {
+
+	uint16_t n = spectrum->points;
+	float *x = spectrum->buffer;
+
+	float mean = 0.0f;
+	for (uint16_t i = 0; i < n; i++)
+		mean += x[i];
+	mean /= n;
+
+	for (uint16_t i = 0; i < n; i++)
+		x[i] = (x[i] - mean) * spectrum->window[i <= n / 2 ? i : n - i];
+
+}
+
+// in place radix-2 complex FFT of m interleaved re, im pairs, twiddles are e^(-j 2 pi k / 2m)
+static void imu_spectrum_fft_float(float *z, uint16_t m, const float (*twiddle)[2]) {
+
+	for (uint16_t i = 1, j = 0; i < m; i++) {
+		uint16_t bit = m >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j) {
+			float re = z[2 * i];
+			float im = z[2 * i + 1];
+			z[2 * i] = z[2 * j];
+			z[2 * i + 1] = z[2 * j + 1];
+			z[2 * j] = re;
+			z[2 * j + 1] = im;
+		}
+	}
+
+	for (uint16_t size = 2; size <= m; size <<= 1) {
+		uint16_t half = size >> 1;
+		uint16_t stride = 2 * m / size;
+		for (uint16_t j = 0; j < half; j++) {
+			float wr = twiddle[j * stride][0];
+			float wi = twiddle[j * stride][1];
+			for (uint16_t start = j; start < m; start += size) {
+				float *a = &z[2 * start];
+				float *b = &z[2 * (start + half)];
+				float tr = b[0] * wr - b[1] * wi;
+				float ti = b[0] * wi + b[1] * wr;
+				b[0] = a[0] - tr;
+				b[1] = a[1] - ti;
+				a[0] += tr;
+				a[1] += ti;
+			}
+		}
+	}
+
+}
+
+// the same in Q15, halving every stage so the output is the transform divided by m
+static void imu_spectrum_fft_q15(int16_t *z, uint16_t m, const int16_t (*twiddle)[2]) {
+
+	for (uint16_t i = 1, j = 0; i < m; i++) {
+		uint16_t bit = m >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j) {
+			int16_t re = z[2 * i];
+			int16_t im = z[2 * i + 1];
+			z[2 * i] = z[2 * j];
+			z[2 * i + 1] = z[2 * j + 1];
+			z[2 * j] = re;
+			z[2 * j + 1] = im;
+		}
+	}
+
+	for (uint16_t size = 2; size <= m; size <<= 1) {
+		uint16_t half = size >> 1;
+		uint16_t stride = 2 * m / size;
+		for (uint16_t j = 0; j < half; j++) {
+			int32_t wr = twiddle[j * stride][0];
+			int32_t wi = twiddle[j * stride][1];
+			for (uint16_t start = j; start < m; start += size) {
+				int16_t *a = &z[2 * start];
+				int16_t *b = &z[2 * (start + half)];
+				int32_t tr = (b[0] * wr - b[1] * wi) >> 15;
+				int32_t ti = (b[0] * wi + b[1] * wr) >> 15;
+				b[0] = (a[0] - tr) >> 1;
+				b[1] = (a[1] - ti) >> 1;
+				a[0] = (a[0] + tr) >> 1;
+				a[1] = (a[1] + ti) >> 1;
+			}
+		}
+	}
+
+}
+
+// converts the windowed frame to Q15 using as much of the range as the frame allows, returns the scale back to float
+static float imu_spectrum_to_q15(struct imu_spectrum *spectrum) {
+
+	float largest = 0.0f;
+	for (uint16_t i = 0; i < spectrum->points; i++)
+		if (fabsf(spectrum->buffer[i]) > largest)
+			largest = fabsf(spectrum->buffer[i]);
+
+	float scale = largest > 0.0f ? Q15_INPUT_LIMIT / largest : 0.0f;
+	for (uint16_t i = 0; i < spectrum->points; i++)
+		spectrum->buffer_q15[i] = (int16_t) lrintf(spectrum->buffer[i] * scale);
+
+	return largest > 0.0f ? (spectrum->points / 2) / scale : 0.0f;
+
+}
+
+// turns the complex transform of the packed frame into the power of each real bin
+static void imu_spectrum_split(struct imu_spectrum *spectrum, uint8_t accumulate) {
+
+	uint16_t m = spectrum->points / 2;
+	const float *z = spectrum->buffer;
+	float *power = spectrum->power;
+
+	// DC and Nyquist are real
+	float dc = z[0] + z[1];
+	float nyquist = z[0] - z[1];
+	if (!accumulate) {
+		power[0] = 0.0f;
+		power[m] = 0.0f;
+	}
+	power[0] += dc * dc;
+	power[m] += nyquist * nyquist;
+
+	for (uint16_t k = 1; k < m; k++) {
+
+		// even samples: (Z[k] + conj(Z[m-k])) / 2, odd samples: (Z[k] - conj(Z[m-k])) / 2j
+		float zr = z[2 * k];
+		float zi = z[2 * k + 1];
+		float cr = z[2 * (m - k)];
+		float ci = -z[2 * (m - k) + 1];
+		float er = 0.5f * (zr + cr);
+		float ei = 0.5f * (zi + ci);
+		float odd_r = 0.5f * (zi - ci);
+		float odd_i = -0.5f * (zr - cr);
+
+		float wr = spectrum->twiddle[k][0];
+		float wi = spectrum->twiddle[k][1];
+		float xr = er + wr * odd_r - wi * odd_i;
+		float xi = ei + wr * odd_i + wi * odd_r;
+
+		if (accumulate)
+			power[k] += xr * xr + xi * xi;
+		else
+			power[k] = xr * xr + xi * xi;
+
+	}
+
+}
+
+// converts the summed power to amplitudes and finds the peaks
+static void imu_spectrum_finish(struct imu_spectrum *spectrum) {
+
+	struct imu_spectrum_result *result = &spectrum->result;
+	uint16_t m = spectrum->points / 2;
+	float *amplitude = spectrum->amplitude;
+
+	// a sine of amplitude A shows up as A * window_sum / 2 in its bin
+	for (uint16_t k = 0; k <= m; k++) {
+		float gain = (k == 0 || k == m ? 1.0f : 2.0f) / spectrum->window_sum;
+		amplitude[k] = sqrtf(spectrum->power[k] / spectrum->frames) * gain;
+	}
+
+	result->timestamp_us = spectrum->frame_timestamp_us;
+	result->bin_hz = spectrum->sample_period_us ? 1e6f / (spectrum->sample_period_us * (float) spectrum->points) : 0.0f;
+	result->bins = m + 1;
+	result->frames = spectrum->frames;
+	for (uint8_t p = 0; p < IMU_SPECTRUM_PEAKS; p++)
+		result->peak[p] = (struct imu_spectrum_peak) { 0.0f, 0.0f };
+
+	for (uint16_t k = 1; k < m; k++) {
+
+		float left = amplitude[k - 1];
+		float center = amplitude[k];
+		float right = amplitude[k + 1];
+		if (center <= left || center < right || center <= result->peak[IMU_SPECTRUM_PEAKS - 1].amplitude)
+			continue;
+
+		// fit a parabola through the three bins
+		float curvature = left - 2.0f * center + right;
+		float offset = curvature != 0.0f ? 0.5f * (left - right) / curvature : 0.0f;
+		struct imu_spectrum_peak peak = {
+			(k + offset) * result->bin_hz,
+			center - 0.25f * (left - right) * offset
+		};
+
+		uint8_t p = IMU_SPECTRUM_PEAKS - 1;
+		while (p > 0 && result->peak[p - 1].amplitude < peak.amplitude) {
+			result->peak[p] = result->peak[p - 1];
+			p--;
+		}
+		result->peak[p] = peak;
+
+	}
+
+}
+
+/**
+ * Transforms the captured frame and adds its power to the average. Every
+ * average frames the handler is called with the result.
+ *
+ * @param spectrum   The analyser
+ */
+void imu_spectrum_run(struct imu_spectrum *spectrum) {
+
+	if (!spectrum->frame_ready)
+		return;
+
+	uint32_t start = DWT->CYCCNT;
+	PROF_BEGIN(imu_spectrum);
+
+	uint16_t m = spectrum->points / 2;
+	imu_spectrum_window(spectrum);
+
+	if (spectrum->path == IMU_SPECTRUM_Q15) {
+		float scale = imu_spectrum_to_q15(spectrum);
+		imu_spectrum_fft_q15(spectrum->buffer_q15, m, spectrum->twiddle_q15);
+		for (uint16_t i = 0; i < spectrum->points; i++)
+			spectrum->buffer[i] = spectrum->buffer_q15[i] * scale;
+	} else {
+		imu_spectrum_fft_float(spectrum->buffer, m, spectrum->twiddle);
+	}
+
+	imu_spectrum_split(spectrum, spectrum->frames > 0);
+	spectrum->frames++;
+	spectrum->frame_ready = 0;
+
+	if (spectrum->frames >= spectrum->average) {
+		imu_spectrum_finish(spectrum);
+		spectrum->frames = 0;
+		spectrum->handler(&spectrum->result);
+	}
+
+	PROF_END(imu_spectrum);
+	spectrum->last_cycles = DWT->CYCCNT - start;
+	if (spectrum->last_cycles > spectrum->max_cycles)
+		spectrum->max_cycles = spectrum->last_cycles;
+
+}
+
+/**
+ * Transforms the latest samples with both the float and the Q15 path and
+ * compares them. Needs points samples to have been added, and discards a
+ * frame waiting for imu_spectrum_run().
+ *
+ * @param spectrum   The analyser
+ * @param result     Receives the cycle counts and the error
+ */
+void imu_spectrum_benchmark(struct imu_spectrum *spectrum, struct imu_spectrum_benchmark *result) {
+
+	uint16_t mask = spectrum->points - 1;
+	uint16_t m = spectrum->points / 2;
+
+	for (uint16_t i = 0; i < spectrum->points; i++)
+		spectrum->buffer[i] = spectrum->input[(spectrum->head + i) & mask];
+	spectrum->frame_ready = 0;
+	imu_spectrum_window(spectrum);
+
+	uint32_t start = DWT->CYCCNT;
+	float scale = imu_spectrum_to_q15(spectrum);
+	imu_spectrum_fft_q15(spectrum->buffer_q15, m, spectrum->twiddle_q15);
+	result->q15_cycles = DWT->CYCCNT - start;
+
+	start = DWT->CYCCNT;
+	imu_spectrum_fft_float(spectrum->buffer, m, spectrum->twiddle);
+	result->float_cycles = DWT->CYCCNT - start;
+
+	// the split into real bins is the same float code for both, so compare the complex transforms
+	float largest = 0.0f;
+	float error = 0.0f;
+	for (uint16_t i = 0; i < spectrum->points; i += 2) {
+		float re = spectrum->buffer[i];
+		float im = spectrum->buffer[i + 1];
+		float dr = spectrum->buffer_q15[i] * scale - re;
+		float di = spectrum->buffer_q15[i + 1] * scale - im;
+		float magnitude = re * re + im * im;
+		float difference = dr * dr + di * di;
+		if (magnitude > largest)
+			largest = magnitude;
+		if (difference > error)
+			error = difference;
+	}
+
+	result->points = spectrum->points;
+	result->q15_error = largest > 0.0f ? sqrtf(error / largest) : 0.0f;
+
+}
+
+/**
+ * Sends part of a result over the UART in binary, small enough for the UART
+ * buffer. Every frame carries the peaks. See tools/spectrum_decode.py.
+ *
+ * @param result      The spectrum
+ * @param first_bin   First bin to send, 0 to start
+ * @returns           First bin of the next part, or 0 once every bin has been sent
+ */
+uint16_t imu_spectrum_send(const struct imu_spectrum_result *result, uint16_t first_bin) {
+
+	static uint8_t frame[2 + 12 + IMU_SPECTRUM_PEAKS * 8 + 4 + IMU_SPECTRUM_SEND_BINS * 4 + 2];
+
+	if (first_bin >= result->bins)
+		return 0;
+	uint16_t count = result->bins - first_bin;
+	if (count > IMU_SPECTRUM_SEND_BINS)
+		count = IMU_SPECTRUM_SEND_BINS;
+
+	uint32_t n = 0;
+	frame[n++] = 0xA5;
+	frame[n++] = 0x53;
+	memcpy(&frame[n], &result->timestamp_us, 4);  n += 4;
+	memcpy(&frame[n], &result->bin_hz, 4);        n += 4;
+	memcpy(&frame[n], &result->bins, 2);          n += 2;
+	memcpy(&frame[n], &result->frames, 2);        n += 2;
+	for (uint8_t p = 0; p < IMU_SPECTRUM_PEAKS; p++) {
+		memcpy(&frame[n], &result->peak[p].frequency_hz, 4);  n += 4;
+		memcpy(&frame[n], &result->peak[p].amplitude, 4);     n += 4;
+	}
+	memcpy(&frame[n], &first_bin, 2);             n += 2;
+	memcpy(&frame[n], &count, 2);                 n += 2;
+	memcpy(&frame[n], &result->amplitude[first_bin], count * 4);
+	n += count * 4;
+
+	uint16_t checksum = 0;
+	for (uint32_t j = 2; j < n; j++)
+		checksum += frame[j];
+	frame[n++] = checksum & 0xFF;
+	frame[n++] = checksum >> 8;
+
+	uart_send_bytes(frame, n);
+
+	first_bin += count;
+	return first_bin < result->bins ? first_bin : 0;
+
+}
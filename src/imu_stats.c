@@ -0,0 +1,261 @@
+// Per-axis summaries of IMU samples over tumbling or sliding windows, so only
+// min, max, mean, variance and RMS have to be sent instead of every sample.
+
+#include "imu_stats.h"
+#include "lib_uart.h"
+#include <math.h>
+#include <string.h>
+
+// an empty window, the next sample is the first one
+static void imu_stats_restart(struct imu_stats *stats) {
+
+	stats->count = 0;
+	stats->since_result = 0;
+	stats->slot = 0;
+	stats->replaced = 0;
+	for (uint8_t axis = 0; axis < IMU_AXES; axis++) {
+		stats->mean[axis] = 0.0f;
+		stats->m2[axis] = 0.0f;
+		stats->min_queue[axis].front = 0;
+		stats->min_queue[axis].count = 0;
+		stats->max_queue[axis].front = 0;
+		stats->max_queue[axis].count = 0;
+	}
+
+}
+
+/**
+ * Prepares a statistics stage.
+ *
+ * @param stats     The stage
+ * @param window    Samples summarized by each result
+ * @param hop       Samples between results: window for tumbling windows, less for sliding windows of up to IMU_STATS_MAX_WINDOW samples
+ * @param handler   Called with each result
+ */
+void imu_stats_init(struct imu_stats *stats, uint16_t window, uint16_t hop, void (*handler)(const struct imu_stats_result *result)) {
+
+	if (window < 1) window = 1;
+	if (hop < 1) hop = 1;
+
+	stats->sliding = hop < window;
+	if (stats->sliding && window > IMU_STATS_MAX_WINDOW)
+		window = IMU_STATS_MAX_WINDOW;
+	if (!stats->sliding)
+		hop = window;
+
+	stats->window = window;
+	stats->hop = hop;
+	stats->next_sample = 0;
+	stats->gaps = 0;
+	stats->handler = handler;
+	imu_stats_restart(stats);
+
+}
+
+// drops ring positions from the back whose values can no longer be the extreme, then appends the new one
+static void imu_stats_queue_push(struct imu_stats_queue *queue, const float *ring, uint16_t window, uint16_t slot, uint8_t maximum) {
+
+	float value = ring[slot];
+	while (queue->count) {
+		uint16_t back = queue->slot[(queue->front + queue->count - 1) % window];
+		if (maximum ? ring[back] > value : ring[back] < value)
+			break;
+		queue->count--;
+	}
+	queue->slot[(queue->front + queue->count) % window] = slot;
+	queue->count++;
+
+}
+
+// forgets the sample about to be overwritten
+static void imu_stats_queue_expire(struct imu_stats_queue *queue, uint16_t window, uint16_t slot) {
+
+	if (queue->count && queue->slot[queue->front] == slot) {
+		queue->front = (queue->front + 1) % window;
+		queue->count--;
+	}
+
+}
+
+// replacing samples accumulates rounding errors, so start over from the ring now and then
+static void imu_stats_recompute(struct imu_stats *stats, uint8_t axis) {
+
+	const float *ring = stats->ring[axis];
+	float shift = ring[0];
+	float mean = 0.0f;
+	float m2 = 0.0f;
+
+	for (uint16_t i = 0; i < stats->count; i++)
+		mean += ring[i] - shift;
+	mean /= stats->count;
+	for (uint16_t i = 0; i < stats->count; i++)
+		m2 += (ring[i] - shift - mean) * (ring[i] - shift - mean);
+
+	stats->shift[axis] = shift;
+	stats->mean[axis] = mean;
+	stats->m2[axis] = m2;
+
+}
+
+// the window holds consecutive samples, so the first one is count - 1 periods before the last
+static void imu_stats_emit(struct imu_stats *stats, uint32_t timestamp_us, uint32_t period_us, uint8_t sensor) {
+
+	struct imu_stats_result *result = &stats->result;
+	result->count = stats->count;
+	result->duration_us = (stats->count - 1) * period_us;
+	result->timestamp_us = timestamp_us - result->duration_us;
+	result->sensor = sensor;
+
+	for (uint8_t axis = 0; axis < IMU_AXES; axis++) {
+		struct imu_stats_axis *a = &result->axis[axis];
+		if (stats->sliding) {
+			a->min = stats->ring[axis][stats->min_queue[axis].slot[stats->min_queue[axis].front]];
+			a->max = stats->ring[axis][stats->max_queue[axis].slot[stats->max_queue[axis].front]];
+		} else {
+			a->min = stats->min[axis];
+			a->max = stats->max[axis];
+		}
+		a->mean = stats->shift[axis] + stats->mean[axis];
+		a->variance = stats->m2[axis] > 0.0f ? stats->m2[axis] / stats->count : 0.0f;
+		a->rms = sqrtf(a->mean * a->mean + a->variance);
+	}
+
+	stats->handler(result);
+
+}
+
+/**
+ * Adds the value[] samples of a block, calling the handler whenever a result is due.
+ * A gap before the block starts the window over.
+ *
+ * @param stats   The stage
+ * @param block   The samples
+ */
+void imu_stats_add_block(struct imu_stats *stats, const struct imu_block *block) {
+
+	uint16_t window = stats->window;
+
+	// a window across the gap would summarize fewer samples over a longer time than it claims
+	if (stats->count > 0 && block->first_sample != stats->next_sample) {
+		imu_stats_restart(stats);
+		stats->gaps++;
+	}
+	stats->next_sample = block->first_sample + block->count;
+
+	for (uint16_t n = 0; n < block->count; n++) {
+
+		uint8_t full = stats->count == window;
+		uint16_t slot = stats->slot;
+
+		for (uint8_t axis = 0; axis < IMU_AXES; axis++) {
+
+			// the first sample of a window sets the shift, the ring keeps the samples as they are
+			float value = block->value[axis][n];
+			if (stats->count == 0)
+				stats->shift[axis] = value;
+			float x = value - stats->shift[axis];
+			float mean = stats->mean[axis];
+
+			if (!stats->sliding) {
+
+				// tumbling: Welford's update, the window is cleared after each result
+				uint16_t count = stats->count + 1;
+				float delta = x - mean;
+				mean += delta / count;
+				stats->m2[axis] += delta * (x - mean);
+				if (count == 1 || value < stats->min[axis]) stats->min[axis] = value;
+				if (count == 1 || value > stats->max[axis]) stats->max[axis] = value;
+
+			} else if (!full) {
+
+				uint16_t count = stats->count + 1;
+				float delta = x - mean;
+				mean += delta / count;
+				stats->m2[axis] += delta * (x - mean);
+
+			} else {
+
+				// sliding: the newest sample replaces the oldest, which is in the slot about to be written
+				float old = stats->ring[axis][slot] - stats->shift[axis];
+				float new_mean = mean + (x - old) / window;
+				stats->m2[axis] += (x - old) * (x - new_mean + old - mean);
+				if (stats->m2[axis] < 0.0f)
+					stats->m2[axis] = 0.0f;
+				mean = new_mean;
+				imu_stats_queue_expire(&stats->min_queue[axis], window, slot);
+				imu_stats_queue_expire(&stats->max_queue[axis], window, slot);
+
+			}
+
+			stats->mean[axis] = mean;
+			if (stats->sliding) {
+				stats->ring[axis][slot] = value;
+				imu_stats_queue_push(&stats->min_queue[axis], stats->ring[axis], window, slot, 0);
+				imu_stats_queue_push(&stats->max_queue[axis], stats->ring[axis], window, slot, 1);
+			}
+
+		}
+
+		if (!full)
+			stats->count++;
+		if (stats->sliding) {
+			stats->slot = (slot + 1) % window;
+			if (full && ++stats->replaced >= (uint32_t) window * IMU_STATS_RESYNC) {
+				stats->replaced = 0;
+				for (uint8_t axis = 0; axis < IMU_AXES; axis++)
+					imu_stats_recompute(stats, axis);
+			}
+		}
+
+		stats->since_result++;
+		if (stats->count < window || stats->since_result < stats->hop)
+			continue;
+		stats->since_result = 0;
+
+		imu_stats_emit(stats, block->timestamp_us + n * block->sample_period_us, block->sample_period_us, block->sensor);
+
+		if (!stats->sliding) {
+			stats->count = 0;
+			for (uint8_t axis = 0; axis < IMU_AXES; axis++) {
+				stats->mean[axis] = 0.0f;
+				stats->m2[axis] = 0.0f;
+			}
+		}
+
+	}
+
+}
+
+/**
+ * Sends a result over the UART in binary. See tools/stats_decode.py.
+ *
+ * @param result   The result
+ */
+void imu_stats_send(const struct imu_stats_result *result) {
+
+	uint8_t frame[2 + 11 + IMU_AXES * 5 * 4 + 2];
+
+	uint32_t n = 0;
+	frame[n++] = 0xA5;
+	frame[n++] = 0x55;
+	memcpy(&frame[n], &result->timestamp_us, 4);  n += 4;
+	memcpy(&frame[n], &result->duration_us, 4);   n += 4;
+	memcpy(&frame[n], &result->count, 2);         n += 2;
+	frame[n++] = result->sensor;
+	for (uint8_t axis = 0; axis < IMU_AXES; axis++) {
+		memcpy(&frame[n], &result->axis[axis].min, 4);       n += 4;
+		memcpy(&frame[n], &result->axis[axis].max, 4);       n += 4;
+		memcpy(&frame[n], &result->axis[axis].mean, 4);      n += 4;
+		memcpy(&frame[n], &result->axis[axis].variance, 4);  n += 4;
+		memcpy(&frame[n], &result->axis[axis].rms, 4);       n += 4;
+	}
+
+	uint16_t checksum = 0;
+	for (uint32_t j = 2; j < n; j++)
+		checksum += frame[j];
+	frame[n++] = checksum & 0xFF;
+	frame[n++] = checksum >> 8;
+
+	uart_send_bytes(frame, n);
+
+}
@@ -0,0 +1,51 @@
+// Streams IMU samples over the UART in binary, each sample with its sequence
+// number and the cycle count at which it was taken.
+
+#include "imu_stream.h"
+#include "lib_uart.h"
+#include <string.h>
+
+/**
+ * Sends the samples of a block, value[] in physical units. See tools/stream_decode.py.
+ *
+ * @param block   The samples
+ */
+void imu_stream_send(const struct imu_block *block) {
+
+	static uint8_t frame[2 + 14 + IMU_STREAM_FRAME_SAMPLES * (4 + IMU_AXES * 4) + 2];
+
+	for (uint16_t first = 0; first < block->count; first += IMU_STREAM_FRAME_SAMPLES) {
+
+		uint16_t count = block->count - first;
+		if (count > IMU_STREAM_FRAME_SAMPLES)
+			count = IMU_STREAM_FRAME_SAMPLES;
+		uint32_t sequence = block->first_sample + first;
+		uint32_t timestamp_us = block->timestamp_us + first * block->sample_period_us;
+
+		uint32_t n = 0;
+		frame[n++] = 0xA5;
+		frame[n++] = 0x59;
+		frame[n++] = block->sensor;
+		memcpy(&frame[n], &sequence, 4);                   n += 4;
+		memcpy(&frame[n], &timestamp_us, 4);               n += 4;
+		memcpy(&frame[n], &block->sample_period_us, 4);    n += 4;
+		frame[n++] = count;
+		for (uint16_t i = first; i < first + count; i++) {
+			memcpy(&frame[n], &block->capture_cycles[i], 4);  n += 4;
+			for (uint8_t axis = 0; axis < IMU_AXES; axis++) {
+				memcpy(&frame[n], &block->value[axis][i], 4);
+				n += 4;
+			}
+		}
+
+		uint16_t checksum = 0;
+		for (uint32_t j = 2; j < n; j++)
+			checksum += frame[j];
+		frame[n++] = checksum & 0xFF;
+		frame[n++] = checksum >> 8;
+
+		uart_send_bytes(frame, n);
+
+	}
+
+}
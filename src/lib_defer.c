@@ -0,0 +1,152 @@
+// Deferred work: interrupt handlers queue work items and pend PendSV, and the
+// PendSV handler, at the lowest interrupt priority, runs them once every other
+// interrupt has finished.
+
+#include "lib_defer.h"
+#include "stm32f429xx.h"
+
+struct defer_stats defer_stats = { 0 };
+
+// queued work items, newest first
+static struct defer_work *volatile pending = 0;
+
+/**
+ * Gives PendSV the lowest priority. Call before the first defer_post().
+ */
+void defer_init(void) {
+
+	NVIC_SetPriority(PendSV_IRQn, 0xFF);
+
+}
+
+/**
+ * Prepares a work item.
+ *
+ * @param work      The work item
+ * @param run       Called from PendSV with the work item
+ * @param context   Anything run() needs, stored in work->context
+ */
+void defer_work_init(struct defer_work *work, void (*run)(struct defer_work *work), void *context) {
+
+	work->next = 0;
+	work->run = run;
+	work->context = context;
+	work->queued = 0;
+	work->posted_cycles = 0;
+	work->runs = 0;
+	work->dropped = 0;
+	work->last_latency_cycles = 0;
+	work->max_latency_cycles = 0;
+
+}
+
+// adds one with LDREX/STREX, a higher priority interrupt may be counting in between
+static void defer_count(volatile uint32_t *counter) {
+
+	uint32_t count;
+	do {
+		count = __LDREXW(counter) + 1;
+	} while (__STREXW(count, counter));
+
+}
+
+/**
+ * Queues a work item and pends PendSV. Safe from any interrupt or from thread mode.
+ *
+ * @param work   The work item
+ * @returns      1 if queued, 0 if it was still queued from before
+ */
+uint8_t defer_post(struct defer_work *work) {
+
+	// claim the work item, a higher priority interrupt may be posting it too
+	do {
+		if (__LDREXW(&work->queued)) {
+			__CLREX();
+			defer_count(&work->dropped);
+			defer_count(&defer_stats.dropped);
+			return 0;
+		}
+	} while (__STREXW(1, &work->queued));
+
+	work->posted_cycles = DWT->CYCCNT;
+
+	struct defer_work *head;
+	do {
+		head = (struct defer_work *) __LDREXW((volatile uint32_t *) &pending);
+		work->next = head;
+	} while (__STREXW((uint32_t) work, (volatile uint32_t *) &pending));
+
+	SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+	return 1;
+
+}
+
+// called by PendSV_Handler, runs work items until none are left
+void defer_run(void) {
+
+	while (1) {
+
+		struct defer_work *list;
+		do {
+			list = (struct defer_work *) __LDREXW((volatile uint32_t *) &pending);
+		} while (__STREXW(0, (volatile uint32_t *) &pending));
+		if (list == 0)
+			return;
+
+		// run the work in the order it was queued
+		struct defer_work *ordered = 0;
+		while (list) {
+			struct defer_work *next = list->next;
+			list->next = ordered;
+			ordered = list;
+			list = next;
+		}
+
+		while (ordered) {
+
+			struct defer_work *work = ordered;
+			ordered = work->next;
+
+			uint32_t latency = DWT->CYCCNT - work->posted_cycles;
+			work->last_latency_cycles = latency;
+			if (latency > work->max_latency_cycles)
+				work->max_latency_cycles = latency;
+			if (latency > defer_stats.max_latency_cycles)
+				defer_stats.max_latency_cycles = latency;
+			defer_stats.total_latency_cycles += latency;
+
+			// from here on the work can be queued again, even by itself
+			work->queued = 0;
+			work->run(work);
+			work->runs++;
+			defer_stats.runs++;
+
+		}
+
+	}
+
+}
+
+/**
+ * Runs the deferred work, then tail calls the kernel's context switch with the
+ * exception return value and process stack untouched.
+ */
+__attribute__((naked)) void PendSV_Handler(void) {
+
+	__asm volatile (
+		"	push {r0, lr}              \n"  // r0 keeps the stack 8 byte aligned
+		"	bl defer_run               \n"
+		"	pop {r0, lr}               \n"
+		"	b kernel_pendsv            \n"
+	);
+
+}
+
+// replaced by lib_kernel's context switch when the kernel is linked in
+__attribute__((weak, naked)) void kernel_pendsv(void) {
+
+	__asm volatile (
+		"	bx lr                      \n"
+	);
+
+}
@@ -0,0 +1,175 @@
+// Cooperative rate-monotonic executive. Replaces a hand written superloop.
+
+#include "lib_exec.h"
+#include "lib_time.h"
+#include "stm32f429xx.h"
+
+// tasks sorted by deadline, highest priority first
+static struct exec_task *tasks = 0;
+
+struct exec_idle exec_idle = { 0 };
+
+static void exec_add(struct exec_task *task) {
+
+	task->runs = 0;
+	task->deadline_misses = 0;
+	task->lost_events = 0;
+	task->last_cycles = 0;
+	task->min_cycles = 0xFFFFFFFF;
+	task->max_cycles = 0;
+	task->total_cycles = 0;
+
+	// equal deadlines keep the order they were added in
+	struct exec_task **link = &tasks;
+	while (*link && (*link)->deadline_us <= task->deadline_us)
+		link = &(*link)->next;
+	task->next = *link;
+	*link = task;
+
+}
+
+/**
+ * Adds a task that runs at a fixed rate. The deadline is the end of the period.
+ *
+ * @param task        The task
+ * @param name        A name for the task, for debugging
+ * @param run         Function to call every period
+ * @param period_us   Microseconds between releases
+ */
+void exec_add_periodic(struct exec_task *task, const char *name, void(*run)(void), uint32_t period_us) {
+
+	task->name = name;
+	task->run = run;
+	task->period_us = period_us;
+	task->deadline_us = period_us;
+	task->release_us = time_now_us();
+	task->ready = 0;
+	exec_add(task);
+
+}
+
+/**
+ * Adds a task that runs after exec_post() is called for it.
+ *
+ * @param task          The task
+ * @param name          A name for the task, for debugging
+ * @param run           Function to call once per posted event
+ * @param deadline_us   Microseconds after the event by which the task must have completed
+ */
+void exec_add_event(struct exec_task *task, const char *name, void(*run)(void), uint32_t deadline_us) {
+
+	task->name = name;
+	task->run = run;
+	task->period_us = 0;
+	task->deadline_us = deadline_us;
+	task->release_us = 0;
+	task->ready = 0;
+	exec_add(task);
+
+}
+
+/**
+ * Marks an event triggered task ready to run. Safe to call from ISRs.
+ *
+ * @param task   The task
+ */
+void exec_post(struct exec_task *task) {
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	if (task->ready) {
+		task->lost_events++;
+	} else {
+		task->release_us = time_now_us();
+		task->ready = 1;
+	}
+
+	__set_PRIMASK(primask);
+
+}
+
+static void exec_run_task(struct exec_task *task) {
+
+	uint32_t start = DWT->CYCCNT;
+	task->run();
+	uint32_t cycles = DWT->CYCCNT - start;
+
+	uint32_t now = time_now_us();
+	if ((int32_t)(now - (task->release_us + task->deadline_us)) > 0)
+		task->deadline_misses++;
+
+	task->runs++;
+	task->last_cycles = cycles;
+	task->total_cycles += cycles;
+	if (cycles < task->min_cycles)
+		task->min_cycles = cycles;
+	if (cycles > task->max_cycles)
+		task->max_cycles = cycles;
+
+}
+
+/**
+ * Runs the tasks forever. The core sleeps with WFI whenever no task is ready.
+ * Requires timebase_setup() and EnableCycles() to have been called.
+ */
+void exec_run(void) {
+
+	while (1) {
+
+		uint32_t now = time_now_us();
+		uint32_t next_release = now + 1000000;
+
+		// release periodic tasks whose period has started and find the next release
+		for (struct exec_task *task = tasks; task; task = task->next) {
+			if (task->period_us == 0)
+				continue;
+			if (!task->ready && (int32_t)(now - task->release_us) >= 0)
+				task->ready = 1;
+			uint32_t release = task->ready ? task->release_us + task->period_us : task->release_us;
+			if ((int32_t)(release - next_release) < 0)
+				next_release = release;
+		}
+
+		// run the highest priority ready task, then start over
+		struct exec_task *task = tasks;
+		__disable_irq();
+		while (task && !task->ready)
+			task = task->next;
+		if (task)
+			task->ready = 0;
+		__enable_irq();
+
+		if (task) {
+			exec_run_task(task);
+			if (task->period_us) {
+				task->release_us += task->period_us;
+				// skip whole periods that were missed instead of running back to back
+				while ((int32_t)(time_now_us() - (task->release_us + task->period_us)) >= 0) {
+					task->release_us += task->period_us;
+					task->deadline_misses++;
+				}
+			}
+			continue;
+		}
+
+		// nothing is ready: sleep until the next release or an interrupt posts an event
+		__disable_irq();
+		for (task = tasks; task && !task->ready; task = task->next)
+			;
+		if (!task && (int32_t)(next_release - time_now_us()) > 0) {
+			timebase_set_wakeup(next_release);
+			// interrupts are still masked after WFI, so the time is read before the waking ISR runs
+			uint32_t asleep = time_now_us();
+			__WFI();
+			uint32_t awake = time_now_us();
+			exec_idle.idle_us += awake - asleep;
+			exec_idle.sleeps++;
+			if ((int32_t)(next_release - awake) > 0)
+				exec_idle.wakeups++;
+		}
+		__enable_irq();
+
+	}
+
+}
@@ -8,6 +8,9 @@
 // array of event handler function pointers
 static void(*exti_handler[16])(void) = { 0 };
 
+// DWT cycle count on entry to the ISR that last called each handler
+static uint32_t entry_cycles[16] = { 0 };
+
 /**
  * Configures an external interrupt.
  * EXTI0 can be pin 0 of any gpio port, EXTI1 can be pin 1 of any gpio port, etc.
@@ -108,15 +111,32 @@ void exti_trigger(enum GPIO_PIN pin) {
 	EXTI->SWIER = (1 << (pin % 16));  // trigger exti
 }
 
+/**
+ * Gets the DWT cycle count taken first thing in the ISR, before the pending bit
+ * is checked or the handler is called. Call it from the handler to timestamp the
+ * edge without the ISR's own overhead.
+ *
+ * @param pin   GPIO pin associated with the interrupt
+ * @returns     DWT->CYCCNT on entry to the ISR that last called the pin's handler
+ */
+uint32_t exti_entry_cycles(enum GPIO_PIN pin) {
+
+	return entry_cycles[pin % 16];
+
+}
+
 /**
  * ISR for External Interrupts 0 and 1. Clears the interrupts and calls the handlers.
  */
 
 void  EXTI0_IRQHandler() {
 
+	uint32_t cycles = DWT->CYCCNT;
+
 	if (EXTI->PR & EXTI_PR_PR0) {
 
 		EXTI->PR = EXTI_PR_PR0;
+		entry_cycles[0] = cycles;
 		if (exti_handler[0]) exti_handler[0]();
 
 	}
@@ -124,107 +144,139 @@ void  EXTI0_IRQHandler() {
 
 void  EXTI1_IRQHandler() {
 
+	uint32_t cycles = DWT->CYCCNT;
+
 	if (EXTI->PR & EXTI_PR_PR1) {
 
 		EXTI->PR = EXTI_PR_PR1;
+		entry_cycles[1] = cycles;
 		if (exti_handler[1]) exti_handler[1]();
 
 	}
 }
 
 void  EXTI2_IRQHandler() {
+
+	uint32_t cycles = DWT->CYCCNT;
+
 	if (EXTI->PR & EXTI_PR_PR2) {
 
 		EXTI->PR = EXTI_PR_PR2;
+		entry_cycles[2] = cycles;
 		if (exti_handler[2]) exti_handler[2]();
 
 	}
 }
 
 void  EXTI3_IRQHandler() {
+
+	uint32_t cycles = DWT->CYCCNT;
+
 	if (EXTI->PR & EXTI_PR_PR3) {
 
 		EXTI->PR = EXTI_PR_PR3;
-		if (exti_handler[3]) exti_handler[0]();
+		entry_cycles[3] = cycles;
+		if (exti_handler[3]) exti_handler[3]();
 
 	}
 }
 
 void EXTI4_IRQHandler() {
+
+	uint32_t cycles = DWT->CYCCNT;
+
 	if (EXTI->PR & EXTI_PR_PR4) {
 
 		EXTI->PR = EXTI_PR_PR4;
+		entry_cycles[4] = cycles;
 		if (exti_handler[4]) exti_handler[4]();
 
 	}
 }
 
 void EXTI9_5_IRQHandler() {
+
+	uint32_t cycles = DWT->CYCCNT;
+
 	if (EXTI->PR & EXTI_PR_PR5) {
 
 		EXTI->PR = EXTI_PR_PR5;
+		entry_cycles[5] = cycles;
 		if (exti_handler[5]) exti_handler[5]();
 
 	}
 	else if (EXTI->PR & EXTI_PR_PR6) {
 
 		EXTI->PR = EXTI_PR_PR6;
+		entry_cycles[6] = cycles;
 		if (exti_handler[6]) exti_handler[6]();
 
 	}
 	else if (EXTI->PR & EXTI_PR_PR7) {
 
 		EXTI->PR = EXTI_PR_PR7;
+		entry_cycles[7] = cycles;
 		if (exti_handler[7]) exti_handler[7]();
 
 	}
 	else if (EXTI->PR & EXTI_PR_PR8) {
 
 		EXTI->PR = EXTI_PR_PR8;
+		entry_cycles[8] = cycles;
 		if (exti_handler[8]) exti_handler[8]();
 
 	}
 	else if (EXTI->PR & EXTI_PR_PR9) {
 
 		EXTI->PR = EXTI_PR_PR9;
+		entry_cycles[9] = cycles;
 		if (exti_handler[9]) exti_handler[9]();
 	}
 }
 
 void EXTI15_10_IRQHandler() {
+
+	uint32_t cycles = DWT->CYCCNT;
+
 	if (EXTI->PR & EXTI_PR_PR10) {
 
 		EXTI->PR = EXTI_PR_PR10;
+		entry_cycles[10] = cycles;
 		if (exti_handler[10]) exti_handler[10]();
 
 	}
 	else if (EXTI->PR & EXTI_PR_PR11) {
 
 		EXTI->PR = EXTI_PR_PR11;
+		entry_cycles[11] = cycles;
 		if (exti_handler[11]) exti_handler[11]();
 
 	}
 	else if (EXTI->PR & EXTI_PR_PR12) {
 
 		EXTI->PR = EXTI_PR_PR12;
+		entry_cycles[12] = cycles;
 		if (exti_handler[12]) exti_handler[12]();
 
 	}
 	else if (EXTI->PR & EXTI_PR_PR13) {
 
 		EXTI->PR = EXTI_PR_PR13;
+		entry_cycles[13] = cycles;
 		if (exti_handler[13]) exti_handler[13]();
 
 	}
 	else if (EXTI->PR & EXTI_PR_PR14) {
 
 		EXTI->PR = EXTI_PR_PR14;
+		entry_cycles[14] = cycles;
 		if (exti_handler[14]) exti_handler[14]();
 
 	}
 	else if (EXTI->PR & EXTI_PR_PR15) {
 
 		EXTI->PR = EXTI_PR_PR15;
+		entry_cycles[15] = cycles;
 		if (exti_handler[15]) exti_handler[15]();
 
 	}
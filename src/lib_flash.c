@@ -0,0 +1,114 @@
+// Internal flash erase and programming for the STM32F429 (2MB, dual bank).
+// Assumes a supply of 2.7 to 3.6V so words can be programmed 32 bits at a time.
+
+#include "lib_flash.h"
+#include "stm32f429xx.h"
+
+#define FLASH_ERRORS (FLASH_SR_OPERR | FLASH_SR_WRPERR | FLASH_SR_PGAERR | FLASH_SR_PGPERR | FLASH_SR_PGSERR)
+
+// unlocks the control register and clears old error flags
+static void flash_unlock(void) {
+
+	while (FLASH->SR & FLASH_SR_BSY);
+	if (FLASH->CR & FLASH_CR_LOCK) {
+		FLASH->KEYR = FLASH_KEYR_KEY1;
+		FLASH->KEYR = FLASH_KEYR_KEY2;
+	}
+	FLASH->SR = FLASH_ERRORS | FLASH_SR_EOP;
+
+}
+
+// waits for the operation to finish, locks the control register and reports errors
+static uint8_t flash_finish(void) {
+
+	while (FLASH->SR & FLASH_SR_BSY);
+	uint32_t status = FLASH->SR;
+	FLASH->CR = FLASH_CR_LOCK;
+	return (status & FLASH_ERRORS) ? 0 : 1;
+
+}
+
+/**
+ * Erases one sector. Sectors 0-3 and 12-15 are 16KB, 4 and 16 are 64KB, the rest are 128KB.
+ * A 128KB sector takes 1 to 2 seconds, during which code in the same bank stalls.
+ *
+ * @param sector   0 to 23
+ * @returns        1 on success, 0 if the flash reported an error
+ */
+uint8_t flash_erase_sector(uint8_t sector) {
+
+	flash_erase_start(sector);
+	while (flash_busy());
+	return flash_erase_finish();
+
+}
+
+/**
+ * Starts erasing a sector and returns at once. Poll flash_busy() until it
+ * returns 0, then call flash_erase_finish(). Reading the sector's bank stalls
+ * until then, and nothing else may program or erase the flash in between.
+ *
+ * @param sector   0 to 23
+ */
+void flash_erase_start(uint8_t sector) {
+
+	// sectors 12-23 are in the second bank, numbered from 16
+	uint32_t snb = sector < 12 ? sector : sector + 4;
+
+	flash_unlock();
+	FLASH->CR = FLASH_CR_PSIZE_1 | FLASH_CR_SER | (snb << FLASH_CR_SNB_Pos);
+	FLASH->CR |= FLASH_CR_STRT;
+
+}
+
+/**
+ * @returns   1 while an erase or programming operation is running
+ */
+uint8_t flash_busy(void) {
+
+	return (FLASH->SR & FLASH_SR_BSY) ? 1 : 0;
+
+}
+
+/**
+ * Ends an erase started by flash_erase_start(), waiting if it is still running.
+ *
+ * @returns   1 on success, 0 if the flash reported an error
+ */
+uint8_t flash_erase_finish(void) {
+
+	uint8_t ok = flash_finish();
+
+	// the data cache may still hold the old contents
+	FLASH->ACR &= ~FLASH_ACR_DCEN;
+	FLASH->ACR |= FLASH_ACR_DCRST;
+	FLASH->ACR &= ~FLASH_ACR_DCRST;
+	FLASH->ACR |= FLASH_ACR_DCEN;
+
+	return ok;
+
+}
+
+/**
+ * Programs words into erased flash.
+ *
+ * @param address   Destination, must be word aligned
+ * @param data      Source words
+ * @param words     Number of words
+ * @returns         1 on success, 0 if the flash reported an error
+ */
+uint8_t flash_write_words(uint32_t address, const uint32_t *data, uint32_t words) {
+
+	flash_unlock();
+	FLASH->CR = FLASH_CR_PSIZE_1 | FLASH_CR_PG;
+
+	for (uint32_t i = 0; i < words; i++) {
+		*(volatile uint32_t *) (address + 4 * i) = data[i];
+		while (FLASH->SR & FLASH_SR_BSY);
+		if (FLASH->SR & FLASH_ERRORS)
+			break;
+	}
+
+	return flash_finish();
+
+}
@@ -69,7 +69,7 @@ void i2c_setup(I2C_TypeDef *i2c, enum I2C_SPEED speed, enum GPIO_PIN sck_pin, en
 	{
 	
 		i2c->TRISE = ((((freqrange) * 300U) / 1000U) + 1U);
-		i2c->CCR =   ((pclk1) / ((400000) * 3U));
+		i2c->CCR =   I2C_CCR_FS | ((pclk1) / ((400000) * 3U));
 	}
 	// enable
 	i2c->CR1 |= 1;
@@ -295,3 +295,281 @@ void i2c_read_registers(I2C_TypeDef *i2c, uint8_t i2c_address, uint8_t byte_coun
 		}
 	}
 }
+
+// non-blocking reads: a queue per bus, serviced by the event, error and DMA interrupts
+enum I2C_BUS_STATE {BUS_IDLE, BUS_START_WRITE, BUS_ADDRESS_WRITE, BUS_REGISTER, BUS_START_READ, BUS_ADDRESS_READ, BUS_RECEIVE};
+
+struct i2c_bus {
+	I2C_TypeDef *i2c;
+	DMA_Stream_TypeDef *dma;
+	uint8_t dma_channel;
+	uint8_t dma_flags_shift;                        // position of the stream's flags in LISR/LIFCR
+	IRQn_Type irqs[3];                              // event, error, DMA
+	struct i2c_transfer *head;
+	struct i2c_transfer *tail;
+	volatile enum I2C_BUS_STATE state;
+	volatile uint8_t paused;                        // pauses not yet resumed
+};
+
+static struct i2c_bus buses[2];
+
+#define DMA_STREAM_FLAGS 0x3D                       // FEIF, DMEIF, TEIF, HTIF, TCIF
+#define DMA_STREAM_TEIF  0x08
+#define DMA_STREAM_TCIF  0x20
+
+// returns the bus state for an I2C peripheral, setting it up on first use
+static struct i2c_bus *i2c_bus(I2C_TypeDef *i2c) {
+
+	struct i2c_bus *bus;
+
+	if (i2c == I2C1)
+		bus = &buses[0];
+	else if (i2c == I2C2)
+		bus = &buses[1];
+	else
+		return 0;
+
+	if (bus->i2c == 0) {
+		bus->i2c = i2c;
+		if (i2c == I2C1) {
+			bus->dma = DMA1_Stream0;
+			bus->dma_channel = 1;
+			bus->dma_flags_shift = 0;
+			bus->irqs[0] = I2C1_EV_IRQn;
+			bus->irqs[1] = I2C1_ER_IRQn;
+			bus->irqs[2] = DMA1_Stream0_IRQn;
+		} else {
+			bus->dma = DMA1_Stream2;
+			bus->dma_channel = 7;
+			bus->dma_flags_shift = 16;
+			bus->irqs[0] = I2C2_EV_IRQn;
+			bus->irqs[1] = I2C2_ER_IRQn;
+			bus->irqs[2] = DMA1_Stream2_IRQn;
+		}
+		RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN;
+		for (uint8_t i = 0; i < 3; i++)
+			NVIC_EnableIRQ(bus->irqs[i]);
+	}
+
+	return bus;
+
+}
+
+// starts the transfer at the head of the queue, if any
+static void i2c_bus_start(struct i2c_bus *bus) {
+
+	struct i2c_transfer *transfer = bus->head;
+	I2C_TypeDef *i2c = bus->i2c;
+
+	if (transfer == 0 || bus->paused) {
+		bus->state = BUS_IDLE;
+		return;
+	}
+
+	// the stop condition of the previous transfer takes a few microseconds
+	while (i2c->CR1 & I2C_CR1_STOP)
+		;
+
+	transfer->status = I2C_TRANSFER_BUSY;
+	bus->state = BUS_START_WRITE;
+	i2c->CR1 &= ~I2C_CR1_POS;
+	i2c->CR1 |= I2C_CR1_ACK;
+	i2c->CR2 |= I2C_CR2_ITEVTEN | I2C_CR2_ITERREN;
+	i2c->CR1 |= I2C_CR1_START;
+
+}
+
+// ends the current transfer, starts the next one and notifies the owner
+static void i2c_bus_finish(struct i2c_bus *bus, enum I2C_TRANSFER_STATUS status) {
+
+	I2C_TypeDef *i2c = bus->i2c;
+	struct i2c_transfer *transfer = bus->head;
+
+	i2c->CR1 |= I2C_CR1_STOP;
+	i2c->CR2 &= ~(I2C_CR2_ITEVTEN | I2C_CR2_ITERREN | I2C_CR2_DMAEN | I2C_CR2_LAST);
+	bus->dma->CR &= ~DMA_SxCR_EN;
+
+	if (transfer == 0) {
+		bus->state = BUS_IDLE;
+		return;
+	}
+
+	bus->head = transfer->next;
+	if (bus->head == 0)
+		bus->tail = 0;
+	transfer->status = status;
+
+	i2c_bus_start(bus);
+	if (transfer->done)
+		transfer->done(transfer);
+
+}
+
+// I2C event interrupt: walks through the address and register phases
+static void i2c_bus_event(struct i2c_bus *bus) {
+
+	I2C_TypeDef *i2c = bus->i2c;
+	struct i2c_transfer *transfer = bus->head;
+	uint32_t status = i2c->SR1;
+
+	if (transfer == 0) {
+		i2c->CR2 &= ~(I2C_CR2_ITEVTEN | I2C_CR2_ITERREN);
+		return;
+	}
+
+	switch (bus->state) {
+	case BUS_START_WRITE:
+		if (status & I2C_SR1_SB) {
+			i2c->DR = transfer->i2c_address << 1;
+			bus->state = BUS_ADDRESS_WRITE;
+		}
+		break;
+	case BUS_ADDRESS_WRITE:
+		if (status & I2C_SR1_ADDR) {
+			(void) i2c->SR2;
+			i2c->DR = transfer->first_reg;
+			bus->state = BUS_REGISTER;
+		}
+		break;
+	case BUS_REGISTER:
+		if (status & I2C_SR1_BTF) {
+			// arm the DMA, the LAST bit makes the peripheral NACK the final byte by itself
+			DMA_Stream_TypeDef *dma = bus->dma;
+			dma->CR &= ~DMA_SxCR_EN;
+			while (dma->CR & DMA_SxCR_EN)
+				;
+			DMA1->LIFCR = DMA_STREAM_FLAGS << bus->dma_flags_shift;
+			dma->PAR  = (uint32_t) &i2c->DR;
+			dma->M0AR = (uint32_t) transfer->rx_buffer;
+			dma->NDTR = transfer->byte_count;
+			dma->CR   = (bus->dma_channel << DMA_SxCR_CHSEL_Pos) | DMA_SxCR_MINC | DMA_SxCR_TCIE | DMA_SxCR_TEIE | DMA_SxCR_EN;
+			i2c->CR2 |= I2C_CR2_DMAEN | I2C_CR2_LAST;
+			i2c->CR1 |= I2C_CR1_START;
+			bus->state = BUS_START_READ;
+		}
+		break;
+	case BUS_START_READ:
+		if (status & I2C_SR1_SB) {
+			i2c->DR = (transfer->i2c_address << 1) | 1;
+			bus->state = BUS_ADDRESS_READ;
+		}
+		break;
+	case BUS_ADDRESS_READ:
+		if (status & I2C_SR1_ADDR) {
+			// from here on the DMA receives the data
+			(void) i2c->SR2;
+			i2c->CR2 &= ~I2C_CR2_ITEVTEN;
+			bus->state = BUS_RECEIVE;
+		}
+		break;
+	default:
+		break;
+	}
+
+}
+
+// I2C error interrupt: NACK, bus error, arbitration lost or overrun
+static void i2c_bus_error(struct i2c_bus *bus) {
+
+	bus->i2c->SR1 &= ~(I2C_SR1_AF | I2C_SR1_BERR | I2C_SR1_ARLO | I2C_SR1_OVR);
+	i2c_bus_finish(bus, I2C_TRANSFER_ERROR);
+
+}
+
+// DMA interrupt: all bytes received
+static void i2c_bus_dma(struct i2c_bus *bus) {
+
+	uint32_t flags = (DMA1->LISR >> bus->dma_flags_shift) & DMA_STREAM_FLAGS;
+	DMA1->LIFCR = DMA_STREAM_FLAGS << bus->dma_flags_shift;
+
+	if (flags & DMA_STREAM_TEIF)
+		i2c_bus_finish(bus, I2C_TRANSFER_ERROR);
+	else if (flags & DMA_STREAM_TCIF)
+		i2c_bus_finish(bus, I2C_TRANSFER_DONE);
+
+}
+
+/**
+ * Queues a register read that runs in the background: the address and register
+ * phases are driven by the I2C event interrupt and the data is received by DMA
+ * (I2C1: DMA1 stream 0, I2C2: DMA1 stream 2). Reads on I2C1 and I2C2 run at the
+ * same time, reads on the same bus run one after another.
+ * The blocking functions must not be used on a bus while reads are queued on it.
+ *
+ * @param i2c        I2C1 or I2C2
+ * @param transfer   The read, with i2c_address, first_reg, byte_count, rx_buffer and done filled in
+ * @returns          1 if queued, 0 if the transfer is already queued or invalid
+ */
+uint8_t i2c_read_registers_async(I2C_TypeDef *i2c, struct i2c_transfer *transfer) {
+
+	struct i2c_bus *bus = i2c_bus(i2c);
+	if (bus == 0 || transfer->byte_count < 2)
+		return 0;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	if (transfer->status == I2C_TRANSFER_QUEUED || transfer->status == I2C_TRANSFER_BUSY) {
+		__set_PRIMASK(primask);
+		return 0;
+	}
+
+	transfer->next = 0;
+	transfer->status = I2C_TRANSFER_QUEUED;
+	if (bus->tail)
+		bus->tail->next = transfer;
+	else
+		bus->head = transfer;
+	bus->tail = transfer;
+
+	if (bus->state == BUS_IDLE)
+		i2c_bus_start(bus);
+
+	__set_PRIMASK(primask);
+	return 1;
+
+}
+
+/**
+ * Pauses or resumes the background reads on a bus, so the blocking functions can
+ * be used in between, or the bus set up again. Pausing waits for the current read
+ * to finish; reads queued while paused start when the bus is resumed. Pauses nest,
+ * the bus resumes once every pause has been matched by a resume.
+ *
+ * @param i2c     I2C1 or I2C2
+ * @param pause   1 to pause, 0 to resume
+ */
+void i2c_async_pause(I2C_TypeDef *i2c, uint8_t pause) {
+
+	struct i2c_bus *bus = i2c_bus(i2c);
+	if (bus == 0)
+		return;
+
+	uint32_t primask = __get_PRIMASK();
+	if (pause) {
+		__disable_irq();
+		bus->paused++;
+		__set_PRIMASK(primask);
+		while (bus->state != BUS_IDLE)
+			;
+		// the blocking functions expect the bus to be free
+		while (i2c->CR1 & I2C_CR1_STOP)
+			;
+		return;
+	}
+
+	__disable_irq();
+	if (bus->paused > 0)
+		bus->paused--;
+	if (bus->paused == 0 && bus->state == BUS_IDLE)
+		i2c_bus_start(bus);
+	__set_PRIMASK(primask);
+
+}
+
+void I2C1_EV_IRQHandler(void)     { i2c_bus_event(&buses[0]); }
+void I2C1_ER_IRQHandler(void)     { i2c_bus_error(&buses[0]); }
+void DMA1_Stream0_IRQHandler(void) { i2c_bus_dma(&buses[0]); }
+void I2C2_EV_IRQHandler(void)     { i2c_bus_event(&buses[1]); }
+void I2C2_ER_IRQHandler(void)     { i2c_bus_error(&buses[1]); }
+void DMA1_Stream2_IRQHandler(void) { i2c_bus_dma(&buses[1]); }
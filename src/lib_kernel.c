@@ -0,0 +1,505 @@
+// Minimal preemptive fixed priority kernel using SysTick and PendSV.
+//
+// The scheduling core (ready lists, wait lists, delays) only touches the data
+// structures below. The Cortex-M4 specific parts are the stack frame layout in
+// kernel_task_create(), the bottom of this file, and SysTick and the PendSV
+// context switch in lib_kernel_port.c. The switch saves the FPU registers only
+// for tasks that have used the FPU (lazy stacking).
+
+#include "lib_kernel.h"
+#include "stm32f429xx.h"
+#include <string.h>
+
+enum TASK_STATE {READY, BLOCKED, DEAD};
+
+struct kernel_stats kernel_stats = { 0 };
+
+// the running task, also used by kernel_pendsv
+struct kernel_task *kernel_current = 0;
+uint32_t kernel_running = 0;
+
+static struct kernel_task *ready_head[KERNEL_PRIORITIES];
+static struct kernel_task *ready_tail[KERNEL_PRIORITIES];
+static uint32_t ready_mask = 0;
+static struct kernel_task *delayed = 0;
+static volatile uint32_t ticks = 0;
+static uint32_t switch_requested_cycles = 0;
+
+static struct kernel_task idle_task;
+static uint32_t idle_stack[64];
+
+static void request_switch(void);
+
+/**************************************************************************
+ * Scheduling core
+ **************************************************************************/
+
+static void ready_add(struct kernel_task *task) {
+
+	task->state = READY;
+	task->next = 0;
+	if (ready_head[task->priority])
+		ready_tail[task->priority]->next = task;
+	else
+		ready_head[task->priority] = task;
+	ready_tail[task->priority] = task;
+	ready_mask |= 1UL << task->priority;
+
+}
+
+static void ready_remove(struct kernel_task *task) {
+
+	struct kernel_task **link = &ready_head[task->priority];
+	struct kernel_task *previous = 0;
+	while (*link && *link != task) {
+		previous = *link;
+		link = &(*link)->next;
+	}
+	if (*link == 0)
+		return;
+	*link = task->next;
+	if (ready_tail[task->priority] == task)
+		ready_tail[task->priority] = previous;
+	if (ready_head[task->priority] == 0)
+		ready_mask &= ~(1UL << task->priority);
+
+}
+
+static struct kernel_task *ready_highest(void) {
+
+	return ready_head[31 - __builtin_clz(ready_mask)];
+
+}
+
+// wait lists are kept sorted by priority, highest first
+static void wait_insert(struct kernel_task **list, struct kernel_task *task) {
+
+	// remember the head, not the link of the task in front: that task can be
+	// woken and its next reused for a ready list while this one still waits
+	task->wait_list = list;
+	while (*list && (*list)->priority >= task->priority)
+		list = &(*list)->next;
+	task->next = *list;
+	*list = task;
+
+}
+
+static void wait_remove(struct kernel_task *task) {
+
+	struct kernel_task **link = task->wait_list;
+	while (*link && *link != task)
+		link = &(*link)->next;
+	if (*link)
+		*link = task->next;
+	task->wait_list = 0;
+
+}
+
+// delayed list is kept sorted by wake tick, soonest first
+static void delay_insert(struct kernel_task *task, uint32_t wake_tick) {
+
+	task->wake_tick = wake_tick;
+	task->delayed = 1;
+	struct kernel_task **link = &delayed;
+	while (*link && (int32_t)((*link)->wake_tick - wake_tick) <= 0)
+		link = &(*link)->delay_next;
+	task->delay_next = *link;
+	*link = task;
+
+}
+
+static void delay_remove(struct kernel_task *task) {
+
+	struct kernel_task **link = &delayed;
+	while (*link && *link != task)
+		link = &(*link)->delay_next;
+	if (*link)
+		*link = task->delay_next;
+	task->delayed = 0;
+
+}
+
+static void make_ready(struct kernel_task *task) {
+
+	if (task->delayed)
+		delay_remove(task);
+	ready_add(task);
+	if (kernel_current && task->priority > kernel_current->priority)
+		request_switch();
+
+}
+
+// wakes the highest priority task of a wait list
+static void wake_one(struct kernel_task **list) {
+
+	struct kernel_task *task = *list;
+	if (task == 0)
+		return;
+	*list = task->next;
+	task->wait_list = 0;
+	make_ready(task);
+
+}
+
+// blocks the current task on a wait list and/or until a tick. Interrupts must be masked.
+// Returns once the task runs again, with the interrupts still masked.
+static void block_current(struct kernel_task **list, uint32_t timeout) {
+
+	struct kernel_task *task = kernel_current;
+	ready_remove(task);
+	task->state = BLOCKED;
+	task->timed_out = 0;
+	task->wait_list = 0;
+	if (list)
+		wait_insert(list, task);
+	if (timeout != KERNEL_WAIT_FOREVER)
+		delay_insert(task, ticks + timeout);
+	request_switch();
+
+	// the switch happens as soon as interrupts are unmasked
+	__enable_irq();
+	__disable_irq();
+
+}
+
+// called by SysTick_Handler once per tick with interrupts masked
+void kernel_tick(void) {
+
+	ticks++;
+
+	while (delayed && (int32_t)(ticks - delayed->wake_tick) >= 0) {
+		struct kernel_task *task = delayed;
+		delayed = task->delay_next;
+		task->delayed = 0;
+		if (task->wait_list) {
+			wait_remove(task);
+			task->timed_out = 1;
+		}
+		make_ready(task);
+	}
+
+	// round robin between ready tasks of the current priority
+	struct kernel_task *task = kernel_current;
+	if (task && task->state == READY && ready_head[task->priority] == task && task->next) {
+		ready_head[task->priority] = task->next;
+		ready_tail[task->priority]->next = task;
+		ready_tail[task->priority] = task;
+		task->next = 0;
+		request_switch();
+	}
+
+}
+
+// called by kernel_pendsv with interrupts masked, returns the task to switch to
+struct kernel_task *kernel_select(void) {
+
+	struct kernel_task *task = ready_highest();
+
+	if (task != kernel_current) {
+		task->switches++;
+		kernel_stats.switches++;
+	}
+	kernel_current = task;
+
+	uint32_t cycles = DWT->CYCCNT - switch_requested_cycles;
+	kernel_stats.last_switch_cycles = cycles;
+	if (cycles > kernel_stats.max_switch_cycles)
+		kernel_stats.max_switch_cycles = cycles;
+
+	return task;
+
+}
+
+/**************************************************************************
+ * API
+ **************************************************************************/
+
+static void kernel_task_exit(void) {
+
+	__disable_irq();
+	ready_remove(kernel_current);
+	kernel_current->state = DEAD;
+	request_switch();
+	__enable_irq();
+	while (1)
+		;
+
+}
+
+static void idle_entry(void *arg) {
+
+	while (1)
+		__WFI();
+
+}
+
+/**
+ * Prepares a task. Tasks can be created before or after kernel_start().
+ *
+ * @param task          The task
+ * @param name          A name for the task, for debugging
+ * @param entry         Function the task runs
+ * @param arg           Argument passed to entry
+ * @param priority      0 (lowest, shared with the idle task) to KERNEL_PRIORITIES - 1 (highest)
+ * @param stack         Memory for the task's stack
+ * @param stack_words   Size of the stack in 32bit words. Tasks that use the FPU need at least 50 words for a context.
+ */
+void kernel_task_create(struct kernel_task *task, const char *name, void(*entry)(void *arg), void *arg, uint8_t priority, uint32_t *stack, uint32_t stack_words) {
+
+	// the exception frame must be 8 byte aligned
+	uint32_t *sp = (uint32_t *)((uintptr_t)(stack + stack_words) & ~(uintptr_t)7);
+
+	// frame popped by the hardware on exception return
+	*--sp = 0x01000000;               // xPSR, thumb state
+	*--sp = (uintptr_t)entry;         // PC
+	*--sp = (uintptr_t)&kernel_task_exit; // LR
+	*--sp = 0;                        // R12
+	*--sp = 0;                        // R3
+	*--sp = 0;                        // R2
+	*--sp = 0;                        // R1
+	*--sp = (uintptr_t)arg;           // R0
+
+	// frame popped by kernel_pendsv
+	*--sp = 0xFFFFFFFD;               // EXC_RETURN: thread mode, PSP, no FPU context
+	for (uint8_t r = 11; r >= 4; r--)
+		*--sp = 0;                    // R11 - R4
+
+	task->sp = sp;
+	task->name = name;
+	task->priority = priority < KERNEL_PRIORITIES ? priority : KERNEL_PRIORITIES - 1;
+	task->wait_list = 0;
+	task->delayed = 0;
+	task->timed_out = 0;
+	task->switches = 0;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	make_ready(task);
+	__set_PRIMASK(primask);
+
+}
+
+/**
+ * Starts SysTick and switches to the highest priority task. Never returns.
+ * The stack in use until then (MSP) is only used by interrupts afterwards.
+ */
+void kernel_start(void) {
+
+	kernel_task_create(&idle_task, "idle", &idle_entry, 0, 0, idle_stack, sizeof(idle_stack) / 4);
+
+	// switching happens at the lowest priority, after all other ISRs are done
+	NVIC_SetPriority(PendSV_IRQn, 0xFF);
+	NVIC_SetPriority(SysTick_IRQn, 0xFF);
+
+	// automatic and lazy FPU state preservation
+	FPU->FPCCR |= FPU_FPCCR_ASPEN_Msk | FPU_FPCCR_LSPEN_Msk;
+
+	__disable_irq();
+	__set_PSP(0);
+	kernel_running = 1;
+	SysTick_Config(SystemCoreClock / KERNEL_TICK_HZ);
+	request_switch();
+	__enable_irq();
+
+	while (1)
+		;
+
+}
+
+/**
+ * Blocks the calling task for a number of ticks.
+ *
+ * @param ticks   Ticks to sleep for
+ */
+void kernel_sleep(uint32_t sleep_ticks) {
+
+	if (sleep_ticks == 0)
+		return;
+	__disable_irq();
+	block_current(0, sleep_ticks);
+	__enable_irq();
+
+}
+
+/**
+ * Lets other ready tasks of the same priority run.
+ */
+void kernel_yield(void) {
+
+	__disable_irq();
+	struct kernel_task *task = kernel_current;
+	if (task->next) {
+		ready_remove(task);
+		ready_add(task);
+		request_switch();
+	}
+	__enable_irq();
+
+}
+
+/**
+ * @returns   Ticks since kernel_start()
+ */
+uint32_t kernel_ticks(void) {
+
+	return ticks;
+
+}
+
+void kernel_sem_init(struct kernel_sem *sem, uint32_t initial_count) {
+
+	sem->count = initial_count;
+	sem->waiters = 0;
+
+}
+
+/**
+ * Takes a semaphore, blocking if the count is 0.
+ *
+ * @param sem       The semaphore
+ * @param timeout   Ticks to wait for, 0 to not wait, or KERNEL_WAIT_FOREVER. Must be 0 in ISRs.
+ * @returns         1 if the semaphore was taken, 0 on timeout
+ */
+uint8_t kernel_sem_take(struct kernel_sem *sem, uint32_t timeout) {
+
+	// ISRs can never block
+	if (__get_IPSR())
+		timeout = 0;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	uint32_t deadline = ticks + timeout;
+	while (sem->count == 0) {
+		if (timeout == 0 || (timeout != KERNEL_WAIT_FOREVER && (int32_t)(deadline - ticks) <= 0)) {
+			__set_PRIMASK(primask);
+			return 0;
+		}
+		block_current(&sem->waiters, timeout == KERNEL_WAIT_FOREVER ? timeout : deadline - ticks);
+	}
+	sem->count--;
+
+	__set_PRIMASK(primask);
+	return 1;
+
+}
+
+/**
+ * Gives a semaphore, waking the highest priority waiting task. Safe to call from ISRs.
+ *
+ * @param sem   The semaphore
+ */
+void kernel_sem_give(struct kernel_sem *sem) {
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	sem->count++;
+	wake_one(&sem->waiters);
+
+	__set_PRIMASK(primask);
+
+}
+
+/**
+ * @param queue       The queue
+ * @param buffer      Memory for item_size * length bytes
+ * @param item_size   Size of one item in bytes
+ * @param length      Maximum number of items
+ */
+void kernel_queue_init(struct kernel_queue *queue, void *buffer, uint32_t item_size, uint32_t length) {
+
+	queue->buffer = buffer;
+	queue->item_size = item_size;
+	queue->length = length;
+	queue->head = 0;
+	queue->count = 0;
+	queue->readers = 0;
+	queue->writers = 0;
+
+}
+
+/**
+ * Copies an item into a queue, blocking while it is full.
+ *
+ * @param queue     The queue
+ * @param item      Item to copy in
+ * @param timeout   Ticks to wait for, 0 to not wait, or KERNEL_WAIT_FOREVER. Must be 0 in ISRs.
+ * @returns         1 if the item was queued, 0 on timeout
+ */
+uint8_t kernel_queue_send(struct kernel_queue *queue, const void *item, uint32_t timeout) {
+
+	// ISRs can never block
+	if (__get_IPSR())
+		timeout = 0;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	uint32_t deadline = ticks + timeout;
+	while (queue->count == queue->length) {
+		if (timeout == 0 || (timeout != KERNEL_WAIT_FOREVER && (int32_t)(deadline - ticks) <= 0)) {
+			__set_PRIMASK(primask);
+			return 0;
+		}
+		block_current(&queue->writers, timeout == KERNEL_WAIT_FOREVER ? timeout : deadline - ticks);
+	}
+
+	uint32_t tail = (queue->head + queue->count) % queue->length;
+	memcpy(&queue->buffer[tail * queue->item_size], item, queue->item_size);
+	queue->count++;
+	wake_one(&queue->readers);
+
+	__set_PRIMASK(primask);
+	return 1;
+
+}
+
+/**
+ * Copies an item out of a queue, blocking while it is empty.
+ *
+ * @param queue     The queue
+ * @param item      Where to copy the item to
+ * @param timeout   Ticks to wait for, 0 to not wait, or KERNEL_WAIT_FOREVER. Must be 0 in ISRs.
+ * @returns         1 if an item was received, 0 on timeout
+ */
+uint8_t kernel_queue_receive(struct kernel_queue *queue, void *item, uint32_t timeout) {
+
+	// ISRs can never block
+	if (__get_IPSR())
+		timeout = 0;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	uint32_t deadline = ticks + timeout;
+	while (queue->count == 0) {
+		if (timeout == 0 || (timeout != KERNEL_WAIT_FOREVER && (int32_t)(deadline - ticks) <= 0)) {
+			__set_PRIMASK(primask);
+			return 0;
+		}
+		block_current(&queue->readers, timeout == KERNEL_WAIT_FOREVER ? timeout : deadline - ticks);
+	}
+
+	memcpy(item, &queue->buffer[queue->head * queue->item_size], queue->item_size);
+	queue->head = (queue->head + 1) % queue->length;
+	queue->count--;
+	wake_one(&queue->writers);
+
+	__set_PRIMASK(primask);
+	return 1;
+
+}
+
+/**************************************************************************
+ * Cortex-M4 port, SysTick and the context switch are in lib_kernel_port.c
+ **************************************************************************/
+
+static void request_switch(void) {
+
+	if (!kernel_running)
+		return;
+	switch_requested_cycles = DWT->CYCCNT;
+	SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+
+}
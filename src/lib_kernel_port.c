@@ -0,0 +1,60 @@
+// Cortex-M4 part of lib_kernel.c: the tick and the PendSV context switch. Kept
+// apart so the scheduling core also builds on the host, see tests/test_kernel.c.
+
+#include "lib_kernel.h"
+#include "stm32f429xx.h"
+
+// in lib_kernel.c
+extern uint32_t kernel_running;
+void kernel_tick(void);
+
+void SysTick_Handler(void) {
+
+	if (!kernel_running)
+		return;
+	__disable_irq();
+	kernel_tick();
+	__enable_irq();
+
+}
+
+/**
+ * Saves R4-R11 (and S16-S31 if the task used the FPU) on the outgoing task's
+ * stack, selects the next task, and restores its context. The hardware saves
+ * and restores the rest of the context on exception entry and return.
+ * PendSV_Handler (lib_defer.c) branches here after running the deferred work.
+ */
+__attribute__((naked)) void kernel_pendsv(void) {
+
+	__asm volatile (
+		"	ldr r1, running_const      \n"
+		"	ldr r1, [r1]               \n"
+		"	cbnz r1, 1f                \n"
+		"	bx lr                      \n"
+		"1:                            \n"
+		"	mrs r0, psp                \n"
+		"	cbz r0, 2f                 \n"  // first switch, nothing to save
+		"	tst lr, #0x10              \n"
+		"	it eq                      \n"
+		"	vstmdbeq r0!, {s16-s31}    \n"
+		"	stmdb r0!, {r4-r11, lr}    \n"
+		"	ldr r1, current_const      \n"
+		"	ldr r1, [r1]               \n"
+		"	str r0, [r1]               \n"
+		"2:                            \n"
+		"	cpsid i                    \n"
+		"	bl kernel_select           \n"
+		"	cpsie i                    \n"
+		"	ldr r0, [r0]               \n"
+		"	ldmia r0!, {r4-r11, lr}    \n"
+		"	tst lr, #0x10              \n"
+		"	it eq                      \n"
+		"	vldmiaeq r0!, {s16-s31}    \n"
+		"	msr psp, r0                \n"
+		"	bx lr                      \n"
+		"	.align 2                   \n"
+		"running_const: .word kernel_running \n"
+		"current_const: .word kernel_current \n"
+	);
+
+}
@@ -0,0 +1,152 @@
+// Scoped cycle profiling with the DWT cycle counter.
+
+#include "lib_prof.h"
+
+#ifdef PROFILING
+
+#include "lib_uart.h"
+#include "stm32f429xx.h"
+#include <string.h>
+
+// every region that has run at least once
+static struct prof_region *regions = 0;
+
+// regions currently being measured, innermost last
+static struct {
+	struct prof_region *region;
+	uint32_t start;
+	uint32_t child_cycles;
+} stack[PROF_MAX_DEPTH];
+static uint32_t depth = 0;
+
+void prof_begin(struct prof_region *region) {
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	if (!region->registered) {
+		region->registered = 1;
+		region->min_cycles = 0xFFFFFFFF;
+		region->next = regions;
+		regions = region;
+	}
+
+	if (depth < PROF_MAX_DEPTH) {
+		stack[depth].region = region;
+		stack[depth].child_cycles = 0;
+		stack[depth].start = DWT->CYCCNT;
+	}
+	depth++;
+
+	__set_PRIMASK(primask);
+
+}
+
+void prof_end(struct prof_region *region) {
+
+	uint32_t now = DWT->CYCCNT;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	// a PROF_END() without a PROF_BEGIN() must not wrap the depth around
+	if (depth == 0) {
+		__set_PRIMASK(primask);
+		return;
+	}
+
+	depth--;
+	if (depth >= PROF_MAX_DEPTH || stack[depth].region != region) {
+		// too deep, or unbalanced begin/end: drop the measurement
+		__set_PRIMASK(primask);
+		return;
+	}
+
+	uint32_t cycles = now - stack[depth].start;
+	if (depth > 0)
+		stack[depth - 1].child_cycles += cycles;
+
+	region->count++;
+	region->total_cycles += cycles;
+	region->self_cycles += cycles - stack[depth].child_cycles;
+	if (cycles < region->min_cycles)
+		region->min_cycles = cycles;
+	if (cycles > region->max_cycles)
+		region->max_cycles = cycles;
+	region->histogram[cycles ? 31 - __builtin_clz(cycles) : 0]++;
+
+	__set_PRIMASK(primask);
+
+}
+
+/**
+ * Sends every region's statistics over the UART in binary. See tools/prof_decode.py.
+ *
+ * One frame per region, all values little endian:
+ *   0xA5 0x50             sync
+ *   name                  16 bytes, zero padded
+ *   count, min, max       uint32
+ *   total, self           uint64
+ *   histogram             32 x uint32
+ *   checksum              uint16, sum of all preceding bytes after the sync
+ */
+void prof_dump(void) {
+
+	uint8_t frame[2 + PROF_NAME_LENGTH + 3 * 4 + 2 * 8 + PROF_BUCKETS * 4 + 2];
+
+	for (struct prof_region *region = regions; region; region = region->next) {
+
+		// copy with interrupts masked so the fields are consistent
+		struct prof_region copy;
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		copy = *region;
+		__set_PRIMASK(primask);
+
+		uint32_t n = 0;
+		frame[n++] = 0xA5;
+		frame[n++] = 0x50;
+		memset(&frame[n], 0, PROF_NAME_LENGTH);
+		strncpy((char *)&frame[n], copy.name, PROF_NAME_LENGTH);
+		n += PROF_NAME_LENGTH;
+		memcpy(&frame[n], &copy.count, 4);         n += 4;
+		memcpy(&frame[n], &copy.min_cycles, 4);    n += 4;
+		memcpy(&frame[n], &copy.max_cycles, 4);    n += 4;
+		memcpy(&frame[n], &copy.total_cycles, 8);  n += 8;
+		memcpy(&frame[n], &copy.self_cycles, 8);   n += 8;
+		memcpy(&frame[n], copy.histogram, PROF_BUCKETS * 4);
+		n += PROF_BUCKETS * 4;
+
+		uint16_t checksum = 0;
+		for (uint32_t j = 2; j < n; j++)
+			checksum += frame[j];
+		frame[n++] = checksum & 0xFF;
+		frame[n++] = checksum >> 8;
+
+		uart_send_bytes(frame, n);
+
+	}
+
+}
+
+/**
+ * Clears the statistics of every region.
+ */
+void prof_reset(void) {
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	for (struct prof_region *region = regions; region; region = region->next) {
+		region->count = 0;
+		region->min_cycles = 0xFFFFFFFF;
+		region->max_cycles = 0;
+		region->total_cycles = 0;
+		region->self_cycles = 0;
+		memset(region->histogram, 0, sizeof(region->histogram));
+	}
+
+	__set_PRIMASK(primask);
+
+}
+
+#endif
@@ -0,0 +1,145 @@
+// Lock-free single producer, single consumer queue of fixed size slots, such as
+// between an interrupt that acquires samples and the task that processes them.
+
+#include "lib_spsc.h"
+#include "stm32f429xx.h"
+#include <string.h>
+
+/**
+ * Prepares an empty queue.
+ *
+ * @param queue       The queue
+ * @param storage     slots * slot_size bytes, word aligned
+ * @param slot_size   Bytes per slot, a multiple of 4
+ * @param slots       Number of slots, a power of two
+ * @returns           1 on success, 0 if the sizes are not allowed
+ */
+uint8_t spsc_init(struct spsc *queue, void *storage, uint16_t slot_size, uint16_t slots) {
+
+	if (slot_size == 0 || (slot_size & 3) || slots == 0 || (slots & (slots - 1)) || ((uintptr_t) storage & 3))
+		return 0;
+
+	queue->storage = storage;
+	queue->slot_size = slot_size;
+	queue->mask = slots - 1;
+	queue->head = 0;
+	queue->tail = 0;
+	queue->overflows = 0;
+	queue->high_water = 0;
+	return 1;
+
+}
+
+/**
+ * Producer: gets the next free slot to fill. It is only handed to the consumer
+ * by spsc_commit(), and reserving again before that returns the same slot.
+ *
+ * @param queue   The queue
+ * @returns       The slot, or 0 if the queue is full
+ */
+void *spsc_reserve(struct spsc *queue) {
+
+	uint32_t head = queue->head;
+	if (head - queue->tail > queue->mask) {
+		queue->overflows++;
+		return 0;
+	}
+	return &queue->storage[(head & queue->mask) * queue->slot_size];
+
+}
+
+/**
+ * Producer: hands the reserved slot to the consumer.
+ *
+ * @param queue   The queue
+ */
+void spsc_commit(struct spsc *queue) {
+
+	uint32_t head = queue->head + 1;
+
+	// the slot contents must be visible before the consumer can see the new head
+	__DMB();
+	queue->head = head;
+
+	uint32_t used = head - queue->tail;
+	if (used > queue->high_water)
+		queue->high_water = used;
+
+}
+
+/**
+ * Producer: copies an item into the queue.
+ *
+ * @param queue   The queue
+ * @param item    slot_size bytes
+ * @returns       1 on success, 0 if the queue was full
+ */
+uint8_t spsc_push(struct spsc *queue, const void *item) {
+
+	void *slot = spsc_reserve(queue);
+	if (slot == 0)
+		return 0;
+	memcpy(slot, item, queue->slot_size);
+	spsc_commit(queue);
+	return 1;
+
+}
+
+/**
+ * Consumer: gets the oldest committed slot. It stays valid until spsc_release().
+ *
+ * @param queue   The queue
+ * @returns       The slot, or 0 if the queue is empty
+ */
+void *spsc_peek(struct spsc *queue) {
+
+	uint32_t tail = queue->tail;
+	if (queue->head == tail)
+		return 0;
+
+	// read the head before the slot contents
+	__DMB();
+	return &queue->storage[(tail & queue->mask) * queue->slot_size];
+
+}
+
+/**
+ * Consumer: gives the slot returned by spsc_peek() back to the producer.
+ *
+ * @param queue   The queue
+ */
+void spsc_release(struct spsc *queue) {
+
+	// finish reading the slot before the producer can reuse it
+	__DMB();
+	queue->tail = queue->tail + 1;
+
+}
+
+/**
+ * Consumer: copies the oldest item out of the queue.
+ *
+ * @param queue   The queue
+ * @param item    Receives slot_size bytes
+ * @returns       1 on success, 0 if the queue was empty
+ */
+uint8_t spsc_pop(struct spsc *queue, void *item) {
+
+	void *slot = spsc_peek(queue);
+	if (slot == 0)
+		return 0;
+	memcpy(item, slot, queue->slot_size);
+	spsc_release(queue);
+	return 1;
+
+}
+
+/**
+ * @param queue   The queue
+ * @returns       Slots committed but not released yet
+ */
+uint32_t spsc_count(const struct spsc *queue) {
+
+	return queue->head - queue->tail;
+
+}
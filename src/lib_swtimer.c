@@ -0,0 +1,291 @@
+// Software timers on a hierarchical timer wheel driven by the TIM2 timebase.
+//
+// Four levels of 64 slots cover 2^24 ticks (4.6 hours at 1ms per tick). Level 0
+// holds timers expiring within the next 64 ticks, level 1 within 64^2 ticks,
+// etc. Every 64 ticks one slot of the next level is cascaded down. Insert,
+// remove and expire are all O(1) per timer regardless of how many are active.
+
+#include "lib_swtimer.h"
+#include "lib_time.h"
+#include "stm32f429xx.h"
+
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define MAX_DELAY    ((1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct swtimer_stats swtimer_stats = { 0 };
+
+// each slot is a circular list with a sentinel head
+static struct swtimer wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static struct swtimer pending;
+static volatile uint32_t current_tick = 0;
+
+static void list_init(struct swtimer *head) {
+
+	head->next = head;
+	head->prev = head;
+
+}
+
+static void list_append(struct swtimer *head, struct swtimer *timer) {
+
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+
+}
+
+static void list_remove(struct swtimer *timer) {
+
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = timer;
+	timer->prev = timer;
+
+}
+
+// moves every timer from one list onto another (empty) list
+static void list_move(struct swtimer *from, struct swtimer *to) {
+
+	if (from->next == from) {
+		list_init(to);
+		return;
+	}
+	to->next = from->next;
+	to->prev = from->prev;
+	to->next->prev = to;
+	to->prev->next = to;
+	list_init(from);
+
+}
+
+// place a timer in the slot matching its expiry. Must be called with interrupts masked.
+static void wheel_insert(struct swtimer *timer) {
+
+	uint32_t expires = timer->expires;
+	int32_t delta = (int32_t)(expires - current_tick);
+	struct swtimer *slot;
+
+	if (delta < 0) {
+		// already due, expire on the tick being processed next
+		slot = &wheel[0][current_tick & WHEEL_MASK];
+	} else if (delta < (1L << WHEEL_BITS)) {
+		slot = &wheel[0][expires & WHEEL_MASK];
+	} else if (delta < (1L << (2 * WHEEL_BITS))) {
+		slot = &wheel[1][(expires >> WHEEL_BITS) & WHEEL_MASK];
+	} else if (delta < (1L << (3 * WHEEL_BITS))) {
+		slot = &wheel[2][(expires >> (2 * WHEEL_BITS)) & WHEEL_MASK];
+	} else {
+		if ((uint32_t)delta > MAX_DELAY) {
+			expires = current_tick + MAX_DELAY;
+			timer->expires = expires;
+		}
+		slot = &wheel[3][(expires >> (3 * WHEEL_BITS)) & WHEEL_MASK];
+	}
+
+	list_append(slot, timer);
+
+}
+
+// re-insert every timer of one upper level slot so it lands in a lower level
+static uint32_t cascade(uint32_t level, uint32_t index) {
+
+	struct swtimer list;
+	list_move(&wheel[level][index], &list);
+
+	while (list.next != &list) {
+		struct swtimer *timer = list.next;
+		list_remove(timer);
+		wheel_insert(timer);
+	}
+
+	return index;
+
+}
+
+// called by the TIM2 ISR once per tick
+static void swtimer_tick(void) {
+
+	uint32_t start = DWT->CYCCNT;
+	uint32_t index = current_tick & WHEEL_MASK;
+
+	if (index == 0 &&
+		cascade(1, (current_tick >> WHEEL_BITS) & WHEEL_MASK) == 0 &&
+		cascade(2, (current_tick >> (2 * WHEEL_BITS)) & WHEEL_MASK) == 0)
+		cascade(3, (current_tick >> (3 * WHEEL_BITS)) & WHEEL_MASK);
+
+	// detach the due slot first so callbacks can start and stop timers freely
+	// timers re-armed by the callbacks below land on the next tick or later
+	struct swtimer list;
+	list_move(&wheel[0][index], &list);
+	current_tick++;
+
+	while (list.next != &list) {
+		struct swtimer *timer = list.next;
+		list_remove(timer);
+		swtimer_stats.expired++;
+
+		if (timer->context == THREAD_CONTEXT) {
+			list_append(&pending, timer);
+			continue;
+		}
+
+		if (timer->period) {
+			timer->expires += timer->period;
+			wheel_insert(timer);
+		} else {
+			timer->active = 0;
+		}
+		timer->callback(timer->arg);
+	}
+
+	swtimer_stats.ticks++;
+
+	uint32_t cycles = DWT->CYCCNT - start;
+	if (cycles > swtimer_stats.max_tick_cycles)
+		swtimer_stats.max_tick_cycles = cycles;
+
+}
+
+/**
+ * Starts the timer wheel. Requires timebase_setup() to have been called.
+ *
+ * @param tick_us   Length of one wheel tick in microseconds, such as 1000
+ */
+void swtimer_setup(uint32_t tick_us) {
+
+	for (uint32_t level = 0; level < WHEEL_LEVELS; level++)
+		for (uint32_t slot = 0; slot < WHEEL_SIZE; slot++)
+			list_init(&wheel[level][slot]);
+	list_init(&pending);
+
+	timebase_set_tick_handler(&swtimer_tick, tick_us);
+
+}
+
+/**
+ * Prepares a timer for use.
+ *
+ * @param timer      The timer
+ * @param callback   Function called when the timer expires
+ * @param arg        Argument passed to the callback
+ * @param context    ISR_CONTEXT to call the callback from the tick ISR, or
+ *                   THREAD_CONTEXT to call it from swtimer_run_pending()
+ */
+void swtimer_init(struct swtimer *timer, void(*callback)(void *arg), void *arg, enum SWTIMER_CONTEXT context) {
+
+	list_init(timer);
+	timer->expires = 0;
+	timer->period = 0;
+	timer->callback = callback;
+	timer->arg = arg;
+	timer->context = context;
+	timer->active = 0;
+	timer->overruns = 0;
+
+}
+
+/**
+ * Arms a timer. Restarting an active timer reschedules it. O(1).
+ *
+ * @param timer          The timer
+ * @param delay_ticks    Ticks until the first expiry
+ * @param period_ticks   Ticks between expiries after the first, or 0 for a one-shot timer
+ */
+void swtimer_start(struct swtimer *timer, uint32_t delay_ticks, uint32_t period_ticks) {
+
+	uint32_t start = DWT->CYCCNT;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	list_remove(timer);
+	timer->expires = current_tick + delay_ticks;
+	timer->period = period_ticks;
+	timer->active = 1;
+	wheel_insert(timer);
+
+	__set_PRIMASK(primask);
+
+	uint32_t cycles = DWT->CYCCNT - start;
+	if (cycles > swtimer_stats.max_start_cycles)
+		swtimer_stats.max_start_cycles = cycles;
+
+}
+
+/**
+ * Disarms a timer, including one that has expired but not yet run. O(1).
+ *
+ * @param timer   The timer
+ */
+void swtimer_stop(struct swtimer *timer) {
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	list_remove(timer);
+	timer->active = 0;
+
+	__set_PRIMASK(primask);
+
+}
+
+/**
+ * @returns   Ticks since swtimer_setup()
+ */
+uint32_t swtimer_now(void) {
+
+	return current_tick;
+
+}
+
+/**
+ * Runs the callbacks of expired THREAD_CONTEXT timers. Call from the main loop.
+ */
+void swtimer_run_pending(void) {
+
+	while (1) {
+		__disable_irq();
+		struct swtimer *timer = pending.next;
+		if (timer == &pending) {
+			__enable_irq();
+			return;
+		}
+		list_remove(timer);
+
+		// periodic timers are re-armed relative to their previous expiry so they don't drift
+		if (timer->period) {
+			timer->expires += timer->period;
+			if ((int32_t)(timer->expires - current_tick) < 0) {
+				timer->expires = current_tick;
+				timer->overruns++;
+			}
+			wheel_insert(timer);
+		} else {
+			timer->active = 0;
+		}
+		__enable_irq();
+
+		timer->callback(timer->arg);
+	}
+
+}
+
+/**
+ * Sleeps with WFI until at least one THREAD_CONTEXT timer is waiting to run.
+ */
+void swtimer_wait(void) {
+
+	while (1) {
+		__disable_irq();
+		if (pending.next != &pending) {
+			__enable_irq();
+			return;
+		}
+		__WFI();
+		__enable_irq();
+	}
+
+}
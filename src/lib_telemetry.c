@@ -0,0 +1,268 @@
+// Telemetry multiplexer: logical channels with their own rate divider, priority
+// and share of every frame, packed together into frames that fill the UART's
+// DMA buffer.
+
+#include "lib_telemetry.h"
+#include "lib_uart.h"
+#include <string.h>
+
+#define FRAME_HEADER   5    // sync, type, sequence, payload length
+#define RECORD_HEADER  3    // channel id, length
+
+// the channel uart_send_bytes() is routed into
+static struct telemetry_channel *routed = 0;
+
+/**
+ * Prepares a multiplexer without channels.
+ *
+ * @param mux              The multiplexer
+ * @param frame_bytes      Size of every frame, up to TELEMETRY_MAX_FRAME. Send one frame per frame_bytes * 10 / baud seconds.
+ * @param stats_interval   Flushes between the channel counters, 0 for never
+ */
+void telemetry_init(struct telemetry *mux, uint16_t frame_bytes, uint16_t stats_interval) {
+
+	if (frame_bytes > TELEMETRY_MAX_FRAME) frame_bytes = TELEMETRY_MAX_FRAME;
+	if (frame_bytes < FRAME_HEADER + RECORD_HEADER + 2 + 1) frame_bytes = FRAME_HEADER + RECORD_HEADER + 2 + 1;
+
+	mux->channels = 0;
+	mux->frame_bytes = frame_bytes;
+	mux->stats_interval = stats_interval;
+	mux->since_stats = 0;
+	mux->sequence = 0;
+	mux->frames = 0;
+
+}
+
+/**
+ * Adds a channel.
+ *
+ * @param mux        The multiplexer
+ * @param channel    The channel
+ * @param id         1 to 255, unique
+ * @param name       Up to TELEMETRY_NAME_LENGTH characters, for the host
+ * @param storage    Queue storage, at least the size of the largest record plus 2
+ * @param size       Bytes of storage
+ * @param priority   0 is served first, channels of equal priority in the order they were added
+ * @param divider    Keeps 1 of every divider records, 1 keeps them all
+ * @param share      Bytes of every frame reserved for the channel, at least its largest record plus 3 to be guaranteed
+ */
+void telemetry_add_channel(struct telemetry *mux, struct telemetry_channel *channel, uint8_t id, const char *name, uint8_t *storage, uint16_t size, uint8_t priority, uint16_t divider, uint16_t share) {
+
+	channel->id = id;
+	strncpy(channel->name, name, TELEMETRY_NAME_LENGTH);
+	channel->priority = priority;
+	channel->divider = divider < 1 ? 1 : divider;
+	channel->share = share;
+	channel->phase = 0;
+	channel->max_record = mux->frame_bytes - FRAME_HEADER - RECORD_HEADER - 2;
+	channel->storage = storage;
+	channel->size = size;
+	channel->head = 0;
+	channel->tail = 0;
+	channel->offered = 0;
+	channel->decimated = 0;
+	channel->dropped = 0;
+	channel->sent = 0;
+	channel->sent_bytes = 0;
+
+	// insert after every channel of the same or a higher priority
+	struct telemetry_channel **link = &mux->channels;
+	while (*link && (*link)->priority <= priority)
+		link = &(*link)->next;
+	channel->next = *link;
+	*link = channel;
+
+}
+
+// copies into the queue, wrapping around the end of the storage
+static void telemetry_queue_write(struct telemetry_channel *channel, const void *data, uint16_t length) {
+
+	uint16_t start = channel->head % channel->size;
+	uint16_t first = channel->size - start < length ? channel->size - start : length;
+	memcpy(&channel->storage[start], data, first);
+	memcpy(channel->storage, (const uint8_t *) data + first, length - first);
+	channel->head += length;
+
+}
+
+// copies out of the queue without removing anything
+static void telemetry_queue_read(const struct telemetry_channel *channel, uint32_t offset, void *data, uint16_t length) {
+
+	uint16_t start = (channel->tail + offset) % channel->size;
+	uint16_t first = channel->size - start < length ? channel->size - start : length;
+	memcpy(data, &channel->storage[start], first);
+	memcpy((uint8_t *) data + first, channel->storage, length - first);
+
+}
+
+/**
+ * Offers a record to a channel.
+ *
+ * @param channel   The channel
+ * @param data      The record
+ * @param length    Bytes in the record
+ * @returns         1 if queued, 0 if skipped by the divider or dropped
+ */
+uint8_t telemetry_write(struct telemetry_channel *channel, const void *data, uint16_t length) {
+
+	channel->offered++;
+
+	if (channel->phase > 0) {
+		channel->phase--;
+		channel->decimated++;
+		return 0;
+	}
+	channel->phase = channel->divider - 1;
+
+	if (length > channel->max_record || channel->head - channel->tail + 2 + length > channel->size) {
+		channel->dropped++;
+		return 0;
+	}
+
+	telemetry_queue_write(channel, &length, 2);
+	telemetry_queue_write(channel, data, length);
+	return 1;
+
+}
+
+/**
+ * Offers a line of text to a channel, without the terminating null.
+ *
+ * @param channel   The channel
+ * @param text      The text
+ * @returns         1 if queued, 0 if skipped by the divider or dropped
+ */
+uint8_t telemetry_log(struct telemetry_channel *channel, const char *text) {
+
+	return telemetry_write(channel, text, strlen(text));
+
+}
+
+static void telemetry_route_handler(const void *data, uint32_t length) {
+
+	telemetry_write(routed, data, length > 0xFFFF ? 0xFFFF : length);
+
+}
+
+/**
+ * Routes uart_send_bytes() into a channel, each call becoming one record, until
+ * telemetry_route(0) sends to the UART again.
+ *
+ * @param channel   The channel, or 0 to stop routing
+ */
+void telemetry_route(struct telemetry_channel *channel) {
+
+	routed = channel;
+	uart_redirect(channel ? &telemetry_route_handler : 0);
+
+}
+
+// moves whole records of a channel into the frame while they fit in allowance bytes, returns the bytes used
+static uint16_t telemetry_take(struct telemetry *mux, struct telemetry_channel *channel, uint32_t *n, uint16_t allowance, uint16_t *records) {
+
+	uint16_t used = 0;
+
+	while (channel->head != channel->tail) {
+
+		uint16_t length;
+		telemetry_queue_read(channel, 0, &length, 2);
+		if (used + RECORD_HEADER + length > allowance)
+			break;
+
+		mux->frame[(*n)++] = channel->id;
+		memcpy(&mux->frame[*n], &length, 2);                 *n += 2;
+		telemetry_queue_read(channel, 2, &mux->frame[*n], length);
+		*n += length;
+		channel->tail += 2 + length;
+
+		used += RECORD_HEADER + length;
+		channel->sent++;
+		channel->sent_bytes += length;
+		(*records)++;
+
+	}
+
+	return used;
+
+}
+
+// adds the counters of every channel as a record on TELEMETRY_STATS_CHANNEL, as many channels as fit
+static uint16_t telemetry_add_stats(struct telemetry *mux, uint32_t *n, uint16_t allowance) {
+
+	const uint16_t entry = 1 + TELEMETRY_NAME_LENGTH + 4 * 4;
+	if (allowance < RECORD_HEADER + 4)
+		return 0;
+
+	uint32_t start = *n;
+	uint16_t length = 4;
+	mux->frame[(*n)++] = TELEMETRY_STATS_CHANNEL;
+	*n += 2;
+	memcpy(&mux->frame[*n], &mux->frames, 4);                *n += 4;
+
+	for (struct telemetry_channel *channel = mux->channels; channel; channel = channel->next) {
+		if (RECORD_HEADER + length + entry > allowance)
+			break;
+		mux->frame[(*n)++] = channel->id;
+		memcpy(&mux->frame[*n], channel->name, TELEMETRY_NAME_LENGTH);  *n += TELEMETRY_NAME_LENGTH;
+		memcpy(&mux->frame[*n], &channel->offered, 4);                  *n += 4;
+		memcpy(&mux->frame[*n], &channel->decimated, 4);                *n += 4;
+		memcpy(&mux->frame[*n], &channel->dropped, 4);                  *n += 4;
+		memcpy(&mux->frame[*n], &channel->sent, 4);                     *n += 4;
+		length += entry;
+	}
+
+	memcpy(&mux->frame[start + 1], &length, 2);
+	return RECORD_HEADER + length;
+
+}
+
+/**
+ * Packs queued records into a frame and sends it, see tools/telemetry_demux.py.
+ * Waits for the previous frame to finish, so call it about as often as a frame takes.
+ *
+ * @param mux   The multiplexer
+ * @returns     Number of records sent
+ */
+uint16_t telemetry_flush(struct telemetry *mux) {
+
+	uint16_t records = 0;
+	uint16_t space = mux->frame_bytes - FRAME_HEADER - 2;
+	uint32_t n = FRAME_HEADER;
+
+	if (mux->stats_interval && ++mux->since_stats >= mux->stats_interval) {
+		mux->since_stats = 0;
+		space -= telemetry_add_stats(mux, &n, space);
+		records++;
+	}
+
+	// first every channel's share, then whatever is left, both in priority order
+	for (struct telemetry_channel *channel = mux->channels; channel; channel = channel->next)
+		space -= telemetry_take(mux, channel, &n, channel->share < space ? channel->share : space, &records);
+	for (struct telemetry_channel *channel = mux->channels; channel; channel = channel->next)
+		space -= telemetry_take(mux, channel, &n, space, &records);
+
+	if (records == 0)
+		return 0;
+
+	uint16_t payload = n - FRAME_HEADER;
+	mux->frame[0] = 0xA5;
+	mux->frame[1] = 0x5C;
+	mux->frame[2] = mux->sequence++;
+	memcpy(&mux->frame[3], &payload, 2);
+
+	uint16_t checksum = 0;
+	for (uint32_t j = 2; j < n; j++)
+		checksum += mux->frame[j];
+	mux->frame[n++] = checksum & 0xFF;
+	mux->frame[n++] = checksum >> 8;
+
+	// the frame itself must not be routed into a channel
+	struct telemetry_channel *route = routed;
+	telemetry_route(0);
+	uart_send_bytes(mux->frame, n);
+	telemetry_route(route);
+
+	mux->frames++;
+	return records;
+
+}
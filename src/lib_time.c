@@ -1,5 +1,13 @@
 #include "lib_time.h"
 
+struct sleep_stats sleep_stats = { 0 };
+struct sleep_stats sleep_busy_stats = { 0 };
+static uint8_t timebase_running = 0;
+static volatile uint32_t compare_cycles = 0;
+static volatile uint8_t compare_fired = 0;
+static void(*tick_handler)(void) = 0;
+static uint32_t tick_period = 0;
+
 void EnableCycles()
 {
 	//Uses Cortex-M debugger to count raw CPU cycles
@@ -17,23 +25,154 @@ void EnableCycles()
 
 void sleepUs(uint32_t uS)
 {
-	volatile uint32_t elapsedUs;
 	//If requested sleep is more than the max,
 	//set it as max and give it some buffer
 	if (uS > maxUsSleep) uS = maxUsSleep - 100;
-	elapsedUs = DWT->CYCCNT = 0;
-	while (uS > elapsedUs)
-	{
-		elapsedUs = DWT->CYCCNT / cyclesPerUs;
-	}
+	//CYCCNT is left free running so other code can use it for timing
+	uint32_t start = DWT->CYCCNT;
+	uint32_t cycles = uS * cyclesPerUs;
+	while ((DWT->CYCCNT - start) < cycles)
+		;
 }
 
-void sleepMs(uint32_t mS)
+static void sleep_record_error(struct sleep_stats *stats, int32_t error)
 {
+	stats->sleeps++;
+	stats->last_error_us = error;
+	if (error > stats->max_error_us)
+		stats->max_error_us = error;
+}
+
+void sleepMsBusy(uint32_t mS)
+{
+	//each millisecond is timed on its own, so the cycle counter never wraps in between
+	uint64_t elapsedCycles = 0;
 	uint32_t elapsedMs;
 	elapsedMs = 0;
 	while (elapsedMs++ < mS)
 	{
+		uint32_t start = DWT->CYCCNT;
 		sleepUs(1000);
+		elapsedCycles += DWT->CYCCNT - start;
+	}
+
+	if (cyclesPerUs)
+		sleep_record_error(&sleep_busy_stats, (int32_t)(elapsedCycles / cyclesPerUs - (uint64_t) mS * 1000));
+}
+
+void timebase_setup(void)
+{
+	//TIM2 is on APB1. Timer clocks run at twice PCLK1 when APB1 is divided.
+	uint32_t ppre1 = APBPrescTable[(RCC->CFGR & RCC_CFGR_PPRE1) >> RCC_CFGR_PPRE1_Pos];
+	uint32_t timclk = SystemCoreClock >> ppre1;
+	if (ppre1 != 0)
+		timclk *= 2;
+
+	//enable clock, then reset
+	RCC->APB1ENR |= RCC_APB1ENR_TIM2EN;
+	RCC->APB1RSTR |= RCC_APB1RSTR_TIM2RST;
+	RCC->APB1RSTR &= ~RCC_APB1RSTR_TIM2RST;
+
+	//1MHz, free running over the full 32bit range
+	TIM2->PSC = (timclk / 1000000) - 1;
+	TIM2->ARR = 0xFFFFFFFF;
+	TIM2->EGR = TIM_EGR_UG;
+	TIM2->SR = 0;
+	TIM2->CR1 = TIM_CR1_CEN;
+
+	NVIC_EnableIRQ(TIM2_IRQn);
+	timebase_running = 1;
+}
+
+void timebase_set_tick_handler(void(*handler)(void), uint32_t period_us)
+{
+	TIM2->DIER &= ~TIM_DIER_CC2IE;
+	tick_handler = handler;
+	tick_period = period_us;
+	TIM2->CCR2 = TIM2->CNT + period_us;
+	TIM2->SR = ~TIM_SR_CC2IF;
+	if (handler)
+		TIM2->DIER |= TIM_DIER_CC2IE;
+}
+
+void timebase_set_wakeup(uint32_t deadline_us)
+{
+	TIM2->CCR1 = deadline_us;
+	TIM2->SR = ~TIM_SR_CC1IF;
+	compare_fired = 0;
+	TIM2->DIER |= TIM_DIER_CC1IE;
+}
+
+uint32_t time_now_us(void)
+{
+	return TIM2->CNT;
+}
+
+void sleepMs(uint32_t mS)
+{
+	if (!timebase_running) {
+		sleepMsBusy(mS);
+		return;
+	}
+
+	//keep each compare well inside the signed 32bit range
+	while (mS > 1000000) {
+		sleepMs(1000000);
+		mS -= 1000000;
+	}
+
+	uint32_t deadline = TIM2->CNT + mS * 1000;
+	timebase_set_wakeup(deadline);
+
+	//interrupts are masked while checking the deadline so a compare that fires
+	//between the check and WFI still wakes us up. Pending ISRs run as soon as
+	//interrupts are unmasked again.
+	while (1) {
+		__disable_irq();
+		if ((int32_t)(deadline - TIM2->CNT) <= 0) {
+			__enable_irq();
+			break;
+		}
+		__WFI();
+		__enable_irq();
+		sleep_stats.wakeups++;
+	}
+
+	uint32_t now_cycles = DWT->CYCCNT;
+	TIM2->DIER &= ~TIM_DIER_CC1IE;
+
+	sleep_record_error(&sleep_stats, (int32_t)(TIM2->CNT - deadline));
+
+	if (compare_fired) {
+		uint32_t latency = now_cycles - compare_cycles;
+		sleep_stats.last_wake_latency = latency;
+		if (latency > sleep_stats.max_wake_latency)
+			sleep_stats.max_wake_latency = latency;
+	}
+}
+
+/**
+ * ISR for TIM2. CC1 is the sleepMs() deadline, CC2 is the periodic tick.
+ */
+void TIM2_IRQHandler(void)
+{
+	//the flags of both channels get set on every compare match, enabled or not
+	uint32_t status = TIM2->SR & TIM2->DIER;
+
+	if (status & TIM_SR_CC1IF) {
+		compare_cycles = DWT->CYCCNT;
+		compare_fired = 1;
+		TIM2->SR = ~TIM_SR_CC1IF;
+	}
+
+	//one call per period. If the ISR was held up for longer than a period the
+	//missed ticks are caught up here, otherwise CCR2 would fall behind CNT and
+	//the next compare would only come after the counter wraps around.
+	if (status & TIM_SR_CC2IF) {
+		do {
+			TIM2->SR = ~TIM_SR_CC2IF;
+			TIM2->CCR2 += tick_period;
+			tick_handler();
+		} while ((int32_t)(TIM2->CNT - TIM2->CCR2) >= 0);
 	}
 }
@@ -11,6 +11,7 @@
 static USART_TypeDef *usart;
 static char uart_tx_buffer[1024] = { 0 };
 static uint32_t i = 0;
+static void (*redirect)(const void *data, uint32_t length) = 0;
 
 /**
  * Setup one of the USARTs for TX-only communication via DMA.
@@ -142,6 +143,44 @@ void uart_send_bin_floats(uint8_t count, float first_value, ...) {
 
 }
 
+/**
+ * Transmit raw bytes via DMA. Waits for the previous transfer to finish before copying them into the TX buffer.
+ *
+ * @param data     Bytes to send
+ * @param length   Number of bytes, at most 1024
+ */
+void uart_send_bytes(const void *data, uint32_t length) {
+
+	if (redirect) {
+		redirect(data, length);
+		return;
+	}
+
+	if (length > sizeof(uart_tx_buffer))
+		length = sizeof(uart_tx_buffer);
+
+	// the DMA may still be reading the buffer
+	while((usart->SR & USART_SR_TC) == 0);
+
+	memcpy(uart_tx_buffer, data, length);
+	i = length;
+
+	uart_tx_via_dma();
+
+}
+
+/**
+ * Hands everything given to uart_send_bytes() to a handler instead of sending it,
+ * such as to queue the frames of a module in a telemetry channel (see lib_telemetry.h).
+ *
+ * @param handler   Pointer to the handler, or 0 to send again
+ */
+void uart_redirect(void (*handler)(const void *data, uint32_t length)) {
+
+	redirect = handler;
+
+}
+
 /**
  * Effectively empties the TX buffer by placing a null character at position zero and resetting the pointer.
  */
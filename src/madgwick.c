@@ -0,0 +1,255 @@
+// Madgwick's gradient descent orientation filter, single precision only.
+//
+// Based on S. Madgwick, "An efficient orientation filter for inertial and
+// inertial/magnetic sensor arrays", 2010. Every constant is a float literal so
+// the FPv4-SP FPU is never asked to do double precision math.
+
+#include "madgwick.h"
+#include "stm32f429xx.h"
+#include <math.h>
+
+struct madgwick_stats madgwick_stats = { 0 };
+
+/**
+ * Approximate 1 / sqrt(x), relative error below 0.1%. Much cheaper than
+ * 1.0f / sqrtf(x), which needs both a VSQRT and a VDIV.
+ */
+float inv_sqrt(float x) {
+
+	// magic constant and tuned Newton step from J. Kadlec
+	union { float f; uint32_t i; } conversion = { x };
+	conversion.i = 0x5F1F1412 - (conversion.i >> 1);
+	float y = conversion.f;
+	return y * (1.69000231f - 0.714158168f * x * y * y);
+
+}
+
+/**
+ * Resets the filter to the identity orientation.
+ *
+ * @param filter           The filter
+ * @param sample_rate_hz   Rate at which the update functions will be called
+ * @param beta             Correction gain. 0.1 is a reasonable start; higher converges faster but is noisier.
+ */
+void madgwick_init(struct madgwick *filter, float sample_rate_hz, float beta) {
+
+	filter->q0 = 1.0f;
+	filter->q1 = 0.0f;
+	filter->q2 = 0.0f;
+	filter->q3 = 0.0f;
+	filter->beta = beta;
+	filter->sample_period = 1.0f / sample_rate_hz;
+
+}
+
+/**
+ * Updates the orientation from gyro and accelerometer readings.
+ *
+ * @param filter       The filter
+ * @param gx, gy, gz   Angular rate in radians per second
+ * @param ax, ay, az   Acceleration in any unit, only the direction is used
+ */
+void madgwick_update_imu(struct madgwick *filter, float gx, float gy, float gz, float ax, float ay, float az) {
+
+	float q0 = filter->q0, q1 = filter->q1, q2 = filter->q2, q3 = filter->q3;
+
+	// rate of change of the quaternion from the gyro
+	float qdot0 = 0.5f * (-q1 * gx - q2 * gy - q3 * gz);
+	float qdot1 = 0.5f * ( q0 * gx + q2 * gz - q3 * gy);
+	float qdot2 = 0.5f * ( q0 * gy - q1 * gz + q3 * gx);
+	float qdot3 = 0.5f * ( q0 * gz + q1 * gy - q2 * gx);
+
+	// correction step, skipped if the accelerometer reading is invalid
+	if (!(ax == 0.0f && ay == 0.0f && az == 0.0f)) {
+
+		float norm = inv_sqrt(ax * ax + ay * ay + az * az);
+		ax *= norm;
+		ay *= norm;
+		az *= norm;
+
+		float _2q0 = 2.0f * q0;
+		float _2q1 = 2.0f * q1;
+		float _2q2 = 2.0f * q2;
+		float _2q3 = 2.0f * q3;
+		float _4q0 = 4.0f * q0;
+		float _4q1 = 4.0f * q1;
+		float _4q2 = 4.0f * q2;
+		float _8q1 = 8.0f * q1;
+		float _8q2 = 8.0f * q2;
+		float q0q0 = q0 * q0;
+		float q1q1 = q1 * q1;
+		float q2q2 = q2 * q2;
+		float q3q3 = q3 * q3;
+
+		// gradient of the objective function
+		float s0 = _4q0 * q2q2 + _2q2 * ax + _4q0 * q1q1 - _2q1 * ay;
+		float s1 = _4q1 * q3q3 - _2q3 * ax + 4.0f * q0q0 * q1 - _2q0 * ay - _4q1 + _8q1 * q1q1 + _8q1 * q2q2 + _4q1 * az;
+		float s2 = 4.0f * q0q0 * q2 + _2q0 * ax + _4q2 * q3q3 - _2q3 * ay - _4q2 + _8q2 * q1q1 + _8q2 * q2q2 + _4q2 * az;
+		float s3 = 4.0f * q1q1 * q3 - _2q1 * ax + 4.0f * q2q2 * q3 - _2q2 * ay;
+
+		float step = s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3;
+		if (step > 0.0f) {
+			norm = filter->beta * inv_sqrt(step);
+			qdot0 -= norm * s0;
+			qdot1 -= norm * s1;
+			qdot2 -= norm * s2;
+			qdot3 -= norm * s3;
+		}
+
+	}
+
+	// integrate and normalize
+	q0 += qdot0 * filter->sample_period;
+	q1 += qdot1 * filter->sample_period;
+	q2 += qdot2 * filter->sample_period;
+	q3 += qdot3 * filter->sample_period;
+
+	float norm = inv_sqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+	filter->q0 = q0 * norm;
+	filter->q1 = q1 * norm;
+	filter->q2 = q2 * norm;
+	filter->q3 = q3 * norm;
+
+}
+
+/**
+ * Updates the orientation from gyro, accelerometer and magnetometer readings.
+ * Falls back to madgwick_update_imu() if the magnetometer reading is all zeros.
+ *
+ * @param filter       The filter
+ * @param gx, gy, gz   Angular rate in radians per second
+ * @param ax, ay, az   Acceleration in any unit, only the direction is used
+ * @param mx, my, mz   Magnetic field in any unit, only the direction is used
+ */
+void madgwick_update_marg(struct madgwick *filter, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz) {
+
+	if (mx == 0.0f && my == 0.0f && mz == 0.0f) {
+		madgwick_update_imu(filter, gx, gy, gz, ax, ay, az);
+		return;
+	}
+
+	float q0 = filter->q0, q1 = filter->q1, q2 = filter->q2, q3 = filter->q3;
+
+	// rate of change of the quaternion from the gyro
+	float qdot0 = 0.5f * (-q1 * gx - q2 * gy - q3 * gz);
+	float qdot1 = 0.5f * ( q0 * gx + q2 * gz - q3 * gy);
+	float qdot2 = 0.5f * ( q0 * gy - q1 * gz + q3 * gx);
+	float qdot3 = 0.5f * ( q0 * gz + q1 * gy - q2 * gx);
+
+	// correction step, skipped if the accelerometer reading is invalid
+	if (!(ax == 0.0f && ay == 0.0f && az == 0.0f)) {
+
+		float norm = inv_sqrt(ax * ax + ay * ay + az * az);
+		ax *= norm;
+		ay *= norm;
+		az *= norm;
+
+		norm = inv_sqrt(mx * mx + my * my + mz * mz);
+		mx *= norm;
+		my *= norm;
+		mz *= norm;
+
+		float _2q0mx = 2.0f * q0 * mx;
+		float _2q0my = 2.0f * q0 * my;
+		float _2q0mz = 2.0f * q0 * mz;
+		float _2q1mx = 2.0f * q1 * mx;
+		float _2q0 = 2.0f * q0;
+		float _2q1 = 2.0f * q1;
+		float _2q2 = 2.0f * q2;
+		float _2q3 = 2.0f * q3;
+		float _2q0q2 = 2.0f * q0 * q2;
+		float _2q2q3 = 2.0f * q2 * q3;
+		float q0q0 = q0 * q0;
+		float q0q1 = q0 * q1;
+		float q0q2 = q0 * q2;
+		float q0q3 = q0 * q3;
+		float q1q1 = q1 * q1;
+		float q1q2 = q1 * q2;
+		float q1q3 = q1 * q3;
+		float q2q2 = q2 * q2;
+		float q2q3 = q2 * q3;
+		float q3q3 = q3 * q3;
+
+		// reference direction of the earth's magnetic field
+		float hx = mx * q0q0 - _2q0my * q3 + _2q0mz * q2 + mx * q1q1 + _2q1 * my * q2 + _2q1 * mz * q3 - mx * q2q2 - mx * q3q3;
+		float hy = _2q0mx * q3 + my * q0q0 - _2q0mz * q1 + _2q1mx * q2 - my * q1q1 + my * q2q2 + _2q2 * mz * q3 - my * q3q3;
+		float _2bx = sqrtf(hx * hx + hy * hy);
+		float _2bz = -_2q0mx * q2 + _2q0my * q1 + mz * q0q0 + _2q1mx * q3 - mz * q1q1 + _2q2 * my * q3 - mz * q2q2 + mz * q3q3;
+		float _4bx = 2.0f * _2bx;
+		float _4bz = 2.0f * _2bz;
+
+		// errors between the measured and expected directions
+		float fa_x = 2.0f * q1q3 - _2q0q2 - ax;
+		float fa_y = 2.0f * q0q1 + _2q2q3 - ay;
+		float fa_z = 1.0f - 2.0f * q1q1 - 2.0f * q2q2 - az;
+		float fm_x = _2bx * (0.5f - q2q2 - q3q3) + _2bz * (q1q3 - q0q2) - mx;
+		float fm_y = _2bx * (q1q2 - q0q3) + _2bz * (q0q1 + q2q3) - my;
+		float fm_z = _2bx * (q0q2 + q1q3) + _2bz * (0.5f - q1q1 - q2q2) - mz;
+
+		// gradient of the objective function
+		float s0 = -_2q2 * fa_x + _2q1 * fa_y - _2bz * q2 * fm_x + (-_2bx * q3 + _2bz * q1) * fm_y + _2bx * q2 * fm_z;
+		float s1 = _2q3 * fa_x + _2q0 * fa_y - 4.0f * q1 * fa_z + _2bz * q3 * fm_x + (_2bx * q2 + _2bz * q0) * fm_y + (_2bx * q3 - _4bz * q1) * fm_z;
+		float s2 = -_2q0 * fa_x + _2q3 * fa_y - 4.0f * q2 * fa_z + (-_4bx * q2 - _2bz * q0) * fm_x + (_2bx * q1 + _2bz * q3) * fm_y + (_2bx * q0 - _4bz * q2) * fm_z;
+		float s3 = _2q1 * fa_x + _2q2 * fa_y + (-_4bx * q3 + _2bz * q1) * fm_x + (-_2bx * q0 + _2bz * q2) * fm_y + _2bx * q1 * fm_z;
+
+		float step = s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3;
+		if (step > 0.0f) {
+			norm = filter->beta * inv_sqrt(step);
+			qdot0 -= norm * s0;
+			qdot1 -= norm * s1;
+			qdot2 -= norm * s2;
+			qdot3 -= norm * s3;
+		}
+
+	}
+
+	// integrate and normalize
+	q0 += qdot0 * filter->sample_period;
+	q1 += qdot1 * filter->sample_period;
+	q2 += qdot2 * filter->sample_period;
+	q3 += qdot3 * filter->sample_period;
+
+	float norm = inv_sqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+	filter->q0 = q0 * norm;
+	filter->q1 = q1 * norm;
+	filter->q2 = q2 * norm;
+	filter->q3 = q3 * norm;
+
+}
+
+/**
+ * Runs one update per sample of a block, timing each update. The sample period
+ * is taken from the block.
+ *
+ * @param filter            The filter
+ * @param block             The samples
+ * @param use_magnetometer  Nonzero for MARG updates, 0 for IMU updates
+ */
+void madgwick_update_block(struct madgwick *filter, const struct imu_block *block, uint8_t use_magnetometer) {
+
+	// the sample rate may have been changed by the producer
+	filter->sample_period = block->sample_period_us * 1e-6f;
+
+	for (uint16_t n = 0; n < block->count; n++) {
+
+		uint32_t start = DWT->CYCCNT;
+
+		if (use_magnetometer)
+			madgwick_update_marg(filter,
+				block->value[IMU_GYRO_X][n],  block->value[IMU_GYRO_Y][n],  block->value[IMU_GYRO_Z][n],
+				block->value[IMU_ACCEL_X][n], block->value[IMU_ACCEL_Y][n], block->value[IMU_ACCEL_Z][n],
+				block->value[IMU_MAGN_X][n],  block->value[IMU_MAGN_Y][n],  block->value[IMU_MAGN_Z][n]);
+		else
+			madgwick_update_imu(filter,
+				block->value[IMU_GYRO_X][n],  block->value[IMU_GYRO_Y][n],  block->value[IMU_GYRO_Z][n],
+				block->value[IMU_ACCEL_X][n], block->value[IMU_ACCEL_Y][n], block->value[IMU_ACCEL_Z][n]);
+
+		uint32_t cycles = DWT->CYCCNT - start;
+		madgwick_stats.updates++;
+		madgwick_stats.last_cycles = cycles;
+		if (cycles > madgwick_stats.max_cycles)
+			madgwick_stats.max_cycles = cycles;
+
+	}
+
+}
@@ -0,0 +1,165 @@
+// Mahony's nonlinear complementary (PI) orientation filter, single precision only.
+//
+// Based on R. Mahony et al., "Nonlinear Complementary Filters on the Special
+// Orthogonal Group", 2008. The error between the measured and estimated
+// reference directions drives a PI correction of the gyro rate.
+
+#include "mahony.h"
+#include "madgwick.h"
+#include <math.h>
+
+/**
+ * Resets the filter to the identity orientation.
+ *
+ * @param filter           The filter
+ * @param sample_rate_hz   Rate at which the update functions will be called
+ * @param kp               Proportional gain, such as 1.0
+ * @param ki               Integral gain, such as 0.0 or 0.01
+ */
+void mahony_init(struct mahony *filter, float sample_rate_hz, float kp, float ki) {
+
+	filter->q0 = 1.0f;
+	filter->q1 = 0.0f;
+	filter->q2 = 0.0f;
+	filter->q3 = 0.0f;
+	filter->kp = kp;
+	filter->ki = ki;
+	filter->integral_x = 0.0f;
+	filter->integral_y = 0.0f;
+	filter->integral_z = 0.0f;
+	filter->sample_period = 1.0f / sample_rate_hz;
+
+}
+
+// applies the PI correction for an error vector, then integrates the corrected rate
+static void mahony_integrate(struct mahony *filter, float gx, float gy, float gz, float ex, float ey, float ez) {
+
+	float dt = filter->sample_period;
+
+	if (filter->ki > 0.0f) {
+		filter->integral_x += filter->ki * ex * dt;
+		filter->integral_y += filter->ki * ey * dt;
+		filter->integral_z += filter->ki * ez * dt;
+		gx += filter->integral_x;
+		gy += filter->integral_y;
+		gz += filter->integral_z;
+	}
+
+	gx += filter->kp * ex;
+	gy += filter->kp * ey;
+	gz += filter->kp * ez;
+
+	gx *= 0.5f * dt;
+	gy *= 0.5f * dt;
+	gz *= 0.5f * dt;
+
+	float q0 = filter->q0, q1 = filter->q1, q2 = filter->q2, q3 = filter->q3;
+	q0 += -q1 * gx - q2 * gy - q3 * gz;
+	q1 +=  filter->q0 * gx + q2 * gz - q3 * gy;
+	q2 +=  filter->q0 * gy - filter->q1 * gz + q3 * gx;
+	q3 +=  filter->q0 * gz + filter->q1 * gy - filter->q2 * gx;
+
+	float norm = inv_sqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+	filter->q0 = q0 * norm;
+	filter->q1 = q1 * norm;
+	filter->q2 = q2 * norm;
+	filter->q3 = q3 * norm;
+
+}
+
+/**
+ * Updates the orientation from gyro and accelerometer readings.
+ *
+ * @param filter       The filter
+ * @param gx, gy, gz   Angular rate in radians per second
+ * @param ax, ay, az   Acceleration in any unit, only the direction is used
+ */
+void mahony_update_imu(struct mahony *filter, float gx, float gy, float gz, float ax, float ay, float az) {
+
+	float ex = 0.0f, ey = 0.0f, ez = 0.0f;
+
+	if (!(ax == 0.0f && ay == 0.0f && az == 0.0f)) {
+
+		float norm = inv_sqrt(ax * ax + ay * ay + az * az);
+		ax *= norm;
+		ay *= norm;
+		az *= norm;
+
+		float q0 = filter->q0, q1 = filter->q1, q2 = filter->q2, q3 = filter->q3;
+
+		// estimated direction of gravity, halved
+		float vx = q1 * q3 - q0 * q2;
+		float vy = q0 * q1 + q2 * q3;
+		float vz = q0 * q0 - 0.5f + q3 * q3;
+
+		// error is the cross product of measured and estimated direction
+		ex = ay * vz - az * vy;
+		ey = az * vx - ax * vz;
+		ez = ax * vy - ay * vx;
+
+	}
+
+	mahony_integrate(filter, gx, gy, gz, ex, ey, ez);
+
+}
+
+/**
+ * Updates the orientation from gyro, accelerometer and magnetometer readings.
+ * Falls back to mahony_update_imu() if the magnetometer reading is all zeros.
+ *
+ * @param filter       The filter
+ * @param gx, gy, gz   Angular rate in radians per second
+ * @param ax, ay, az   Acceleration in any unit, only the direction is used
+ * @param mx, my, mz   Magnetic field in any unit, only the direction is used
+ */
+void mahony_update_marg(struct mahony *filter, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz) {
+
+	if ((mx == 0.0f && my == 0.0f && mz == 0.0f) || (ax == 0.0f && ay == 0.0f && az == 0.0f)) {
+		mahony_update_imu(filter, gx, gy, gz, ax, ay, az);
+		return;
+	}
+
+	float norm = inv_sqrt(ax * ax + ay * ay + az * az);
+	ax *= norm;
+	ay *= norm;
+	az *= norm;
+
+	norm = inv_sqrt(mx * mx + my * my + mz * mz);
+	mx *= norm;
+	my *= norm;
+	mz *= norm;
+
+	float q0 = filter->q0, q1 = filter->q1, q2 = filter->q2, q3 = filter->q3;
+	float q0q0 = q0 * q0;
+	float q0q1 = q0 * q1;
+	float q0q2 = q0 * q2;
+	float q0q3 = q0 * q3;
+	float q1q1 = q1 * q1;
+	float q1q2 = q1 * q2;
+	float q1q3 = q1 * q3;
+	float q2q2 = q2 * q2;
+	float q2q3 = q2 * q3;
+	float q3q3 = q3 * q3;
+
+	// reference direction of the earth's magnetic field
+	float hx = 2.0f * (mx * (0.5f - q2q2 - q3q3) + my * (q1q2 - q0q3) + mz * (q1q3 + q0q2));
+	float hy = 2.0f * (mx * (q1q2 + q0q3) + my * (0.5f - q1q1 - q3q3) + mz * (q2q3 - q0q1));
+	float bx = sqrtf(hx * hx + hy * hy);
+	float bz = 2.0f * (mx * (q1q3 - q0q2) + my * (q2q3 + q0q1) + mz * (0.5f - q1q1 - q2q2));
+
+	// estimated direction of gravity and magnetic field, halved
+	float vx = q1q3 - q0q2;
+	float vy = q0q1 + q2q3;
+	float vz = q0q0 - 0.5f + q3q3;
+	float wx = bx * (0.5f - q2q2 - q3q3) + bz * (q1q3 - q0q2);
+	float wy = bx * (q1q2 - q0q3) + bz * (q0q1 + q2q3);
+	float wz = bx * (q0q2 + q1q3) + bz * (0.5f - q1q1 - q2q2);
+
+	// error is the sum of the cross products of measured and estimated directions
+	float ex = (ay * vz - az * vy) + (my * wz - mz * wy);
+	float ey = (az * vx - ax * vz) + (mz * wx - mx * wz);
+	float ez = (ax * vy - ay * vx) + (mx * wy - my * wx);
+
+	mahony_integrate(filter, gx, gy, gz, ex, ey, ez);
+
+}
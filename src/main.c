@@ -45,17 +45,456 @@
 #include "mpu6050.h"
 #include "lib_uart.h"
 #include "lib_time.h"
+#include "lib_exec.h"
+#include "lib_swtimer.h"
+#include "lib_kernel.h"
+#include "lib_prof.h"
+#include "lib_exti.h"
+#include "fusion.h"
+#include "imu_spectrum.h"
+#include "imu_stats.h"
+#include "imu_capture.h"
+#include "imu_stream.h"
+#include "imu_pack.h"
+#include "imu_orient.h"
+#include "lib_telemetry.h"
+#include "imu_decimate.h"
+#include "imu_align.h"
+#include "lib_defer.h"
 
-extern I2C_TypeDef *i2c;
+static struct mpu6050 imu;
+static struct exec_task sensor_task;
+static struct swtimer led_timer;
+static struct exec_task profile_task;
+static struct exec_task calibration_task;
+static struct fusion fusion;
+#ifdef SPECTRUM_MODE
+static struct imu_spectrum spectrum;
+static struct exec_task spectrum_task;
+static struct exec_task spectrum_send_task;
+static const struct imu_spectrum_result *spectrum_result;
+static uint16_t spectrum_next_bin;
+#endif
+#ifdef STATS_MODE
+static struct imu_stats stats;
+#endif
+#ifdef CAPTURE_MODE
+static struct imu_capture capture;
+static struct imu_capture_sample capture_ring[2560] IMU_CAPTURE_CCMRAM;
+static struct exec_task capture_task;
+#endif
+#ifdef STREAM_MODE
+static struct exec_task jitter_task;
+#endif
+#ifdef PACK_MODE
+static struct imu_pack pack;
+#endif
+#ifdef ORIENT_MODE
+static struct imu_orient orient;
+#endif
+#ifdef MUX_MODE
+static struct imu_orient orient;
+static struct imu_pack pack;
+static struct imu_stats stats;
+static struct telemetry telemetry;
+static struct telemetry_channel attitude_channel, raw_channel, stats_channel, profile_channel, log_channel;
+static uint8_t attitude_queue[512], raw_queue[1024], stats_queue[512], profile_queue[2048], log_queue[256];
+static struct exec_task telemetry_task;
+#endif
+#ifdef BENCHMARK_MODE
+static struct exec_task benchmark_task;
+static struct imu_block recorded[4];         // the latest samples, replayed through every filter
+static uint32_t recorded_samples;
+static struct imu_spectrum benchmark_spectrum;   // only benchmarked, never run
+#endif
+#ifdef FIFO_MODE
+static struct imu_pack pack;
+static struct exec_task fifo_task;
+#endif
+#ifdef DECIMATE_MODE
+static struct imu_decimate decimate;
+static struct exec_task decimate_report_task;
+#endif
+#ifdef SLEEP_MODE
+static struct exec_task sleep_task;
+#endif
+#ifdef DEFER_MODE
+static struct exec_task defer_report_task;
+#endif
+#ifdef ALIGN_MODE
+static struct mpu6050 second_imu;
+static struct imu_align align;
+static struct exec_task second_sensor_task, align_report_task;
+static int32_t align_skew_us, align_worst_skew_us;
+#endif
+#ifdef KERNEL_MODE
+static struct kernel_task sensor_kernel_task, report_kernel_task;
+static uint32_t sensor_stack[1024], report_stack[512];
+static struct kernel_sem sample_ready, uart_lock;
+#endif
 
 
-void process_new_sensor_values(float gyro_x, float gyro_y, float gyro_z, float accel_x, float accel_y, float accel_z, float magn_x, float magn_y, float magn_z) {
+void process_new_sensor_values(const struct imu_block *block) {
 
-	// sensor fusion with Madgwick's Filter
-	// MadgwickAHRSupdate(gyro_z, gyro_y, -gyro_x, accel_z, accel_y, -accel_x, magn_z, magn_y, -magn_x);
-	uart_send_csv_floats(3,
-		accel_x,accel_y, accel_z);
+	// sensor fusion, the filter can be changed at runtime with fusion_select()
+	PROF_BEGIN(fusion);
+	fusion_update_block(&fusion, block);
+	PROF_END(fusion);
+
+#ifdef BENCHMARK_MODE
+	// the UART is left to the benchmark results, the samples are only recorded for them
+	for (uint16_t n = 0; n < block->count; n++, recorded_samples++) {
+		struct imu_block *trace = &recorded[recorded_samples / IMU_BLOCK_CAPACITY % 4];
+		uint16_t i = recorded_samples % IMU_BLOCK_CAPACITY;
+		for (uint8_t axis = 0; axis < IMU_AXES; axis++) {
+			trace->raw[axis][i] = block->raw[axis][n];
+			trace->value[axis][i] = block->value[axis][n];
+		}
+		trace->sample_period_us = block->sample_period_us;
+		trace->count = IMU_BLOCK_CAPACITY;
+	}
+	imu_spectrum_add_block(&benchmark_spectrum, block);
+	return;
+#endif
+
+#ifdef ORIENT_MODE
+	float q[4];
+	fusion_get_quaternion(&fusion, q);
+	imu_orient_add(&orient, block, q);
+	return;
+#endif
+
+#ifdef MUX_MODE
+	// the modules send their own frames, which become records of their channels
+	float q[4];
+	fusion_get_quaternion(&fusion, q);
+	telemetry_route(&attitude_channel);
+	imu_orient_add(&orient, block, q);
+	telemetry_route(&raw_channel);
+	imu_pack_send(&pack, block);
+	telemetry_route(&stats_channel);
+	imu_stats_add_block(&stats, block);
+	telemetry_route(0);
+	return;
+#endif
+
+#ifdef DECIMATE_MODE
+	// low pass filtered down to the output rate instead of dropping samples
+	PROF_BEGIN(decimate);
+	imu_decimate_process(&decimate, block);
+	PROF_END(decimate);
+	return;
+#endif
+
+#ifdef SLEEP_MODE
+	// the UART is left to the sleep statistics
+	return;
+#endif
+
+#ifdef DEFER_MODE
+	// this runs in PendSV, which would cut into a line of the report task, so the UART is left to the report
+	return;
+#endif
+
+#ifdef ALIGN_MODE
+	// only sets of simultaneous samples of both sensors go out
+	imu_align_add(&align, block);
 	return;
+#endif
+
+#ifdef SPECTRUM_MODE
+	// the FFT runs in its own task, only copy the samples here
+	if (imu_spectrum_add_block(&spectrum, block))
+		exec_post(&spectrum_task);
+	return;
+#endif
+
+#ifdef STATS_MODE
+	// one summary frame replaces a second of samples
+	imu_stats_add_block(&stats, block);
+	return;
+#endif
+
+#ifdef CAPTURE_MODE
+	if (imu_capture_add_block(&capture, block))
+		exec_post(&capture_task);
+	return;
+#endif
+
+#ifdef STREAM_MODE
+	PROF_BEGIN(uart_stream);
+	imu_stream_send(block);
+	PROF_END(uart_stream);
+	return;
+#endif
+
+#if defined(PACK_MODE) || defined(FIFO_MODE)
+	PROF_BEGIN(uart_pack);
+	imu_pack_send(&pack, block);
+	PROF_END(uart_pack);
+	return;
+#endif
+
+	PROF_BEGIN(uart_csv);
+	for (uint16_t n = 0; n < block->count; n++)
+		uart_send_csv_floats(3,
+			block->value[IMU_ACCEL_X][n], block->value[IMU_ACCEL_Y][n], block->value[IMU_ACCEL_Z][n]);
+	PROF_END(uart_csv);
+	return;
+}
+
+// runs in interrupt context once the sample has been read: only hand the work over to the sensor task
+void sensor_data_ready(struct mpu6050 *sensor) {
+
+#ifdef KERNEL_MODE
+	kernel_sem_give(&sample_ready);
+#elif defined(ALIGN_MODE)
+	exec_post(sensor == &second_imu ? &second_sensor_task : &sensor_task);
+#else
+	exec_post(&sensor_task);
+#endif
+}
+
+void service_sensor(void) {
+
+	mpu6050_service(&imu);
+}
+
+// flash writes for the gyro calibration, away from the sensor task: a full sector takes 1 to 2s to erase
+void save_calibration(void) {
+
+	imu_calibration_service(&imu.calibration);
+}
+
+#ifdef SPECTRUM_MODE
+void run_spectrum(void) {
+
+	imu_spectrum_run(&spectrum);
+}
+
+// every result is sent in parts, one per run, so the sensor task is not held up by the UART
+void send_spectrum(void) {
+
+	spectrum_next_bin = imu_spectrum_send(spectrum_result, spectrum_next_bin);
+	if (spectrum_next_bin)
+		exec_post(&spectrum_send_task);
+}
+
+void spectrum_ready(const struct imu_spectrum_result *result) {
+
+	spectrum_result = result;
+	spectrum_next_bin = 0;
+	exec_post(&spectrum_send_task);
+}
+#endif
+
+#ifdef CAPTURE_MODE
+// one frame per run, so sampling carries on during the upload
+void upload_capture(void) {
+
+	if (imu_capture_upload(&capture))
+		exec_post(&capture_task);
+}
+#endif
+
+#ifdef BENCHMARK_MODE
+// one line per benchmark: an id, then its results
+void run_benchmarks(void) {
+
+	uint32_t reference_cycles, mismatches;
+	uint32_t cycles = imu_convert_benchmark(&imu.register_layout, &reference_cycles, &mismatches);
+	uart_send_csv_floats(4, 1.0f, (float) cycles / IMU_BLOCK_CAPACITY, (float) reference_cycles / IMU_BLOCK_CAPACITY, (float) mismatches);
+
+	// both FFT paths on the latest samples, once enough have arrived
+	if (benchmark_spectrum.filled >= benchmark_spectrum.points) {
+		struct imu_spectrum_benchmark spectrum_result;
+		imu_spectrum_benchmark(&benchmark_spectrum, &spectrum_result);
+		uart_send_csv_floats(5, 3.0f, (float) spectrum_result.points, (float) spectrum_result.float_cycles,
+			(float) spectrum_result.q15_cycles, spectrum_result.q15_error);
+	}
+
+	// the recorded samples have no reference orientation, so only the cost of every filter
+	if (recorded_samples < 4 * IMU_BLOCK_CAPACITY)
+		return;
+	for (enum FUSION_FILTER type = 0; type < FUSION_FILTERS; type++) {
+		struct fusion_benchmark result;
+		fusion_benchmark(type, 1, recorded, 4, 0, &result);
+		uart_send_csv_floats(4, 2.0f, (float) type, (float) result.mean_cycles, (float) result.max_cycles);
+	}
+}
+#endif
+
+#ifdef FIFO_MODE
+// the data ready interrupt is off in FIFO mode, the samples are collected here in bursts
+void poll_fifo(void) {
+
+	mpu6050_fifo_poll(&imu);
+}
+#endif
+
+#ifdef DECIMATE_MODE
+void send_decimated(const struct imu_block *block) {
+
+	for (uint16_t n = 0; n < block->count; n++)
+		uart_send_csv_floats(3,
+			block->value[IMU_ACCEL_X][n], block->value[IMU_ACCEL_Y][n], block->value[IMU_ACCEL_Z][n]);
+}
+
+// the cost of every stage, measured by imu_decimate_process() with the cycle counter
+void report_decimate(void) {
+
+	for (uint8_t s = 0; s < decimate.stage_count; s++) {
+		const struct imu_decimate_stage *stage = &decimate.stage[s];
+		float mean = stage->inputs ? (float) stage->total_cycles / stage->inputs : 0.0f;
+		uart_send_csv_floats(4, (float) s, (float) stage->factor, mean, (float) stage->max_cycles);
+	}
+}
+#endif
+
+#ifdef SLEEP_MODE
+// sleeps 5ms with WFI then 5ms busy, and sends both sets of sleep statistics and how long the executive slept
+void report_sleep(void) {
+
+	static uint32_t last_time_us, last_idle_us, last_sleeps;
+	uint32_t now_us = time_now_us();
+	float idle = last_time_us ? 100.0f * (exec_idle.idle_us - last_idle_us) / (now_us - last_time_us) : 0.0f;
+	uart_send_csv_floats(3, 1.0f, idle, (float) (exec_idle.sleeps - last_sleeps));
+	last_time_us = now_us;
+	last_idle_us = exec_idle.idle_us;
+	last_sleeps = exec_idle.sleeps;
+
+	sleepMs(5);
+	sleepMsBusy(5);
+	uart_send_csv_floats(6, 2.0f, (float) sleep_stats.sleeps, (float) sleep_stats.last_error_us, (float) sleep_stats.max_error_us,
+		(float) sleep_stats.wakeups, (float) sleep_stats.max_wake_latency);
+	uart_send_csv_floats(4, 3.0f, (float) sleep_busy_stats.sleeps, (float) sleep_busy_stats.last_error_us,
+		(float) sleep_busy_stats.max_error_us);
+}
+#endif
+
+#ifdef DEFER_MODE
+void report_defer(void) {
+
+	static uint32_t last_runs;
+	static uint64_t last_total_cycles;
+	uint32_t runs;
+	uint64_t total_cycles;
+
+	// PendSV can run the read in between, which changes the number of runs
+	do {
+		runs = defer_stats.runs;
+		total_cycles = defer_stats.total_latency_cycles;
+	} while (runs != defer_stats.runs);
+
+	float mean = runs != last_runs ? (float) (total_cycles - last_total_cycles) / (runs - last_runs) : 0.0f;
+	uart_send_csv_floats(5, (float) runs, (float) defer_stats.dropped, (float) defer_stats.max_latency_cycles, mean,
+		(float) imu.missed);
+	last_runs = runs;
+	last_total_cycles = total_cycles;
+}
+#endif
+
+#ifdef ALIGN_MODE
+void service_second_sensor(void) {
+
+	mpu6050_service(&second_imu);
+}
+
+// the second sensor's blocks skip the fusion, they are only matched up with the first sensor's
+void process_second_sensor_values(const struct imu_block *block) {
+
+	imu_align_add(&align, block);
+}
+
+// the accelerometer averaged over both sensors, which lowers the noise by a factor of sqrt(2)
+void send_aligned(const struct imu_block *const blocks[], uint8_t count) {
+
+	int32_t skew = (int32_t) (blocks[1]->timestamp_us - blocks[0]->timestamp_us);
+	align_skew_us = skew;
+	if (skew < 0)
+		skew = -skew;
+	if (skew > align_worst_skew_us)
+		align_worst_skew_us = skew;
+
+	uint16_t samples = blocks[0]->count < blocks[1]->count ? blocks[0]->count : blocks[1]->count;
+	for (uint16_t n = 0; n < samples; n++)
+		uart_send_csv_floats(3,
+			0.5f * (blocks[0]->value[IMU_ACCEL_X][n] + blocks[1]->value[IMU_ACCEL_X][n]),
+			0.5f * (blocks[0]->value[IMU_ACCEL_Y][n] + blocks[1]->value[IMU_ACCEL_Y][n]),
+			0.5f * (blocks[0]->value[IMU_ACCEL_Z][n] + blocks[1]->value[IMU_ACCEL_Z][n]));
+}
+
+void report_align(void) {
+
+	uart_send_csv_floats(4, (float) align.sets, (float) align.dropped, (float) align_skew_us, (float) align_worst_skew_us);
+}
+#endif
+
+#ifdef STREAM_MODE
+void send_jitter(void) {
+
+	mpu6050_jitter_send(&imu);
+}
+#endif
+
+#ifdef MUX_MODE
+void send_telemetry(void) {
+
+	telemetry_flush(&telemetry);
+}
+
+void dump_profile(void) {
+
+	telemetry_route(&profile_channel);
+	prof_dump();
+	telemetry_route(0);
+}
+#endif
+
+#ifdef KERNEL_MODE
+// highest priority: preempts the report task as soon as a sample is ready
+void sensor_entry(void *arg) {
+
+	while (1) {
+		kernel_sem_take(&sample_ready, KERNEL_WAIT_FOREVER);
+		kernel_sem_take(&uart_lock, KERNEL_WAIT_FOREVER);
+		mpu6050_service(&imu);
+		kernel_sem_give(&uart_lock);
+	}
+}
+
+// once a second: context switches in that second, the last and worst switch cost in cycles, and the sensor task's switches
+void report_entry(void *arg) {
+
+	uint32_t last_switches = 0;
+	while (1) {
+		kernel_sleep(KERNEL_TICK_HZ);
+		kernel_sem_take(&uart_lock, KERNEL_WAIT_FOREVER);
+		// the lock also keeps the sensor task off the calibration while it is saved
+		save_calibration();
+		uart_send_csv_floats(4, (float) (kernel_stats.switches - last_switches), (float) kernel_stats.last_switch_cycles,
+			(float) kernel_stats.max_switch_cycles, (float) sensor_kernel_task.switches);
+		kernel_sem_give(&uart_lock);
+		last_switches = kernel_stats.switches;
+	}
+}
+#endif
+
+// user button: dump the profiling statistics
+void user_button_pressed(void) {
+
+	exec_post(&profile_task);
+}
+
+// runs in the timer wheel's tick ISR, a GPIO write does not need a task
+void toggle_led(void *arg) {
+
+	static uint8_t led_on = 0;
+	led_on = !led_on;
+	if (led_on)
+		gpio_high(PB7);
+	else
+		gpio_low(PB7);
 }
 
 
@@ -64,16 +503,148 @@ int main(void)
 
 	SystemCoreClockUpdate();
 	EnableCycles();
+	timebase_setup();
 	gpio_setup(PB7, OUTPUT, PUSH_PULL, FIFTY_MHZ, NO_PULL, AF0);
-	mpu6050_hmc5883l_setup(PF1, PF0, PF2, &process_new_sensor_values);
+	fusion_init(&fusion, FUSION_MADGWICK, 72.7f, 1);
+	mpu6050_setup(&imu, PF1, PF0, PF2, MPU6050_ADDRESS_AD0_LOW, &process_new_sensor_values);
 	uart_setup(PD8, 115200);
 
-	while (1)
-	{
-	  gpio_high(PB7);
-	  sleepMs(1000);
-	  gpio_low(PB7);
-	  sleepMs(1000);
-	}
+#ifdef SPECTRUM_MODE
+	// 1kHz samples, 1024 point frames with 50% overlap, 4 frames per spectrum: a 0.98Hz resolution every 2s
+	mpu6050_configure(&imu, &(struct mpu6050_config) {1000, MPU6050_DLPF_184HZ, MPU6050_GYRO_2000DPS, MPU6050_ACCEL_4G});
+	imu_spectrum_init(&spectrum, IMU_ACCEL_Z, 1024, 512, 4, IMU_SPECTRUM_FLOAT, &spectrum_ready);
+	exec_add_event(&sensor_task, "sensor", &service_sensor, 1000);
+	exec_add_event(&spectrum_task, "spectrum", &run_spectrum, 500000);
+	exec_add_event(&spectrum_send_task, "spectrum_send", &send_spectrum, 1000000);
+#elif defined(CAPTURE_MODE)
+	// 1kHz samples, 0.5s before and 1.5s after the accelerometer magnitude reaches 2.5g
+	mpu6050_configure(&imu, &(struct mpu6050_config) {1000, MPU6050_DLPF_184HZ, MPU6050_GYRO_2000DPS, MPU6050_ACCEL_16G});
+	imu_capture_init(&capture, capture_ring, 2560, 500, 1500, IMU_CAPTURE_LEVEL, 2.5f);
+	exec_add_event(&sensor_task, "sensor", &service_sensor, 1000);
+	exec_add_event(&capture_task, "capture", &upload_capture, 1000000);
+#elif defined(PACK_MODE)
+	// 500Hz raw samples, 32 per frame and a keyframe every 16 frames: about 10 bytes per sample instead of 36
+	mpu6050_configure(&imu, &(struct mpu6050_config) {500, MPU6050_DLPF_184HZ, MPU6050_GYRO_2000DPS, MPU6050_ACCEL_4G});
+	mpu6050_set_block_length(&imu, 32);
+	imu_pack_init(&pack, 16);
+	exec_add_event(&sensor_task, "sensor", &service_sensor, 2000);
+#elif defined(ORIENT_MODE)
+	// 500Hz orientation and angular rate, 8 per frame: 11 bytes each instead of 28 as floats
+	mpu6050_configure(&imu, &(struct mpu6050_config) {500, MPU6050_DLPF_184HZ, MPU6050_GYRO_2000DPS, MPU6050_ACCEL_4G});
+	imu_orient_init(&orient, IMU_ORIENT_GYRO, 8);
+	exec_add_event(&sensor_task, "sensor", &service_sensor, 2000);
+#elif defined(MUX_MODE)
+	// 200Hz samples in blocks of 8, one 512 byte frame every 50ms fills 89% of the 115200 baud link.
+	// the attitude and raw channels are always guaranteed room for their largest records, the rest shares what is left
+	mpu6050_configure(&imu, &(struct mpu6050_config) {200, MPU6050_DLPF_94HZ, MPU6050_GYRO_2000DPS, MPU6050_ACCEL_4G});
+	mpu6050_set_block_length(&imu, 8);
+	imu_orient_init(&orient, IMU_ORIENT_GYRO, 8);
+	imu_pack_init(&pack, 16);
+	imu_stats_init(&stats, 200, 200, &imu_stats_send);
+	telemetry_init(&telemetry, 512, 20);
+	telemetry_add_channel(&telemetry, &attitude_channel, 1, "attitude", attitude_queue, sizeof(attitude_queue), 0, 1, 112);
+	telemetry_add_channel(&telemetry, &raw_channel, 2, "raw", raw_queue, sizeof(raw_queue), 1, 1, 248);
+	telemetry_add_channel(&telemetry, &stats_channel, 3, "stats", stats_queue, sizeof(stats_queue), 2, 1, 0);
+	telemetry_add_channel(&telemetry, &profile_channel, 4, "profile", profile_queue, sizeof(profile_queue), 3, 1, 0);
+	telemetry_add_channel(&telemetry, &log_channel, 5, "log", log_queue, sizeof(log_queue), 4, 1, 64);
+	telemetry_log(&log_channel, "started: madgwick fusion, 200Hz");
+	exec_add_event(&sensor_task, "sensor", &service_sensor, 5000);
+	exec_add_periodic(&telemetry_task, "telemetry", &send_telemetry, 50000);
+#elif defined(BENCHMARK_MODE)
+	// the sensor and fusion keep running at 72.7Hz, and every 10s the benchmarks are sent instead of samples:
+	//   1, cycles per sample of imu_convert(), of imu_convert_reference(), values where they disagree
+	//   2, filter type, mean and worst cycles per MARG update over the latest 128 samples, one line per filter
+	//   3, FFT points, cycles of the float complex FFT and of the conversion to Q15 plus the Q15 complex FFT,
+	//      Q15 error relative to the largest value, on the latest accelerometer z samples (the first line comes
+	//      once 1024 samples, 14s, have arrived)
+	imu_spectrum_init(&benchmark_spectrum, IMU_ACCEL_Z, 1024, 1024, 1, IMU_SPECTRUM_FLOAT, 0);
+	exec_add_event(&sensor_task, "sensor", &service_sensor, 13000);
+	exec_add_periodic(&benchmark_task, "benchmark", &run_benchmarks, 10000000);
+#elif defined(FIFO_MODE)
+	// 500Hz accel and gyro collected by the sensor's FIFO and read in bursts of 25 samples every 50ms
+	// instead of one read per data ready interrupt, then sent delta and varint compressed.
+	// polled every 10ms, the 85 sample FIFO holds 170ms, so a late poll does not overflow it
+	mpu6050_fifo_setup(&imu, 500, 25);
+	imu_pack_init(&pack, 16);
+	exec_add_periodic(&fifo_task, "fifo", &poll_fifo, 10000);
+#elif defined(DECIMATE_MODE)
+	// 1kHz samples in blocks of 32, filtered down to 125Hz by a 24 tap 4x stage then a 32 tap 2x stage,
+	// and sent as lines of 3 accelerometer values. Once a second one line of 4 per stage:
+	//   stage, decimation factor, mean cycles per input sample of 10 axes, worst cycles per block
+	mpu6050_configure(&imu, &(struct mpu6050_config) {1000, MPU6050_DLPF_184HZ, MPU6050_GYRO_2000DPS, MPU6050_ACCEL_4G});
+	mpu6050_set_block_length(&imu, 32);
+	imu_decimate_init(&decimate, 8, &send_decimated);
+	imu_decimate_add_stage(&decimate, 4, 0, 24);
+	imu_decimate_add_stage(&decimate, 2, 0, 32);
+	exec_add_event(&sensor_task, "sensor", &service_sensor, 32000);
+	exec_add_periodic(&decimate_report_task, "decimate", &report_decimate, 1000000);
+#elif defined(SLEEP_MODE)
+	// the sensor keeps running at 72.7Hz without sending samples, and once a second three lines:
+	//   1, % of the last second the executive spent in WFI, WFI entries in that second
+	//   2, sleepMs() calls, last and worst error in us, WFI wake-ups, worst wake latency in cycles
+	//   3, sleepMsBusy() calls, last and worst error in us
+	exec_add_event(&sensor_task, "sensor", &service_sensor, 13000);
+	exec_add_periodic(&sleep_task, "sleep", &report_sleep, 1000000);
+#elif defined(DEFER_MODE)
+	// the data ready interrupt only takes a timestamp and defers the blocking read to PendSV instead of starting
+	// a background read. The fusion runs on the samples in PendSV, and once a second a line of 5:
+	//   reads run, reads dropped because the previous one had not run yet, worst and mean cycles from the
+	//   interrupt to the read, samples the driver missed
+	exec_add_periodic(&defer_report_task, "defer", &report_defer, 1000000);
+#elif defined(ALIGN_MODE)
+	// a second MPU6050 on I2C1 (PB8 clock, PB9 data, PC3 interrupt) next to the first one on I2C2, both at 100Hz
+	// and read in the background at the same time. Their own clocks differ a little, so each sample is matched
+	// with the other sensor's sample taken within half a period, and one is dropped whenever the sampling instants
+	// slip past each other. Lines of 3: the accelerometer averaged over both sensors, and once a second a line of 4:
+	//   sets matched, blocks dropped, last and worst time between the two sensors' samples in us
+	mpu6050_setup(&second_imu, PB8, PB9, PC3, MPU6050_ADDRESS_AD0_LOW, &process_second_sensor_values);
+	mpu6050_configure(&imu, &(struct mpu6050_config) {100, MPU6050_DLPF_44HZ, MPU6050_GYRO_2000DPS, MPU6050_ACCEL_4G});
+	mpu6050_configure(&second_imu, &(struct mpu6050_config) {100, MPU6050_DLPF_44HZ, MPU6050_GYRO_2000DPS, MPU6050_ACCEL_4G});
+	imu_align_init(&align, 2, 5000, &send_aligned);
+	exec_add_event(&sensor_task, "sensor", &service_sensor, 10000);
+	exec_add_event(&second_sensor_task, "second_sensor", &service_second_sensor, 10000);
+	exec_add_periodic(&align_report_task, "align", &report_align, 1000000);
+	mpu6050_start_async(&second_imu, &sensor_data_ready);
+#elif defined(KERNEL_MODE)
+	// the preemptive kernel instead of the executive: the sensor task blocks on a semaphore given
+	// by the data ready callback, and a line of kernel statistics goes out between the samples every second
+	kernel_sem_init(&sample_ready, 0);
+	kernel_sem_init(&uart_lock, 1);
+	kernel_task_create(&sensor_kernel_task, "sensor", &sensor_entry, 0, 2, sensor_stack, 1024);
+	kernel_task_create(&report_kernel_task, "report", &report_entry, 0, 1, report_stack, 512);
+#else
+#ifdef STATS_MODE
+	imu_stats_init(&stats, 73, 73, &imu_stats_send);
+#endif
+	// sensor data arrives at 72.7Hz and is read in the background, each sample must be processed before the next one
+	exec_add_event(&sensor_task, "sensor", &service_sensor, 13000);
+#endif
+	// 10ms wheel ticks for timers that do not need a task of their own
+	swtimer_setup(10000);
+	swtimer_init(&led_timer, &toggle_led, 0, ISR_CONTEXT);
+	swtimer_start(&led_timer, 100, 100);
+#ifdef STREAM_MODE
+	exec_add_periodic(&jitter_task, "jitter", &send_jitter, 1000000);
+#endif
+#ifndef KERNEL_MODE
+	exec_add_periodic(&calibration_task, "calibration", &save_calibration, 1000000);
+#endif
+#if !defined(FIFO_MODE) && !defined(DEFER_MODE)
+	mpu6050_start_async(&imu, &sensor_data_ready);
+#endif
+#if defined(PROFILING) && !defined(KERNEL_MODE)
+#ifdef MUX_MODE
+	exec_add_event(&profile_task, "profile", &dump_profile, 1000000);
+#else
+	exec_add_event(&profile_task, "profile", &prof_dump, 1000000);
+#endif
+	exti_setup(PC13, NO_PULL, RISING_EDGE, &user_button_pressed);
+#endif
+
+#ifdef KERNEL_MODE
+	kernel_start();
+#else
+	exec_run();
+#endif
 }
 
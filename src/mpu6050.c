@@ -2,96 +2,514 @@
 // License: public domain
 
 #include "mpu6050.h"
+#include "lib_prof.h"
+#include "lib_time.h"
+#include "lib_uart.h"
+#include <string.h>
 
 
 // i2c device addresses
-#define MPU6050_ADDRESS  0b1101000
 #define HMC5883L_ADDRESS 0b0011110
 
-// offsets calculated at power up
-static int16_t gyro_x_offset = 0;
-static int16_t gyro_y_offset = 0;
-static int16_t gyro_z_offset = 0;
-static uint32_t samples = 0;
-I2C_TypeDef *i2c;
-
-
-void(*event_handler)(float gyro_x, float gyro_y, float gyro_z, float accel_x, float accel_y, float accel_z, float magn_x, float magn_y, float magn_z);
-
-static void mpu6050_hmc5883l_read_sensors(void) {
-
-	
-	// read the sensor values
-	uint8_t rx_buffer[20];
-	i2c_read_registers(i2c, MPU6050_ADDRESS, 20, 0x3B, rx_buffer);
-
-	// extract the raw values
-	int16_t  accel_x_raw  = rx_buffer[0]  << 8 | rx_buffer[1];
-	int16_t  accel_y_raw  = rx_buffer[2]  << 8 | rx_buffer[3];
-	int16_t  accel_z_raw  = rx_buffer[4]  << 8 | rx_buffer[5];
-	int16_t  mpu_temp_raw = rx_buffer[6]  << 8 | rx_buffer[7];
-	int16_t  gyro_x_raw   = rx_buffer[8]  << 8 | rx_buffer[9];
-	int16_t  gyro_y_raw   = rx_buffer[10] << 8 | rx_buffer[11];
-	int16_t  gyro_z_raw   = rx_buffer[12] << 8 | rx_buffer[13];
-	int16_t  magn_x_raw   = rx_buffer[14] << 8 | rx_buffer[15];
-	int16_t  magn_y_raw   = rx_buffer[16] << 8 | rx_buffer[17];
-	int16_t  magn_z_raw   = rx_buffer[18] << 8 | rx_buffer[19];
-
-	// calculate the offsets at power up
-	if(samples < 64) {
-		samples++;
+// FIFO mode
+#define FIFO_SIZE        1024
+#define FIFO_SAMPLE_SIZE 12     // accel xyz + gyro xyz
+#define FIFO_BURST       20     // samples per I2C transaction, limited by the 8bit byte count
+
+// I2C bit times per sample: 9 bits a byte, plus start, repeated start and stop
+#define BUS_BITS_RECORD  ((3 + MPU6050_RECORD_SIZE) * 9 + 3)   // address, register, address again, then the record
+#define BUS_BITS_FIFO    (FIFO_SAMPLE_SIZE * 9)                 // the status and count reads are shared by a whole burst
+#define BUS_LOAD_PERCENT 75     // of the bus the reads may take, the rest absorbs blocking accesses and late reads
+
+// sensitivities per full scale range, from the datasheets
+static const float accel_counts_per_g[4] = {16384.0f, 8192.0f, 4096.0f, 2048.0f};
+static const float gyro_counts_per_dps[4] = {131.0f, 65.5f, 32.8f, 16.4f};
+#define MAGN_SCALE  (1.0f / 660.0f)
+#define DEGREES_PER_RADIAN 57.2957795f
+
+// data ready intervals ignored by the jitter histogram while the average period settles after a restart
+#define JITTER_SETTLE 256
+
+// the calibration is stored for, and only refined at, these ranges
+#define CALIBRATION_GYRO_RANGE  MPU6050_GYRO_2000DPS
+#define CALIBRATION_ACCEL_RANGE MPU6050_ACCEL_4G
+
+// register dump from 0x3B: accel xyz, temperature, gyro xyz, magnetometer xzy (EXT_SENS_DATA)
+static const uint8_t register_axes[] = {
+	IMU_ACCEL_X, IMU_ACCEL_Y, IMU_ACCEL_Z, IMU_CONVERT_DROP,
+	IMU_GYRO_X, IMU_GYRO_Y, IMU_GYRO_Z,
+	IMU_MAGN_X, IMU_MAGN_Z, IMU_MAGN_Y        // the HMC5883L output registers are ordered x, z, y
+};
+
+// FIFO: accel xyz, gyro xyz
+static const uint8_t fifo_axes[] = {
+	IMU_ACCEL_X, IMU_ACCEL_Y, IMU_ACCEL_Z,
+	IMU_GYRO_X, IMU_GYRO_Y, IMU_GYRO_Z
+};
+
+// the EXTI handlers take no arguments, so each sensor gets its own data ready trampoline
+static struct mpu6050 *sensors[MPU6050_MAX_SENSORS];
+static uint8_t sensor_count = 0;
+
+// I2C1 and I2C2, shared by every sensor on them
+static struct {
+	uint8_t configured;
+	enum I2C_SPEED speed;
+} buses[2];
+
+// sets up the sensor's bus at a speed, unless it already runs at that speed. Setting the bus up
+// resets the peripheral, so the background reads of every sensor on it are paused meanwhile
+static void mpu6050_set_bus_speed(struct mpu6050 *imu, enum I2C_SPEED speed) {
+
+	uint8_t bus = imu->i2c == I2C1 ? 0 : 1;
+	if (buses[bus].configured && buses[bus].speed == speed)
+		return;
+
+	i2c_async_pause(imu->i2c, 1);
+	i2c_setup(imu->i2c, speed, imu->sck_pin, imu->sda_pin);
+	i2c_async_pause(imu->i2c, 0);
+
+	buses[bus].configured = 1;
+	buses[bus].speed = speed;
+
+}
+
+// gives the current block to the event handler
+static void mpu6050_flush(struct mpu6050 *imu) {
+
+	struct imu_block *block = &imu->blocks[imu->block_index];
+	if (block->count == 0)
+		return;
+
+	block->sequence = imu->block_sequence++;
+	block->sensor = imu->id;
+	imu->handler(block);
+
+	imu->block_index = (imu->block_index + 1) % MPU6050_BLOCK_POOL;
+	imu->blocks[imu->block_index].count = 0;
+
+}
+
+// gives the calibrated gyro offsets to both record layouts
+static void mpu6050_apply_offsets(struct mpu6050 *imu) {
+
+	static const enum IMU_AXIS gyro_axes[3] = {IMU_GYRO_X, IMU_GYRO_Y, IMU_GYRO_Z};
+
+	// the offsets are in counts at +/-2000dps, and the counts per dps double with each smaller range
+	uint8_t shift = CALIBRATION_GYRO_RANGE - imu->config.gyro_range;
+
+	for (uint8_t i = 0; i < 3; i++) {
+		int16_t offset = imu_calibration_offset(&imu->calibration, i) * (1 << shift);
+		imu_convert_set_offset(&imu->register_layout, gyro_axes[i], offset);
+		imu_convert_set_offset(&imu->fifo_layout, gyro_axes[i], offset);
+	}
+
+}
+
+// converts consecutive records into blocks and hands full blocks to the event handler
+static void mpu6050_process(struct mpu6050 *imu, const struct imu_convert *layout, const uint8_t *records, uint16_t count, uint32_t timestamp_us, uint32_t sequence, uint32_t capture_cycles) {
+
+	// the first sample after a configuration change may have been taken with either configuration
+	while (imu->discard > 0 && count > 0) {
+		imu->discard--;
+		records += layout->record_size;
+		timestamp_us += imu->sample_period_us;
+		sequence++;
+		capture_cycles += imu->sample_period_cycles;
+		count--;
+	}
+
+	// feed every sample to the calibration, which also refines the offsets while running
+	const uint8_t *record = records;
+	uint8_t changed = 0;
+	uint8_t calibrating = imu->config.gyro_range == CALIBRATION_GYRO_RANGE && imu->config.accel_range == CALIBRATION_ACCEL_RANGE;
+	for (uint16_t i = 0; calibrating && i < count; i++) {
+		const int16_t gyro[3] = {
+			imu_convert_extract(layout, record, IMU_GYRO_X),
+			imu_convert_extract(layout, record, IMU_GYRO_Y),
+			imu_convert_extract(layout, record, IMU_GYRO_Z)
+		};
+		const int16_t accel[3] = {
+			imu_convert_extract(layout, record, IMU_ACCEL_X),
+			imu_convert_extract(layout, record, IMU_ACCEL_Y),
+			imu_convert_extract(layout, record, IMU_ACCEL_Z)
+		};
+		changed |= imu_calibration_add(&imu->calibration, gyro, accel);
+		record += layout->record_size;
+	}
+	if (changed)
+		mpu6050_apply_offsets(imu);
+
+	while (count > 0) {
+
+		// the samples of a block are consecutive, so a dropped sample ends the block early
+		struct imu_block *block = &imu->blocks[imu->block_index];
+		if (block->count > 0 && sequence != block->first_sample + block->count) {
+			mpu6050_flush(imu);
+			block = &imu->blocks[imu->block_index];
+		}
+		if (block->count == 0) {
+			block->timestamp_us = timestamp_us;
+			block->sample_period_us = imu->sample_period_us;
+			block->first_sample = sequence;
+		}
+
+		uint16_t space = imu->block_length - block->count;
+		uint16_t n = count < space ? count : space;
+		for (uint16_t i = 0; i < n; i++)
+			block->capture_cycles[block->count + i] = capture_cycles + i * imu->sample_period_cycles;
+		PROF_BEGIN(imu_convert);
+		imu_convert(layout, records, n, block);
+		PROF_END(imu_convert);
+
+		records += n * layout->record_size;
+		timestamp_us += n * imu->sample_period_us;
+		sequence += n;
+		capture_cycles += n * imu->sample_period_cycles;
+		count -= n;
+
+		if (block->count >= imu->block_length)
+			mpu6050_flush(imu);
+
+	}
+
+}
+
+// reads the magnetometer every (1 + delay) samples so it is not polled faster than its 75Hz output rate
+static void mpu6050_set_aux_rate(struct mpu6050 *imu, uint16_t rate_hz) {
+
+	uint8_t delay = rate_hz > 75 ? (rate_hz + 74) / 75 - 1 : 0;
+	if (delay > 31) delay = 31;
+	i2c_write_register(imu->i2c, imu->address, 0x34, delay);                  // I2C_MST_DLY = delay
+	i2c_write_register(imu->i2c, imu->address, 0x67, 0x01);                   // apply the delay to slave 0
+
+}
+
+// bit times per second the sensor's reads take on its bus
+static uint32_t mpu6050_bus_load(const struct mpu6050 *imu, uint32_t rate_hz) {
+
+	return rate_hz * (imu->fifo_stats.enabled ? BUS_BITS_FIFO : BUS_BITS_RECORD);
+
+}
+
+// writes imu->config to the sensor, then recomputes the sample period, scale factors and offsets
+static void mpu6050_write_config(struct mpu6050 *imu) {
+
+	struct mpu6050_config *config = &imu->config;
+	I2C_TypeDef *i2c = imu->i2c;
+	uint8_t address = imu->address;
+
+	// what the other sensors on the bus read, and whether any of them drains a FIFO
+	uint32_t others = 0;
+	uint8_t fifo = imu->fifo_stats.enabled;
+	for (uint8_t i = 0; i < sensor_count; i++) {
+		if (sensors[i] != imu && sensors[i]->i2c == i2c) {
+			others += mpu6050_bus_load(sensors[i], sensors[i]->config.rate_hz);
+			fifo |= sensors[i]->fifo_stats.enabled;
+		}
+	}
+
+	// the divider counts gyro output samples, and the rate is lowered to what is left of the bus at 400kHz
+	uint32_t output_hz = config->dlpf == MPU6050_DLPF_260HZ ? 8000 : 1000;
+	uint32_t capacity = 400000 * BUS_LOAD_PERCENT / 100;
+	uint32_t max_hz = others < capacity ? (capacity - others) / mpu6050_bus_load(imu, 1) : 4;
+	if (max_hz > output_hz) max_hz = output_hz;
+	if (max_hz < 4) max_hz = 4;
+	if (config->rate_hz < 4) config->rate_hz = 4;
+	if (config->rate_hz > max_hz) config->rate_hz = max_hz;
+	uint32_t divider = (output_hz + config->rate_hz / 2) / config->rate_hz;
+	if (divider < (output_hz + max_hz - 1) / max_hz) divider = (output_hz + max_hz - 1) / max_hz;
+	if (divider > 256) divider = 256;
+
+	// 100kHz carries a record (about 210 bits) every 2.1ms, so faster rates need the 400kHz bus.
+	// FIFO bursts are read with the blocking functions, which the faster bus keeps short
+	uint32_t load = others + mpu6050_bus_load(imu, output_hz / divider);
+	mpu6050_set_bus_speed(imu, (fifo || load > 100000 * BUS_LOAD_PERCENT / 100) ? FAST_MODE_400KHZ : STANDARD_MODE_100KHZ);
+	imu->sample_period_us = 1000000 * divider / output_hz;
+	imu->sample_period_cycles = imu->sample_period_us * (SystemCoreClock / 1000000);
+	config->rate_hz = output_hz / divider;
+
+	// the histogram is centered on the average period, start over at the new one
+	if (!imu->jitter.restart_bin_cycles)
+		imu->jitter.restart_bin_cycles = imu->jitter.bin_cycles;
+
+	i2c_write_register(i2c, address, 0x1A, config->dlpf);                     // DLPF
+	i2c_write_register(i2c, address, 0x19, divider - 1);                      // sample rate = gyro output rate / (1 + divider)
+	i2c_write_register(i2c, address, 0x1B, config->gyro_range << 3);          // gyro full scale
+	i2c_write_register(i2c, address, 0x1C, config->accel_range << 3);         // accelerometer full scale
+	if (imu->aux_master)
+		mpu6050_set_aux_rate(imu, config->rate_hz);
+
+	float accel_scale = 1.0f / accel_counts_per_g[config->accel_range];
+	float gyro_scale = 1.0f / (gyro_counts_per_dps[config->gyro_range] * DEGREES_PER_RADIAN);
+	const float register_scales[] = {
+		accel_scale, accel_scale, accel_scale, 0.0f,
+		gyro_scale, gyro_scale, gyro_scale,
+		MAGN_SCALE, MAGN_SCALE, MAGN_SCALE
+	};
+	const float fifo_scales[] = {
+		accel_scale, accel_scale, accel_scale,
+		gyro_scale, gyro_scale, gyro_scale
+	};
+	imu_convert_init(&imu->register_layout, MPU6050_RECORD_SIZE, register_axes, register_scales);
+	imu_convert_init(&imu->fifo_layout, FIFO_SAMPLE_SIZE, fifo_axes, fifo_scales);
+	mpu6050_apply_offsets(imu);
+
+}
+
+// converts the samples read in the background
+static uint16_t mpu6050_drain(struct mpu6050 *imu) {
+
+	uint16_t serviced = 0;
+	struct mpu6050_record *record;
+
+	while ((record = spsc_peek(&imu->record_queue))) {
+		mpu6050_process(imu, &imu->register_layout, record->data, 1, record->timestamp_us, record->sequence, record->capture_cycles);
+		spsc_release(&imu->record_queue);
+		serviced++;
+	}
+
+	return serviced;
+
+}
+
+// switches to a requested configuration, called right after a sample has been read
+static void mpu6050_apply_requested(struct mpu6050 *imu) {
+
+	if (!imu->config_requested)
 		return;
-	} else if(samples < 128) {
-		gyro_x_offset += gyro_x_raw;
-		gyro_y_offset += gyro_y_raw;
-		gyro_z_offset += gyro_z_raw;
-		samples++;
+	imu->config_requested = 0;
+
+	// wait for a background read in progress, and convert it with the old settings
+	i2c_async_pause(imu->i2c, 1);
+	mpu6050_drain(imu);
+	mpu6050_flush(imu);
+
+	imu->config = imu->requested;
+	mpu6050_write_config(imu);
+	imu->discard = 1;
+
+	i2c_async_pause(imu->i2c, 0);
+
+}
+
+// reads one sample with the blocking functions, holding back the background reads of other sensors on the bus
+static void mpu6050_read_at(struct mpu6050 *imu, uint32_t timestamp_us, uint32_t sequence, uint32_t capture_cycles) {
+
+	uint8_t rx_buffer[MPU6050_RECORD_SIZE];
+	PROF_BEGIN(mpu_i2c_read);
+	i2c_async_pause(imu->i2c, 1);
+	i2c_read_registers(imu->i2c, imu->address, MPU6050_RECORD_SIZE, 0x3B, rx_buffer);
+	i2c_async_pause(imu->i2c, 0);
+	PROF_END(mpu_i2c_read);
+
+	mpu6050_process(imu, &imu->register_layout, rx_buffer, 1, timestamp_us, sequence, capture_cycles);
+	mpu6050_apply_requested(imu);
+
+}
+
+// deferred from the data ready interrupt, runs from PendSV
+static void mpu6050_read_deferred(struct defer_work *work) {
+
+	struct mpu6050 *imu = work->context;
+	uint32_t sequence, timestamp_us, capture_cycles;
+
+	// the data ready interrupt can update these in between, which changes the sequence number
+	do {
+		sequence = imu->read_sequence;
+		timestamp_us = imu->read_time_us;
+		capture_cycles = imu->read_cycles;
+	} while (sequence != imu->read_sequence);
+
+	mpu6050_read_at(imu, timestamp_us, sequence, capture_cycles);
+
+}
+
+// bins the interval since the previous data ready interrupt, returns how many sample periods it spans
+static uint32_t mpu6050_jitter_add(struct mpu6050 *imu, uint32_t cycles) {
+
+	struct mpu6050_jitter *jitter = &imu->jitter;
+
+	uint32_t restart_bin_cycles = jitter->restart_bin_cycles;
+	if (restart_bin_cycles) {
+		jitter->bin_cycles = restart_bin_cycles;
+		jitter->period_q4 = imu->sample_period_cycles << 4;
+		jitter->last_cycles = cycles;
+		jitter->settle = JITTER_SETTLE;
+		jitter->intervals = 0;
+		jitter->lost = 0;
+		jitter->min_cycles = 0;
+		jitter->max_cycles = 0;
+		memset(jitter->bins, 0, sizeof(jitter->bins));
+		jitter->restart_bin_cycles = 0;
+		return 1;
+	}
+
+	uint32_t interval = cycles - jitter->last_cycles;
+	jitter->last_cycles = cycles;
+
+	// an interval of several periods means interrupts were lost, the sensor kept sampling regardless
+	uint32_t period = jitter->period_q4 >> 4;
+	uint32_t periods = (interval + period / 2) / period;
+	if (periods < 1)
+		periods = 1;
+	int32_t deviation = (int32_t) (interval - periods * period);
+
+	if (periods == 1)
+		jitter->period_q4 += ((int32_t) ((interval << 4) - jitter->period_q4)) >> 6;
+	if (jitter->settle > 0) {
+		jitter->settle--;
+		return periods;
+	}
+	jitter->lost += periods - 1;
+
+	// round down, so a bin covers one bin width on either side of zero too
+	int32_t width = jitter->bin_cycles;
+	int32_t bin = deviation >= 0 ? deviation / width : -((-deviation - 1) / width) - 1;
+	bin += MPU6050_JITTER_BINS / 2;
+	if (bin < 0) bin = 0;
+	if (bin >= MPU6050_JITTER_BINS) bin = MPU6050_JITTER_BINS - 1;
+	jitter->bins[bin]++;
+
+	if (jitter->intervals == 0 || deviation < jitter->min_cycles)
+		jitter->min_cycles = deviation;
+	if (jitter->intervals == 0 || deviation > jitter->max_cycles)
+		jitter->max_cycles = deviation;
+	jitter->intervals++;
+
+	return periods;
+
+}
+
+// data ready interrupt: timestamp and number the sample, then read it from PendSV or in the background
+static void mpu6050_data_ready(struct mpu6050 *imu) {
+
+	uint32_t cycles = exti_entry_cycles(imu->irq_pin);
+	uint32_t now = time_now_us();
+
+	// lost interrupts still use up sequence numbers, so the gap shows downstream
+	uint32_t sequence = imu->sample_sequence + mpu6050_jitter_add(imu, cycles) - 1;
+	imu->sample_sequence = sequence + 1;
+
+	// a read still waiting for PendSV will get this newer sample, so it takes the newer timestamp
+	if (!imu->async) {
+		imu->read_time_us = now;
+		imu->read_cycles = cycles;
+		imu->read_sequence = sequence;
+		if (!defer_post(&imu->read_work))
+			imu->missed++;
+		return;
+	}
+
+	// the DMA fills the reserved record, which is committed once the read is done
+	struct mpu6050_record *record = 0;
+	if (imu->transfer.status != I2C_TRANSFER_QUEUED && imu->transfer.status != I2C_TRANSFER_BUSY)
+		record = spsc_reserve(&imu->record_queue);
+	if (record == 0) {
+		imu->missed++;
 		return;
-	} else if(samples == 128) {
-		gyro_x_offset /= 64;
-		gyro_y_offset /= 64;
-		gyro_z_offset /= 64;
-		samples++;
-	} else {
-		gyro_x_raw -= gyro_x_offset;
-		gyro_y_raw -= gyro_y_offset;
-		gyro_z_raw -= gyro_z_offset;
 	}
 
-	// convert accelerometer readings into G's
-	float accel_x = accel_x_raw / 8192.0f;
-	float accel_y = accel_y_raw / 8192.0f;
-	float accel_z = accel_z_raw / 8192.0f;
+	record->timestamp_us = now;
+	record->capture_cycles = cycles;
+	record->sequence = sequence;
+	imu->transfer.rx_buffer = record->data;
+	i2c_read_registers_async(imu->i2c, &imu->transfer);
 
-	// convert temperature reading into degrees Celsius
-	float mpu_temp = mpu_temp_raw / 340.0f + 36.53f;
+}
+
+static void mpu6050_data_ready_0(void) { mpu6050_data_ready(sensors[0]); }
+static void mpu6050_data_ready_1(void) { mpu6050_data_ready(sensors[1]); }
+static void mpu6050_data_ready_2(void) { mpu6050_data_ready(sensors[2]); }
+static void mpu6050_data_ready_3(void) { mpu6050_data_ready(sensors[3]); }
+static void (*const data_ready[MPU6050_MAX_SENSORS])(void) = {
+	mpu6050_data_ready_0, mpu6050_data_ready_1, mpu6050_data_ready_2, mpu6050_data_ready_3
+};
 
-	// convert gyro readings into Radians per second
-	float gyro_x = gyro_x_raw / 939.650784f;
-	float gyro_y = gyro_y_raw / 939.650784f;
-	float gyro_z = gyro_z_raw / 939.650784f;
+// background read finished, in interrupt context
+static void mpu6050_read_done(struct i2c_transfer *transfer) {
 
-	// convert magnetometer readings into Gauss's
-	float magn_x = magn_x_raw / 660.0f;
-	float magn_y = magn_y_raw / 660.0f;
-	float magn_z = magn_z_raw / 660.0f;
+	struct mpu6050 *imu = transfer->context;
 
-	// give the event handler the sensor readings
-	event_handler(gyro_x, gyro_y, gyro_z, accel_x, accel_y, accel_z, magn_x, magn_y, magn_z);
+	if (transfer->status != I2C_TRANSFER_DONE) {
+		imu->missed++;
+		return;
+	}
+
+	spsc_commit(&imu->record_queue);
+	if (imu->ready)
+		imu->ready(imu);
 
 }
 
 /**
- * Configure an MPU6050 and HMC5883L sensor.
+ * Changes the output data rate, low pass filter and ranges while running. The
+ * change is made right after the next sample has been read: the current block is
+ * handed over first, so no block mixes settings, the scale factors and gyro offsets
+ * are recomputed for the new ranges, and the first sample taken during the switch
+ * is dropped. In FIFO mode the FIFO is reset after the switch.
+ * Offsets are only refined online at +/-2000dps and +/-4g, the ranges they are stored for.
+ * The I2C bus runs at 400kHz while the reads of the sensors on it need more than
+ * 75% of 100kHz, and rates whose reads do not fit in 75% of 400kHz are lowered:
+ * a single sensor alone on the bus reads at most 1428 samples per second.
  *
+ * @param imu      The sensor
+ * @param config   The new configuration, copied
+ */
+void mpu6050_configure(struct mpu6050 *imu, const struct mpu6050_config *config) {
+
+	imu->config_requested = 0;
+	imu->requested = *config;
+	imu->config_requested = 1;
+
+}
+
+/**
+ * Sets how many samples are collected into a block before it is given to the
+ * event handler. Defaults to 1 in data ready mode. In FIFO mode every drained
+ * burst is handed over as well, even if it is shorter.
+ *
+ * @param imu      The sensor
+ * @param length   Samples per block, 1 to IMU_BLOCK_CAPACITY
+ */
+void mpu6050_set_block_length(struct mpu6050 *imu, uint16_t length) {
+
+	if (length < 1) length = 1;
+	if (length > IMU_BLOCK_CAPACITY) length = IMU_BLOCK_CAPACITY;
+	imu->block_length = length;
+
+}
+
+/**
+ * Reads the sensors and gives them to the event handler once a block is full.
+ * This is what the data ready interrupt does by default.
+ *
+ * @param imu   The sensor
+ */
+void mpu6050_read_sensors(struct mpu6050 *imu) {
+
+	uint32_t cycles = DWT->CYCCNT;
+	mpu6050_read_at(imu, time_now_us(), imu->sample_sequence++, cycles);
+
+}
+
+/**
+ * Configure an MPU6050 and HMC5883L sensor. The data ready interrupt takes a
+ * timestamp and defers the blocking read to PendSV (see lib_defer.h), which gives
+ * blocks to the handler. See mpu6050_start_async() to read with the DMA instead.
+ *
+ * @param imu       The sensor's state, must stay valid for as long as the sensor runs
  * @param sck_pin   I2C clock pin
  * @param sda_pin   I2C data pin
  * @param int_pin   MPU6050 interrupt pin
- * @param handler   Pointer to an event handler that will be called after new sensor readings have been processed
+ * @param address   MPU6050_ADDRESS_AD0_LOW or MPU6050_ADDRESS_AD0_HIGH
+ * @param handler   Pointer to an event handler that will be given each block of new sensor readings
+ * @returns         1 on success, 0 for an unsupported pin combination or too many sensors
  */
-void mpu6050_hmc5883l_setup(enum GPIO_PIN sck_pin, enum GPIO_PIN sda_pin, enum GPIO_PIN int_pin, void(*handler)(float gyro_x, float gyro_y, float gyro_z, float accel_x, float accel_y, float accel_z, float magn_x, float magn_y, float magn_z)) {
+uint8_t mpu6050_setup(struct mpu6050 *imu, enum GPIO_PIN sck_pin, enum GPIO_PIN sda_pin, enum GPIO_PIN int_pin, uint8_t address, void(*handler)(const struct imu_block *block)) {
+
+	I2C_TypeDef *i2c;
 
-	
 	// determine which i2c peripheral to use
 	if(sck_pin == PB6 && sda_pin == PB9)
 		i2c = I2C1;
@@ -104,37 +522,338 @@ void mpu6050_hmc5883l_setup(enum GPIO_PIN sck_pin, enum GPIO_PIN sda_pin, enum G
 	else if(sck_pin == PB10 && sda_pin == PB11)
 		i2c = I2C2;
 	else
-		return;
+		return 0;
+
+	if (sensor_count >= MPU6050_MAX_SENSORS)
+		return 0;
 
-	// assign the event handler pointer
-	event_handler = handler;
+	imu->id = sensor_count;
+	sensors[sensor_count++] = imu;
+	imu->i2c = i2c;
+	imu->address = address;
+	imu->sck_pin = sck_pin;
+	imu->sda_pin = sda_pin;
+	imu->irq_pin = int_pin;
+	imu->aux_master = 0;
+	imu->handler = handler;
 
-	// configure i2c
-	i2c_setup(i2c, STANDARD_MODE_100KHZ, sck_pin, sda_pin);
+	imu->block_index = 0;
+	imu->block_sequence = 0;
+	imu->block_length = 1;
+	imu->sample_period_us = 13750;
+	imu->sample_sequence = 0;
+	imu->jitter = (struct mpu6050_jitter) { .bin_cycles = SystemCoreClock / 1000000 };
+	imu->blocks[0].count = 0;
+
+	defer_init();
+	defer_work_init(&imu->read_work, &mpu6050_read_deferred, imu);
+	imu->read_time_us = 0;
+	imu->read_cycles = 0;
+	imu->read_sequence = 0;
+
+	imu->async = 0;
+	imu->ready = 0;
+	imu->transfer.status = I2C_TRANSFER_IDLE;
+	spsc_init(&imu->record_queue, imu->records, sizeof(struct mpu6050_record), MPU6050_ASYNC_RECORDS);
+	imu->missed = 0;
+
+	imu->fifo_watermark = 0;
+	imu->fifo_drained_us = 0;
+	imu->fifo_stats = (struct mpu6050_fifo_stats) { 0 };
+
+	// sample rate = 8kHz / 110 = 72.7Hz, full scale +/- 2000dps and +/- 4g
+	imu->config = (struct mpu6050_config) {73, MPU6050_DLPF_260HZ, MPU6050_GYRO_2000DPS, MPU6050_ACCEL_4G};
+	imu->config_requested = 0;
+	imu->discard = 0;
+
+	// offsets saved in flash are applied by mpu6050_write_config()
+	imu_calibration_init(&imu->calibration, imu->id);
+	imu_calibration_load(&imu->calibration);
+
+	// configure i2c, a second sensor on the same bus must not reset it
+	if (!buses[i2c == I2C1 ? 0 : 1].configured)
+		mpu6050_set_bus_speed(imu, STANDARD_MODE_100KHZ);
 
 	// configure the MPU6050 (gyro/accelerometer)
-	i2c_write_register(i2c, MPU6050_ADDRESS, 0x6B, 0x00);                     // exit sleep
-	i2c_write_register(i2c, MPU6050_ADDRESS, 0x19, 109);                      // sample rate = 8kHz / 110 = 72.7Hz
-	i2c_write_register(i2c, MPU6050_ADDRESS, 0x1B, 0x18);                     // gyro full scale = +/- 2000dps
-	i2c_write_register(i2c, MPU6050_ADDRESS, 0x1C, 0x08);                     // accelerometer full scale = +/- 4g
-	i2c_write_register(i2c, MPU6050_ADDRESS, 0x38, 0x01);                     // enable INTA interrupt
-
-	// configure the HMC5883L (magnetometer)
-	//i2c_write_register(i2c, MPU6050_ADDRESS, 0x6A, 0x00);                     // disable i2c master mode
-	//i2c_write_register(i2c, MPU6050_ADDRESS, 0x37, 0x02);                     // enable i2c master bypass mode
-	//i2c_write_register(i2c, HMC5883L_ADDRESS, 0x00, 0x18);                     // sample rate = 75Hz
-	//i2c_write_register(i2c, HMC5883L_ADDRESS, 0x01, 0x60);                     // full scale = +/- 2.5 Gauss
-	//i2c_write_register(i2c, HMC5883L_ADDRESS, 0x02, 0x00);                     // continuous measurement mode
-	//i2c_write_register(i2c, MPU6050_ADDRESS, 0x37, 0x00);                     // disable i2c master bypass mode
-	//i2c_write_register(i2c, MPU6050_ADDRESS, 0x6A, 0x20);                     // enable i2c master mode
-
-	// configure the MPU6050 to automatically read the magnetometer
-	//i2c_write_register(i2c, MPU6050_ADDRESS, 0x25, HMC5883L_ADDRESS | 0x80);  // slave 0 i2c address, read mode
-	//i2c_write_register(i2c, MPU6050_ADDRESS, 0x26, 0x03);                     // slave 0 register = 0x03 (x axis)
-	//i2c_write_register(i2c, MPU6050_ADDRESS, 0x27, 6 | 0x80);                 // slave 0 transfer size = 6, enabled
-	//i2c_write_register(i2c, MPU6050_ADDRESS, 0x67, 1);                        // enable slave 0 delay
+	i2c_write_register(i2c, address, 0x6B, 0x00);                             // exit sleep
+	mpu6050_write_config(imu);                                                // sample rate, DLPF and full scale ranges
+	i2c_write_register(i2c, address, 0x38, 0x01);                             // enable INTA interrupt
+
+	// configure the HMC5883L (magnetometer) through the MPU6050's bypass switch
+	i2c_write_register(i2c, address, 0x6A, 0x00);                             // disable i2c master mode
+	i2c_write_register(i2c, address, 0x37, 0x02);                             // enable i2c master bypass mode
+	uint8_t id[3];
+	i2c_read_registers(i2c, HMC5883L_ADDRESS, 3, 0x0A, id);                   // identification = "H43"
+	uint8_t magnetometer_found = (id[0] == 'H' && id[1] == '4' && id[2] == '3');
+	if (magnetometer_found) {
+		i2c_write_register(i2c, HMC5883L_ADDRESS, 0x00, 0x18);                // sample rate = 75Hz
+		i2c_write_register(i2c, HMC5883L_ADDRESS, 0x01, 0x60);                // full scale = +/- 2.5 Gauss
+		i2c_write_register(i2c, HMC5883L_ADDRESS, 0x02, 0x00);                // continuous measurement mode
+	}
+	i2c_write_register(i2c, address, 0x37, 0x00);                             // disable i2c master bypass mode
+
+	// configure the MPU6050 to automatically read the magnetometer into EXT_SENS_DATA,
+	// so the magnetometer arrives in the same burst as the accel and gyro readings.
+	// if the identification does not match, EXT_SENS_DATA stays zero and the filters skip it.
+	if (magnetometer_found) {
+		i2c_write_register(i2c, address, 0x24, 0x40 | 0x0D);                  // wait for external sensor data, 400kHz aux bus
+		i2c_write_register(i2c, address, 0x25, HMC5883L_ADDRESS | 0x80);      // slave 0 i2c address, read mode
+		i2c_write_register(i2c, address, 0x26, 0x03);                         // slave 0 register = 0x03 (x axis)
+		i2c_write_register(i2c, address, 0x27, 6 | 0x80);                     // slave 0 transfer size = 6, enabled
+		mpu6050_set_aux_rate(imu, imu->config.rate_hz);
+		imu->aux_master = 0x20;
+		i2c_write_register(i2c, address, 0x6A, imu->aux_master);              // enable i2c master mode
+	}
 
 	// configure an external interrupt for the MPU6050's active-high INTA signal
-	exti_setup(int_pin, NO_PULL, RISING_EDGE, &mpu6050_hmc5883l_read_sensors);
+	exti_setup(int_pin, NO_PULL, RISING_EDGE, data_ready[imu->id]);
+
+	return 1;
+
+}
+
+/**
+ * Replaces what the data ready interrupt does. Use this to keep the I2C read out
+ * of interrupt context: the handler posts an event, and the task handling the
+ * event calls mpu6050_read_sensors().
+ *
+ * @param imu       The sensor
+ * @param handler   Pointer to the new data ready handler
+ */
+void mpu6050_set_irq_handler(struct mpu6050 *imu, void(*handler)(void)) {
+
+	exti_setup(imu->irq_pin, NO_PULL, RISING_EDGE, handler);
+
+}
+
+/**
+ * Makes the data ready interrupt timestamp the sample and start a background
+ * read (interrupt and DMA driven), then return. Reads of sensors on different
+ * buses overlap. When a read completes, ready() is called in interrupt context;
+ * it should post an event whose task calls mpu6050_service().
+ * Blocks are timestamped with the data ready interrupt, so blocks of different
+ * sensors can be matched up with imu_align.
+ *
+ * @param imu     The sensor
+ * @param ready   Called in interrupt context after each completed read, or 0 to poll mpu6050_service()
+ */
+void mpu6050_start_async(struct mpu6050 *imu, void (*ready)(struct mpu6050 *imu)) {
+
+	imu->transfer.i2c_address = imu->address;
+	imu->transfer.first_reg = 0x3B;
+	imu->transfer.byte_count = MPU6050_RECORD_SIZE;
+	imu->transfer.done = &mpu6050_read_done;
+	imu->transfer.context = imu;
+	imu->ready = ready;
+	imu->async = 1;
+
+	exti_setup(imu->irq_pin, NO_PULL, RISING_EDGE, data_ready[imu->id]);
+
+}
+
+/**
+ * Converts the samples read in the background and gives blocks to the event handler.
+ *
+ * @param imu   The sensor
+ * @returns     Number of samples serviced
+ */
+uint16_t mpu6050_service(struct mpu6050 *imu) {
+
+	uint16_t serviced = mpu6050_drain(imu);
+	if (serviced)
+		mpu6050_apply_requested(imu);
+	return serviced;
+
+}
+
+
+/**
+ * Switches the MPU6050 to FIFO mode. The data ready interrupt is disabled, instead
+ * mpu6050_fifo_poll() must be called periodically to drain the FIFO in bursts.
+ * The I2C bus is switched to 400kHz, which keeps the bursts short.
+ *
+ * @param imu         The sensor
+ * @param rate_hz     Sample rate, 4 to 1000 Hz
+ * @param watermark   Number of samples to let accumulate before mpu6050_fifo_poll() reads them
+ */
+void mpu6050_fifo_setup(struct mpu6050 *imu, uint16_t rate_hz, uint16_t watermark) {
+
+	I2C_TypeDef *i2c = imu->i2c;
+	uint8_t address = imu->address;
+
+	if (rate_hz > 1000) rate_hz = 1000;
+	if (watermark < 1) watermark = 1;
+	if (watermark > FIFO_SIZE / FIFO_SAMPLE_SIZE / 2) watermark = FIFO_SIZE / FIFO_SAMPLE_SIZE / 2;
+	imu->fifo_watermark = watermark;
+	imu->block_length = watermark < IMU_BLOCK_CAPACITY ? watermark : IMU_BLOCK_CAPACITY;
+
+	// other sensors on the bus may be reading in the background, they wait until this is done
+	i2c_async_pause(i2c, 1);
+
+	// stop the data ready interrupt from reading registers in the middle of this
+	i2c_write_register(i2c, address, 0x38, 0x00);                             // disable interrupts
+
+	// mpu6050_write_config() switches the bus to 400kHz for the FIFO bursts
+	imu->fifo_stats.enabled = 1;
+	imu->config.rate_hz = rate_hz;
+	imu->config.dlpf = MPU6050_DLPF_184HZ;                                    // gyro output rate = 1kHz
+	mpu6050_write_config(imu);
+	i2c_write_register(i2c, address, 0x23, 0x78);                             // FIFO: gyro xyz + accel
+	i2c_write_register(i2c, address, 0x6A, 0x04 | imu->aux_master);           // reset the FIFO
+	i2c_write_register(i2c, address, 0x6A, 0x40 | imu->aux_master);           // enable the FIFO
+
+	imu->fifo_drained_us = time_now_us();
+	i2c_async_pause(i2c, 0);
+
+}
+
+// throw away the FIFO contents so the next read starts on a sample boundary. The samples thrown
+// away keep their sequence numbers, so the gap shows downstream. at_least covers samples lost
+// before the reset, such as those overwritten by an overflow
+static void mpu6050_fifo_reset(struct mpu6050 *imu, uint32_t at_least) {
+
+	uint8_t rx_buffer[2];
+	i2c_async_pause(imu->i2c, 1);
+	i2c_read_registers(imu->i2c, imu->address, 2, 0x72, rx_buffer);              // FIFO count, a partial sample counts too
+	i2c_write_register(imu->i2c, imu->address, 0x6A, 0x04 | imu->aux_master); // reset the FIFO (FIFO_EN is cleared)
+	i2c_write_register(imu->i2c, imu->address, 0x6A, 0x40 | imu->aux_master); // enable the FIFO
+	i2c_async_pause(imu->i2c, 0);
+
+	uint32_t count = rx_buffer[0] << 8 | rx_buffer[1];
+	uint32_t discarded = (count + FIFO_SAMPLE_SIZE - 1) / FIFO_SAMPLE_SIZE;
+	if (discarded < at_least)
+		discarded = at_least;
+	imu->sample_sequence += discarded;
+	imu->fifo_stats.discarded += discarded;
+	imu->fifo_drained_us = time_now_us();
+
+}
+
+/**
+ * Drains the FIFO if at least the watermark number of samples is waiting, and
+ * gives the samples to the event handler in blocks. Handles FIFO overflows by resetting
+ * the FIFO, which realigns the stream on a sample boundary. The background reads of
+ * other sensors on the bus are held back during each blocking access.
+ *
+ * @param imu   The sensor
+ * @returns     Number of samples read
+ */
+uint16_t mpu6050_fifo_poll(struct mpu6050 *imu) {
+
+	uint8_t rx_buffer[FIFO_BURST * FIFO_SAMPLE_SIZE];
+
+	// INT_STATUS bit 4 latches a FIFO overflow, reading it clears it
+	i2c_async_pause(imu->i2c, 1);
+	i2c_read_registers(imu->i2c, imu->address, 1, 0x3A, rx_buffer);
+	uint8_t overflow = rx_buffer[0] & 0x10;
+
+	i2c_read_registers(imu->i2c, imu->address, 2, 0x72, rx_buffer);
+	uint16_t count = rx_buffer[0] << 8 | rx_buffer[1];
+	i2c_async_pause(imu->i2c, 0);
+
+	// after an overflow the oldest bytes were overwritten, so sample boundaries are lost. Every
+	// sample taken since the last drain is gone, which the time since then tells best
+	if (overflow || count >= FIFO_SIZE || (count % FIFO_SAMPLE_SIZE) != 0) {
+		uint32_t taken = 0;
+		if (overflow || count >= FIFO_SIZE) {
+			imu->fifo_stats.overflows++;
+			taken = (time_now_us() - imu->fifo_drained_us) / imu->sample_period_us;
+		} else {
+			imu->fifo_stats.realigns++;
+		}
+		mpu6050_fifo_reset(imu, taken);
+		return 0;
+	}
+
+	uint16_t available = count / FIFO_SAMPLE_SIZE;
+	if (available < imu->fifo_watermark)
+		return 0;
+
+	uint32_t now = time_now_us();
+	uint32_t now_cycles = DWT->CYCCNT;
+	uint16_t remaining = available;
+	while (remaining > 0) {
+
+		uint8_t burst = remaining > FIFO_BURST ? FIFO_BURST : remaining;
+		PROF_BEGIN(mpu_fifo_burst);
+		i2c_async_pause(imu->i2c, 1);
+		i2c_read_registers(imu->i2c, imu->address, burst * FIFO_SAMPLE_SIZE, 0x74, rx_buffer);
+		i2c_async_pause(imu->i2c, 0);
+		PROF_END(mpu_fifo_burst);
+		imu->fifo_stats.bursts++;
+
+		// the newest sample was taken about now, older ones one period apart
+		uint32_t age = (remaining - 1) * imu->sample_period_us;
+		uint32_t age_cycles = (remaining - 1) * imu->sample_period_cycles;
+		mpu6050_process(imu, &imu->fifo_layout, rx_buffer, burst, now - age, imu->sample_sequence, now_cycles - age_cycles);
+		imu->sample_sequence += burst;
+
+		remaining -= burst;
+
+	}
+
+	imu->fifo_drained_us = now;
+
+	// hand over whatever is left so every burst reaches the event handler
+	mpu6050_flush(imu);
+
+	// the FIFO holds samples taken during the switch, start over
+	if (imu->config_requested) {
+		mpu6050_apply_requested(imu);
+		mpu6050_fifo_reset(imu, 0);
+	}
+
+	imu->fifo_stats.samples += available;
+	return available;
+
+}
+
+/**
+ * Clears the data ready jitter histogram. The histogram is cleared by the next
+ * data ready interrupt, and also whenever the sample rate changes.
+ *
+ * @param imu          The sensor
+ * @param bin_cycles   Width of a histogram bin in CPU cycles, or 0 for 1us
+ */
+void mpu6050_jitter_reset(struct mpu6050 *imu, uint32_t bin_cycles) {
+
+	if (bin_cycles == 0)
+		bin_cycles = SystemCoreClock / 1000000;
+	imu->jitter.restart_bin_cycles = bin_cycles;
+
+}
+
+/**
+ * Sends the data ready jitter histogram over the UART, see tools/stream_decode.py.
+ *
+ * @param imu   The sensor
+ */
+void mpu6050_jitter_send(const struct mpu6050 *imu) {
+
+	static uint8_t frame[2 + 1 + 8 * 4 + MPU6050_JITTER_BINS * 4 + 2];
+	const struct mpu6050_jitter *jitter = &imu->jitter;
+
+	uint32_t n = 0;
+	frame[n++] = 0xA5;
+	frame[n++] = 0x58;
+	frame[n++] = imu->id;
+	memcpy(&frame[n], &SystemCoreClock, 4);             n += 4;
+	memcpy(&frame[n], &jitter->bin_cycles, 4);          n += 4;
+	memcpy(&frame[n], &jitter->period_q4, 4);           n += 4;
+	memcpy(&frame[n], &jitter->intervals, 4);           n += 4;
+	memcpy(&frame[n], &jitter->lost, 4);                n += 4;
+	memcpy(&frame[n], &imu->missed, 4);                 n += 4;
+	memcpy(&frame[n], &jitter->min_cycles, 4);          n += 4;
+	memcpy(&frame[n], &jitter->max_cycles, 4);          n += 4;
+	memcpy(&frame[n], jitter->bins, sizeof(jitter->bins));
+	n += sizeof(jitter->bins);
+
+	uint16_t checksum = 0;
+	for (uint32_t j = 2; j < n; j++)
+		checksum += frame[j];
+	frame[n++] = checksum & 0xFF;
+	frame[n++] = checksum >> 8;
+
+	uart_send_bytes(frame, n);
 
 }
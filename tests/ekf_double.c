@@ -0,0 +1,45 @@
+// src/ekf.c built in double precision, as the reference for test_ekf.c. The
+// struct and functions are renamed so they link next to the float build, and
+// the struct stays in here, behind the functions below.
+
+#include <math.h>
+
+#define EKF_REAL    double
+#define EKF_SQRT    sqrt
+#define ekf         ekf_double
+#define ekf_init    ekf_double_init
+#define ekf_update  ekf_double_update
+#include "../src/ekf.c"
+
+#include "ekf_double.h"
+
+static struct ekf_double reference;
+
+void ekf_double_reset(float sample_rate_hz) {
+
+	ekf_double_init(&reference, sample_rate_hz);
+
+}
+
+void ekf_double_step(const double g[3], const double a[3], const double m[3]) {
+
+	ekf_double_update(&reference, g[0], g[1], g[2], a[0], a[1], a[2], m[0], m[1], m[2]);
+
+}
+
+void ekf_double_state(double q[4], double bias[3], double *min_variance) {
+
+	q[0] = reference.q0;
+	q[1] = reference.q1;
+	q[2] = reference.q2;
+	q[3] = reference.q3;
+	*min_variance = reference.p[0];
+	for (uint8_t i = 0; i < 3; i++) {
+		bias[i] = reference.bias[i];
+		if (reference.p[P(i, i)] < *min_variance)
+			*min_variance = reference.p[P(i, i)];
+		if (reference.p[P(i + 3, i + 3)] < *min_variance)
+			*min_variance = reference.p[P(i + 3, i + 3)];
+	}
+
+}
@@ -0,0 +1,17 @@
+#pragma once
+// The double precision build of src/ekf.c in ekf_double.c, one filter.
+
+/**
+ * Resets the filter, see ekf_init().
+ */
+void ekf_double_reset(float sample_rate_hz);
+
+/**
+ * One update, see ekf_update().
+ */
+void ekf_double_step(const double g[3], const double a[3], const double m[3]);
+
+/**
+ * Reads the orientation, the gyro bias and the smallest variance on the diagonal of the covariance.
+ */
+void ekf_double_state(double q[4], double bias[3], double *min_variance);
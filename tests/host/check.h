@@ -0,0 +1,44 @@
+#pragma once
+// Assertions and timing for the host tests. A failed CHECK() is printed and
+// counted, and check_result() turns the count into the exit status.
+
+#include <stdio.h>
+#include <time.h>
+
+static int check_failures = 0;
+
+#define CHECK(condition) do {                                                   \
+	if (!(condition)) {                                                         \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);    \
+		check_failures++;                                                       \
+	}                                                                           \
+} while (0)
+
+#define CHECK_NEAR(actual, expected, tolerance) do {                            \
+	double a_ = (actual), e_ = (expected);                                      \
+	if (!(a_ - e_ <= (tolerance) && e_ - a_ <= (tolerance))) {                  \
+		printf("%s:%d: check failed: %s = %g, expected %g +/- %g\n",            \
+		       __FILE__, __LINE__, #actual, a_, e_, (double) (tolerance));      \
+		check_failures++;                                                       \
+	}                                                                           \
+} while (0)
+
+// prints the result of a test program, returns its exit status
+static inline int check_result(const char *name) {
+
+	if (check_failures)
+		printf("%s: %d checks failed\n", name, check_failures);
+	else
+		printf("%s: passed\n", name);
+	return check_failures != 0;
+
+}
+
+// monotonic time in seconds, for the benchmarks
+static inline double host_seconds(void) {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+
+}
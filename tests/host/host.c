@@ -0,0 +1,16 @@
+// The registers and core state behind host/stm32f429xx.h.
+
+#include "stm32f429xx.h"
+
+CoreDebug_Type host_core_debug;
+DWT_Type host_dwt;
+SCB_Type host_scb;
+FPU_Type host_fpu;
+RCC_TypeDef host_rcc;
+TIM_TypeDef host_tim2;
+I2C_TypeDef host_i2c1, host_i2c2;
+
+uint32_t host_primask = 0;
+uint32_t host_ipsr = 0;
+uint32_t SystemCoreClock = 180000000;
+const uint8_t APBPrescTable[8] = { 0, 0, 0, 0, 1, 2, 3, 4 };
@@ -0,0 +1,173 @@
+#pragma once
+// Stand-in for the CMSIS device header, so the hardware independent parts of the
+// firmware can be built and tested on the host. The registers are plain structs
+// in RAM (see host.c) that the tests set and inspect, and the core intrinsics
+// only track the interrupt mask.
+
+#include <stdint.h>
+
+#define __IO volatile
+#define __I  volatile const
+#define __O  volatile
+
+typedef enum {
+	PendSV_IRQn = -2,
+	SysTick_IRQn = -1,
+	TIM2_IRQn = 28,
+} IRQn_Type;
+
+// core
+
+typedef struct {
+	__IO uint32_t DHCSR;
+	__IO uint32_t DCRSR;
+	__IO uint32_t DCRDR;
+	__IO uint32_t DEMCR;
+} CoreDebug_Type;
+
+typedef struct {
+	__IO uint32_t CTRL;
+	__IO uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct {
+	__I  uint32_t CPUID;
+	__IO uint32_t ICSR;
+	__IO uint32_t VTOR;
+	__IO uint32_t AIRCR;
+	__IO uint32_t SCR;
+	__IO uint32_t CCR;
+} SCB_Type;
+
+typedef struct {
+	uint32_t RESERVED0;
+	__IO uint32_t FPCCR;
+	__IO uint32_t FPCAR;
+	__IO uint32_t FPDSCR;
+} FPU_Type;
+
+extern CoreDebug_Type host_core_debug;
+extern DWT_Type host_dwt;
+extern SCB_Type host_scb;
+extern FPU_Type host_fpu;
+
+#define CoreDebug   (&host_core_debug)
+#define DWT         (&host_dwt)
+#define SCB         (&host_scb)
+#define FPU         (&host_fpu)
+
+#define CoreDebug_DEMCR_TRCENA_Msk   (1U << 24)
+#define DWT_CTRL_CYCCNTENA_Msk       (1U << 0)
+#define SCB_ICSR_PENDSVSET_Msk       (1U << 28)
+#define FPU_FPCCR_ASPEN_Msk          (1U << 31)
+#define FPU_FPCCR_LSPEN_Msk          (1U << 30)
+
+extern uint32_t SystemCoreClock;
+extern const uint8_t APBPrescTable[8];
+
+// 1 while interrupts are masked
+extern uint32_t host_primask;
+// exception number while "in an ISR", 0 in thread mode
+extern uint32_t host_ipsr;
+
+static inline uint32_t __get_PRIMASK(void) { return host_primask; }
+static inline void __set_PRIMASK(uint32_t primask) { host_primask = primask; }
+static inline void __disable_irq(void) { host_primask = 1; }
+static inline void __enable_irq(void) { host_primask = 0; }
+static inline void __WFI(void) { }
+static inline void __DMB(void) { __sync_synchronize(); }
+static inline uint32_t __get_IPSR(void) { return host_ipsr; }
+static inline void __set_PSP(uint32_t psp) { (void) psp; }
+
+static inline void NVIC_EnableIRQ(IRQn_Type irq) { (void) irq; }
+static inline void NVIC_DisableIRQ(IRQn_Type irq) { (void) irq; }
+static inline void NVIC_SetPriority(IRQn_Type irq, uint32_t priority) { (void) irq; (void) priority; }
+static inline uint32_t SysTick_Config(uint32_t ticks) { (void) ticks; return 0; }
+
+// peripherals
+
+typedef struct {
+	__IO uint32_t CR;
+	__IO uint32_t PLLCFGR;
+	__IO uint32_t CFGR;
+	__IO uint32_t CIR;
+	__IO uint32_t AHB1RSTR;
+	__IO uint32_t AHB2RSTR;
+	__IO uint32_t AHB3RSTR;
+	uint32_t RESERVED0;
+	__IO uint32_t APB1RSTR;
+	__IO uint32_t APB2RSTR;
+	uint32_t RESERVED1[2];
+	__IO uint32_t AHB1ENR;
+	__IO uint32_t AHB2ENR;
+	__IO uint32_t AHB3ENR;
+	uint32_t RESERVED2;
+	__IO uint32_t APB1ENR;
+	__IO uint32_t APB2ENR;
+} RCC_TypeDef;
+
+typedef struct {
+	__IO uint32_t CR1;
+	__IO uint32_t CR2;
+	__IO uint32_t SMCR;
+	__IO uint32_t DIER;
+	__IO uint32_t SR;
+	__IO uint32_t EGR;
+	__IO uint32_t CCMR1;
+	__IO uint32_t CCMR2;
+	__IO uint32_t CCER;
+	__IO uint32_t CNT;
+	__IO uint32_t PSC;
+	__IO uint32_t ARR;
+	__IO uint32_t RCR;
+	__IO uint32_t CCR1;
+	__IO uint32_t CCR2;
+	__IO uint32_t CCR3;
+	__IO uint32_t CCR4;
+} TIM_TypeDef;
+
+typedef struct {
+	__IO uint32_t MODER;
+	__IO uint32_t OTYPER;
+	__IO uint32_t OSPEEDR;
+	__IO uint32_t PUPDR;
+	__IO uint32_t IDR;
+	__IO uint32_t ODR;
+	__IO uint32_t BSRR;
+	__IO uint32_t LCKR;
+	__IO uint32_t AFR[2];
+} GPIO_TypeDef;
+
+typedef struct {
+	__IO uint32_t CR1;
+	__IO uint32_t CR2;
+	__IO uint32_t OAR1;
+	__IO uint32_t OAR2;
+	__IO uint32_t DR;
+	__IO uint32_t SR1;
+	__IO uint32_t SR2;
+	__IO uint32_t CCR;
+	__IO uint32_t TRISE;
+	__IO uint32_t FLTR;
+} I2C_TypeDef;
+
+extern RCC_TypeDef host_rcc;
+extern TIM_TypeDef host_tim2;
+extern I2C_TypeDef host_i2c1, host_i2c2;
+
+#define RCC    (&host_rcc)
+#define TIM2   (&host_tim2)
+#define I2C1   (&host_i2c1)
+#define I2C2   (&host_i2c2)
+
+#define RCC_CFGR_PPRE1_Pos        10
+#define RCC_CFGR_PPRE1            (7U << RCC_CFGR_PPRE1_Pos)
+#define RCC_APB1ENR_TIM2EN        (1U << 0)
+#define RCC_APB1RSTR_TIM2RST      (1U << 0)
+
+#define TIM_CR1_CEN               (1U << 0)
+#define TIM_DIER_CC1IE            (1U << 1)
+#define TIM_DIER_CC2IE            (1U << 2)
+#define TIM_SR_CC1IF              (1U << 1)
+#define TIM_SR_CC2IF              (1U << 2)
+#define TIM_EGR_UG                (1U << 0)
@@ -0,0 +1,4 @@
+#pragma once
+// The family header some drivers include, the same fake device.
+
+#include "stm32f429xx.h"
@@ -0,0 +1,143 @@
+// Single producer, single consumer queue (src/lib_spsc.c) under load: a producer
+// and a consumer thread move millions of items through queues of a few sizes,
+// with both the copying and the in place functions. The consumer checks that
+// items arrive complete, in order, and exactly once, then the throughput is
+// printed. The host's __DMB() is a full barrier, as on the Cortex-M4.
+//
+// Usage: spsc_stress [items per queue size]
+
+#include "check.h"
+#include "lib_spsc.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ITEMS      2000000
+#define WORDS      8              // per item: the sequence number, then words derived from it
+
+struct item {
+	uint32_t word[WORDS];
+};
+
+static struct spsc queue;
+static uint32_t storage[256 * WORDS];
+static uint32_t items;
+
+// the producer fills every word, so a slot read before it was complete shows up
+static void fill(struct item *item, uint32_t sequence) {
+
+	item->word[0] = sequence;
+	for (uint32_t w = 1; w < WORDS; w++)
+		item->word[w] = sequence * 2654435761u + w;
+
+}
+
+static uint32_t intact(const struct item *item, uint32_t sequence) {
+
+	if (item->word[0] != sequence)
+		return 0;
+	for (uint32_t w = 1; w < WORDS; w++)
+		if (item->word[w] != sequence * 2654435761u + w)
+			return 0;
+	return 1;
+
+}
+
+// every other item is copied in with spsc_push(), the others are filled in place
+static void *producer(void *arg) {
+
+	for (uint32_t sequence = 0; sequence < items; sequence++) {
+		if (sequence & 1) {
+			struct item item;
+			fill(&item, sequence);
+			while (!spsc_push(&queue, &item))
+				sched_yield();
+		} else {
+			struct item *slot;
+			while (!(slot = spsc_reserve(&queue)))
+				sched_yield();
+			fill(slot, sequence);
+			spsc_commit(&queue);
+		}
+	}
+	return 0;
+
+}
+
+// returns the number of items that were out of order or incomplete
+static void *consumer(void *arg) {
+
+	uintptr_t errors = 0;
+	for (uint32_t sequence = 0; sequence < items; sequence++) {
+		if (sequence & 2) {
+			struct item item;
+			while (!spsc_pop(&queue, &item))
+				sched_yield();
+			errors += !intact(&item, sequence);
+		} else {
+			const struct item *slot;
+			while (!(slot = spsc_peek(&queue)))
+				sched_yield();
+			errors += !intact(slot, sequence);
+			spsc_release(&queue);
+		}
+	}
+	return (void *) errors;
+
+}
+
+static void stress(uint16_t slots) {
+
+	CHECK(spsc_init(&queue, storage, sizeof(struct item), slots));
+
+	pthread_t producer_thread, consumer_thread;
+	void *errors;
+	double begin = host_seconds();
+	pthread_create(&consumer_thread, 0, &consumer, 0);
+	pthread_create(&producer_thread, 0, &producer, 0);
+	pthread_join(producer_thread, 0);
+	pthread_join(consumer_thread, &errors);
+	double elapsed = host_seconds() - begin;
+
+	printf("  %3d slots: %u items in %.3fs, %.1f ns per item, %u reservations refused, high water %u\n",
+	       slots, (unsigned) items, elapsed, elapsed * 1e9 / items, (unsigned) queue.overflows, (unsigned) queue.high_water);
+	CHECK((uintptr_t) errors == 0);
+	CHECK(spsc_count(&queue) == 0);
+	CHECK(queue.head == items && queue.tail == items);
+	CHECK(queue.high_water <= slots);
+
+}
+
+// the same items through one thread, without any waiting: the cost of the queue itself
+static void single_thread(void) {
+
+	CHECK(spsc_init(&queue, storage, sizeof(struct item), 16));
+
+	uint32_t errors = 0;
+	struct item item;
+	double begin = host_seconds();
+	for (uint32_t sequence = 0; sequence < items; sequence++) {
+		fill(&item, sequence);
+		spsc_push(&queue, &item);
+		spsc_pop(&queue, &item);
+		errors += !intact(&item, sequence);
+	}
+	double elapsed = host_seconds() - begin;
+
+	printf("  one thread: %.1f ns per push and pop of %d bytes\n", elapsed * 1e9 / items, (int) sizeof(struct item));
+	CHECK(errors == 0);
+
+}
+
+int main(int argc, char *argv[]) {
+
+	items = argc > 1 ? strtoul(argv[1], 0, 0) : ITEMS;
+
+	single_thread();
+	stress(2);
+	stress(16);
+	stress(256);
+	return check_result("spsc_stress");
+
+}
@@ -0,0 +1,148 @@
+// Matching blocks of several sensors by timestamp (src/imu_align.c): sets of
+// simultaneous blocks arriving in any order, a sensor whose samples are taken
+// a little later than the others', a sensor that loses a block, and timestamps
+// wrapping around in the middle of a set.
+
+#include "check.h"
+#include "imu_align.h"
+
+#define PERIOD_US   8000          // blocks of 8 samples at 1kHz
+#define POOL        4             // blocks kept per sensor, like the driver's block pool
+
+static struct imu_align align;
+static struct imu_block blocks[3][POOL];
+static uint32_t next_block[3];
+static const struct imu_block *set[IMU_ALIGN_MAX_SENSORS];
+static uint8_t set_count;
+static uint32_t sets;
+
+static void aligned(const struct imu_block *const received[], uint8_t count) {
+
+	for (uint8_t i = 0; i < count; i++)
+		set[i] = received[i];
+	set_count = count;
+	sets++;
+
+}
+
+// the next block of a sensor, taken at a time
+static const struct imu_block *add(uint8_t sensor, uint32_t timestamp_us) {
+
+	struct imu_block *block = &blocks[sensor][next_block[sensor]++ % POOL];
+	block->sensor = sensor;
+	block->timestamp_us = timestamp_us;
+	block->sample_period_us = PERIOD_US / 8;
+	block->count = 8;
+	imu_align_add(&align, block);
+	return block;
+
+}
+
+static void start(uint8_t sensors, uint32_t tolerance_us) {
+
+	imu_align_init(&align, sensors, tolerance_us, &aligned);
+	sets = 0;
+	set_count = 0;
+
+}
+
+// three sensors, each set complete in a different order, and a set only once every sensor is in it
+static void test_matching(void) {
+
+	start(3, PERIOD_US / 2);
+	static const uint8_t orders[3][3] = { { 0, 1, 2 }, { 2, 0, 1 }, { 1, 2, 0 } };
+	for (uint32_t round = 0; round < 30; round++) {
+		const struct imu_block *expected[3];
+		for (uint8_t i = 0; i < 3; i++) {
+			uint8_t sensor = orders[round % 3][i];
+			CHECK(sets == round);
+			expected[sensor] = add(sensor, 1000 + round * PERIOD_US + sensor * 100);
+		}
+		CHECK(sets == round + 1 && set_count == 3);
+		for (uint8_t sensor = 0; sensor < 3; sensor++)
+			CHECK(set[sensor] == expected[sensor]);
+	}
+	CHECK(align.sets == 30 && align.dropped == 0);
+
+	// a block of an unknown sensor is ignored
+	struct imu_block stray = { .sensor = 3, .timestamp_us = 1000 };
+	imu_align_add(&align, &stray);
+	CHECK(sets == 30 && align.dropped == 0);
+
+}
+
+// sensor 1 samples 3ms after sensor 0: matched within a 4ms tolerance, but with a 2ms one every block is dropped
+static void test_skew(void) {
+
+	start(2, PERIOD_US / 2);
+	for (uint32_t round = 0; round < 10; round++) {
+		add(0, round * PERIOD_US);
+		add(1, round * PERIOD_US + 3000);
+	}
+	CHECK(sets == 10 && align.dropped == 0);
+	CHECK(set[1]->timestamp_us - set[0]->timestamp_us == 3000);
+
+	start(2, 2000);
+	for (uint32_t round = 0; round < 10; round++) {
+		add(0, round * PERIOD_US);
+		add(1, round * PERIOD_US + 3000);
+	}
+	CHECK(sets == 0);
+	CHECK(align.dropped == 19);                       // the last block of sensor 1 is still waiting
+
+	// sensor 1 loses a block: the block of sensor 0 without a partner is dropped, then they match again
+	start(2, PERIOD_US / 2);
+	add(0, 0);
+	add(1, 100);
+	add(0, PERIOD_US);
+	add(0, 2 * PERIOD_US);                             // replaces the one at PERIOD_US, still unmatched
+	CHECK(sets == 1 && align.dropped == 1);
+	add(1, 2 * PERIOD_US + 100);
+	CHECK(sets == 2 && align.dropped == 1);
+	CHECK(set[0]->timestamp_us == 2 * PERIOD_US && set[1]->timestamp_us == 2 * PERIOD_US + 100);
+
+	// a late block of sensor 1 is older than the pending one of sensor 0, so it is the one dropped
+	add(0, 4 * PERIOD_US);
+	add(1, 3 * PERIOD_US + 100);
+	CHECK(sets == 2 && align.dropped == 2);
+	add(1, 4 * PERIOD_US + 100);
+	CHECK(sets == 3 && align.dropped == 2);
+
+}
+
+// the microsecond timestamps wrap every 71 minutes, the order comes from differences
+static void test_wraparound(void) {
+
+	start(2, PERIOD_US / 2);
+	uint32_t begin = 0xFFFFFFFF - 2 * PERIOD_US - 500;
+	for (uint32_t round = 0; round < 6; round++) {
+		add(1, begin + round * PERIOD_US + 1000);
+		add(0, begin + round * PERIOD_US);
+		CHECK(sets == round + 1);
+		CHECK(set[1]->timestamp_us - set[0]->timestamp_us == 1000);
+	}
+	CHECK(align.dropped == 0);
+
+	// sensor 0 just before the wrap and sensor 1 just after it: one set, not the newest dropped as the oldest
+	start(2, PERIOD_US / 2);
+	add(0, 0xFFFFFF00);
+	add(1, 0x00000100);
+	CHECK(sets == 1 && align.dropped == 0);
+
+	// across the wrap, too far apart: the block before the wrap is the older one
+	start(2, PERIOD_US / 2);
+	add(1, 0x00001000);
+	add(0, 0xFFFFF000);
+	CHECK(sets == 0 && align.dropped == 1);
+	CHECK(align.pending[1] != 0 && align.pending[0] == 0);
+
+}
+
+int main(void) {
+
+	test_matching();
+	test_skew();
+	test_wraparound();
+	return check_result("align");
+
+}
@@ -0,0 +1,182 @@
+// Gyro calibration persistence (src/imu_calibration.c) on a fake flash sector
+// mapped at the sector's address: offsets found by imu_calibration_add() are
+// only written by imu_calibration_service(), which never waits for an erase,
+// and a full sector keeps the newest record of every sensor.
+
+#include "check.h"
+#include "imu_calibration.h"
+#include "lib_flash.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static uint32_t *sector;
+static uint32_t erases, writes, busy_polls, busy_left;
+static uint8_t erasing;
+
+// the flash driver, on the mapping: programming can only clear bits, and nothing may be programmed while erasing
+void flash_erase_start(uint8_t sector_number) {
+
+	CHECK(sector_number == IMU_CALIBRATION_SECTOR);
+	CHECK(!erasing);
+	memset(sector, 0xFF, IMU_CALIBRATION_SIZE);
+	erasing = 1;
+	busy_left = 3;
+	erases++;
+
+}
+
+uint8_t flash_busy(void) {
+
+	busy_polls++;
+	if (busy_left > 0)
+		busy_left--;
+	return busy_left > 0;
+
+}
+
+uint8_t flash_erase_finish(void) {
+
+	CHECK(erasing);
+	erasing = 0;
+	busy_left = 0;
+	return 1;
+
+}
+
+uint8_t flash_erase_sector(uint8_t sector_number) {
+
+	flash_erase_start(sector_number);
+	return flash_erase_finish();
+
+}
+
+uint8_t flash_write_words(uint32_t address, const uint32_t *data, uint32_t words) {
+
+	CHECK(!erasing);
+	CHECK(address >= IMU_CALIBRATION_ADDRESS && address + 4 * words <= IMU_CALIBRATION_ADDRESS + IMU_CALIBRATION_SIZE);
+	uint32_t *word = (uint32_t *) (uintptr_t) address;
+	for (uint32_t i = 0; i < words; i++) {
+		CHECK(word[i] == 0xFFFFFFFF);
+		word[i] &= data[i];
+	}
+	writes++;
+	return 1;
+
+}
+
+// one window of a still sensor with the given gyro bias in counts
+static uint8_t add_still_window(struct imu_calibration *cal, int16_t x, int16_t y, int16_t z) {
+
+	const int16_t gyro[3] = { x, y, z };
+	const int16_t accel[3] = { 0, 0, 8192 };
+	uint8_t changed = 0;
+	for (uint32_t n = 0; n < IMU_CALIBRATION_WINDOW; n++)
+		changed |= imu_calibration_add(cal, gyro, accel);
+	return changed;
+
+}
+
+static void test_deferred_save(void) {
+
+	struct imu_calibration cal, loaded;
+	imu_calibration_init(&cal, 1);
+	CHECK(!imu_calibration_load(&cal));
+
+	CHECK(add_still_window(&cal, 100, -50, 20));
+	CHECK(cal.source == CALIBRATION_MEASURED);
+	CHECK(cal.save_pending);
+	CHECK(writes == 0);
+
+	CHECK(imu_calibration_service(&cal));
+	CHECK(!cal.save_pending);
+	CHECK(writes == 1 && cal.saves == 1);
+	CHECK(!imu_calibration_service(&cal));
+	CHECK(writes == 1);
+
+	imu_calibration_init(&loaded, 1);
+	CHECK(imu_calibration_load(&loaded));
+	CHECK(imu_calibration_offset(&loaded, 0) == 100 && imu_calibration_offset(&loaded, 1) == -50 && imu_calibration_offset(&loaded, 2) == 20);
+
+	// refinement only marks a save once the offsets drifted 4 counts from the saved ones
+	add_still_window(&cal, 101, -50, 20);
+	CHECK(!cal.save_pending);
+	for (uint32_t n = 0; n < 40 && !cal.save_pending; n++)
+		add_still_window(&cal, 120, -50, 20);
+	CHECK(cal.save_pending);
+	CHECK(writes == 1);
+	CHECK(imu_calibration_service(&cal));
+	CHECK(cal.sequence == 2);
+
+}
+
+// fills the sector with records of three sensors, then saves again in the background
+static void test_full_sector(void) {
+
+	struct imu_calibration cal[3], loaded;
+	memset(sector, 0xFF, IMU_CALIBRATION_SIZE);
+	for (uint32_t s = 0; s < 3; s++)
+		imu_calibration_init(&cal[s], 10 + s);
+
+	const uint32_t slots = IMU_CALIBRATION_SIZE / 32;
+	for (uint32_t n = 0; n < slots; n++) {
+		struct imu_calibration *c = &cal[n % 3];
+		c->offset[0] = n * 16;
+		c->offset[1] = -(int32_t) c->id * 16;
+		CHECK(imu_calibration_save(c));
+	}
+	CHECK(erases == 0);
+
+	// the sensor whose offsets changed starts the erase, and nothing waits for it
+	cal[0].offset[0] = 7 * 16;
+	cal[0].save_pending = 1;
+	uint32_t saves = cal[0].saves;
+	CHECK(!imu_calibration_service(&cal[0]));
+	CHECK(erases == 1 && erasing);
+	uint32_t polls = 0;
+	while (!imu_calibration_service(&cal[0]))
+		CHECK(++polls < 10);
+	CHECK(polls == 2);
+	CHECK(cal[0].saves == saves + 1);
+
+	// every sensor finds its newest offsets after the erase
+	for (uint32_t s = 0; s < 3; s++) {
+		imu_calibration_init(&loaded, 10 + s);
+		CHECK(imu_calibration_load(&loaded));
+		CHECK(loaded.sequence == cal[s].sequence);
+		CHECK(loaded.offset[0] == cal[s].offset[0]);
+		CHECK(loaded.offset[1] == -(int32_t) (10 + s) * 16);
+	}
+	CHECK(sector[4 * 8] == 0xFFFFFFFF);   // three kept records and the new one
+
+	// the blocking save keeps them too
+	memset(sector, 0xFF, IMU_CALIBRATION_SIZE);
+	for (uint32_t n = 0; n < slots; n++)
+		CHECK(imu_calibration_save(&cal[n % 3]));
+	cal[2].offset[2] = 5 * 16;
+	CHECK(imu_calibration_save(&cal[2]));
+	CHECK(erases == 2);
+	for (uint32_t s = 0; s < 3; s++) {
+		imu_calibration_init(&loaded, 10 + s);
+		CHECK(imu_calibration_load(&loaded));
+		CHECK(loaded.sequence == cal[s].sequence);
+		CHECK(loaded.offset[2] == cal[s].offset[2]);
+	}
+
+}
+
+int main(void) {
+
+	sector = mmap((void *) IMU_CALIBRATION_ADDRESS, IMU_CALIBRATION_SIZE, PROT_READ | PROT_WRITE,
+	              MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (sector != (void *) IMU_CALIBRATION_ADDRESS) {
+		printf("calibration: cannot map the flash sector at 0x%08X\n", IMU_CALIBRATION_ADDRESS);
+		return 1;
+	}
+	memset(sector, 0xFF, IMU_CALIBRATION_SIZE);
+
+	test_deferred_save();
+	test_full_sector();
+	return check_result("calibration");
+
+}
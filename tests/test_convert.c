@@ -0,0 +1,186 @@
+// Register dump conversion (src/imu_convert.c) against the byte by byte
+// assembly and float division the MPU6050 driver used before, on the register
+// layout of the MPU6050 and HMC5883L, plus its cost per sample.
+
+#include "check.h"
+#include "imu_convert.h"
+#include <math.h>
+#include <string.h>
+
+#define RECORD_SIZE 20
+#define RECORDS     20000
+
+static const uint8_t register_axes[] = {
+	IMU_ACCEL_X, IMU_ACCEL_Y, IMU_ACCEL_Z, IMU_CONVERT_DROP,
+	IMU_GYRO_X, IMU_GYRO_Y, IMU_GYRO_Z,
+	IMU_MAGN_X, IMU_MAGN_Z, IMU_MAGN_Y
+};
+
+// accel at 4g, gyro at 2000dps in radians per second, magnetometer at 1.3Ga
+static const float register_scales[] = {
+	1.0f / 8192.0f, 1.0f / 8192.0f, 1.0f / 8192.0f, 0.0f,
+	1.0f / 939.650784f, 1.0f / 939.650784f, 1.0f / 939.650784f,
+	1.0f / 660.0f, 1.0f / 660.0f, 1.0f / 660.0f
+};
+
+static uint8_t records[RECORDS * RECORD_SIZE];
+static struct imu_block block, reference_block;
+static uint32_t random_state = 1;
+
+static uint8_t random_byte(void) {
+
+	random_state = random_state * 1664525 + 1013904223;
+	return random_state >> 24;
+
+}
+
+static void fill_records(void) {
+
+	for (uint32_t n = 0; n < sizeof(records); n++)
+		records[n] = random_byte();
+
+	// the extremes of every value in the first records
+	static const int16_t extremes[] = { -32768, -32767, -1, 0, 1, 32766, 32767 };
+	for (uint32_t r = 0; r < 7; r++)
+		for (uint32_t v = 0; v < RECORD_SIZE / 2; v++) {
+			records[r * RECORD_SIZE + 2 * v] = (uint16_t) extremes[r] >> 8;
+			records[r * RECORD_SIZE + 2 * v + 1] = (uint16_t) extremes[r] & 0xFF;
+		}
+
+}
+
+static uint32_t close_enough(float actual, float expected) {
+
+	return fabsf(actual - expected) <= 2e-7f * fabsf(expected);
+
+}
+
+// the conversion as the driver used to do it, one sample at a time
+static void legacy_convert(const uint8_t *rx_buffer, const int16_t gyro_offset[3], float out[IMU_AXES], int16_t raw[IMU_AXES]) {
+
+	int16_t accel_x_raw = rx_buffer[0]  << 8 | rx_buffer[1];
+	int16_t accel_y_raw = rx_buffer[2]  << 8 | rx_buffer[3];
+	int16_t accel_z_raw = rx_buffer[4]  << 8 | rx_buffer[5];
+	int16_t gyro_x_raw  = rx_buffer[8]  << 8 | rx_buffer[9];
+	int16_t gyro_y_raw  = rx_buffer[10] << 8 | rx_buffer[11];
+	int16_t gyro_z_raw  = rx_buffer[12] << 8 | rx_buffer[13];
+	int16_t magn_x_raw  = rx_buffer[14] << 8 | rx_buffer[15];
+	int16_t magn_z_raw  = rx_buffer[16] << 8 | rx_buffer[17];
+	int16_t magn_y_raw  = rx_buffer[18] << 8 | rx_buffer[19];
+
+	gyro_x_raw -= gyro_offset[0];
+	gyro_y_raw -= gyro_offset[1];
+	gyro_z_raw -= gyro_offset[2];
+
+	raw[IMU_ACCEL_X] = accel_x_raw;  out[IMU_ACCEL_X] = accel_x_raw / 8192.0f;
+	raw[IMU_ACCEL_Y] = accel_y_raw;  out[IMU_ACCEL_Y] = accel_y_raw / 8192.0f;
+	raw[IMU_ACCEL_Z] = accel_z_raw;  out[IMU_ACCEL_Z] = accel_z_raw / 8192.0f;
+	raw[IMU_GYRO_X] = gyro_x_raw;    out[IMU_GYRO_X] = gyro_x_raw / 939.650784f;
+	raw[IMU_GYRO_Y] = gyro_y_raw;    out[IMU_GYRO_Y] = gyro_y_raw / 939.650784f;
+	raw[IMU_GYRO_Z] = gyro_z_raw;    out[IMU_GYRO_Z] = gyro_z_raw / 939.650784f;
+	raw[IMU_MAGN_X] = magn_x_raw;    out[IMU_MAGN_X] = magn_x_raw / 660.0f;
+	raw[IMU_MAGN_Y] = magn_y_raw;    out[IMU_MAGN_Y] = magn_y_raw / 660.0f;
+	raw[IMU_MAGN_Z] = magn_z_raw;    out[IMU_MAGN_Z] = magn_z_raw / 660.0f;
+
+}
+
+static void test_against_legacy(void) {
+
+	struct imu_convert convert;
+	imu_convert_init(&convert, RECORD_SIZE, register_axes, register_scales);
+	static const int16_t gyro_offset[3] = { -123, 32767, -32768 };
+	imu_convert_set_offset(&convert, IMU_GYRO_X, gyro_offset[0]);
+	imu_convert_set_offset(&convert, IMU_GYRO_Y, gyro_offset[1]);
+	imu_convert_set_offset(&convert, IMU_GYRO_Z, gyro_offset[2]);
+
+	uint32_t raw_mismatches = 0, value_mismatches = 0;
+	for (uint32_t first = 0; first < RECORDS; first += IMU_BLOCK_CAPACITY) {
+
+		// in two parts, so appending to a partly filled block is covered
+		block.count = 0;
+		imu_convert(&convert, &records[first * RECORD_SIZE], 5, &block);
+		imu_convert(&convert, &records[(first + 5) * RECORD_SIZE], IMU_BLOCK_CAPACITY - 5, &block);
+		CHECK(block.count == IMU_BLOCK_CAPACITY);
+
+		for (uint32_t n = 0; n < IMU_BLOCK_CAPACITY && first + n < RECORDS; n++) {
+			float expected[IMU_AXES];
+			int16_t raw[IMU_AXES];
+			legacy_convert(&records[(first + n) * RECORD_SIZE], gyro_offset, expected, raw);
+			for (uint32_t axis = 0; axis < IMU_AXES; axis++) {
+				if (block.raw[axis][n] != raw[axis])
+					raw_mismatches++;
+				if (!close_enough(block.value[axis][n], expected[axis]))
+					value_mismatches++;
+			}
+		}
+
+	}
+
+	CHECK(raw_mismatches == 0);
+	CHECK(value_mismatches == 0);
+	CHECK(imu_convert_extract(&convert, records, IMU_MAGN_Y) == (int16_t)(records[18] << 8 | records[19]));
+
+}
+
+static void test_unmapped_and_flipped(void) {
+
+	// accel only, z flipped: everything else reads 0
+	static const uint8_t axes[] = { IMU_ACCEL_X, IMU_ACCEL_Y, IMU_ACCEL_Z, IMU_CONVERT_DROP };
+	static const float scales[] = { 0.5f, 0.5f, -0.5f, 0.0f };
+	struct imu_convert convert;
+	imu_convert_init(&convert, 8, axes, scales);
+	imu_convert_set_offset(&convert, IMU_ACCEL_Z, 100);
+
+	memset(&block, 0xFF, sizeof(block));
+	block.count = 0;
+	static const uint8_t record[8] = { 0x01, 0x00, 0xFF, 0xFE, 0x00, 0x64, 0x12, 0x34 };
+	imu_convert(&convert, record, 1, &block);
+
+	CHECK(block.raw[IMU_ACCEL_X][0] == 256 && block.value[IMU_ACCEL_X][0] == 128.0f);
+	CHECK(block.raw[IMU_ACCEL_Y][0] == -2 && block.value[IMU_ACCEL_Y][0] == -1.0f);
+	CHECK(block.raw[IMU_ACCEL_Z][0] == 0 && block.value[IMU_ACCEL_Z][0] == 0.0f);
+	for (uint32_t axis = 0; axis < IMU_AXES; axis++)
+		if (axis < IMU_ACCEL_X || axis > IMU_ACCEL_Z)
+			CHECK(block.raw[axis][0] == 0 && block.value[axis][0] == 0.0f);
+
+}
+
+static void benchmark(void) {
+
+	struct imu_convert convert;
+	imu_convert_init(&convert, RECORD_SIZE, register_axes, register_scales);
+	imu_convert_set_offset(&convert, IMU_GYRO_X, 17);
+
+	uint32_t reference_cycles, mismatches;
+	imu_convert_benchmark(&convert, &reference_cycles, &mismatches);
+	CHECK(mismatches == 0);
+
+	double start = host_seconds();
+	for (uint32_t first = 0; first + IMU_BLOCK_CAPACITY <= RECORDS; first += IMU_BLOCK_CAPACITY) {
+		block.count = 0;
+		imu_convert(&convert, &records[first * RECORD_SIZE], IMU_BLOCK_CAPACITY, &block);
+	}
+	double fast = host_seconds() - start;
+
+	start = host_seconds();
+	for (uint32_t first = 0; first + IMU_BLOCK_CAPACITY <= RECORDS; first += IMU_BLOCK_CAPACITY) {
+		reference_block.count = 0;
+		imu_convert_reference(&convert, &records[first * RECORD_SIZE], IMU_BLOCK_CAPACITY, &reference_block);
+	}
+	double reference = host_seconds() - start;
+
+	uint32_t samples = RECORDS / IMU_BLOCK_CAPACITY * IMU_BLOCK_CAPACITY;
+	printf("convert: %.1f ns per sample, reference %.1f ns (host, portable REV16/SSUB16)\n", fast * 1e9 / samples, reference * 1e9 / samples);
+
+}
+
+int main(void) {
+
+	fill_records();
+	test_against_legacy();
+	test_unmapped_and_flipped();
+	benchmark();
+
+	return check_result("test_convert");
+
+}
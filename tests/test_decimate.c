@@ -0,0 +1,271 @@
+// Multistage decimation (src/imu_decimate.c): the response of the designed
+// filters, the 1kHz -> 250Hz -> 125Hz pipeline against a double precision
+// filter-then-drop reference, the group delay correction of the timestamps, the
+// restart after a gap, and the cost per input sample.
+
+#include "check.h"
+#include "imu_decimate.h"
+#include <math.h>
+#include <string.h>
+
+#define RATE_HZ     1000
+#define OUTPUT_HZ   125
+#define INPUTS      4096
+#define OUTPUTS     (INPUTS / 8)
+#define TAPS_1      24
+#define TAPS_2      32
+#define PI          3.14159265358979
+
+static struct imu_decimate decimate;
+static struct imu_block block;
+static float output[OUTPUTS + 64][IMU_AXES];
+static uint32_t output_time_us[OUTPUTS + 64];
+static uint32_t output_sample[OUTPUTS + 64];
+static uint32_t output_count;
+static uint32_t output_blocks;
+
+static void collect(const struct imu_block *out) {
+
+	CHECK(out->sequence == output_blocks);
+	output_blocks++;
+	for (uint16_t n = 0; n < out->count && output_count < OUTPUTS + 64; n++, output_count++) {
+		for (uint8_t axis = 0; axis < IMU_AXES; axis++)
+			output[output_count][axis] = out->value[axis][n];
+		output_time_us[output_count] = out->timestamp_us + n * out->sample_period_us;
+		output_sample[output_count] = out->first_sample + n;
+	}
+
+}
+
+static void start(void) {
+
+	imu_decimate_init(&decimate, 16, &collect);
+	CHECK(imu_decimate_add_stage(&decimate, 4, 0, TAPS_1));
+	CHECK(imu_decimate_add_stage(&decimate, 2, 0, TAPS_2));
+	output_count = 0;
+	output_blocks = 0;
+
+}
+
+// the test signal on every axis: a sine, with a phase per axis, plus an offset
+static double signal(uint32_t n, double frequency, double offset, uint8_t axis) {
+
+	return offset + sin(2.0 * PI * frequency * n / RATE_HZ + axis);
+
+}
+
+// feeds samples first .. first + count - 1 in blocks of IMU_BLOCK_CAPACITY
+static void feed(uint32_t first, uint32_t count, double frequency, double offset) {
+
+	for (uint32_t n = first; n < first + count; ) {
+		block.count = first + count - n < IMU_BLOCK_CAPACITY ? first + count - n : IMU_BLOCK_CAPACITY;
+		block.first_sample = n;
+		block.timestamp_us = n * (1000000 / RATE_HZ);
+		block.sample_period_us = 1000000 / RATE_HZ;
+		for (uint16_t i = 0; i < block.count; i++)
+			for (uint8_t axis = 0; axis < IMU_AXES; axis++)
+				block.value[axis][i] = signal(n + i, frequency, offset, axis);
+		imu_decimate_process(&decimate, &block);
+		n += block.count;
+	}
+
+}
+
+// peak amplitude of the outputs of one axis after the filters have settled
+static double amplitude(uint8_t axis, double offset) {
+
+	double peak = 0.0;
+	for (uint32_t n = 16; n < output_count; n++)
+		if (fabs(output[n][axis] - offset) > peak)
+			peak = fabs(output[n][axis] - offset);
+	return peak;
+
+}
+
+// the designs: symmetric, unity gain at DC and half at the cutoff. Short stages have wide transitions,
+// the pipeline below checks that together they keep aliases out of the output band
+static void test_design(void) {
+
+	float taps[IMU_DECIMATE_TAPS];
+	static const uint8_t designs[][2] = { { 4, TAPS_1 }, { 2, TAPS_2 } };
+
+	for (uint8_t d = 0; d < 2; d++) {
+
+		uint8_t factor = designs[d][0];
+		uint8_t tap_count = designs[d][1];
+		imu_decimate_design(taps, tap_count, factor);
+
+		double sum = 0.0;
+		for (uint8_t k = 0; k < tap_count; k++) {
+			sum += taps[k];
+			CHECK_NEAR(taps[k], taps[tap_count - 1 - k], 1e-7);          // symmetric, so linear phase
+		}
+		CHECK_NEAR(sum, 1.0, 1e-6);
+
+		float cutoff = 0.8f * 0.5f / factor;
+		CHECK_NEAR(imu_decimate_gain(taps, tap_count, 0.0f), 1.0, 1e-6);
+		CHECK_NEAR(imu_decimate_gain(taps, tap_count, cutoff), 0.5, 0.1);
+
+		// the worst gain from twice the cutoff, where the first alias of the band below half the cutoff starts
+		float rejection = 0.0f;
+		for (float f = 2.0f * cutoff; f <= 0.5f; f += 0.0005f)
+			if (imu_decimate_gain(taps, tap_count, f) > rejection)
+				rejection = imu_decimate_gain(taps, tap_count, f);
+
+		printf("  factor %d, %2d taps: gain %.4f at half the cutoff, %.3f at the cutoff %.4f, down %.1f dB from %.4f\n",
+		       factor, tap_count, imu_decimate_gain(taps, tap_count, 0.5f * cutoff), imu_decimate_gain(taps, tap_count, cutoff),
+		       cutoff, -20.0 * log10(rejection), 2.0f * cutoff);
+		CHECK(rejection < 0.01f);
+
+	}
+
+}
+
+// a direct filter-then-drop cascade in double precision on the same designs
+static void reference(double frequency, double offset, uint8_t axis, double *out, uint32_t *out_count) {
+
+	static double x[INPUTS], y[INPUTS];
+	float taps_1[TAPS_1], taps_2[TAPS_2];
+	imu_decimate_design(taps_1, TAPS_1, 4);
+	imu_decimate_design(taps_2, TAPS_2, 2);
+
+	// the delay lines start filled with the first input
+	for (uint32_t n = 0; n < INPUTS; n++)
+		x[n] = signal(n, frequency, offset, axis);
+	uint32_t count = 0;
+	for (uint32_t n = 3; n < INPUTS; n += 4, count++) {
+		double sum = 0.0;
+		for (uint32_t k = 0; k < TAPS_1; k++)
+			sum += taps_1[k] * x[n >= k ? n - k : 0];
+		y[count] = sum;
+	}
+	*out_count = 0;
+	for (uint32_t n = 1; n < count; n += 2) {
+		double sum = 0.0;
+		for (uint32_t k = 0; k < TAPS_2; k++)
+			sum += taps_2[k] * y[n >= k ? n - k : 0];
+		out[(*out_count)++] = sum;
+	}
+
+}
+
+static void test_pipeline(void) {
+
+	static double expected[INPUTS];
+	uint32_t expected_count;
+
+	// in band: passes, matches the reference, and the timestamps are corrected for the delay of both filters
+	start();
+	feed(0, INPUTS, 10.0, 0.5);
+	CHECK(output_count == OUTPUTS);
+	CHECK(output_blocks == OUTPUTS / 16);
+	CHECK(decimate.stage[0].inputs == INPUTS && decimate.stage[0].outputs == INPUTS / 4);
+	CHECK(decimate.stage[1].outputs == OUTPUTS);
+	for (uint8_t axis = 0; axis < IMU_AXES; axis++) {
+		reference(10.0, 0.5, axis, expected, &expected_count);
+		CHECK(expected_count == output_count);
+		double worst = 0.0;
+		for (uint32_t n = 0; n < output_count; n++)
+			if (fabs(output[n][axis] - expected[n]) > worst)
+				worst = fabs(output[n][axis] - expected[n]);
+		CHECK(worst < 2e-5);
+	}
+	CHECK(output_sample[OUTPUTS - 1] == OUTPUTS - 1);
+	CHECK(output_time_us[1] - output_time_us[0] == 1000000 / OUTPUT_HZ);
+	double timing = 0.0;
+	for (uint32_t n = 16; n < output_count; n++) {
+		double t = output_time_us[n] * 1e-6;
+		double error = fabs(output[n][IMU_ACCEL_X] - 0.5 - sin(2.0 * PI * 10.0 * t + IMU_ACCEL_X));
+		if (error > timing)
+			timing = error;
+	}
+	printf("  10Hz in band: gain %.4f, worst error against the delayed input %.4f\n", amplitude(IMU_ACCEL_X, 0.5), timing);
+	CHECK_NEAR(amplitude(IMU_ACCEL_X, 0.5), 1.0, 0.01);
+	CHECK(timing < 0.02);
+
+	// 240Hz would read as 10Hz at 125Hz if the samples were just dropped
+	start();
+	feed(0, INPUTS, 240.0, 0.5);
+	printf("  240Hz, aliasing onto 10Hz: gain %.5f\n", amplitude(IMU_GYRO_Y, 0.5));
+	CHECK(amplitude(IMU_GYRO_Y, 0.5) < 0.00316);
+
+	// a sweep of the whole pipeline: within 2% up to 20Hz, and whatever would fold back onto 0 to 40Hz
+	// (85Hz and up) at least 50dB down
+	double passband = 0.0, aliases = 0.0;
+	for (double frequency = 5.0; frequency < 500.0; frequency += 5.0) {
+		start();
+		feed(0, INPUTS, frequency, 0.0);
+		double gain = amplitude(IMU_MAGN_Z, 0.0);
+		if (frequency <= 20.0 && fabs(gain - 1.0) > passband)
+			passband = fabs(gain - 1.0);
+		if (frequency >= 85.0 && gain > aliases)
+			aliases = gain;
+	}
+	printf("  1kHz to 125Hz: %.2f dB ripple up to 20Hz, aliases onto 0 to 40Hz down %.1f dB\n",
+	       -20.0 * log10(1.0 - passband), -20.0 * log10(aliases));
+	CHECK(passband < 0.02);
+	CHECK(aliases < 0.00316);
+
+	// a single stage of as many taps as the longer one does far worse
+	float taps[IMU_DECIMATE_TAPS];
+	imu_decimate_design(taps, IMU_DECIMATE_TAPS, 8);
+	float single = 0.0f;
+	for (float f = 0.085f; f <= 0.5f; f += 0.0005f)
+		if (imu_decimate_gain(taps, IMU_DECIMATE_TAPS, f) > single)
+			single = imu_decimate_gain(taps, IMU_DECIMATE_TAPS, f);
+	printf("  one %d tap stage instead: aliases down %.1f dB\n", IMU_DECIMATE_TAPS, -20.0 * log10(single));
+	CHECK(aliases < single / 10);
+
+}
+
+// samples missing between blocks restart the delay lines, nothing from before the gap leaks through
+static void test_gap(void) {
+
+	// 25 outputs, 9 of them still in the block in progress
+	start();
+	feed(0, 200, 0.0, 1.0);
+	CHECK(output_count == 16 && output_blocks == 1);
+
+	// 100 samples are lost and the level changed meanwhile
+	feed(300, 400, 0.0, 3.0);
+	CHECK(decimate.restarts == 1);
+	CHECK(output_count == 73);                            // the partial block went out at the gap
+	CHECK(output_sample[24] == 24);
+	CHECK(output_sample[25] == 25 + 13);                  // 100 / 8 rounded up
+	CHECK_NEAR(output[24][IMU_GYRO_X], signal(0, 0.0, 1.0, IMU_GYRO_X), 1e-5);
+	double worst = 0.0;
+	for (uint32_t n = 25; n < output_count; n++)
+		if (fabs(output[n][IMU_GYRO_X] - signal(0, 0.0, 3.0, IMU_GYRO_X)) > worst)
+			worst = fabs(output[n][IMU_GYRO_X] - signal(0, 0.0, 3.0, IMU_GYRO_X));
+	CHECK(worst < 1e-5);
+
+	// contiguous blocks do not restart
+	feed(700, 300, 0.0, 3.0);
+	CHECK(decimate.restarts == 1);
+
+}
+
+// host time per input sample, and how it splits between the stages
+static void test_cost(void) {
+
+	start();
+	double begin = host_seconds();
+	for (uint32_t round = 0; round < 64; round++)
+		feed(round * INPUTS, INPUTS, 10.0, 0.0);
+	double elapsed = host_seconds() - begin;
+	printf("  imu_decimate_process on the host: %.1f ns per input sample of 10 axes, %u outputs per stage %u and %u\n",
+	       elapsed * 1e9 / (64.0 * INPUTS), (unsigned) decimate.stage[0].outputs, (unsigned) decimate.stage[1].inputs,
+	       (unsigned) decimate.stage[1].outputs);
+	CHECK(decimate.restarts == 0);
+
+}
+
+int main(void) {
+
+	test_design();
+	test_pipeline();
+	test_gap();
+	test_cost();
+	return check_result("decimate");
+
+}
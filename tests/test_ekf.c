@@ -0,0 +1,156 @@
+// The extended Kalman filter (src/ekf.c) in single precision against a double
+// precision build of the same source (ekf_double.c), fed the same synthetic
+// recordings (trace.h): how far the float orientation and gyro bias stray from
+// the double ones, whether the float covariance stays positive, how well both
+// track the true orientation and find the true bias, and the cost of an update
+// in each precision.
+
+#include "check.h"
+#include "ekf.h"
+#include "ekf_double.h"
+#include "trace.h"
+#include <stdio.h>
+
+#define RATE_HZ     1000
+#define BLOCKS      (20 * RATE_HZ / IMU_BLOCK_CAPACITY)   // 20s
+#define SAMPLES     (BLOCKS * IMU_BLOCK_CAPACITY)
+
+static struct imu_block trace[BLOCKS];
+static double truth[SAMPLES][4];
+
+struct dataset {
+	const char *name;
+	struct trace_motion motion;
+	double max_divergence_deg;   // float against double, anywhere in the trace
+	double max_error_deg;        // double against the truth, over the last half
+	double max_bias_error_dps;   // either against the true bias at the end
+};
+
+static const struct dataset datasets[] = {
+	{ "still", { .gyro_noise_dps = 0.1, .accel_noise_g = 0.005, .magn_noise_gauss = 0.002, .bias_dps = { 0.5, -0.3, 0.2 }, .seed = 20 },
+	  0.01, 0.2, 0.05 },
+	{ "60dps", { .rate_dps = 60.0, .bias_dps = { 0.5, -0.3, 0.2 }, .gyro_noise_dps = 0.1, .accel_noise_g = 0.005, .magn_noise_gauss = 0.002, .seed = 21 },
+	  0.01, 0.2, 0.05 },
+	{ "200dps", { .rate_dps = 200.0, .bias_dps = { -1.0, 0.7, 0.4 }, .gyro_noise_dps = 0.1, .accel_noise_g = 0.005, .magn_noise_gauss = 0.002, .seed = 22 },
+	  0.01, 0.2, 0.05 },
+};
+
+static void test_dataset(const struct dataset *dataset) {
+
+	trace_generate(&dataset->motion, RATE_HZ, BLOCKS, trace, truth, 0);
+
+	struct ekf filter;
+	ekf_init(&filter, RATE_HZ);
+	ekf_double_reset(RATE_HZ);
+
+	double divergence = 0.0, error = 0.0, float_error = 0.0, min_variance = 1.0;
+	double q[4], bias[3], variance;
+	uint32_t sample = 0;
+
+	for (uint32_t b = 0; b < BLOCKS; b++) {
+		const struct imu_block *block = &trace[b];
+		for (uint32_t n = 0; n < block->count; n++, sample++) {
+
+			const float *v[IMU_AXES];
+			for (uint32_t axis = 0; axis < IMU_AXES; axis++)
+				v[axis] = &block->value[axis][n];
+			ekf_update(&filter, *v[IMU_GYRO_X], *v[IMU_GYRO_Y], *v[IMU_GYRO_Z], *v[IMU_ACCEL_X], *v[IMU_ACCEL_Y], *v[IMU_ACCEL_Z],
+			           *v[IMU_MAGN_X], *v[IMU_MAGN_Y], *v[IMU_MAGN_Z]);
+			ekf_double_step((double[3]) { *v[IMU_GYRO_X], *v[IMU_GYRO_Y], *v[IMU_GYRO_Z] },
+			                (double[3]) { *v[IMU_ACCEL_X], *v[IMU_ACCEL_Y], *v[IMU_ACCEL_Z] },
+			                (double[3]) { *v[IMU_MAGN_X], *v[IMU_MAGN_Y], *v[IMU_MAGN_Z] });
+
+			ekf_double_state(q, bias, &variance);
+			float estimate[4] = { filter.q0, filter.q1, filter.q2, filter.q3 };
+			double d = trace_error_deg(estimate, q);
+			if (d > divergence)
+				divergence = d;
+			if (variance < min_variance)
+				min_variance = variance;
+			for (uint32_t i = 0; i < EKF_STATES; i++)
+				CHECK(filter.p[i * EKF_STATES - i * (i - 1) / 2] > 0.0f);
+
+			if (sample >= SAMPLES / 2) {
+				float reference[4] = { q[0], q[1], q[2], q[3] };
+				double e = trace_error_deg(reference, truth[sample]);
+				if (e > error)
+					error = e;
+				e = trace_error_deg(estimate, truth[sample]);
+				if (e > float_error)
+					float_error = e;
+			}
+
+		}
+	}
+
+	double bias_error = 0.0, float_bias_error = 0.0;
+	for (uint32_t i = 0; i < 3; i++) {
+		double e = fabs(bias[i] / TRACE_DEG - dataset->motion.bias_dps[i]);
+		double f = fabs(filter.bias[i] / TRACE_DEG - dataset->motion.bias_dps[i]);
+		bias_error = e > bias_error ? e : bias_error;
+		float_bias_error = f > float_bias_error ? f : float_bias_error;
+	}
+
+	printf("  %-7s float vs double %.4f deg, error double %.3f float %.3f deg, bias error double %.4f float %.4f dps\n",
+	       dataset->name, divergence, error, float_error, bias_error, float_bias_error);
+	CHECK(divergence < dataset->max_divergence_deg);
+	CHECK(error < dataset->max_error_deg);
+	CHECK(float_error < dataset->max_error_deg);
+	CHECK(bias_error < dataset->max_bias_error_dps);
+	CHECK(float_bias_error < dataset->max_bias_error_dps);
+	CHECK(min_variance > 0.0);
+	CHECK(filter.accel_rejected == 0);
+
+}
+
+// a long shake makes the accelerometer useless, the filter must keep to the gyro and count the rejections
+static void test_acceleration_rejected(void) {
+
+	struct ekf filter;
+	ekf_init(&filter, RATE_HZ);
+	for (uint32_t n = 0; n < 1000; n++)
+		ekf_update(&filter, 0.0f, 0.0f, 0.0f, 1.5f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f);
+	CHECK(filter.accel_rejected == 1000);
+	CHECK(filter.q0 == 1.0f && filter.q1 == 0.0f && filter.q2 == 0.0f && filter.q3 == 0.0f);
+
+}
+
+static void benchmark(void) {
+
+	const struct imu_block *block = &trace[0];
+	struct ekf filter;
+	volatile float sink;
+	ekf_init(&filter, RATE_HZ);
+	ekf_double_reset(RATE_HZ);
+
+	double start = host_seconds();
+	for (uint32_t b = 0; b < BLOCKS; b++)
+		for (uint32_t n = 0; n < IMU_BLOCK_CAPACITY; n++)
+			ekf_update(&filter, block[b].value[IMU_GYRO_X][n], block[b].value[IMU_GYRO_Y][n], block[b].value[IMU_GYRO_Z][n],
+			           block[b].value[IMU_ACCEL_X][n], block[b].value[IMU_ACCEL_Y][n], block[b].value[IMU_ACCEL_Z][n],
+			           block[b].value[IMU_MAGN_X][n], block[b].value[IMU_MAGN_Y][n], block[b].value[IMU_MAGN_Z][n]);
+	double single = host_seconds() - start;
+	sink = filter.q0;
+	(void) sink;
+
+	start = host_seconds();
+	for (uint32_t b = 0; b < BLOCKS; b++)
+		for (uint32_t n = 0; n < IMU_BLOCK_CAPACITY; n++)
+			ekf_double_step((double[3]) { block[b].value[IMU_GYRO_X][n], block[b].value[IMU_GYRO_Y][n], block[b].value[IMU_GYRO_Z][n] },
+			                (double[3]) { block[b].value[IMU_ACCEL_X][n], block[b].value[IMU_ACCEL_Y][n], block[b].value[IMU_ACCEL_Z][n] },
+			                (double[3]) { block[b].value[IMU_MAGN_X][n], block[b].value[IMU_MAGN_Y][n], block[b].value[IMU_MAGN_Z][n] });
+	double twice = host_seconds() - start;
+
+	printf("  ekf_update on the host: %.1f ns per update in float, %.1f ns in double\n", single * 1e9 / SAMPLES, twice * 1e9 / SAMPLES);
+
+}
+
+int main(void) {
+
+	for (uint32_t d = 0; d < sizeof(datasets) / sizeof(datasets[0]); d++)
+		test_dataset(&datasets[d]);
+	test_acceleration_rejected();
+	benchmark();
+	return check_result("ekf");
+
+}
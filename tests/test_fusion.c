@@ -0,0 +1,101 @@
+// Every filter behind src/fusion.c on the same synthetic recordings (trace.h),
+// replayed with fusion_benchmark() against the true orientation: a still
+// sensor, and a sensor turning at up to 60 and 200 degrees per second with
+// noisy, biased readings. Also fusion_select() carrying the orientation over,
+// and the cost of an update of each filter.
+
+#include "check.h"
+#include "fusion.h"
+#include "trace.h"
+#include <stdio.h>
+
+#define RATE_HZ     1000
+#define BLOCKS      (10 * RATE_HZ / IMU_BLOCK_CAPACITY)   // 10s
+#define SAMPLES     (BLOCKS * IMU_BLOCK_CAPACITY)
+
+static struct imu_block trace[BLOCKS];
+static float reference[SAMPLES][4];
+
+struct dataset {
+	const char *name;
+	struct trace_motion motion;
+	float max_mean_error_deg[FUSION_FILTERS];   // bounds with the magnetometer, every filter starting at the identity
+};
+
+static const struct dataset datasets[] = {
+	{ "still", { .gyro_noise_dps = 0.1, .accel_noise_g = 0.005, .magn_noise_gauss = 0.002, .seed = 10 },
+	  { 0.15f, 0.05f, 0.15f, 0.1f } },
+	{ "60dps", { .rate_dps = 60.0, .bias_dps = { 0.5, -0.3, 0.2 }, .gyro_noise_dps = 0.1, .accel_noise_g = 0.005, .magn_noise_gauss = 0.002, .seed = 11 },
+	  { 1.0f, 1.8f, 0.2f, 0.1f } },
+	{ "200dps", { .rate_dps = 200.0, .bias_dps = { 0.5, -0.3, 0.2 }, .gyro_noise_dps = 0.1, .accel_noise_g = 0.005, .magn_noise_gauss = 0.002, .seed = 12 },
+	  { 0.7f, 0.8f, 0.2f, 0.1f } },
+};
+
+static void test_datasets(void) {
+
+	printf("  %-8s %-14s %-4s %10s %10s %12s\n", "dataset", "filter", "mode", "mean deg", "max deg", "ns/update");
+
+	for (uint32_t d = 0; d < sizeof(datasets) / sizeof(datasets[0]); d++) {
+
+		const struct dataset *dataset = &datasets[d];
+		trace_generate(&dataset->motion, RATE_HZ, BLOCKS, trace, 0, reference);
+
+		for (enum FUSION_FILTER type = 0; type < FUSION_FILTERS; type++) {
+			for (uint8_t use_magnetometer = 0; use_magnetometer < 2; use_magnetometer++) {
+
+				struct fusion_benchmark result;
+				double start = host_seconds();
+				fusion_benchmark(type, use_magnetometer, trace, BLOCKS, reference, &result);
+				double seconds = host_seconds() - start;
+
+				printf("  %-8s %-14s %-4s %10.3f %10.3f %12.1f\n", dataset->name, fusion_name(type), use_magnetometer ? "marg" : "imu",
+				       result.mean_error_deg, result.max_error_deg, seconds * 1e9 / result.updates);
+				CHECK(result.updates == SAMPLES);
+				if (use_magnetometer)
+					CHECK(result.mean_error_deg < dataset->max_mean_error_deg[type]);
+				else
+					CHECK(result.mean_error_deg < 3.0f);    // the heading drifts with the gyro bias
+
+			}
+		}
+
+	}
+
+}
+
+// switching filters must not move the orientation
+static void test_select(void) {
+
+	struct trace_motion motion = { .initial_deg = { 0, 0, 0 }, .rate_dps = 60.0, .seed = 13 };
+	trace_generate(&motion, RATE_HZ, BLOCKS, trace, 0, reference);
+
+	struct fusion fusion;
+	fusion_init(&fusion, FUSION_MADGWICK, RATE_HZ, 1);
+	for (uint32_t b = 0; b < BLOCKS; b++) {
+		fusion_update_block(&fusion, &trace[b]);
+		float before[4], after[4];
+		fusion_get_quaternion(&fusion, before);
+		fusion_select(&fusion, (enum FUSION_FILTER) ((b + 1) % FUSION_FILTERS));
+		fusion_get_quaternion(&fusion, after);
+		for (uint32_t i = 0; i < 4; i++)
+			CHECK(before[i] == after[i]);
+	}
+	CHECK(fusion_stats.updates == SAMPLES);
+
+	// and the filters keep tracking across the switches
+	float q[4];
+	fusion_get_quaternion(&fusion, q);
+	double truth[4] = { reference[SAMPLES - 1][0], reference[SAMPLES - 1][1], reference[SAMPLES - 1][2], reference[SAMPLES - 1][3] };
+	double error = trace_error_deg(q, truth);
+	printf("  switching filters every block: final error %.3f degrees\n", error);
+	CHECK(error < 2.0);
+
+}
+
+int main(void) {
+
+	test_datasets();
+	test_select();
+	return check_result("fusion");
+
+}
@@ -0,0 +1,246 @@
+// Scheduling core of the kernel (src/lib_kernel.c): ready, wait and delayed
+// lists. The core is included so the tests can block tasks directly, without
+// the PendSV context switch of lib_kernel_port.c. A requested switch shows up
+// as PENDSVSET in SCB->ICSR.
+
+#include "check.h"
+#include "../src/lib_kernel.c"
+
+static uint32_t stacks[8][64];
+static struct kernel_task tasks[8];
+static uint32_t task_count = 0;
+
+static void entry(void *arg) { }
+
+static struct kernel_task *create(const char *name, uint8_t priority) {
+
+	struct kernel_task *task = &tasks[task_count];
+	kernel_task_create(task, name, &entry, 0, priority, stacks[task_count], 64);
+	task_count++;
+	return task;
+
+}
+
+static void reset(void) {
+
+	memset(ready_head, 0, sizeof(ready_head));
+	memset(ready_tail, 0, sizeof(ready_tail));
+	ready_mask = 0;
+	delayed = 0;
+	kernel_current = 0;
+	task_count = 0;
+	SCB->ICSR = 0;
+
+}
+
+// blocks a task as if it had called kernel_sem_take() or kernel_sleep() while running
+static void block(struct kernel_task *task, struct kernel_task **list, uint32_t timeout) {
+
+	struct kernel_task *running = kernel_current;
+	kernel_current = task;
+	__disable_irq();
+	block_current(list, timeout);
+	__enable_irq();
+	kernel_current = running;
+
+}
+
+static uint32_t switch_requested(void) {
+
+	uint32_t requested = SCB->ICSR & SCB_ICSR_PENDSVSET_Msk;
+	SCB->ICSR = 0;
+	return requested;
+
+}
+
+// every ready list is a proper list ending at its tail, holding only ready tasks of its priority, each once
+static uint32_t ready_lists_consistent(void) {
+
+	uint32_t seen[8] = { 0 };
+	for (uint32_t p = 0; p < KERNEL_PRIORITIES; p++) {
+		struct kernel_task *last = 0;
+		uint32_t length = 0;
+		for (struct kernel_task *task = ready_head[p]; task; task = task->next) {
+			if (++length > task_count || task->priority != p || task->state != READY)
+				return 0;
+			seen[task - tasks]++;
+			last = task;
+		}
+		if (last != (ready_head[p] ? ready_tail[p] : 0) && ready_head[p])
+			return 0;
+		if (!!(ready_mask & (1UL << p)) != !!ready_head[p])
+			return 0;
+	}
+	for (uint32_t i = 0; i < task_count; i++)
+		if (seen[i] != (tasks[i].state == READY))
+			return 0;
+	return 1;
+
+}
+
+static void test_wait_list_order(void) {
+
+	reset();
+	struct kernel_sem sem;
+	kernel_sem_init(&sem, 0);
+	struct kernel_task *a = create("a", 3), *b = create("b", 5), *c = create("c", 1), *d = create("d", 5);
+	block(a, &sem.waiters, KERNEL_WAIT_FOREVER);
+	block(b, &sem.waiters, KERNEL_WAIT_FOREVER);
+	block(c, &sem.waiters, KERNEL_WAIT_FOREVER);
+	block(d, &sem.waiters, KERNEL_WAIT_FOREVER);
+
+	CHECK(sem.waiters == b && b->next == d && d->next == a && a->next == c && c->next == 0);
+	CHECK(a->wait_list == &sem.waiters && c->wait_list == &sem.waiters);
+	CHECK(ready_mask == 0);
+
+	kernel_sem_give(&sem);
+	CHECK(b->state == READY && b->wait_list == 0 && sem.waiters == d);
+	CHECK(ready_lists_consistent());
+
+}
+
+// a task times out on a wait list after the task in front of it was woken and reused its next for a ready list
+static void test_timeout_after_predecessor_woken(void) {
+
+	reset();
+	struct kernel_sem sem;
+	kernel_sem_init(&sem, 0);
+	struct kernel_task *idle = create("idle", 0);
+	struct kernel_task *x = create("x", 5);
+	struct kernel_task *y = create("y", 3);
+	kernel_current = idle;
+
+	block(x, &sem.waiters, KERNEL_WAIT_FOREVER);
+	block(y, &sem.waiters, 10);
+	CHECK(sem.waiters == x && x->next == y);
+
+	// x is taken off the wait list, then another task of its priority becomes ready behind it
+	kernel_sem_give(&sem);
+	struct kernel_task *r = create("r", 5);
+	CHECK(x->state == READY && x->next == r);
+	CHECK(sem.waiters == y);
+
+	for (uint32_t i = 0; i < 10; i++)
+		kernel_tick();
+
+	CHECK(y->timed_out);
+	CHECK(y->wait_list == 0);
+	CHECK(sem.waiters == 0);
+	CHECK(y->state == READY);
+	CHECK(ready_lists_consistent());
+
+	// with nobody waiting, a give only counts
+	kernel_sem_give(&sem);
+	CHECK(sem.count == 2);
+	CHECK(ready_lists_consistent());
+
+}
+
+static void test_delays_and_preemption(void) {
+
+	reset();
+	kernel_running = 1;
+	struct kernel_task *idle = create("idle", 0);
+	struct kernel_task *low = create("low", 1);
+	struct kernel_task *high = create("high", 4);
+	kernel_current = idle;
+	switch_requested();
+
+	uint32_t start = ticks;
+	block(high, 0, 5);
+	block(low, 0, 3);
+	CHECK(delayed == low && low->delay_next == high);
+	switch_requested();
+
+	kernel_tick();
+	kernel_tick();
+	CHECK(low->state == BLOCKED && high->state == BLOCKED);
+	kernel_tick();
+	CHECK(ticks == start + 3);
+	CHECK(low->state == READY && !low->timed_out);
+	CHECK(switch_requested());
+	CHECK(kernel_select() == low);
+
+	// low is running now, high preempts it when its delay ends
+	kernel_tick();
+	CHECK(!switch_requested());
+	kernel_tick();
+	CHECK(high->state == READY);
+	CHECK(switch_requested());
+	CHECK(kernel_select() == high);
+	CHECK(delayed == 0);
+	CHECK(ready_lists_consistent());
+	kernel_running = 0;
+
+}
+
+static void test_round_robin(void) {
+
+	reset();
+	kernel_running = 1;
+	struct kernel_task *a = create("a", 2), *b = create("b", 2), *c = create("c", 2);
+	CHECK(kernel_select() == a);
+	switch_requested();
+
+	kernel_tick();
+	CHECK(switch_requested());
+	CHECK(kernel_select() == b);
+	kernel_tick();
+	CHECK(kernel_select() == c);
+	kernel_tick();
+	CHECK(kernel_select() == a);
+	CHECK(ready_lists_consistent());
+	kernel_running = 0;
+
+}
+
+static void test_queue(void) {
+
+	reset();
+	uint32_t buffer[4];
+	struct kernel_queue queue;
+	kernel_queue_init(&queue, buffer, sizeof(uint32_t), 4);
+	struct kernel_task *idle = create("idle", 0), *reader = create("reader", 3);
+	kernel_current = idle;
+
+	uint32_t item = 0;
+	CHECK(kernel_queue_receive(&queue, &item, 0) == 0);
+	block(reader, &queue.readers, 20);
+	CHECK(reader->state == BLOCKED && reader->delayed);
+
+	for (uint32_t i = 1; i <= 4; i++)
+		CHECK(kernel_queue_send(&queue, &i, 0));
+	CHECK(kernel_queue_send(&queue, &item, 0) == 0);
+	CHECK(reader->state == READY && !reader->delayed && queue.readers == 0);
+
+	for (uint32_t i = 1; i <= 4; i++) {
+		CHECK(kernel_queue_receive(&queue, &item, 0));
+		CHECK(item == i);
+	}
+	CHECK(queue.count == 0);
+
+	// a send from an ISR never blocks, whatever the timeout
+	host_ipsr = 16 + TIM2_IRQn;
+	for (uint32_t i = 0; i < 4; i++)
+		kernel_queue_send(&queue, &i, 0);
+	CHECK(kernel_queue_send(&queue, &item, KERNEL_WAIT_FOREVER) == 0);
+	host_ipsr = 0;
+
+	for (uint32_t i = 0; i < 30; i++)
+		kernel_tick();
+	CHECK(!reader->timed_out);
+	CHECK(ready_lists_consistent());
+
+}
+
+int main(void) {
+
+	test_wait_list_order();
+	test_timeout_after_predecessor_woken();
+	test_delays_and_preemption();
+	test_round_robin();
+	test_queue();
+
+	return check_result("test_kernel");
+
+}
@@ -0,0 +1,179 @@
+// Madgwick's filter (src/madgwick.c) on synthetic recordings with a known
+// orientation (trace.h): the gyro integration alone, convergence from the
+// identity to a tilted and turned sensor, and tracking a moving sensor with
+// noisy, biased readings, with and without the magnetometer. Also the accuracy
+// of inv_sqrt() and the cost of an update.
+
+#include "check.h"
+#include "madgwick.h"
+#include "trace.h"
+#include <stdio.h>
+
+#define RATE_HZ     1000
+#define BLOCKS      (10 * RATE_HZ / IMU_BLOCK_CAPACITY)   // 10s
+#define SAMPLES     (BLOCKS * IMU_BLOCK_CAPACITY)
+#define SETTLED     (5 * RATE_HZ)                         // errors are measured over the last 5s
+
+static struct imu_block trace[BLOCKS];
+static double truth[SAMPLES][4];
+
+struct errors {
+	double mean_deg;
+	double max_deg;
+	double final_deg;
+};
+
+// runs the filter over the trace from the true initial orientation or the identity
+static void run(float beta, uint8_t use_magnetometer, uint8_t start_true, uint8_t tilt_only, struct errors *errors) {
+
+	struct madgwick filter;
+	madgwick_init(&filter, RATE_HZ, beta);
+	if (start_true) {
+		double first[4];
+		memcpy(first, truth[0], sizeof(first));
+		filter.q0 = first[0];
+		filter.q1 = first[1];
+		filter.q2 = first[2];
+		filter.q3 = first[3];
+	}
+
+	errors->mean_deg = 0.0;
+	errors->max_deg = 0.0;
+	uint32_t sample = 0;
+	for (uint32_t b = 0; b < BLOCKS; b++) {
+		const struct imu_block *block = &trace[b];
+		for (uint32_t n = 0; n < block->count; n++, sample++) {
+			if (sample > 0 || !start_true) {
+				if (use_magnetometer)
+					madgwick_update_marg(&filter, block->value[IMU_GYRO_X][n], block->value[IMU_GYRO_Y][n], block->value[IMU_GYRO_Z][n],
+					                     block->value[IMU_ACCEL_X][n], block->value[IMU_ACCEL_Y][n], block->value[IMU_ACCEL_Z][n],
+					                     block->value[IMU_MAGN_X][n], block->value[IMU_MAGN_Y][n], block->value[IMU_MAGN_Z][n]);
+				else
+					madgwick_update_imu(&filter, block->value[IMU_GYRO_X][n], block->value[IMU_GYRO_Y][n], block->value[IMU_GYRO_Z][n],
+					                    block->value[IMU_ACCEL_X][n], block->value[IMU_ACCEL_Y][n], block->value[IMU_ACCEL_Z][n]);
+			}
+			float q[4] = { filter.q0, filter.q1, filter.q2, filter.q3 };
+			double error = tilt_only ? trace_tilt_error_deg(q, truth[sample]) : trace_error_deg(q, truth[sample]);
+			if (sample >= SAMPLES - SETTLED) {
+				errors->mean_deg += error / SETTLED;
+				if (error > errors->max_deg)
+					errors->max_deg = error;
+			}
+			errors->final_deg = error;
+		}
+	}
+
+}
+
+static void report(const char *name, const struct errors *errors) {
+
+	printf("  %-36s mean %6.3f  max %6.3f  final %6.3f degrees\n", name, errors->mean_deg, errors->max_deg, errors->final_deg);
+
+}
+
+// with beta 0 the filter only integrates the gyro, which must follow the true motion
+static void test_integration(void) {
+
+	struct trace_motion motion = { .initial_deg = { 0, 0, 0 }, .rate_dps = 90.0, .seed = 1 };
+	trace_generate(&motion, RATE_HZ, BLOCKS, trace, truth, 0);
+
+	struct errors errors;
+	run(0.0f, 0, 1, 0, &errors);
+	report("gyro only, 90dps, no noise", &errors);
+	CHECK(errors.max_deg < 0.3);
+
+}
+
+static void test_static_convergence(void) {
+
+	struct trace_motion motion = {
+		.initial_deg = { 30, -20, 50 }, .gyro_noise_dps = 0.1, .accel_noise_g = 0.005, .magn_noise_gauss = 0.002, .seed = 2
+	};
+	trace_generate(&motion, RATE_HZ, BLOCKS, trace, truth, 0);
+
+	struct errors errors;
+	run(0.1f, 0, 0, 1, &errors);
+	report("imu, still, tilt from identity", &errors);
+	CHECK(errors.max_deg < 0.5);
+
+	// the heading converges much slower than the tilt, so with a higher gain
+	run(0.5f, 1, 0, 0, &errors);
+	report("marg, still, from identity, beta 0.5", &errors);
+	CHECK(errors.mean_deg < 1.0);
+	CHECK(errors.final_deg < 0.2);
+
+	// the heading is unobservable without the magnetometer and stays where it started
+	run(0.1f, 0, 0, 0, &errors);
+	CHECK(errors.final_deg > 40.0);
+
+}
+
+static void test_tracking(void) {
+
+	struct trace_motion motion = {
+		.initial_deg = { 10, 5, -120 }, .rate_dps = 60.0, .bias_dps = { 0.5, -0.3, 0.2 },
+		.gyro_noise_dps = 0.1, .accel_noise_g = 0.005, .magn_noise_gauss = 0.002, .seed = 3
+	};
+	trace_generate(&motion, RATE_HZ, BLOCKS, trace, truth, 0);
+
+	struct errors errors;
+	run(0.1f, 0, 1, 1, &errors);
+	report("imu, 60dps with bias, tilt", &errors);
+	CHECK(errors.mean_deg < 0.3);
+	CHECK(errors.max_deg < 0.6);
+
+	run(0.1f, 1, 1, 0, &errors);
+	report("marg, 60dps with bias", &errors);
+	CHECK(errors.mean_deg < 0.8);
+	CHECK(errors.max_deg < 2.0);
+
+	// without a correction the bias turns into drift
+	run(0.0f, 1, 1, 0, &errors);
+	report("marg, 60dps with bias, beta 0", &errors);
+	CHECK(errors.final_deg > 3.0);
+
+}
+
+static void test_inv_sqrt(void) {
+
+	double worst = 0.0;
+	for (float x = 1e-6f; x < 1e6f; x *= 1.001f) {
+		double error = fabs(inv_sqrt(x) * sqrt(x) - 1.0);
+		if (error > worst)
+			worst = error;
+	}
+	printf("  inv_sqrt relative error at most %.5f%%\n", worst * 100.0);
+	CHECK(worst < 0.001);
+
+}
+
+static void benchmark(void) {
+
+	struct madgwick filter;
+	volatile float sink;
+	const uint32_t rounds = 20;
+
+	for (uint8_t use_magnetometer = 0; use_magnetometer < 2; use_magnetometer++) {
+		madgwick_init(&filter, RATE_HZ, 0.1f);
+		double start = host_seconds();
+		for (uint32_t r = 0; r < rounds; r++)
+			for (uint32_t b = 0; b < BLOCKS; b++)
+				madgwick_update_block(&filter, &trace[b], use_magnetometer);
+		double seconds = host_seconds() - start;
+		sink = filter.q0;
+		(void) sink;
+		printf("  madgwick_update_%s on the host: %.1f ns per update\n", use_magnetometer ? "marg" : "imu ", seconds * 1e9 / (rounds * SAMPLES));
+	}
+
+}
+
+int main(void) {
+
+	test_integration();
+	test_static_convergence();
+	test_tracking();
+	test_inv_sqrt();
+	benchmark();
+	return check_result("madgwick");
+
+}
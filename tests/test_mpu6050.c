@@ -0,0 +1,465 @@
+// The MPU6050 driver (src/mpu6050.c) against a register model of the MPU6050
+// and the HMC5883L behind its auxiliary bus: the HMC5883L is only reachable
+// on the main bus while the MPU6050's bypass switch is on and its I2C master
+// is off, and the MPU6050 copies the HMC5883L's output registers into
+// EXT_SENS_DATA while SLV0 is set up to read them. Checks the bypass setup,
+// the "H43" identification, SLV0 and I2C_MST_DLY, and that the magnetometer's
+// x, z, y registers end up on the right axes.
+//
+// The bus model also keeps background reads queued until the test completes
+// them, and counts a bus reset or blocking access while reads are queued on an
+// unpaused bus as an error.
+
+#include "check.h"
+#include "mpu6050.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define HMC5883L_ADDRESS 0x1E
+
+// one MPU6050 and the HMC5883L on its auxiliary bus
+struct model {
+	uint8_t address;
+	uint8_t mpu[128];
+	uint8_t hmc[16];
+	uint32_t hmc_writes;
+};
+
+static struct model models[2];
+static uint32_t bus_errors;        // accesses nobody answered, two devices answered, or the bus was in use
+static uint32_t bus_setups;
+static enum I2C_SPEED bus_speed;
+static uint32_t now_us;
+
+// background reads of I2C1, in order
+static struct i2c_transfer *queued[MPU6050_MAX_SENSORS];
+static uint32_t queued_count;
+static uint32_t pauses;
+
+static struct {
+	enum GPIO_PIN pin;
+	void (*handler)(void);
+} extis[MPU6050_MAX_SENSORS];
+static uint32_t exti_count;
+
+static struct model *find_mpu(uint8_t address) {
+
+	for (uint32_t m = 0; m < 2; m++)
+		if (models[m].address == address)
+			return &models[m];
+	return 0;
+
+}
+
+// the HMC5883L answers on the main bus through the bypass switch only
+static struct model *find_hmc(void) {
+
+	struct model *found = 0;
+	for (uint32_t m = 0; m < 2; m++) {
+		struct model *model = &models[m];
+		if ((model->mpu[0x37] & 0x02) && !(model->mpu[0x6A] & 0x20)) {
+			if (found)
+				bus_errors++;
+			found = model;
+		}
+	}
+	return found;
+
+}
+
+// the I2C master fills EXT_SENS_DATA from slave 0 before every sample
+static void sample_aux(struct model *model) {
+
+	const uint8_t *mpu = model->mpu;
+	if (!(mpu[0x6A] & 0x20) || !(mpu[0x27] & 0x80) || mpu[0x25] != (0x80 | HMC5883L_ADDRESS))
+		return;
+	for (uint8_t i = 0; i < (mpu[0x27] & 0x0F); i++)
+		model->mpu[0x49 + i] = model->hmc[(mpu[0x26] + i) & 0x0F];
+
+}
+
+// the blocking functions and a reset may not run while background reads are queued
+static void check_bus_free(void) {
+
+	if (queued_count > 0 && pauses == 0)
+		bus_errors++;
+
+}
+
+void i2c_setup(I2C_TypeDef *i2c, enum I2C_SPEED speed, enum GPIO_PIN sck_pin, enum GPIO_PIN sda_pin) {
+
+	check_bus_free();
+	bus_setups++;
+	bus_speed = speed;
+
+}
+
+void i2c_write_register(I2C_TypeDef *i2c, uint8_t i2c_address, uint8_t reg, uint8_t value) {
+
+	check_bus_free();
+	struct model *model = i2c_address == HMC5883L_ADDRESS ? find_hmc() : find_mpu(i2c_address);
+	if (!model) {
+		bus_errors++;
+		return;
+	}
+	if (i2c_address == HMC5883L_ADDRESS) {
+		model->hmc[reg & 0x0F] = value;
+		model->hmc_writes++;
+	} else {
+		model->mpu[reg & 0x7F] = value;
+	}
+
+}
+
+static void read_registers(uint8_t i2c_address, uint8_t byte_count, uint8_t first_reg, uint8_t *rx_buffer) {
+
+	struct model *model = i2c_address == HMC5883L_ADDRESS ? find_hmc() : find_mpu(i2c_address);
+	if (!model) {
+		bus_errors++;
+		memset(rx_buffer, 0xFF, byte_count);
+		return;
+	}
+	if (i2c_address == HMC5883L_ADDRESS) {
+		for (uint8_t i = 0; i < byte_count; i++)
+			rx_buffer[i] = model->hmc[(first_reg + i) & 0x0F];
+	} else {
+		sample_aux(model);
+		for (uint8_t i = 0; i < byte_count; i++)
+			rx_buffer[i] = model->mpu[(first_reg + i) & 0x7F];
+	}
+
+}
+
+void i2c_read_registers(I2C_TypeDef *i2c, uint8_t i2c_address, uint8_t byte_count, uint8_t first_reg, uint8_t *rx_buffer) {
+
+	check_bus_free();
+	read_registers(i2c_address, byte_count, first_reg, rx_buffer);
+
+}
+
+uint8_t i2c_read_registers_async(I2C_TypeDef *i2c, struct i2c_transfer *transfer) {
+
+	CHECK(queued_count < MPU6050_MAX_SENSORS);
+	transfer->status = I2C_TRANSFER_QUEUED;
+	queued[queued_count++] = transfer;
+	return 1;
+
+}
+
+// the reads queued in the background finish, unless the bus is paused
+static void complete_reads(void) {
+
+	for (uint32_t n = 0; n < queued_count && pauses == 0; n++) {
+		struct i2c_transfer *transfer = queued[n];
+		read_registers(transfer->i2c_address, transfer->byte_count, transfer->first_reg, transfer->rx_buffer);
+		transfer->status = I2C_TRANSFER_DONE;
+		if (transfer->done)
+			transfer->done(transfer);
+	}
+	if (pauses == 0)
+		queued_count = 0;
+
+}
+
+void i2c_async_pause(I2C_TypeDef *i2c, uint8_t pause) {
+
+	if (pause) {
+		pauses++;
+	} else {
+		CHECK(pauses > 0);
+		pauses--;
+	}
+
+}
+
+void exti_setup(enum GPIO_PIN pin, enum GPIO_PULL pull, enum EXTI_EDGE edge, void(*handler)(void)) {
+
+	uint32_t n = 0;
+	while (n < exti_count && extis[n].pin != pin)
+		n++;
+	if (n == exti_count)
+		exti_count++;
+	extis[n].pin = pin;
+	extis[n].handler = handler;
+
+}
+
+static void fire(enum GPIO_PIN pin) {
+
+	for (uint32_t n = 0; n < exti_count; n++)
+		if (extis[n].pin == pin)
+			extis[n].handler();
+
+}
+
+uint32_t exti_entry_cycles(enum GPIO_PIN pin) { return DWT->CYCCNT; }
+void defer_init(void) { }
+void defer_work_init(struct defer_work *work, void (*run)(struct defer_work *work), void *context) { work->run = run; work->context = context; }
+uint8_t defer_post(struct defer_work *work) { work->run(work); return 1; }
+uint32_t time_now_us(void) { return now_us; }
+void uart_send_bytes(const void *data, uint32_t length) { }
+void flash_erase_start(uint8_t sector) { }
+uint8_t flash_busy(void) { return 0; }
+uint8_t flash_erase_finish(void) { return 1; }
+uint8_t flash_erase_sector(uint8_t sector) { return 1; }
+uint8_t flash_write_words(uint32_t address, const uint32_t *data, uint32_t words) { return 1; }
+
+// the driver keeps pointers to every sensor it set up
+static struct mpu6050 imu, second_imu;
+static struct imu_block received;
+static uint32_t blocks_received;
+
+static void handler(const struct imu_block *block) {
+
+	received = *block;
+	blocks_received++;
+
+}
+
+static void put16(uint8_t *registers, int16_t value) {
+
+	registers[0] = (uint16_t) value >> 8;
+	registers[1] = value & 0xFF;
+
+}
+
+static void reset_model(struct model *model, uint8_t address, const char *id) {
+
+	memset(model, 0, sizeof(*model));
+	model->address = address;
+	memcpy(&model->hmc[0x0A], id, 3);
+
+}
+
+static void test_magnetometer(void) {
+
+	reset_model(&models[0], MPU6050_ADDRESS_AD0_LOW, "H43");
+	bus_errors = 0;
+	CHECK(mpu6050_setup(&imu, PB8, PB9, PC0, MPU6050_ADDRESS_AD0_LOW, &handler));
+	const uint8_t *mpu = models[0].mpu;
+	const uint8_t *hmc = models[0].hmc;
+
+	// every HMC5883L access got through the bypass, which is off again
+	CHECK(bus_errors == 0);
+	CHECK(bus_setups == 1 && bus_speed == STANDARD_MODE_100KHZ);
+	CHECK(models[0].hmc_writes == 3);
+	CHECK(hmc[0x00] == 0x18 && hmc[0x01] == 0x60 && hmc[0x02] == 0x00);
+	CHECK(mpu[0x37] == 0x00);
+
+	// slave 0 reads the 6 output registers from 0x03, after the MPU6050's own samples
+	CHECK(mpu[0x24] == 0x4D);
+	CHECK(mpu[0x25] == 0x9E);
+	CHECK(mpu[0x26] == 0x03);
+	CHECK(mpu[0x27] == 0x86);
+	CHECK(mpu[0x67] == 0x01);
+	CHECK(mpu[0x6A] == 0x20);
+	CHECK(mpu[0x38] == 0x01 && mpu[0x6B] == 0x00);
+
+	// 73Hz: the magnetometer's 75Hz is read every sample
+	CHECK(mpu[0x34] == 0);
+	CHECK(mpu[0x19] == 109 && mpu[0x1A] == MPU6050_DLPF_260HZ);
+
+	// the HMC5883L output registers are x, z, y
+	put16(&models[0].mpu[0x3B], 4096);
+	put16(&models[0].mpu[0x3D], -8192);
+	put16(&models[0].mpu[0x3F], 8192);
+	put16(&models[0].mpu[0x43], 164);
+	put16(&models[0].mpu[0x45], -328);
+	put16(&models[0].mpu[0x47], 1640);
+	put16(&models[0].hmc[0x03], 330);
+	put16(&models[0].hmc[0x05], -660);
+	put16(&models[0].hmc[0x07], 123);
+	mpu6050_read_sensors(&imu);
+	CHECK(blocks_received == 1);
+	CHECK(received.count == 1);
+	CHECK(received.raw[IMU_ACCEL_X][0] == 4096 && received.raw[IMU_ACCEL_Y][0] == -8192 && received.raw[IMU_ACCEL_Z][0] == 8192);
+	CHECK(received.raw[IMU_GYRO_X][0] == 164 - imu_calibration_offset(&imu.calibration, 0));
+	CHECK(received.raw[IMU_MAGN_X][0] == 330);
+	CHECK(received.raw[IMU_MAGN_Y][0] == 123);
+	CHECK(received.raw[IMU_MAGN_Z][0] == -660);
+	CHECK_NEAR(received.value[IMU_MAGN_X][0], 0.5f, 1e-6f);
+	CHECK_NEAR(received.value[IMU_MAGN_Z][0], -1.0f, 1e-6f);
+	CHECK_NEAR(received.value[IMU_ACCEL_X][0], 0.5f, 1e-6f);
+	CHECK_NEAR(received.value[IMU_GYRO_Z][0], 100.0f / 57.2957795f, 1e-4f);
+
+	// faster rates read the magnetometer no faster than its 75Hz: every 7th sample at 500Hz
+	mpu6050_configure(&imu, &(struct mpu6050_config) {500, MPU6050_DLPF_184HZ, MPU6050_GYRO_2000DPS, MPU6050_ACCEL_4G});
+	mpu6050_read_sensors(&imu);
+	CHECK(imu.config.rate_hz == 500);
+	CHECK(mpu[0x19] == 1 && mpu[0x1A] == MPU6050_DLPF_184HZ);
+	CHECK(mpu[0x34] == 6);
+	CHECK(mpu[0x67] == 0x01);
+
+	// a record every 2ms does not fit in 100kHz
+	CHECK(bus_setups == 2 && bus_speed == FAST_MODE_400KHZ);
+
+	mpu6050_configure(&imu, &(struct mpu6050_config) {40, MPU6050_DLPF_44HZ, MPU6050_GYRO_2000DPS, MPU6050_ACCEL_4G});
+	mpu6050_read_sensors(&imu);
+	CHECK(mpu[0x34] == 0);
+	CHECK(bus_setups == 3 && bus_speed == STANDARD_MODE_100KHZ);
+	CHECK(bus_errors == 0);
+
+}
+
+// a second sensor without a magnetometer on the same bus
+static void test_missing_magnetometer(void) {
+
+	reset_model(&models[1], MPU6050_ADDRESS_AD0_HIGH, "XYZ");
+	bus_errors = 0;
+	CHECK(mpu6050_setup(&second_imu, PB8, PB9, PC1, MPU6050_ADDRESS_AD0_HIGH, &handler));
+	const uint8_t *mpu = models[1].mpu;
+
+	CHECK(bus_errors == 0);
+	CHECK(bus_setups == 3);                 // the bus of the first sensor is not reset
+	CHECK(models[1].hmc_writes == 0);
+	CHECK(mpu[0x37] == 0x00);
+	CHECK(mpu[0x27] == 0x00 && mpu[0x25] == 0x00);
+	CHECK(mpu[0x6A] == 0x00);
+	CHECK(second_imu.aux_master == 0);
+
+	// EXT_SENS_DATA stays zero
+	put16(&models[1].hmc[0x03], 330);
+	blocks_received = 0;
+	mpu6050_read_sensors(&second_imu);
+	CHECK(blocks_received == 1);
+	CHECK(received.sensor == 1);
+	CHECK(received.raw[IMU_MAGN_X][0] == 0 && received.raw[IMU_MAGN_Y][0] == 0 && received.raw[IMU_MAGN_Z][0] == 0);
+
+}
+
+// the second sensor switches to FIFO mode while the first reads in the background on the same bus
+static void test_shared_bus(void) {
+
+	// the first sample after the last configuration change is dropped
+	mpu6050_start_async(&imu, 0);
+	fire(PC0);
+	complete_reads();
+	CHECK(mpu6050_service(&imu) == 1);
+
+	fire(PC0);
+	CHECK(queued_count == 1);
+
+	bus_errors = 0;
+	blocks_received = 0;
+	uint32_t setups = bus_setups;
+	mpu6050_fifo_setup(&second_imu, 500, 25);
+	CHECK(bus_errors == 0);
+	CHECK(pauses == 0);
+	CHECK(bus_setups == setups + 1 && bus_speed == FAST_MODE_400KHZ);
+	CHECK(models[1].mpu[0x6A] == 0x40 && models[1].mpu[0x38] == 0x00);
+
+	// the first sensor's read was kept waiting, not lost
+	CHECK(queued_count == 1);
+	complete_reads();
+	CHECK(mpu6050_service(&imu) == 1);
+	CHECK(blocks_received == 1 && received.sensor == 0);
+	CHECK(imu.missed == 0);
+
+	// the bus already runs at 400kHz
+	mpu6050_fifo_setup(&second_imu, 1000, 25);
+	CHECK(bus_setups == setups + 1);
+	CHECK(bus_errors == 0);
+
+	// 1000 records a second do not fit next to the FIFO bursts, 500 do
+	mpu6050_configure(&imu, &(struct mpu6050_config) {1000, MPU6050_DLPF_184HZ, MPU6050_GYRO_2000DPS, MPU6050_ACCEL_4G});
+	fire(PC0);
+	complete_reads();
+	mpu6050_service(&imu);
+	CHECK(imu.config.rate_hz == 500 && models[0].mpu[0x19] == 1);
+	CHECK(bus_setups == setups + 1);
+
+	// alone on the bus, 1000 records a second fit in 400kHz
+	mpu6050_configure(&second_imu, &(struct mpu6050_config) {4, MPU6050_DLPF_184HZ, MPU6050_GYRO_2000DPS, MPU6050_ACCEL_4G});
+	models[1].mpu[0x72] = 25 * 12 >> 8;
+	models[1].mpu[0x73] = 25 * 12 & 0xFF;
+
+	// the FIFO is drained, and then reset for the new rate, while the first sensor has a read queued
+	fire(PC0);
+	CHECK(queued_count == 1);
+	bus_errors = 0;
+	CHECK(mpu6050_fifo_poll(&second_imu) == 25);
+	CHECK(second_imu.config.rate_hz == 4);
+	CHECK(bus_errors == 0 && pauses == 0);
+	CHECK(queued_count == 1);
+	complete_reads();
+	CHECK(mpu6050_service(&imu) == 1);
+	mpu6050_configure(&imu, &(struct mpu6050_config) {1000, MPU6050_DLPF_184HZ, MPU6050_GYRO_2000DPS, MPU6050_ACCEL_4G});
+	fire(PC0);
+	complete_reads();
+	mpu6050_service(&imu);
+	CHECK(imu.config.rate_hz == 1000 && models[0].mpu[0x19] == 0);
+
+	// and 8kHz is lowered to what 400kHz carries
+	mpu6050_configure(&imu, &(struct mpu6050_config) {8000, MPU6050_DLPF_260HZ, MPU6050_GYRO_2000DPS, MPU6050_ACCEL_4G});
+	fire(PC0);
+	complete_reads();
+	mpu6050_service(&imu);
+	CHECK(imu.config.rate_hz == 1333 && models[0].mpu[0x19] == 5);
+	CHECK(bus_speed == FAST_MODE_400KHZ && bus_errors == 0);
+
+}
+
+// samples the FIFO throws away keep their numbers, so the next block starts after a gap
+static void test_fifo_gaps(void) {
+
+	struct mpu6050_fifo_stats before = second_imu.fifo_stats;
+	CHECK(second_imu.sample_period_us == 250000);
+
+	// 25 samples, read in full, less the one dropped after the rate change of the last test
+	models[1].mpu[0x3A] = 0x00;
+	models[1].mpu[0x72] = 25 * 12 >> 8;
+	models[1].mpu[0x73] = 25 * 12 & 0xFF;
+	blocks_received = 0;
+	CHECK(mpu6050_fifo_poll(&second_imu) == 25);
+	CHECK(blocks_received == 1 && received.sensor == 1 && received.count == 24);
+	uint32_t next = received.first_sample + 24;
+
+	// 30s without a poll overflows the 85 sample FIFO: 120 samples were taken, none can be read
+	now_us += 30000000;
+	models[1].mpu[0x3A] = 0x10;
+	models[1].mpu[0x72] = 1024 >> 8;
+	models[1].mpu[0x73] = 1024 & 0xFF;
+	CHECK(mpu6050_fifo_poll(&second_imu) == 0);
+	CHECK(second_imu.fifo_stats.overflows == before.overflows + 1);
+	CHECK(second_imu.fifo_stats.discarded == before.discarded + 120);
+
+	models[1].mpu[0x3A] = 0x00;
+	models[1].mpu[0x72] = 25 * 12 >> 8;
+	models[1].mpu[0x73] = 25 * 12 & 0xFF;
+	now_us += 25 * 250000;
+	CHECK(mpu6050_fifo_poll(&second_imu) == 25);
+	CHECK(received.first_sample == next + 120);
+	next = received.first_sample + 25;
+
+	// a count that is not whole samples: what was there is thrown away, the partial sample included
+	models[1].mpu[0x72] = 0;
+	models[1].mpu[0x73] = 40;
+	CHECK(mpu6050_fifo_poll(&second_imu) == 0);
+	CHECK(second_imu.fifo_stats.realigns == before.realigns + 1);
+	models[1].mpu[0x73] = 25 * 12 & 0xFF;
+	models[1].mpu[0x72] = 25 * 12 >> 8;
+	CHECK(mpu6050_fifo_poll(&second_imu) == 25);
+	CHECK(received.first_sample == next + 4);
+	CHECK(bus_errors == 0 && pauses == 0);
+
+}
+
+int main(void) {
+
+	// the calibration sector, blank
+	void *sector = mmap((void *) IMU_CALIBRATION_ADDRESS, IMU_CALIBRATION_SIZE, PROT_READ | PROT_WRITE,
+	                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (sector != (void *) IMU_CALIBRATION_ADDRESS) {
+		printf("mpu6050: cannot map the flash sector at 0x%08X\n", IMU_CALIBRATION_ADDRESS);
+		return 1;
+	}
+	memset(sector, 0xFF, IMU_CALIBRATION_SIZE);
+
+	test_magnetometer();
+	test_missing_magnetometer();
+	test_shared_bus();
+	test_fifo_gaps();
+	return check_result("mpu6050");
+
+}
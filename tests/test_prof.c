@@ -0,0 +1,81 @@
+// Cycle profiling (src/lib_prof.c), built with -DPROFILING: inclusive and self
+// time of nested regions, and a stray PROF_END() leaving later regions intact.
+
+#include "check.h"
+#include "lib_prof.h"
+#include "stm32f429xx.h"
+#include <string.h>
+
+static uint8_t sent[4096];
+static uint32_t sent_length = 0;
+
+void uart_send_bytes(const void *data, uint32_t length) {
+
+	memcpy(&sent[sent_length], data, length);
+	sent_length += length;
+
+}
+
+static void test_nesting(void) {
+
+	DWT->CYCCNT = 1000;
+	PROF_BEGIN(outer);
+	DWT->CYCCNT = 1100;
+	PROF_BEGIN(inner);
+	DWT->CYCCNT = 1400;
+	PROF_END(inner);
+	DWT->CYCCNT = 1500;
+	PROF_END(outer);
+
+	CHECK(prof_region_outer.count == 1 && prof_region_inner.count == 1);
+	CHECK(prof_region_outer.total_cycles == 500);
+	CHECK(prof_region_outer.self_cycles == 200);
+	CHECK(prof_region_inner.total_cycles == 300 && prof_region_inner.self_cycles == 300);
+	CHECK(prof_region_inner.histogram[8] == 1);
+
+}
+
+static void test_unmatched_end(void) {
+
+	static struct prof_region stray = { .name = "stray" };
+	prof_end(&stray);
+	prof_end(&stray);
+	CHECK(stray.count == 0);
+
+	// still balanced afterwards: the region is measured, and as the outermost one
+	DWT->CYCCNT = 2000;
+	PROF_BEGIN(after);
+	DWT->CYCCNT = 2064;
+	PROF_END(after);
+	CHECK(prof_region_after.count == 1);
+	CHECK(prof_region_after.total_cycles == 64 && prof_region_after.self_cycles == 64);
+
+	DWT->CYCCNT = 3000;
+	PROF_BEGIN(outer_again);
+	DWT->CYCCNT = 3010;
+	PROF_END(outer_again);
+	CHECK(prof_region_outer_again.self_cycles == 10);
+
+}
+
+static void test_dump(void) {
+
+	sent_length = 0;
+	prof_dump();
+	// one frame per region that ran: inner, outer, after, outer_again
+	const uint32_t frame = 2 + PROF_NAME_LENGTH + 3 * 4 + 2 * 8 + PROF_BUCKETS * 4 + 2;
+	CHECK(sent_length == 4 * frame);
+	CHECK(sent[0] == 0xA5 && sent[1] == 0x50);
+	CHECK(memcmp(&sent[2], "outer_again", 12) == 0);
+
+}
+
+int main(void) {
+
+	test_nesting();
+	test_unmatched_end();
+	test_dump();
+
+	return check_result("test_prof");
+
+}
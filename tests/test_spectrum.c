@@ -0,0 +1,239 @@
+// Vibration spectrum (src/imu_spectrum.c) against a double precision reference
+// computed the way numpy would (mean removed, periodic Hann window, direct DFT,
+// power averaged over the same overlapped frames), on both FFT paths. Also the
+// peaks, the result keeping its own buffer while the next average builds up,
+// frames starting over after missing samples, and imu_spectrum_benchmark().
+
+#include "check.h"
+#include "imu_spectrum.h"
+#include <math.h>
+#include <string.h>
+
+#define RATE_HZ   1000
+#define POINTS    1024
+#define HOP       512
+#define AVERAGE   4
+#define SAMPLES   (POINTS + (AVERAGE - 1) * HOP)
+#define PI        3.14159265358979
+
+static struct imu_spectrum spectrum, spectrum_q15;
+static const struct imu_spectrum_result *latest;
+static uint32_t results;
+static struct imu_block block;
+static double samples[3 * SAMPLES];
+static double reference[POINTS / 2 + 1];
+static uint32_t sent_bytes;
+
+void uart_send_bytes(const void *data, uint32_t length) {
+
+	sent_bytes += length;
+
+}
+
+static void spectrum_ready(const struct imu_spectrum_result *result) {
+
+	latest = result;
+	results++;
+
+}
+
+static uint32_t random_state = 1;
+
+static double noise(void) {
+
+	random_state = random_state * 1664525 + 1013904223;
+	return (random_state >> 8) / 16777216.0 - 0.5;
+
+}
+
+// gravity, 0.5g at 62.5Hz (exactly bin 64), 0.2g at 137.3Hz (between bins 140 and 141), and some noise
+static void make_samples(void) {
+
+	for (uint32_t n = 0; n < 3 * SAMPLES; n++) {
+		double t = (double) n / RATE_HZ;
+		samples[n] = 1.0 + 0.5 * sin(2.0 * PI * 62.5 * t) + 0.2 * sin(2.0 * PI * 137.3 * t + 0.3) + 0.01 * noise();
+	}
+
+}
+
+// feeds samples first .. first + count - 1 in blocks of 32, running the analyser whenever a frame is due
+static void feed(struct imu_spectrum *analyser, uint32_t first, uint32_t count) {
+
+	for (uint32_t n = first; n < first + count; ) {
+		block.count = first + count - n < 32 ? first + count - n : 32;
+		block.first_sample = n;
+		block.timestamp_us = n * (1000000 / RATE_HZ);
+		block.sample_period_us = 1000000 / RATE_HZ;
+		for (uint16_t i = 0; i < block.count; i++)
+			block.value[IMU_ACCEL_Z][i] = samples[n + i];
+		if (imu_spectrum_add_block(analyser, &block))
+			imu_spectrum_run(analyser);
+		n += block.count;
+	}
+
+}
+
+// the averaged amplitude spectrum of the frames starting at first, first + HOP, ...
+static void reference_spectrum(uint32_t first) {
+
+	static double power[POINTS / 2 + 1];
+	double window[POINTS], window_sum = 0.0;
+	memset(power, 0, sizeof(power));
+	for (uint32_t i = 0; i < POINTS; i++) {
+		window[i] = 0.5 - 0.5 * cos(2.0 * PI * i / POINTS);
+		window_sum += window[i];
+	}
+
+	for (uint32_t frame = 0; frame < AVERAGE; frame++) {
+		const double *x = &samples[first + frame * HOP];
+		double mean = 0.0, windowed[POINTS];
+		for (uint32_t i = 0; i < POINTS; i++)
+			mean += x[i] / POINTS;
+		for (uint32_t i = 0; i < POINTS; i++)
+			windowed[i] = (x[i] - mean) * window[i];
+		for (uint32_t k = 0; k <= POINTS / 2; k++) {
+			double re = 0.0, im = 0.0;
+			for (uint32_t i = 0; i < POINTS; i++) {
+				re += windowed[i] * cos(2.0 * PI * k * i / POINTS);
+				im -= windowed[i] * sin(2.0 * PI * k * i / POINTS);
+			}
+			power[k] += re * re + im * im;
+		}
+	}
+
+	for (uint32_t k = 0; k <= POINTS / 2; k++)
+		reference[k] = sqrt(power[k] / AVERAGE) * (k == 0 || k == POINTS / 2 ? 1.0 : 2.0) / window_sum;
+
+}
+
+// largest difference from the reference, relative to the largest bin
+static double spectrum_error(const struct imu_spectrum_result *result) {
+
+	double largest = 0.0, error = 0.0;
+	for (uint32_t k = 0; k < result->bins; k++) {
+		if (reference[k] > largest)
+			largest = reference[k];
+		if (fabs(result->amplitude[k] - reference[k]) > error)
+			error = fabs(result->amplitude[k] - reference[k]);
+	}
+	return error / largest;
+
+}
+
+static void test_reference(void) {
+
+	imu_spectrum_init(&spectrum, IMU_ACCEL_Z, POINTS, HOP, AVERAGE, IMU_SPECTRUM_FLOAT, &spectrum_ready);
+	imu_spectrum_init(&spectrum_q15, IMU_ACCEL_Z, POINTS, HOP, AVERAGE, IMU_SPECTRUM_Q15, &spectrum_ready);
+	reference_spectrum(0);
+
+	results = 0;
+	feed(&spectrum, 0, SAMPLES);
+	CHECK(results == 1 && latest == &spectrum.result);
+	CHECK(latest->bins == POINTS / 2 + 1 && latest->frames == AVERAGE);
+	CHECK_NEAR(latest->bin_hz, (double) RATE_HZ / POINTS, 1e-6);
+	CHECK(latest->timestamp_us == (SAMPLES - 1) * (1000000 / RATE_HZ));
+	double float_error = spectrum_error(latest);
+
+	feed(&spectrum_q15, 0, SAMPLES);
+	CHECK(results == 2 && latest == &spectrum_q15.result);
+	double q15_error = spectrum_error(latest);
+
+	printf("  %d points, %d frames: float %.2e, Q15 %.2e of the largest bin from the double reference\n",
+	       POINTS, AVERAGE, float_error, q15_error);
+	CHECK(float_error < 1e-5);
+	CHECK(q15_error < 2e-3);
+
+	// the strongest peaks: the sine on a bin exactly, the other one interpolated
+	const struct imu_spectrum_peak *peak = spectrum.result.peak;
+	printf("  peaks %.3fHz %.4f, %.3fHz %.4f\n", peak[0].frequency_hz, peak[0].amplitude, peak[1].frequency_hz, peak[1].amplitude);
+	CHECK_NEAR(peak[0].frequency_hz, 62.5, 0.01);
+	CHECK_NEAR(peak[0].amplitude, 0.5, 0.005);
+	CHECK_NEAR(peak[1].frequency_hz, 137.3, 0.1);
+	CHECK_NEAR(peak[1].amplitude, 0.2, 0.03);
+	CHECK(peak[2].amplitude < 0.05);
+
+}
+
+// the result is not overwritten by the frames of the next average, and the next result matches its own reference
+static void test_result_buffer(void) {
+
+	static float kept[POINTS / 2 + 1];
+	memcpy(kept, spectrum.result.amplitude, sizeof(kept));
+
+	// two more frames: halfway into the next average
+	results = 0;
+	feed(&spectrum, SAMPLES, 2 * HOP);
+	CHECK(results == 0 && spectrum.frames == 2);
+	CHECK(memcmp(kept, spectrum.result.amplitude, sizeof(kept)) == 0);
+
+	// the sender goes through the bins in parts, from the result
+	sent_bytes = 0;
+	uint16_t next = imu_spectrum_send(&spectrum.result, 0);
+	CHECK(next == IMU_SPECTRUM_SEND_BINS);
+	next = imu_spectrum_send(&spectrum.result, next);
+	CHECK(next == 2 * IMU_SPECTRUM_SEND_BINS);
+	CHECK(imu_spectrum_send(&spectrum.result, next) == 0);
+	CHECK(sent_bytes == 3 * (2 + 12 + IMU_SPECTRUM_PEAKS * 8 + 4 + 2) + (POINTS / 2 + 1) * 4);
+
+	feed(&spectrum, SAMPLES + 2 * HOP, 2 * HOP);
+	CHECK(results == 1);
+	reference_spectrum(AVERAGE * HOP);
+	CHECK(spectrum_error(&spectrum.result) < 1e-5);
+
+}
+
+// samples missing between blocks: the frame starts over, and POINTS samples are needed after the gap
+static void test_gap(void) {
+
+	imu_spectrum_init(&spectrum, IMU_ACCEL_Z, POINTS, HOP, 1, IMU_SPECTRUM_FLOAT, &spectrum_ready);
+	results = 0;
+	feed(&spectrum, 0, 1000);
+	CHECK(spectrum.filled == 1000 && spectrum.gaps == 0);
+
+	feed(&spectrum, 1010, 1000);
+	CHECK(spectrum.gaps == 1);
+	CHECK(results == 0 && spectrum.filled == 1000);
+
+	// the first frame is the POINTS samples right after the gap
+	feed(&spectrum, 2010, POINTS - 1000);
+	CHECK(results == 1);
+	CHECK(spectrum.result.timestamp_us == (1010 + POINTS - 1) * (1000000 / RATE_HZ));
+	CHECK(spectrum.gaps == 1);
+
+}
+
+static void test_benchmark(void) {
+
+	struct imu_spectrum_benchmark result;
+	imu_spectrum_init(&spectrum, IMU_ACCEL_Z, POINTS, HOP, AVERAGE, IMU_SPECTRUM_FLOAT, &spectrum_ready);
+	feed(&spectrum, 0, POINTS);
+	imu_spectrum_benchmark(&spectrum, &result);
+	CHECK(result.points == POINTS);
+	CHECK(spectrum.frame_ready == 0);
+	printf("  imu_spectrum_benchmark: Q15 error %.2e of the largest value\n", result.q15_error);
+	CHECK(result.q15_error > 0.0f && result.q15_error < 2e-3f);
+
+	// the cost of a whole frame on the host, both paths
+	for (uint8_t path = 0; path < 2; path++) {
+		imu_spectrum_init(&spectrum, IMU_ACCEL_Z, POINTS, HOP, AVERAGE, path, &spectrum_ready);
+		feed(&spectrum, 0, POINTS - 1);
+		double begin = host_seconds();
+		uint32_t frames = 0;
+		for (uint32_t n = POINTS - 1; n + HOP <= 3 * SAMPLES; n += HOP, frames++)
+			feed(&spectrum, n, HOP);
+		printf("  imu_spectrum_run on the host, %s: %.1f us per %d point frame\n",
+		       path == IMU_SPECTRUM_FLOAT ? "float" : "Q15", (host_seconds() - begin) * 1e6 / frames, POINTS);
+	}
+
+}
+
+int main(void) {
+
+	make_samples();
+	test_reference();
+	test_result_buffer();
+	test_gap();
+	test_benchmark();
+	return check_result("spectrum");
+
+}
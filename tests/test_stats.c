@@ -0,0 +1,181 @@
+// Window statistics (src/imu_stats.c) against a double precision reference
+// over the same samples: tumbling windows with Welford's update, sliding
+// windows that replace their oldest sample and keep min and max in monotonic
+// queues, long enough to pass the periodic recomputation, and windows starting
+// over after missing samples.
+
+#include "check.h"
+#include "imu_stats.h"
+#include <math.h>
+
+#define PERIOD_US   1000
+
+static struct imu_stats stats;
+static struct imu_stats_result results[256];
+static uint32_t result_count;
+static struct imu_block block;
+
+void uart_send_bytes(const void *data, uint32_t length) {
+
+}
+
+static void collect(const struct imu_stats_result *result) {
+
+	if (result_count < 256)
+		results[result_count] = *result;
+	result_count++;
+
+}
+
+// a different level per axis, a slow sine and noise, so the extremes move around inside the windows
+static float sample(uint32_t n, uint8_t axis) {
+
+	uint32_t hash = (n * 2654435761u) ^ (axis * 40503u);
+	hash ^= hash >> 15;
+	hash *= 2246822519u;
+	hash ^= hash >> 13;
+	return 100.0f * axis + 3.0f * sinf(n * 0.01f + axis) + (hash >> 8) / 16777216.0f - 0.5f;
+
+}
+
+// feeds samples first .. first + count - 1 in blocks of 13, so windows end inside blocks
+static void feed(uint32_t first, uint32_t count) {
+
+	for (uint32_t n = first; n < first + count; ) {
+		block.count = first + count - n < 13 ? first + count - n : 13;
+		block.first_sample = n;
+		block.timestamp_us = 5000000 + n * PERIOD_US;
+		block.sample_period_us = PERIOD_US;
+		block.sensor = 2;
+		for (uint16_t i = 0; i < block.count; i++)
+			for (uint8_t axis = 0; axis < IMU_AXES; axis++)
+				block.value[axis][i] = sample(n + i, axis);
+		imu_stats_add_block(&stats, &block);
+		n += block.count;
+	}
+
+}
+
+// checks a result against samples first .. first + count - 1, returns the worst relative variance error
+static double check_result_window(const struct imu_stats_result *result, uint32_t first, uint16_t count) {
+
+	CHECK(result->count == count);
+	CHECK(result->sensor == 2);
+	CHECK(result->timestamp_us == 5000000 + first * PERIOD_US);
+	CHECK(result->duration_us == (uint32_t) (count - 1) * PERIOD_US);
+
+	double worst = 0.0;
+	for (uint8_t axis = 0; axis < IMU_AXES; axis++) {
+		double mean = 0.0, variance = 0.0;
+		float min = sample(first, axis), max = min;
+		for (uint32_t n = first; n < first + count; n++) {
+			float x = sample(n, axis);
+			mean += x;
+			if (x < min) min = x;
+			if (x > max) max = x;
+		}
+		mean /= count;
+		for (uint32_t n = first; n < first + count; n++)
+			variance += (sample(n, axis) - mean) * (sample(n, axis) - mean);
+		variance /= count;
+
+		const struct imu_stats_axis *a = &result->axis[axis];
+		CHECK(a->min == min && a->max == max);
+		CHECK_NEAR(a->mean, mean, 1e-4 * (fabs(mean) + 1.0));
+		CHECK_NEAR(a->rms, sqrt(mean * mean + variance), 1e-4 * (fabs(mean) + 1.0));
+		if (fabs(a->variance - variance) / variance > worst)
+			worst = fabs(a->variance - variance) / variance;
+	}
+	return worst;
+
+}
+
+static void test_tumbling(void) {
+
+	imu_stats_init(&stats, 50, 50, &collect);
+	result_count = 0;
+	feed(0, 1000);
+	CHECK(result_count == 20);
+
+	double worst = 0.0;
+	for (uint32_t r = 0; r < result_count; r++) {
+		double error = check_result_window(&results[r], r * 50, 50);
+		if (error > worst)
+			worst = error;
+	}
+	printf("  tumbling, 50 samples: variance within %.1e of the reference\n", worst);
+	CHECK(worst < 1e-5);
+
+}
+
+// every 10 samples a result over the latest 100, for long enough to pass several recomputations from the ring
+static void test_sliding(void) {
+
+	imu_stats_init(&stats, 100, 10, &collect);
+	result_count = 0;
+	uint32_t samples = 100 + 100 * IMU_STATS_RESYNC * 3;
+	feed(0, samples);
+	CHECK(result_count == 1 + (samples - 100) / 10);
+
+	double worst = 0.0;
+	for (uint32_t r = 0; r < result_count && r < 256; r++) {
+		double error = check_result_window(&results[r], r * 10, 100);
+		if (error > worst)
+			worst = error;
+	}
+
+	// the latest results, long after the first recomputation
+	uint32_t done = result_count;
+	result_count = 0;
+	feed(samples, 200);
+	CHECK(result_count == 20);
+	for (uint32_t r = 0; r < result_count; r++) {
+		double error = check_result_window(&results[r], (done + r) * 10, 100);
+		if (error > worst)
+			worst = error;
+	}
+	printf("  sliding, 100 samples every 10: variance within %.1e of the reference\n", worst);
+	CHECK(worst < 2e-3);
+
+}
+
+// samples missing between blocks: the window in progress is dropped, and the next one starts after the gap
+static void test_gap(void) {
+
+	imu_stats_init(&stats, 50, 50, &collect);
+	result_count = 0;
+	feed(0, 80);
+	CHECK(result_count == 1 && stats.gaps == 0);
+
+	feed(90, 60);
+	CHECK(stats.gaps == 1);
+	CHECK(result_count == 2);
+	check_result_window(&results[1], 90, 50);
+
+	// contiguous blocks do not start over
+	feed(150, 40);
+	CHECK(stats.gaps == 1 && result_count == 3);
+	check_result_window(&results[2], 140, 50);
+
+	// sliding: after the gap no result until the window has filled again, and the extremes from before are gone
+	imu_stats_init(&stats, 100, 10, &collect);
+	result_count = 0;
+	feed(0, 150);
+	CHECK(result_count == 6);
+	feed(1000, 99);
+	CHECK(stats.gaps == 1 && result_count == 6);
+	feed(1099, 11);
+	CHECK(result_count == 8);
+	check_result_window(&results[6], 1000, 100);
+	check_result_window(&results[7], 1010, 100);
+
+}
+
+int main(void) {
+
+	test_tumbling();
+	test_sliding();
+	test_gap();
+	return check_result("stats");
+
+}
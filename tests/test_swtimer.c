@@ -0,0 +1,300 @@
+// Timer wheel (src/lib_swtimer.c) driven through the TIM2 compare ISR
+// (src/lib_time.c): expiry at the exact tick on every level of the wheel,
+// periodic and thread context timers, and the cost of insert and expire.
+
+#include "check.h"
+#include "lib_swtimer.h"
+#include "lib_time.h"
+#include <stdlib.h>
+
+#define TICK_US     1000
+#define MAX_DELAY   ((1UL << 24) - 1)
+#define BENCH_COUNT 100000
+
+void TIM2_IRQHandler(void);
+
+struct probe {
+	uint32_t fired;
+	uint32_t first_tick;
+	uint32_t last_tick;
+};
+
+static struct swtimer timers[BENCH_COUNT];
+static struct probe probes[BENCH_COUNT];
+static uint32_t expected[BENCH_COUNT];
+static uint32_t random_state = 12345;
+
+static uint32_t random_below(uint32_t limit) {
+
+	random_state = random_state * 1664525 + 1013904223;
+	return (uint32_t)(((uint64_t) random_state * limit) >> 32);
+
+}
+
+// the tick being processed when a callback runs
+static void probe_callback(void *arg) {
+
+	struct probe *probe = arg;
+	uint32_t tick = swtimer_now() - 1;
+	if (probe->fired == 0)
+		probe->first_tick = tick;
+	probe->last_tick = tick;
+	probe->fired++;
+
+}
+
+// lets the counter reach the CC2 compare and runs the ISR, once per tick
+static void run_ticks(uint32_t ticks) {
+
+	while (ticks--) {
+		TIM2->CNT = TIM2->CCR2;
+		TIM2->SR = TIM_SR_CC2IF;
+		TIM2_IRQHandler();
+	}
+
+}
+
+static void test_compare_interrupt(void) {
+
+	CHECK(TIM2->DIER & TIM_DIER_CC2IE);
+	CHECK(TIM2->CCR2 == TIM2->CNT + TICK_US);
+
+	uint32_t tick = swtimer_now();
+	uint32_t compare = TIM2->CCR2;
+	run_ticks(1);
+	CHECK(swtimer_now() == tick + 1);
+	CHECK(TIM2->CCR2 == compare + TICK_US);
+	CHECK((TIM2->SR & TIM_SR_CC2IF) == 0);
+
+	// held up for 2.5 periods: every missed tick is caught up and the compare is ahead of the counter again
+	TIM2->CNT = TIM2->CCR2 + 2 * TICK_US + TICK_US / 2;
+	TIM2->SR = TIM_SR_CC2IF;
+	TIM2_IRQHandler();
+	CHECK(swtimer_now() == tick + 4);
+	CHECK((int32_t)(TIM2->CCR2 - TIM2->CNT) > 0);
+
+	// the sleepMs() compare alone does not tick the wheel
+	TIM2->DIER |= TIM_DIER_CC1IE;
+	TIM2->SR = TIM_SR_CC1IF;
+	TIM2_IRQHandler();
+	TIM2->DIER &= ~TIM_DIER_CC1IE;
+	CHECK(swtimer_now() == tick + 4);
+
+	// and a CC2 flag without the interrupt enabled is ignored
+	TIM2->DIER &= ~TIM_DIER_CC2IE;
+	TIM2->SR = TIM_SR_CC2IF;
+	TIM2_IRQHandler();
+	TIM2->DIER |= TIM_DIER_CC2IE;
+	CHECK(swtimer_now() == tick + 4);
+
+}
+
+static void test_one_shot(void) {
+
+	static const uint32_t delays[] = { 0, 1, 2, 63, 64, 65, 127, 128, 4095, 4096, 4097, 262143, 262144, 262145, 300000, MAX_DELAY, MAX_DELAY + 1000 };
+	const uint32_t count = sizeof(delays) / sizeof(delays[0]);
+
+	// start off a slot boundary so the wheel levels are not aligned with the delays
+	run_ticks(37);
+	uint32_t start = swtimer_now();
+	for (uint32_t i = 0; i < count; i++) {
+		probes[i] = (struct probe) { 0 };
+		swtimer_init(&timers[i], &probe_callback, &probes[i], ISR_CONTEXT);
+		swtimer_start(&timers[i], delays[i], 0);
+	}
+
+	run_ticks(MAX_DELAY + 2);
+
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t delay = delays[i] > MAX_DELAY ? MAX_DELAY : delays[i];
+		CHECK(probes[i].fired == 1);
+		CHECK(probes[i].first_tick == start + delay);
+		CHECK(timers[i].active == 0);
+	}
+
+}
+
+static void test_periodic(void) {
+
+	struct probe probe = { 0 };
+	struct swtimer timer;
+	swtimer_init(&timer, &probe_callback, &probe, ISR_CONTEXT);
+
+	uint32_t start = swtimer_now();
+	swtimer_start(&timer, 3, 7);
+	run_ticks(1000);
+	swtimer_stop(&timer);
+
+	CHECK(probe.fired == (1000 - 3 + 6) / 7);
+	CHECK(probe.first_tick == start + 3);
+	CHECK(probe.last_tick == start + 3 + 7 * (probe.fired - 1));
+
+	// long periods stay exact across the cascades
+	probe = (struct probe) { 0 };
+	start = swtimer_now();
+	swtimer_start(&timer, 5000, 5000);
+	run_ticks(20001);
+	swtimer_stop(&timer);
+	CHECK(probe.fired == 4);
+	CHECK(probe.last_tick == start + 20000);
+
+}
+
+static void test_stop_and_restart(void) {
+
+	struct probe stopped = { 0 }, restarted = { 0 };
+	struct swtimer a, b;
+	swtimer_init(&a, &probe_callback, &stopped, ISR_CONTEXT);
+	swtimer_init(&b, &probe_callback, &restarted, ISR_CONTEXT);
+
+	uint32_t start = swtimer_now();
+	swtimer_start(&a, 10, 0);
+	swtimer_start(&b, 100, 0);
+	run_ticks(5);
+	swtimer_stop(&a);
+	swtimer_start(&b, 5, 0);
+	run_ticks(200);
+
+	CHECK(stopped.fired == 0);
+	CHECK(a.active == 0);
+	CHECK(restarted.fired == 1);
+	CHECK(restarted.first_tick == start + 10);
+
+	// stopping twice, or a timer that never ran, is harmless
+	swtimer_stop(&a);
+	swtimer_stop(&b);
+	run_ticks(10);
+	CHECK(stopped.fired == 0 && restarted.fired == 1);
+
+}
+
+static void test_thread_context(void) {
+
+	struct probe probe = { 0 };
+	struct swtimer timer;
+	swtimer_init(&timer, &probe_callback, &probe, THREAD_CONTEXT);
+
+	swtimer_start(&timer, 10, 10);
+	run_ticks(10);
+	CHECK(probe.fired == 0);
+	run_ticks(1);
+	CHECK(probe.fired == 0);
+	swtimer_run_pending();
+	CHECK(probe.fired == 1);
+	swtimer_run_pending();
+	CHECK(probe.fired == 1);
+
+	// not run for several periods: one call, counted as an overrun, then back on schedule
+	run_ticks(35);
+	swtimer_run_pending();
+	CHECK(probe.fired == 2);
+	CHECK(timer.overruns == 1);
+	run_ticks(1);
+	swtimer_run_pending();
+	CHECK(probe.fired == 3);
+
+	// stopping removes it from the pending list too
+	run_ticks(10);
+	swtimer_stop(&timer);
+	swtimer_run_pending();
+	CHECK(probe.fired == 3);
+
+}
+
+// ISR context callbacks that re-arm themselves with random delays
+static void chain_callback(void *arg) {
+
+	struct probe *probe = arg;
+	struct swtimer *timer = &timers[probe - probes];
+	probe_callback(arg);
+	CHECK(probe->last_tick == expected[probe - probes]);
+	if (probe->fired < 20) {
+		uint32_t delay = random_below(5000);
+		expected[probe - probes] = swtimer_now() + delay;
+		swtimer_start(timer, delay, 0);
+	}
+
+}
+
+static void test_random(void) {
+
+	const uint32_t count = 20000;
+	uint32_t start = swtimer_now();
+	uint32_t last = start;
+
+	for (uint32_t i = 0; i < count; i++) {
+		probes[i] = (struct probe) { 0 };
+		uint32_t delay = random_below(i & 1 ? 300000 : 200);
+		expected[i] = start + delay;
+		if (expected[i] > last)
+			last = expected[i];
+		swtimer_init(&timers[i], &probe_callback, &probes[i], ISR_CONTEXT);
+		swtimer_start(&timers[i], delay, 0);
+	}
+	run_ticks(last - start + 1);
+
+	uint32_t wrong = 0;
+	for (uint32_t i = 0; i < count; i++)
+		if (probes[i].fired != 1 || probes[i].first_tick != expected[i])
+			wrong++;
+	CHECK(wrong == 0);
+
+	for (uint32_t i = 0; i < 1000; i++) {
+		probes[i] = (struct probe) { 0 };
+		expected[i] = swtimer_now() + i;
+		swtimer_init(&timers[i], &chain_callback, &probes[i], ISR_CONTEXT);
+		swtimer_start(&timers[i], i, 0);
+	}
+	run_ticks(1000 + 20 * 5000);
+	wrong = 0;
+	for (uint32_t i = 0; i < 1000; i++)
+		if (probes[i].fired != 20)
+			wrong++;
+	CHECK(wrong == 0);
+
+}
+
+static void benchmark(void) {
+
+	for (uint32_t i = 0; i < BENCH_COUNT; i++) {
+		probes[i] = (struct probe) { 0 };
+		swtimer_init(&timers[i], &probe_callback, &probes[i], ISR_CONTEXT);
+	}
+
+	double start = host_seconds();
+	for (uint32_t i = 0; i < BENCH_COUNT; i++)
+		swtimer_start(&timers[i], 1 + random_below((1 << 16) - 1), 0);
+	double insert = host_seconds() - start;
+
+	uint32_t expired = swtimer_stats.expired;
+	start = host_seconds();
+	run_ticks(1 << 16);
+	double expire = host_seconds() - start;
+	expired = swtimer_stats.expired - expired;
+
+	start = host_seconds();
+	run_ticks(1 << 16);
+	double idle = host_seconds() - start;
+
+	CHECK(expired == BENCH_COUNT);
+	printf("swtimer: insert %.1f ns, expire %.1f ns per timer (%u timers over %u ticks), idle tick %.1f ns\n",
+	       insert * 1e9 / BENCH_COUNT, (expire - idle) * 1e9 / expired, expired, 1 << 16, idle * 1e9 / (1 << 16));
+
+}
+
+int main(void) {
+
+	TIM2->CNT = 123456;
+	swtimer_setup(TICK_US);
+
+	test_compare_interrupt();
+	test_one_shot();
+	test_periodic();
+	test_stop_and_restart();
+	test_thread_context();
+	test_random();
+	benchmark();
+
+	return check_result("test_swtimer");
+
+}
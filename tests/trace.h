@@ -0,0 +1,214 @@
+#pragma once
+// Synthetic IMU recordings with a known orientation, for the filter tests. The
+// sensor turns with a smooth angular rate, and the readings are what an
+// MPU6050 and HMC5883L at rest on the earth's surface would report: the true
+// rate plus a bias and noise, gravity and the earth's field rotated into the
+// sensor frame plus noise, all quantized to the sensors' counts. The true
+// orientation is kept in double precision.
+//
+// Quaternions follow struct madgwick: q0 is the scalar part, and q rotates
+// vectors from the sensor frame into the earth frame, whose x axis points to
+// magnetic north and z axis up.
+
+#include "imu_block.h"
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TRACE_GYRO_SCALE   (1.0 / 939.650784)   // rad/s per count at 2000dps
+#define TRACE_ACCEL_SCALE  (1.0 / 8192.0)       // g per count at 4g
+#define TRACE_MAGN_SCALE   (1.0 / 660.0)        // gauss per count
+#define TRACE_FIELD_X      0.25                 // earth's field in gauss, 60 degrees dip
+#define TRACE_FIELD_Z      -0.433
+#define TRACE_DEG          (M_PI / 180.0)
+
+struct trace_motion {
+	double initial_deg[3];      // roll, pitch, yaw at the start
+	double rate_dps;            // amplitude of the angular rate about each axis, 0 to stay still
+	double bias_dps[3];         // constant gyro bias
+	double gyro_noise_dps;      // standard deviations of the white noise on each axis
+	double accel_noise_g;
+	double magn_noise_gauss;
+	uint32_t seed;
+};
+
+static uint32_t trace_random_state;
+
+// standard normal, Box-Muller on a 32bit LCG
+static inline double trace_gaussian(void) {
+
+	trace_random_state = trace_random_state * 1664525 + 1013904223;
+	double u1 = (trace_random_state + 1.0) / 4294967297.0;
+	trace_random_state = trace_random_state * 1664525 + 1013904223;
+	double u2 = trace_random_state / 4294967296.0;
+	return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+
+}
+
+static inline void trace_multiply(const double a[4], const double b[4], double out[4]) {
+
+	double r[4] = {
+		a[0] * b[0] - a[1] * b[1] - a[2] * b[2] - a[3] * b[3],
+		a[0] * b[1] + a[1] * b[0] + a[2] * b[3] - a[3] * b[2],
+		a[0] * b[2] - a[1] * b[3] + a[2] * b[0] + a[3] * b[1],
+		a[0] * b[3] + a[1] * b[2] - a[2] * b[1] + a[3] * b[0]
+	};
+	memcpy(out, r, sizeof(r));
+
+}
+
+// rotates an earth frame vector into the sensor frame: q* v q
+static inline void trace_to_sensor(const double q[4], const double v[3], double out[3]) {
+
+	double p[4] = { 0.0, v[0], v[1], v[2] };
+	double conjugate[4] = { q[0], -q[1], -q[2], -q[3] };
+	double t[4];
+	trace_multiply(conjugate, p, t);
+	trace_multiply(t, q, t);
+	out[0] = t[1];
+	out[1] = t[2];
+	out[2] = t[3];
+
+}
+
+static inline void trace_from_euler(const double deg[3], double q[4]) {
+
+	double cr = cos(deg[0] * TRACE_DEG / 2), sr = sin(deg[0] * TRACE_DEG / 2);
+	double cp = cos(deg[1] * TRACE_DEG / 2), sp = sin(deg[1] * TRACE_DEG / 2);
+	double cy = cos(deg[2] * TRACE_DEG / 2), sy = sin(deg[2] * TRACE_DEG / 2);
+	q[0] = cr * cp * cy + sr * sp * sy;
+	q[1] = sr * cp * cy - cr * sp * sy;
+	q[2] = cr * sp * cy + sr * cp * sy;
+	q[3] = cr * cp * sy - sr * sp * cy;
+
+}
+
+static inline void trace_rate(const struct trace_motion *motion, double t, double w[3]) {
+
+	double a = motion->rate_dps * TRACE_DEG;
+	w[0] = a * sin(2.0 * M_PI * 0.31 * t);
+	w[1] = a * sin(2.0 * M_PI * 0.23 * t + 1.0);
+	w[2] = a * sin(2.0 * M_PI * 0.17 * t + 2.0);
+
+}
+
+static inline int16_t trace_counts(double value, double scale) {
+
+	double counts = round(value / scale);
+	return counts > 32767 ? 32767 : counts < -32768 ? -32768 : (int16_t) counts;
+
+}
+
+/**
+ * Generates a recording.
+ *
+ * @param motion      The motion and sensor errors
+ * @param rate_hz     Sample rate
+ * @param blocks      Number of blocks, IMU_BLOCK_CAPACITY samples each
+ * @param trace       Receives the blocks
+ * @param truth       Receives the true orientation at each sample, or 0
+ * @param reference   Receives the same as floats, for fusion_benchmark(), or 0
+ */
+static inline void trace_generate(const struct trace_motion *motion, uint32_t rate_hz, uint32_t blocks, struct imu_block *trace, double (*truth)[4], float (*reference)[4]) {
+
+	const uint32_t substeps = 8;
+	const double field[3] = { TRACE_FIELD_X, 0.0, TRACE_FIELD_Z };
+	const double gravity[3] = { 0.0, 0.0, 1.0 };
+	const double dt = 1.0 / rate_hz / substeps;
+	double q[4];
+	trace_from_euler(motion->initial_deg, q);
+	trace_random_state = motion->seed;
+
+	for (uint32_t b = 0; b < blocks; b++) {
+
+		struct imu_block *block = &trace[b];
+		memset(block, 0, sizeof(*block));
+		block->sequence = b;
+		block->sample_period_us = 1000000 / rate_hz;
+		block->timestamp_us = b * IMU_BLOCK_CAPACITY * block->sample_period_us;
+		block->first_sample = b * IMU_BLOCK_CAPACITY;
+		block->count = IMU_BLOCK_CAPACITY;
+
+		for (uint32_t n = 0; n < IMU_BLOCK_CAPACITY; n++) {
+
+			uint32_t sample = b * IMU_BLOCK_CAPACITY + n;
+
+			// the gyro integrates over the sample period, so it reads the mean rate
+			double w[3], mean[3] = { 0.0, 0.0, 0.0 };
+			for (uint32_t s = 0; s < substeps; s++) {
+				trace_rate(motion, (sample * substeps + s + 0.5) * dt, w);
+				double angle = sqrt(w[0] * w[0] + w[1] * w[1] + w[2] * w[2]) * dt;
+				double step[4] = { 1.0, 0.0, 0.0, 0.0 };
+				if (angle > 0.0) {
+					double k = sin(angle / 2) / (angle / dt);
+					step[0] = cos(angle / 2);
+					step[1] = w[0] * k;
+					step[2] = w[1] * k;
+					step[3] = w[2] * k;
+				}
+				trace_multiply(q, step, q);
+				for (uint32_t i = 0; i < 3; i++)
+					mean[i] += w[i] / substeps;
+			}
+
+			double a[3], m[3];
+			trace_to_sensor(q, gravity, a);
+			trace_to_sensor(q, field, m);
+
+			for (uint32_t i = 0; i < 3; i++) {
+				int16_t gyro = trace_counts(mean[i] + motion->bias_dps[i] * TRACE_DEG + motion->gyro_noise_dps * TRACE_DEG * trace_gaussian(), TRACE_GYRO_SCALE);
+				int16_t accel = trace_counts(a[i] + motion->accel_noise_g * trace_gaussian(), TRACE_ACCEL_SCALE);
+				int16_t magn = trace_counts(m[i] + motion->magn_noise_gauss * trace_gaussian(), TRACE_MAGN_SCALE);
+				block->raw[IMU_GYRO_X + i][n] = gyro;
+				block->raw[IMU_ACCEL_X + i][n] = accel;
+				block->raw[IMU_MAGN_X + i][n] = magn;
+				block->value[IMU_GYRO_X + i][n] = (float) (gyro * TRACE_GYRO_SCALE);
+				block->value[IMU_ACCEL_X + i][n] = (float) (accel * TRACE_ACCEL_SCALE);
+				block->value[IMU_MAGN_X + i][n] = (float) (magn * TRACE_MAGN_SCALE);
+			}
+
+			for (uint32_t i = 0; i < 4; i++) {
+				if (truth)
+					truth[sample][i] = q[i];
+				if (reference)
+					reference[sample][i] = (float) q[i];
+			}
+
+		}
+
+	}
+
+}
+
+/**
+ * @returns   Angle of the rotation between an estimate and the truth, in degrees
+ */
+static inline double trace_error_deg(const float estimate[4], const double truth[4]) {
+
+	double dot = 0.0, norm = 0.0;
+	for (uint32_t i = 0; i < 4; i++) {
+		dot += estimate[i] * truth[i];
+		norm += (double) estimate[i] * estimate[i];
+	}
+	dot = fabs(dot) / sqrt(norm);
+	return 2.0 * acos(dot < 1.0 ? dot : 1.0) / TRACE_DEG;
+
+}
+
+/**
+ * @returns   Angle between the estimated and true direction of gravity, in degrees: the error that ignores the heading
+ */
+static inline double trace_tilt_error_deg(const float estimate[4], const double truth[4]) {
+
+	const double up[3] = { 0.0, 0.0, 1.0 };
+	double e[4] = { estimate[0], estimate[1], estimate[2], estimate[3] };
+	double norm = sqrt(e[0] * e[0] + e[1] * e[1] + e[2] * e[2] + e[3] * e[3]);
+	for (uint32_t i = 0; i < 4; i++)
+		e[i] /= norm;
+	double a[3], b[3];
+	trace_to_sensor(e, up, a);
+	trace_to_sensor(truth, up, b);
+	double dot = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+	return acos(dot < 1.0 ? dot : 1.0) / TRACE_DEG;
+
+}
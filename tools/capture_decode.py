@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+# Decodes the shock captures sent by imu_capture_upload() (src/imu_capture.c).
+# Each complete capture is written to capture_<id>.csv with the time relative to
+# the trigger and every axis in physical units.
+#
+# Usage: capture_decode.py capture.bin [output_directory]
+#        stty -F /dev/ttyACM0 115200 raw && capture_decode.py /dev/ttyACM0
+
+import os
+import struct
+import sys
+
+SYNC_HEADER = b'\xA5\x56'
+SYNC_SAMPLES = b'\xA5\x57'
+AXES = ['gyro_x', 'gyro_y', 'gyro_z', 'accel_x', 'accel_y', 'accel_z', 'magn_x', 'magn_y', 'magn_z']
+HEADER = struct.Struct('<HIBfHH%df' % len(AXES))
+SAMPLES = struct.Struct('<HHB')
+SAMPLE = struct.Struct('<I%dh' % len(AXES))
+TRIGGERS = ['level', 'slope']
+
+
+def frames(stream):
+    buffer = b''
+    while True:
+        chunk = stream.read(256)
+        if not chunk:
+            return
+        buffer += chunk
+        while True:
+            start = buffer.find(b'\xA5')
+            if start < 0 or len(buffer) - start < 2 + SAMPLES.size:
+                buffer = buffer[max(start, 0):] if start >= 0 else b''
+                break
+            sync = buffer[start:start + 2]
+            if sync == SYNC_HEADER:
+                length = 2 + HEADER.size + 2
+            elif sync == SYNC_SAMPLES:
+                count = buffer[start + 2 + SAMPLES.size - 1]
+                length = 2 + SAMPLES.size + count * SAMPLE.size + 2
+            else:
+                buffer = buffer[start + 1:]
+                continue
+            if len(buffer) - start < length:
+                break
+            frame = buffer[start:start + length]
+            body = frame[2:-2]
+            checksum, = struct.unpack('<H', frame[-2:])
+            if sum(body) & 0xFFFF != checksum:
+                buffer = buffer[start + 1:]
+                continue
+            buffer = buffer[start + length:]
+            yield sync, body
+
+
+def captures(stream):
+    current = None
+    for sync, body in frames(stream):
+        if sync == SYNC_HEADER:
+            fields = HEADER.unpack(body)
+            current = {'id': fields[0], 'trigger_us': fields[1], 'trigger': TRIGGERS[fields[2]] if fields[2] < 2 else '?',
+                       'threshold': fields[3], 'pre': fields[4], 'total': fields[5], 'scale': fields[6:],
+                       'samples': [None] * fields[5]}
+            continue
+        capture_id, index, count = SAMPLES.unpack_from(body)
+        if current is None or current['id'] != capture_id:
+            continue
+        for i in range(count):
+            if index + i < current['total']:
+                current['samples'][index + i] = SAMPLE.unpack_from(body, SAMPLES.size + i * SAMPLE.size)
+        if index + count >= current['total']:
+            yield current
+            current = None
+
+
+def main():
+    if len(sys.argv) < 2:
+        print('usage: capture_decode.py capture.bin [output_directory]')
+        sys.exit(1)
+    directory = sys.argv[2] if len(sys.argv) > 2 else '.'
+    with open(sys.argv[1], 'rb') as stream:
+        for capture in captures(stream):
+            missing = capture['samples'].count(None)
+            path = os.path.join(directory, 'capture_%d.csv' % capture['id'])
+            print('capture %d: %s trigger %.3f at %.6f s, %d samples (%d before), %d missing -> %s'
+                  % (capture['id'], capture['trigger'], capture['threshold'], capture['trigger_us'] / 1e6,
+                     capture['total'], capture['pre'], missing, path))
+            with open(path, 'w') as csv:
+                csv.write('time_s,' + ','.join(AXES) + '\n')
+                for sample in capture['samples']:
+                    if sample is None:
+                        continue
+                    # timestamps wrap every 71 minutes
+                    dt = ((sample[0] - capture['trigger_us'] + 2**31) % 2**32 - 2**31) / 1e6
+                    values = [raw * scale for raw, scale in zip(sample[1:], capture['scale'])]
+                    csv.write('%.6f,' % dt + ','.join('%.5f' % v for v in values) + '\n')
+
+
+if __name__ == '__main__':
+    main()
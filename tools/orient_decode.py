@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+# Decodes the orientations sent by imu_orient_add() (src/imu_orient.c) and
+# prints them as CSV: the quaternion, the roll, pitch and yaw in degrees, and
+# any vectors that were sent along.
+#
+# Error bounds, for unit quaternions on the device:
+#   each of the smallest three    +/-0.00070 (half of a 1/(511 sqrt(2)) step)
+#   rotation angle                at most 0.27 degrees
+#   half floats                   relative error 2^-11 (0.049%) from 6.1e-5 to 65504,
+#                                 absolute error 2^-25 below that, larger values become infinity
+#
+# Usage: orient_decode.py capture.bin
+#        stty -F /dev/ttyACM0 115200 raw && orient_decode.py /dev/ttyACM0
+
+import math
+import struct
+import sys
+
+SYNC = b'\xA5\x5B'
+HEADER = struct.Struct('<BBIIIB')
+VECTORS = [(0x01, ['gyro_x', 'gyro_y', 'gyro_z']),
+           (0x02, ['accel_x', 'accel_y', 'accel_z']),
+           (0x04, ['magn_x', 'magn_y', 'magn_z'])]
+STEP = 1 / (511 * math.sqrt(2))
+
+
+def entry_size(vectors):
+    return 1 + 4 + 6 * sum(1 for bit, _ in VECTORS if vectors & bit)
+
+
+def frames(stream):
+    buffer = b''
+    while True:
+        chunk = stream.read(256)
+        if not chunk:
+            return
+        buffer += chunk
+        while True:
+            start = buffer.find(SYNC)
+            if start < 0 or len(buffer) - start < 2 + HEADER.size:
+                buffer = buffer[max(start, 0):] if start >= 0 else buffer[-1:]
+                break
+            header = HEADER.unpack(buffer[start + 2:start + 2 + HEADER.size])
+            length = 2 + HEADER.size + header[5] * entry_size(header[1]) + 2
+            if len(buffer) - start < length:
+                break
+            frame = buffer[start:start + length]
+            body = frame[2:-2]
+            checksum, = struct.unpack('<H', frame[-2:])
+            if sum(body) & 0xFFFF != checksum:
+                buffer = buffer[start + 1:]
+                continue
+            buffer = buffer[start + length:]
+            yield header, body[HEADER.size:]
+
+
+def unpack_quaternion(packed):
+    largest = packed >> 30
+    others = [((packed >> shift & 0x3FF) - 511) * STEP for shift in (20, 10, 0)]
+    q = others[:largest] + [math.sqrt(max(0.0, 1 - sum(v * v for v in others)))] + others[largest:]
+    return q
+
+
+def euler_degrees(q):
+    q0, q1, q2, q3 = q
+    roll = math.atan2(2 * (q0 * q1 + q2 * q3), 1 - 2 * (q1 * q1 + q2 * q2))
+    pitch = math.asin(max(-1.0, min(1.0, 2 * (q0 * q2 - q3 * q1))))
+    yaw = math.atan2(2 * (q0 * q3 + q1 * q2), 1 - 2 * (q2 * q2 + q3 * q3))
+    return [math.degrees(a) for a in (roll, pitch, yaw)]
+
+
+def main():
+    if len(sys.argv) < 2:
+        print('usage: orient_decode.py capture.bin')
+        sys.exit(1)
+    printed_vectors = None
+    with open(sys.argv[1], 'rb') as stream:
+        for header, entries in frames(stream):
+            sensor, vectors, sample, timestamp, period, count = header
+            names = [name for bit, axes in VECTORS if vectors & bit for name in axes]
+            if vectors != printed_vectors:
+                print('sensor,sequence,timestamp_us,q0,q1,q2,q3,roll,pitch,yaw' + ''.join(',' + name for name in names))
+                printed_vectors = vectors
+            size = entry_size(vectors)
+            for i in range(count):
+                entry = entries[i * size:(i + 1) * size]
+                sample += entry[0]
+                packed, = struct.unpack('<I', entry[1:5])
+                halves = struct.unpack('<%de' % len(names), entry[5:])
+                q = unpack_quaternion(packed)
+                print('%d,%d,%d,%s,%s%s' % (sensor, sample, timestamp + (sample - header[2]) * period,
+                                            ','.join('%.5f' % v for v in q),
+                                            ','.join('%.2f' % a for a in euler_degrees(q)),
+                                            ''.join(',%g' % v for v in halves)))
+
+
+if __name__ == '__main__':
+    main()
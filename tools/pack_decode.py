@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+# Decodes the compressed raw samples sent by imu_pack_send() (src/imu_pack.c).
+# Samples are printed as CSV in raw counts. Every frame is checked against the
+# sum of its raw counts, so any reconstruction that is not bit exact is
+# reported; frames after a lost frame are skipped until the next keyframe.
+#
+# Usage: pack_decode.py capture.bin
+#        stty -F /dev/ttyACM0 115200 raw && pack_decode.py /dev/ttyACM0
+
+import struct
+import sys
+
+SYNC = b'\xA5\x5A'
+AXES = ['gyro_x', 'gyro_y', 'gyro_z', 'accel_x', 'accel_y', 'accel_z', 'magn_x', 'magn_y', 'magn_z']
+HEADER = struct.Struct('<BBBIIIBHH')
+FLOAT_SAMPLE_SIZE = 4 * len(AXES)
+
+
+def frames(stream):
+    buffer = b''
+    while True:
+        chunk = stream.read(256)
+        if not chunk:
+            return
+        buffer += chunk
+        while True:
+            start = buffer.find(SYNC)
+            if start < 0 or len(buffer) - start < 2 + HEADER.size:
+                buffer = buffer[max(start, 0):] if start >= 0 else buffer[-1:]
+                break
+            payload = HEADER.unpack(buffer[start + 2:start + 2 + HEADER.size])[7]
+            length = 2 + HEADER.size + payload + 2
+            if len(buffer) - start < length:
+                break
+            frame = buffer[start:start + length]
+            body = frame[2:-2]
+            checksum, = struct.unpack('<H', frame[-2:])
+            if sum(body) & 0xFFFF != checksum:
+                buffer = buffer[start + 1:]
+                continue
+            buffer = buffer[start + length:]
+            yield length, HEADER.unpack(body[:HEADER.size]), body[HEADER.size:]
+
+
+def varints(payload):
+    value = shift = 0
+    for byte in payload:
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if byte < 0x80:
+            yield (value >> 1) ^ -(value & 1)
+            value = shift = 0
+
+
+class Decoder:
+
+    def __init__(self):
+        self.last = None
+        self.frame = None
+        self.bytes = 0
+        self.samples = 0
+        self.skipped = 0
+        self.mismatches = 0
+
+    # returns the samples of a frame as lists of raw counts, or None if the frame can not be decoded
+    def decode(self, length, header, payload):
+        sensor, keyframe, frame, first_sample, timestamp, period, count, size, raw_sum = header
+        in_order = self.frame is not None and frame == (self.frame + 1) & 0xFF
+        self.frame = frame
+        if keyframe:
+            self.last = [0] * len(AXES)
+        elif not in_order or self.last is None:
+            self.last = None
+            self.skipped += 1
+            return None
+        deltas = list(varints(payload))
+        if len(deltas) != count * len(AXES):
+            self.last = None
+            self.mismatches += 1
+            return None
+        samples = []
+        for i in range(count):
+            sample = []
+            for axis in range(len(AXES)):
+                value = (self.last[axis] + deltas[i * len(AXES) + axis]) & 0xFFFF
+                value -= (value & 0x8000) << 1
+                self.last[axis] = value
+                sample.append(value)
+            samples.append(sample)
+        if sum(v & 0xFFFF for sample in samples for v in sample) & 0xFFFF != raw_sum:
+            self.last = None
+            self.mismatches += 1
+            return None
+        self.bytes += length
+        self.samples += count
+        return samples
+
+
+def main():
+    if len(sys.argv) < 2:
+        print('usage: pack_decode.py capture.bin')
+        sys.exit(1)
+    decoders = {}
+    print('sensor,sequence,timestamp_us,' + ','.join(AXES))
+    with open(sys.argv[1], 'rb') as stream:
+        for length, header, payload in frames(stream):
+            sensor, first_sample, timestamp, period = header[0], header[3], header[4], header[5]
+            decoder = decoders.setdefault(sensor, Decoder())
+            samples = decoder.decode(length, header, payload)
+            if samples is None:
+                continue
+            for i, sample in enumerate(samples):
+                print('%d,%d,%d,%s' % (sensor, first_sample + i, timestamp + i * period, ','.join(str(v) for v in sample)))
+    for sensor, decoder in sorted(decoders.items()):
+        if decoder.samples:
+            print('# sensor %d: %d samples in %d bytes, %.2f bytes per sample, %.1f times smaller than floats'
+                  % (sensor, decoder.samples, decoder.bytes, decoder.bytes / decoder.samples,
+                     FLOAT_SAMPLE_SIZE * decoder.samples / decoder.bytes))
+        print('# sensor %d: %d frames skipped waiting for a keyframe, %d failed the bit exact check'
+              % (sensor, decoder.skipped, decoder.mismatches), file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()
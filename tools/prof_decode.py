@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+# Pretty-prints the binary statistics sent by prof_dump() (src/lib_prof.c).
+#
+# Usage: prof_decode.py capture.bin [cpu_hz]
+#        stty -F /dev/ttyACM0 115200 raw && prof_decode.py /dev/ttyACM0
+
+import struct
+import sys
+
+SYNC = b'\xA5\x50'
+NAME_LENGTH = 16
+BUCKETS = 32
+BODY = struct.Struct('<%dsIIIQQ%dI' % (NAME_LENGTH, BUCKETS))
+FRAME_LENGTH = len(SYNC) + BODY.size + 2
+
+
+def frames(stream):
+    buffer = b''
+    while True:
+        chunk = stream.read(256)
+        if not chunk:
+            return
+        buffer += chunk
+        while True:
+            start = buffer.find(SYNC)
+            if start < 0 or len(buffer) - start < FRAME_LENGTH:
+                buffer = buffer[max(start, 0):] if start >= 0 else buffer[-1:]
+                break
+            frame = buffer[start:start + FRAME_LENGTH]
+            body = frame[2:-2]
+            checksum, = struct.unpack('<H', frame[-2:])
+            if sum(body) & 0xFFFF != checksum:
+                buffer = buffer[start + 1:]
+                continue
+            buffer = buffer[start + FRAME_LENGTH:]
+            yield BODY.unpack(body)
+
+
+def print_region(fields, cpu_hz):
+    name, count, minimum, maximum, total, self_total = fields[:6]
+    histogram = fields[6:]
+    name = name.rstrip(b'\0').decode('ascii', 'replace')
+    if count == 0:
+        print('%-16s  never completed' % name)
+        return
+    us = 1e6 / cpu_hz
+    print('%-16s  n=%-8d min=%-8d mean=%-10.1f max=%-8d self=%-10.1f cycles  (mean %.2f us)'
+          % (name, count, minimum, total / count, maximum, self_total / count, total / count * us))
+    peak = max(histogram)
+    for bucket, hits in enumerate(histogram):
+        if hits:
+            bar = '#' * max(1, int(40 * hits / peak))
+            print('    %8d - %-8d  %8d  %s' % (1 << bucket, (2 << bucket) - 1, hits, bar))
+
+
+def main():
+    if len(sys.argv) < 2:
+        print('usage: prof_decode.py capture.bin [cpu_hz]')
+        sys.exit(1)
+    cpu_hz = float(sys.argv[2]) if len(sys.argv) > 2 else 180e6
+    with open(sys.argv[1], 'rb') as stream:
+        for fields in frames(stream):
+            print_region(fields, cpu_hz)
+
+
+if __name__ == '__main__':
+    main()
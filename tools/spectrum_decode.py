@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+# Decodes the vibration spectra sent by imu_spectrum_send() (src/imu_spectrum.c).
+# Prints the peaks of every spectrum, and optionally appends each complete
+# spectrum to a CSV file as one row of amplitudes from DC to Nyquist.
+#
+# Usage: spectrum_decode.py capture.bin [spectra.csv]
+#        stty -F /dev/ttyACM0 115200 raw && spectrum_decode.py /dev/ttyACM0
+
+import struct
+import sys
+
+SYNC = b'\xA5\x53'
+PEAKS = 4
+HEADER = struct.Struct('<IfHH%dfHH' % (2 * PEAKS))
+
+
+def frames(stream):
+    buffer = b''
+    while True:
+        chunk = stream.read(256)
+        if not chunk:
+            return
+        buffer += chunk
+        while True:
+            start = buffer.find(SYNC)
+            if start < 0 or len(buffer) - start < len(SYNC) + HEADER.size + 2:
+                buffer = buffer[max(start, 0):] if start >= 0 else buffer[-1:]
+                break
+            fields = HEADER.unpack_from(buffer, start + len(SYNC))
+            count = fields[-1]
+            length = len(SYNC) + HEADER.size + 4 * count + 2
+            if len(buffer) - start < length:
+                break
+            frame = buffer[start:start + length]
+            body = frame[2:-2]
+            checksum, = struct.unpack('<H', frame[-2:])
+            if sum(body) & 0xFFFF != checksum:
+                buffer = buffer[start + 1:]
+                continue
+            buffer = buffer[start + length:]
+            amplitudes = struct.unpack_from('<%df' % count, body, HEADER.size)
+            yield fields, amplitudes
+
+
+def spectra(stream):
+    # parts of one spectrum share its timestamp and arrive in order
+    current = None
+    for fields, amplitudes in frames(stream):
+        timestamp, bin_hz, bins, averaged = fields[:4]
+        peaks = list(zip(fields[4:4 + 2 * PEAKS:2], fields[5:4 + 2 * PEAKS:2]))
+        first_bin = fields[-2]
+        if first_bin == 0:
+            current = {'timestamp': timestamp, 'bin_hz': bin_hz, 'frames': averaged,
+                       'peaks': peaks, 'amplitude': [None] * bins}
+        if current is None or current['timestamp'] != timestamp:
+            current = None
+            continue
+        current['amplitude'][first_bin:first_bin + len(amplitudes)] = amplitudes
+        if first_bin + len(amplitudes) >= bins:
+            yield current
+            current = None
+
+
+def main():
+    if len(sys.argv) < 2:
+        print('usage: spectrum_decode.py capture.bin [spectra.csv]')
+        sys.exit(1)
+    csv = open(sys.argv[2], 'a') if len(sys.argv) > 2 else None
+    with open(sys.argv[1], 'rb') as stream:
+        for spectrum in spectra(stream):
+            peaks = '  '.join('%8.2f Hz %.4f' % peak for peak in spectrum['peaks'] if peak[1] > 0)
+            print('%10.3f s  %d frames  %.3f Hz/bin  %s'
+                  % (spectrum['timestamp'] / 1e6, spectrum['frames'], spectrum['bin_hz'], peaks))
+            if csv:
+                csv.write('%d,%f,' % (spectrum['timestamp'], spectrum['bin_hz']))
+                csv.write(','.join('%g' % a for a in spectrum['amplitude']) + '\n')
+    if csv:
+        csv.close()
+
+
+if __name__ == '__main__':
+    main()
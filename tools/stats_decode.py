@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+# Prints the window summaries sent by imu_stats_send() (src/imu_stats.c).
+#
+# Usage: stats_decode.py capture.bin
+#        stty -F /dev/ttyACM0 115200 raw && stats_decode.py /dev/ttyACM0
+
+import struct
+import sys
+
+SYNC = b'\xA5\x55'
+AXES = ['gyro_x', 'gyro_y', 'gyro_z', 'accel_x', 'accel_y', 'accel_z', 'magn_x', 'magn_y', 'magn_z']
+BODY = struct.Struct('<IIHB%df' % (5 * len(AXES)))
+FRAME_LENGTH = len(SYNC) + BODY.size + 2
+
+
+def frames(stream):
+    buffer = b''
+    while True:
+        chunk = stream.read(256)
+        if not chunk:
+            return
+        buffer += chunk
+        while True:
+            start = buffer.find(SYNC)
+            if start < 0 or len(buffer) - start < FRAME_LENGTH:
+                buffer = buffer[max(start, 0):] if start >= 0 else buffer[-1:]
+                break
+            frame = buffer[start:start + FRAME_LENGTH]
+            body = frame[2:-2]
+            checksum, = struct.unpack('<H', frame[-2:])
+            if sum(body) & 0xFFFF != checksum:
+                buffer = buffer[start + 1:]
+                continue
+            buffer = buffer[start + FRAME_LENGTH:]
+            yield BODY.unpack(body)
+
+
+def main():
+    if len(sys.argv) < 2:
+        print('usage: stats_decode.py capture.bin')
+        sys.exit(1)
+    with open(sys.argv[1], 'rb') as stream:
+        for fields in frames(stream):
+            timestamp, duration, count, sensor = fields[:4]
+            print('%10.3f s  sensor %d  %d samples over %.3f s' % (timestamp / 1e6, sensor, count, duration / 1e6))
+            for axis, name in enumerate(AXES):
+                minimum, maximum, mean, variance, rms = fields[4 + 5 * axis:9 + 5 * axis]
+                print('    %-8s  min %10.4f  max %10.4f  mean %10.4f  std %10.4f  rms %10.4f'
+                      % (name, minimum, maximum, mean, variance ** 0.5, rms))
+
+
+if __name__ == '__main__':
+    main()
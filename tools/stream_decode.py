@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+# Decodes the samples sent by imu_stream_send() (src/imu_stream.c) and the data
+# ready jitter histograms sent by mpu6050_jitter_send() (src/mpu6050.c).
+# Samples are printed as CSV with their sequence number and the time since the
+# previous sample from the capture cycle counts; dropped samples and histograms
+# are printed as comment lines starting with '#'.
+#
+# Usage: stream_decode.py capture.bin
+#        stty -F /dev/ttyACM0 115200 raw && stream_decode.py /dev/ttyACM0
+
+import struct
+import sys
+
+SYNC_JITTER = b'\xA5\x58'
+SYNC_SAMPLES = b'\xA5\x59'
+AXES = ['gyro_x', 'gyro_y', 'gyro_z', 'accel_x', 'accel_y', 'accel_z', 'magn_x', 'magn_y', 'magn_z']
+BINS = 32
+JITTER = struct.Struct('<BIIIIIIii%dI' % BINS)
+SAMPLES = struct.Struct('<BIIIB')
+SAMPLE = struct.Struct('<I%df' % len(AXES))
+DEFAULT_CLOCK_HZ = 180000000
+
+
+def frames(stream):
+    buffer = b''
+    while True:
+        chunk = stream.read(256)
+        if not chunk:
+            return
+        buffer += chunk
+        while True:
+            start = buffer.find(b'\xA5')
+            if start < 0 or len(buffer) - start < 2 + SAMPLES.size:
+                buffer = buffer[max(start, 0):] if start >= 0 else b''
+                break
+            sync = buffer[start:start + 2]
+            if sync == SYNC_JITTER:
+                length = 2 + JITTER.size + 2
+            elif sync == SYNC_SAMPLES:
+                count = buffer[start + 2 + SAMPLES.size - 1]
+                length = 2 + SAMPLES.size + count * SAMPLE.size + 2
+            else:
+                buffer = buffer[start + 1:]
+                continue
+            if len(buffer) - start < length:
+                break
+            frame = buffer[start:start + length]
+            body = frame[2:-2]
+            checksum, = struct.unpack('<H', frame[-2:])
+            if sum(body) & 0xFFFF != checksum:
+                buffer = buffer[start + 1:]
+                continue
+            buffer = buffer[start + length:]
+            yield sync, body
+
+
+def print_jitter(body, clocks):
+    fields = JITTER.unpack(body)
+    sensor, clock_hz, bin_cycles, period_q4, intervals, lost, missed, min_cycles, max_cycles = fields[:9]
+    bins = fields[9:]
+    clocks[sensor] = clock_hz
+    us = 1e6 / clock_hz
+    print('# sensor %d jitter: %d intervals, average period %.3f us, deviation %.3f to %.3f us, %d interrupts lost, %d reads missed'
+          % (sensor, intervals, period_q4 / 16 * us, min_cycles * us, max_cycles * us, lost, missed))
+    peak = max(bins) or 1
+    for i, count in enumerate(bins):
+        if count == 0:
+            continue
+        low = (i - BINS // 2) * bin_cycles * us
+        edge = '<' if i == 0 else '>' if i == BINS - 1 else ' '
+        print('#   %s%9.3f us  %8d  %s' % (edge, low, count, '*' * (50 * count // peak)))
+
+
+def main():
+    if len(sys.argv) < 2:
+        print('usage: stream_decode.py capture.bin')
+        sys.exit(1)
+    clocks = {}
+    last = {}
+    print('sensor,sequence,timestamp_us,interval_us,' + ','.join(AXES))
+    with open(sys.argv[1], 'rb') as stream:
+        for sync, body in frames(stream):
+            if sync == SYNC_JITTER:
+                print_jitter(body, clocks)
+                continue
+            sensor, sequence, timestamp, period, count = SAMPLES.unpack(body[:SAMPLES.size])
+            us = 1e6 / clocks.get(sensor, DEFAULT_CLOCK_HZ)
+            for i in range(count):
+                offset = SAMPLES.size + i * SAMPLE.size
+                fields = SAMPLE.unpack(body[offset:offset + SAMPLE.size])
+                cycles, values = fields[0], fields[1:]
+                interval = ''
+                if sensor in last:
+                    last_sequence, last_cycles = last[sensor]
+                    dropped = (sequence + i - last_sequence - 1) & 0xFFFFFFFF
+                    if dropped:
+                        print('# sensor %d: %d samples dropped before %d' % (sensor, dropped, sequence + i))
+                    elif cycles and last_cycles:
+                        interval = '%.3f' % (((cycles - last_cycles) & 0xFFFFFFFF) * us)
+                last[sensor] = (sequence + i, cycles)
+                print('%d,%d,%d,%s,%s' % (sensor, sequence + i, timestamp + i * period, interval,
+                                          ','.join('%.5f' % v for v in values)))
+
+
+if __name__ == '__main__':
+    main()
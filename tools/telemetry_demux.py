@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+# Splits the frames sent by telemetry_flush() (src/lib_telemetry.c) back into
+# their channels. The records of each channel are appended to channel_<id>.bin,
+# which the channel's own decoder reads, such as pack_decode.py or
+# stats_decode.py for channels fed with telemetry_route(). The counters of
+# every channel and lost frames are printed, and the channels given with
+# --text are printed as lines of text as well.
+#
+# Usage: telemetry_demux.py capture.bin [output_directory] [--text id ...]
+#        stty -F /dev/ttyACM0 115200 raw && telemetry_demux.py /dev/ttyACM0 out --text 5
+
+import os
+import struct
+import sys
+
+SYNC = b'\xA5\x5C'
+HEADER = struct.Struct('<BH')
+RECORD = struct.Struct('<BH')
+STATS_CHANNEL = 0
+STATS_ENTRY = struct.Struct('<B8sIIII')
+
+
+def frames(stream):
+    buffer = b''
+    while True:
+        chunk = stream.read(256)
+        if not chunk:
+            return
+        buffer += chunk
+        while True:
+            start = buffer.find(SYNC)
+            if start < 0 or len(buffer) - start < 2 + HEADER.size:
+                buffer = buffer[max(start, 0):] if start >= 0 else buffer[-1:]
+                break
+            sequence, payload = HEADER.unpack(buffer[start + 2:start + 2 + HEADER.size])
+            length = 2 + HEADER.size + payload + 2
+            if len(buffer) - start < length:
+                break
+            frame = buffer[start:start + length]
+            body = frame[2:-2]
+            checksum, = struct.unpack('<H', frame[-2:])
+            if sum(body) & 0xFFFF != checksum:
+                buffer = buffer[start + 1:]
+                continue
+            buffer = buffer[start + length:]
+            yield sequence, body[HEADER.size:]
+
+
+def records(payload):
+    offset = 0
+    while offset + RECORD.size <= len(payload):
+        channel, length = RECORD.unpack(payload[offset:offset + RECORD.size])
+        offset += RECORD.size
+        yield channel, payload[offset:offset + length]
+        offset += length
+
+
+def print_stats(record):
+    frames_sent, = struct.unpack('<I', record[:4])
+    print('# %d frames sent' % frames_sent)
+    for offset in range(4, len(record) - STATS_ENTRY.size + 1, STATS_ENTRY.size):
+        channel, name, offered, decimated, dropped, sent = STATS_ENTRY.unpack(record[offset:offset + STATS_ENTRY.size])
+        print('#   channel %3d %-8s  offered %8d  decimated %8d  dropped %6d  sent %8d'
+              % (channel, name.rstrip(b'\0').decode(errors='replace'), offered, decimated, dropped, sent))
+
+
+def main():
+    arguments = [a for a in sys.argv[1:] if a != '--text']
+    text = set()
+    if '--text' in sys.argv:
+        index = sys.argv.index('--text')
+        text = {int(a) for a in sys.argv[index + 1:]}
+        arguments = sys.argv[1:index]
+    if not arguments:
+        print('usage: telemetry_demux.py capture.bin [output_directory] [--text id ...]')
+        sys.exit(1)
+    directory = arguments[1] if len(arguments) > 1 else '.'
+    os.makedirs(directory, exist_ok=True)
+    outputs = {}
+    last_sequence = None
+    lost = 0
+    with open(arguments[0], 'rb') as stream:
+        for sequence, payload in frames(stream):
+            if last_sequence is not None and sequence != (last_sequence + 1) & 0xFF:
+                lost += (sequence - last_sequence - 1) & 0xFF
+                print('# frames lost before frame %d, %d so far' % (sequence, lost))
+            last_sequence = sequence
+            for channel, record in records(payload):
+                if channel == STATS_CHANNEL:
+                    print_stats(record)
+                    continue
+                if channel in text:
+                    print('[%d] %s' % (channel, record.decode(errors='replace')))
+                if channel not in outputs:
+                    outputs[channel] = open(os.path.join(directory, 'channel_%d.bin' % channel), 'wb')
+                outputs[channel].write(record)
+    for output in outputs.values():
+        output.close()
+
+
+if __name__ == '__main__':
+    main()